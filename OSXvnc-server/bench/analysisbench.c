@@ -0,0 +1,642 @@
+/*
+ * analysisbench.c - time rfbAnalyseTile against the code it replaced.
+ *
+ * encbench -analysis runs this on each corpus file and format instead of
+ * the encoders.  The screen, translated to the client's format, is cut
+ * into tiles the way each encoder cuts it (16x16 for Hextile, 64x64 for
+ * ZRLE, the -rect size for Tight) and every tile is copied out on its own,
+ * with a spare pixel after it as ZRLE's buffer has.  Each encoder's old
+ * way of finding its colours is then timed over all the tiles against
+ * rfbAnalyseTile, without SIMD and with it, and first every tile is
+ * checked to give the encoder the same answer all three ways.
+ *
+ * The old code is kept here as it was in each encoder, less the fetching
+ * of pixels: Hextile's testColours, Tight's FillPalette and PaletteInsert
+ * with a palette of up to 256 colours (2 at 8 bits, as Tight does), and
+ * ZRLE's PaletteHelper and run counting.
+ */
+
+/*
+ *  OSXvnc Copyright (C) 2002-2004 Redstone Software osxvnc@redstonesoftware.com
+ *  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rfb.h"
+
+#define ANALYSIS_HEXTILE        0
+#define ANALYSIS_TIGHT          1
+#define ANALYSIS_ZRLE           2
+#define NUM_ANALYSES            3
+
+#define CODE_OLD                0
+#define CODE_SCALAR             1       /* rfbAnalyseTile, no SIMD */
+#define CODE_SIMD               2
+#define NUM_CODES               3
+
+static char *analysisNames[NUM_ANALYSES] = { "hextile", "tight", "zrle" };
+static char *codeNames[NUM_CODES] = { "old", "scalar", "simd" };
+
+#define TIGHT_MAX_COLOURS       256
+#define ZRLE_MAX_PALETTE        127
+
+typedef struct {
+    int w, h;
+    char *pixels;
+} benchTile;
+
+typedef struct {
+    int bpp;
+    int count;
+    benchTile *tiles;
+    char *buf;
+} benchTiles;
+
+
+/*
+ * Hextile's testColours.
+ */
+
+typedef struct {
+    Bool solid, mono;
+    CARD32 bg, fg;
+} hextileColours;
+
+#define DEFINE_OLD_HEXTILE_FUNCTION(bpp)                                      \
+                                                                              \
+static void                                                                   \
+OldHextile##bpp(CARD##bpp *data, int stride, int w, int h, hextileColours *r) \
+{                                                                             \
+    CARD##bpp colour1 = data[0], colour2 = 0;                                 \
+    int n1 = 0, n2 = 0;                                                       \
+    int x, y;                                                                 \
+                                                                              \
+    r->mono = TRUE;                                                           \
+    r->solid = TRUE;                                                          \
+                                                                              \
+    for (y = 0; y < h; y++, data += stride) {                                 \
+        for (x = 0; x < w; x++) {                                             \
+            if (data[x] == colour1) {                                         \
+                n1++;                                                         \
+                continue;                                                     \
+            }                                                                 \
+                                                                              \
+            if (n2 == 0) {                                                    \
+                r->solid = FALSE;                                             \
+                colour2 = data[x];                                            \
+            }                                                                 \
+                                                                              \
+            if (data[x] == colour2) {                                         \
+                n2++;                                                         \
+                continue;                                                     \
+            }                                                                 \
+                                                                              \
+            r->mono = FALSE;                                                  \
+            goto done;                                                        \
+        }                                                                     \
+    }                                                                         \
+                                                                              \
+done:                                                                         \
+    if (n1 > n2) {                                                            \
+        r->bg = colour1;                                                      \
+        r->fg = colour2;                                                      \
+    } else {                                                                  \
+        r->bg = colour2;                                                      \
+        r->fg = colour1;                                                      \
+    }                                                                         \
+}
+
+DEFINE_OLD_HEXTILE_FUNCTION(8)
+DEFINE_OLD_HEXTILE_FUNCTION(16)
+DEFINE_OLD_HEXTILE_FUNCTION(32)
+
+/* What hextile.cc makes of rfbAnalyseTile */
+
+static void
+NewHextile(rfbTileAnalysis *ta, void *data, int bpp, int w, int h,
+           hextileColours *r)
+{
+    rfbAnalyseTile(ta, data, bpp, w, h, w, 2, 0);
+
+    r->solid = (ta->numColours == 1);
+    r->mono = (ta->numColours != 0);
+
+    if (r->solid) {
+        r->bg = ta->colours[0];
+        r->fg = 0;
+    } else if (ta->counts[0] > ta->counts[1]) {
+        r->bg = ta->colours[0];
+        r->fg = ta->colours[1];
+    } else {
+        r->bg = ta->colours[1];
+        r->fg = ta->colours[0];
+    }
+}
+
+
+/*
+ * Tight's FillPalette and PaletteInsert.
+ */
+
+typedef struct oldColourList {
+    struct oldColourList *next;
+    int idx;
+    CARD32 rgb;
+} oldColourList;
+
+typedef struct {
+    oldColourList *listNode;
+    int numPixels;
+} oldPaletteEntry;
+
+typedef struct {
+    oldPaletteEntry entry[256];
+    oldColourList *hash[256];
+    oldColourList list[256];
+    int numColors, maxColors;
+    CARD32 monoBg, monoFg;
+} oldPalette;
+
+#define HASH_FUNC16(rgb) ((int)((((rgb) >> 8) + (rgb)) & 0xFF))
+#define HASH_FUNC32(rgb) ((int)((((rgb) >> 16) + ((rgb) >> 8)) & 0xFF))
+
+static void
+OldPaletteReset(oldPalette *palette)
+{
+    palette->numColors = 0;
+    memset(palette->hash, 0, 256 * sizeof(oldColourList *));
+}
+
+static int
+OldPaletteInsert(oldPalette *palette, CARD32 rgb, int numPixels, int bpp)
+{
+    oldColourList *pnode;
+    oldColourList *prev_pnode = NULL;
+    int hash_key, idx, new_idx, count;
+
+    hash_key = (bpp == 16) ? HASH_FUNC16(rgb) : HASH_FUNC32(rgb);
+
+    pnode = palette->hash[hash_key];
+
+    while (pnode != NULL) {
+        if (pnode->rgb == rgb) {
+            /* Such palette entry already exists. */
+            new_idx = idx = pnode->idx;
+            count = palette->entry[idx].numPixels + numPixels;
+            if (new_idx && palette->entry[new_idx-1].numPixels < count) {
+                do {
+                    palette->entry[new_idx] = palette->entry[new_idx-1];
+                    palette->entry[new_idx].listNode->idx = new_idx;
+                    new_idx--;
+                }
+                while (new_idx && palette->entry[new_idx-1].numPixels < count);
+                palette->entry[new_idx].listNode = pnode;
+                pnode->idx = new_idx;
+            }
+            palette->entry[new_idx].numPixels = count;
+            return palette->numColors;
+        }
+        prev_pnode = pnode;
+        pnode = pnode->next;
+    }
+
+    /* Check if palette is full. */
+    if (palette->numColors == 256 || palette->numColors == palette->maxColors) {
+        palette->numColors = 0;
+        return 0;
+    }
+
+    /* Move palette entries with lesser pixel counts. */
+    for ( idx = palette->numColors;
+          idx > 0 && palette->entry[idx-1].numPixels < numPixels;
+          idx-- ) {
+        palette->entry[idx] = palette->entry[idx-1];
+        palette->entry[idx].listNode->idx = idx;
+    }
+
+    /* Add new palette entry into the freed slot. */
+    pnode = &palette->list[palette->numColors];
+    if (prev_pnode != NULL) {
+        prev_pnode->next = pnode;
+    } else {
+        palette->hash[hash_key] = pnode;
+    }
+    pnode->next = NULL;
+    pnode->idx = idx;
+    pnode->rgb = rgb;
+    palette->entry[idx].listNode = pnode;
+    palette->entry[idx].numPixels = numPixels;
+
+    return (++palette->numColors);
+}
+
+#define DEFINE_OLD_TIGHT_FUNCTION(bpp)                                        \
+                                                                              \
+static void                                                                   \
+OldTight##bpp(oldPalette *palette, CARD##bpp *data, int count)                \
+{                                                                             \
+    CARD##bpp c0, c1, ci = 0;                                                 \
+    int i, n0, n1, ni;                                                        \
+                                                                              \
+    c0 = data[0];                                                             \
+    for (i = 1; i < count && data[i] == c0; i++);                             \
+    if (i >= count) {                                                         \
+        palette->numColors = 1;   /* Solid rectangle */                       \
+        return;                                                               \
+    }                                                                         \
+                                                                              \
+    if (palette->maxColors < 2) {                                             \
+        palette->numColors = 0;   /* Full-color encoding preferred */         \
+        return;                                                               \
+    }                                                                         \
+                                                                              \
+    n0 = i;                                                                   \
+    c1 = data[i];                                                             \
+    n1 = 0;                                                                   \
+    for (i++; i < count; i++) {                                               \
+        ci = data[i];                                                         \
+        if (ci == c0) {                                                       \
+            n0++;                                                             \
+        } else if (ci == c1) {                                                \
+            n1++;                                                             \
+        } else                                                                \
+            break;                                                            \
+    }                                                                         \
+    if (i >= count) {                                                         \
+        if (n0 > n1) {                                                        \
+            palette->monoBg = (CARD32)c0;                             \
+            palette->monoFg = (CARD32)c1;                             \
+        } else {                                                              \
+            palette->monoBg = (CARD32)c1;                             \
+            palette->monoFg = (CARD32)c0;                             \
+        }                                                                     \
+        palette->numColors = 2;   /* Two colors */                            \
+        return;                                                               \
+    }                                                                         \
+                                                                              \
+    OldPaletteReset(palette);                                                 \
+    OldPaletteInsert(palette, c0, (CARD32)n0, bpp);                           \
+    OldPaletteInsert(palette, c1, (CARD32)n1, bpp);                           \
+                                                                              \
+    ni = 1;                                                                   \
+    for (i++; i < count; i++) {                                               \
+        if (data[i] == ci) {                                                  \
+            ni++;                                                             \
+        } else {                                                              \
+            if (!OldPaletteInsert(palette, ci, (CARD32)ni, bpp))              \
+                return;                                                       \
+            ci = data[i];                                                     \
+            ni = 1;                                                           \
+        }                                                                     \
+    }                                                                         \
+    OldPaletteInsert(palette, ci, (CARD32)ni, bpp);                           \
+}
+
+DEFINE_OLD_TIGHT_FUNCTION(8)
+DEFINE_OLD_TIGHT_FUNCTION(16)
+DEFINE_OLD_TIGHT_FUNCTION(32)
+
+static int
+TightMaxColours(int bpp)
+{
+    return (bpp == 8) ? 2 : TIGHT_MAX_COLOURS;
+}
+
+
+/*
+ * ZRLE's PaletteHelper and run counting, as one batch of rows since the
+ * tile is already in place.
+ */
+
+typedef struct {
+    CARD32 palette[ZRLE_MAX_PALETTE];
+    CARD8 index[4096 + ZRLE_MAX_PALETTE];
+    CARD32 key[4096 + ZRLE_MAX_PALETTE];
+    int size;
+    int runs, singlePixels;
+} oldPaletteHelper;
+
+static inline void
+OldZrleInsert(oldPaletteHelper *ph, CARD32 pix)
+{
+    if (ph->size < ZRLE_MAX_PALETTE) {
+        int i = (pix ^ (pix >> 17)) & 4095;
+        while (ph->index[i] != 255 && ph->key[i] != pix)
+            i++;
+        if (ph->index[i] != 255)
+            return;
+
+        ph->index[i] = ph->size;
+        ph->key[i] = pix;
+        ph->palette[ph->size] = pix;
+    }
+    ph->size++;
+}
+
+#define DEFINE_OLD_ZRLE_FUNCTION(bpp)                                         \
+                                                                              \
+static void                                                                   \
+OldZrle##bpp(oldPaletteHelper *ph, CARD##bpp *data, int w, int h)             \
+{                                                                             \
+    CARD##bpp *ptr = data, *end = data + w * h, *runStart;                    \
+    CARD##bpp pix = 0;                                                        \
+    int runLength = 0;                                                        \
+                                                                              \
+    memset(ph->index, 255, sizeof(ph->index));                                \
+    ph->size = 0;                                                             \
+    ph->runs = ph->singlePixels = 0;                                          \
+                                                                              \
+    /* One past the end is different so the inner loop stops there */        \
+    *end = ~*(end-1);                                                         \
+                                                                              \
+    while (ptr < end) {                                                       \
+        if (*ptr != pix || !runLength) {                                      \
+            if (runLength) {                                                  \
+                if (runLength == 1)                                           \
+                    ph->singlePixels++;                                       \
+                else                                                          \
+                    ph->runs++;                                               \
+                OldZrleInsert(ph, pix);                                       \
+            }                                                                 \
+            pix = *ptr;                                                       \
+            runLength = 0;                                                    \
+        }                                                                     \
+        runStart = ptr;                                                       \
+        while (*++ptr == pix) ;                                               \
+        runLength += ptr - runStart;                                          \
+    }                                                                         \
+    if (runLength == 1)                                                       \
+        ph->singlePixels++;                                                   \
+    else                                                                      \
+        ph->runs++;                                                           \
+    OldZrleInsert(ph, pix);                                                   \
+}
+
+DEFINE_OLD_ZRLE_FUNCTION(8)
+DEFINE_OLD_ZRLE_FUNCTION(16)
+DEFINE_OLD_ZRLE_FUNCTION(32)
+
+
+/*
+ * Running them.  Everything any of them might want is in the scratch, so
+ * none of them pays for setting it up.
+ */
+
+typedef struct {
+    hextileColours hextile;
+    oldPalette palette;
+    oldPaletteHelper helper;
+    rfbTileAnalysis ta;
+} benchScratch;
+
+static void
+Analyse(int analysis, int code, int bpp, benchTile *tile, benchScratch *s)
+{
+    if (code != CODE_OLD) {
+        rfbSimdAnalysis = (code == CODE_SIMD);
+        switch (analysis) {
+            case ANALYSIS_HEXTILE:
+                NewHextile(&s->ta, tile->pixels, bpp, tile->w, tile->h, &s->hextile);
+                break;
+            case ANALYSIS_TIGHT:
+                rfbAnalyseTile(&s->ta, tile->pixels, bpp, tile->w, tile->h,
+                               tile->w, TightMaxColours(bpp), 0);
+                break;
+            case ANALYSIS_ZRLE:
+                rfbAnalyseTile(&s->ta, tile->pixels, bpp, tile->w, tile->h,
+                               tile->w, ZRLE_MAX_PALETTE, rfbAnalyseRuns);
+                break;
+        }
+        return;
+    }
+
+    switch (analysis) {
+        case ANALYSIS_HEXTILE:
+            if (bpp == 8)
+                OldHextile8((CARD8 *)tile->pixels, tile->w, tile->w, tile->h, &s->hextile);
+            else if (bpp == 16)
+                OldHextile16((CARD16 *)tile->pixels, tile->w, tile->w, tile->h, &s->hextile);
+            else
+                OldHextile32((CARD32 *)tile->pixels, tile->w, tile->w, tile->h, &s->hextile);
+            break;
+        case ANALYSIS_TIGHT:
+            s->palette.maxColors = TightMaxColours(bpp);
+            if (bpp == 8)
+                OldTight8(&s->palette, (CARD8 *)tile->pixels, tile->w * tile->h);
+            else if (bpp == 16)
+                OldTight16(&s->palette, (CARD16 *)tile->pixels, tile->w * tile->h);
+            else
+                OldTight32(&s->palette, (CARD32 *)tile->pixels, tile->w * tile->h);
+            break;
+        case ANALYSIS_ZRLE:
+            if (bpp == 8)
+                OldZrle8(&s->helper, (CARD8 *)tile->pixels, tile->w, tile->h);
+            else if (bpp == 16)
+                OldZrle16(&s->helper, (CARD16 *)tile->pixels, tile->w, tile->h);
+            else
+                OldZrle32(&s->helper, (CARD32 *)tile->pixels, tile->w, tile->h);
+            break;
+    }
+}
+
+/* Whether the old code and the new give the encoder the same answer */
+
+static Bool
+SameAnswer(int analysis, benchScratch *old, benchScratch *new)
+{
+    rfbTileAnalysis *ta = &new->ta;
+    int i, idx;
+
+    switch (analysis) {
+        case ANALYSIS_HEXTILE:
+            if (old->hextile.solid != new->hextile.solid ||
+                old->hextile.mono != new->hextile.mono ||
+                old->hextile.bg != new->hextile.bg)
+                return FALSE;
+            return (!old->hextile.mono || old->hextile.solid ||
+                    old->hextile.fg == new->hextile.fg);
+
+        case ANALYSIS_TIGHT:
+            if (old->palette.numColors != ta->numColours)
+                return FALSE;
+            /* The old count of the second colour is one short */
+            if (ta->numColours == 2) {
+                if (ta->counts[0] >= ta->counts[1])
+                    return (old->palette.monoBg == ta->colours[0] &&
+                            old->palette.monoFg == ta->colours[1]);
+                return (old->palette.monoBg == ta->colours[1] &&
+                        old->palette.monoFg == ta->colours[0]);
+            }
+            if (ta->numColours > 2) {
+                /* The same colours and counts, in whatever order */
+                for (i = 0; i < ta->numColours; i++) {
+                    idx = rfbTileColourIndex(ta, old->palette.entry[i].listNode->rgb);
+                    if (idx < 0 || ta->counts[idx] - (idx == 1) != old->palette.entry[i].numPixels)
+                        return FALSE;
+                }
+            }
+            return TRUE;
+
+        case ANALYSIS_ZRLE:
+            if (old->helper.runs != ta->runs ||
+                old->helper.singlePixels != ta->singlePixels)
+                return FALSE;
+            /* Once it had 127 colours the old helper counted every run as
+               another, so a tile of exactly 127 was too many for it */
+            if (old->helper.size > ZRLE_MAX_PALETTE)
+                return (ta->numColours == 0 || ta->numColours == ZRLE_MAX_PALETTE);
+            if (old->helper.size != ta->numColours)
+                return FALSE;
+            for (i = 0; i < ta->numColours; i++) {
+                if (old->helper.palette[i] != ta->colours[i])
+                    return FALSE;
+            }
+            return TRUE;
+    }
+    return FALSE;
+}
+
+
+static Bool
+CutTiles(benchTiles *t, char *pixels, int bpp, int width, int height,
+         int tileWidth, int tileHeight)
+{
+    int bytes = bpp / 8;
+    int x, y, w, h, row;
+    char *p;
+
+    t->bpp = bpp;
+    t->count = ((width + tileWidth - 1) / tileWidth) * ((height + tileHeight - 1) / tileHeight);
+    t->tiles = (benchTile *)xalloc(t->count * sizeof(benchTile));
+    t->buf = (char *)xalloc((width * height + t->count) * bytes);
+    if (!t->tiles || !t->buf) {
+        rfbLog("encbench: out of memory for tiles\n");
+        xfree(t->tiles);
+        xfree(t->buf);
+        return FALSE;
+    }
+
+    p = t->buf;
+    t->count = 0;
+    for (y = 0; y < height; y += tileHeight) {
+        h = min(tileHeight, height - y);
+        for (x = 0; x < width; x += tileWidth) {
+            w = min(tileWidth, width - x);
+            t->tiles[t->count].w = w;
+            t->tiles[t->count].h = h;
+            t->tiles[t->count].pixels = p;
+            t->count++;
+            for (row = 0; row < h; row++) {
+                memcpy(p, pixels + ((y + row) * width + x) * bytes, w * bytes);
+                p += w * bytes;
+            }
+            p += bytes;         /* the spare pixel */
+        }
+    }
+    return TRUE;
+}
+
+static void
+FreeTiles(benchTiles *t)
+{
+    xfree(t->tiles);
+    xfree(t->buf);
+}
+
+
+/*
+ * rfbAnalysisBench runs all three analyses over width x height pixels of
+ * bpp bits each and prints how they went.  It returns FALSE if the new
+ * code didn't agree with the old.
+ */
+
+Bool
+rfbAnalysisBench(char *path, char *format, char *pixels, int bpp, int width,
+                 int height, int iterations, int rectWidth, int rectHeight)
+{
+    static int tileWidths[NUM_ANALYSES] = { 16, 0, 64 };
+    static int tileHeights[NUM_ANALYSES] = { 16, 0, 64 };
+    benchScratch *old = (benchScratch *)xalloc(sizeof(benchScratch));
+    benchScratch *new = (benchScratch *)xalloc(sizeof(benchScratch));
+    Bool simdWas = rfbSimdAnalysis, ok = TRUE;
+    benchTiles t;
+    int analysis, code, i, n, mismatches;
+    rfbPaceTime start, elapsed;
+    double seconds, oldSeconds = 0, bytes;
+
+    if (!old || !new) {
+        rfbLog("encbench: out of memory for analysis\n");
+        xfree(old);
+        xfree(new);
+        return FALSE;
+    }
+
+    for (analysis = 0; analysis < NUM_ANALYSES; analysis++) {
+        if (!CutTiles(&t, pixels, bpp, width, height,
+                      tileWidths[analysis] ? tileWidths[analysis] : rectWidth,
+                      tileHeights[analysis] ? tileHeights[analysis] : rectHeight)) {
+            ok = FALSE;
+            break;
+        }
+
+        mismatches = 0;
+        for (i = 0; i < t.count; i++) {
+            Analyse(analysis, CODE_OLD, bpp, &t.tiles[i], old);
+            for (code = CODE_SCALAR; code < NUM_CODES; code++) {
+                Analyse(analysis, code, bpp, &t.tiles[i], new);
+                if (!SameAnswer(analysis, old, new) && mismatches++ == 0)
+                    rfbLog("encbench: %s %s tile %d: %s analysis differs from the old\n",
+                           path, analysisNames[analysis], i, codeNames[code]);
+            }
+        }
+        if (mismatches) {
+            rfbLog("encbench: %s %s at %s: %d differences\n",
+                   path, analysisNames[analysis], format, mismatches);
+            ok = FALSE;
+        }
+
+        for (code = 0; code < NUM_CODES; code++) {
+            start = rfbPacingNow();
+            for (n = 0; n < iterations; n++) {
+                for (i = 0; i < t.count; i++)
+                    Analyse(analysis, code, bpp, &t.tiles[i], new);
+            }
+            elapsed = max(rfbPacingNow() - start, 1);
+
+            seconds = elapsed / 1000000.0;
+            if (code == CODE_OLD)
+                oldSeconds = seconds;
+            bytes = (double)width * height * (bpp / 8) * iterations;
+            printf("%-24s %-8s %-7s %-6s %9.1f %11.0f %8.2f\n",
+                   path, analysisNames[analysis], format, codeNames[code],
+                   bytes / seconds / (1024 * 1024), t.count * iterations / seconds,
+                   oldSeconds / seconds);
+            fflush(stdout);
+        }
+
+        FreeTiles(&t);
+    }
+
+    rfbSimdAnalysis = simdWas;
+    xfree(old);
+    xfree(new);
+    return ok;
+}
@@ -0,0 +1,1064 @@
+/*
+ * encbench.c - run the encoders over a corpus of captured framebuffers.
+ *
+ * Each corpus file is loaded as the screen and sent, as a grid of
+ * rectangles, to a fake client with every chosen encoder, at every chosen
+ * client pixel format and every compression and quality level the encoder
+ * has.  The output goes down a socketpair to a thread which throws it away,
+ * so the encoders, updateBuf and WriteExact all run just as they do for a
+ * real client, only without the window server.
+ *
+ * For each run it prints the throughput in MB/s of screen pixels encoded,
+ * the input rectangles encoded per second, and the compression ratio of
+ * the bytes written against Raw at the client's pixel format.  With
+ * -checksum it adds the CRC-32 of everything the client was sent, so the
+ * output of two builds can be compared run by run.
+ *
+ * With -headless it instead plays the headless source's scripted workloads
+ * (see headless.c) and sends each frame's damage through the server's own
+ * update path, rfbMarkRectsModified to rfbSendFramebufferUpdate, so the
+ * damage merging, scaling, tile cache and parallel encoding run as well.
+ * Throughput is then of the damaged pixels, and updates are counted instead
+ * of rectangles.
+ *
+ * With -analysis it instead times how the encoders find the colours in
+ * their tiles, the old way against rfbAnalyseTile (see analysisbench.c).
+ * With -verifytight it checks the SIMD filters of tight_simd.c against
+ * the scalar ones, each on its own (see tightverify.c), and then sends
+ * each screen with Tight twice, without them and with them, and checks the
+ * two came out the same.
+ *
+ * Corpus files are either snapshots of a -shmfb segment (see shmfb.h),
+ * which keep the screen's own pixel format, or binary PPMs (P6), which
+ * most screenshot tools can write and which are loaded as 32 bit RGB.
+ */
+
+/*
+ *  OSXvnc Copyright (C) 2002-2004 Redstone Software osxvnc@redstonesoftware.com
+ *  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "rfb.h"
+#include "shmfb.h"
+
+#define MAX_LEVELS 16
+
+typedef Bool (*encoderFn)(rfbClientPtr cl, int x, int y, int w, int h);
+
+/* Which of the level lists an encoder is run over */
+#define LEVELS_NONE     0
+#define LEVELS_ZLIB     1       /* -compress */
+#define LEVELS_TIGHT    2       /* -compress and -quality */
+
+static struct {
+    char *name;
+    int encoding;
+    encoderFn encoder;
+    int levels;
+} encoders[] = {
+    { "raw",     rfbEncodingRaw,     rfbSendRectEncodingRaw,     LEVELS_NONE },
+    { "rre",     rfbEncodingRRE,     rfbSendRectEncodingRRE,     LEVELS_NONE },
+    { "corre",   rfbEncodingCoRRE,   rfbSendRectEncodingCoRRE,   LEVELS_NONE },
+    { "hextile", rfbEncodingHextile, rfbSendRectEncodingHextile, LEVELS_NONE },
+    { "zlib",    rfbEncodingZlib,    rfbSendRectEncodingZlib,    LEVELS_ZLIB },
+    { "zlibhex", rfbEncodingZlibHex, rfbSendRectEncodingZlibHex, LEVELS_ZLIB },
+    { "tight",   rfbEncodingTight,   rfbSendRectEncodingTight,   LEVELS_TIGHT },
+    { "zrle",    rfbEncodingZRLE,    rfbSendRectEncodingZRLE,    LEVELS_NONE },
+};
+
+#define NUM_ENCODERS (sizeof(encoders) / sizeof(encoders[0]))
+
+/* Client pixel formats, filled in by SetupFormats once the host's byte
+   order is known.  "32" is what the server itself uses for PPMs. */
+
+static struct {
+    char *name;
+    rfbPixelFormat format;
+} formats[] = {
+    { "32" },
+    { "32swap" },
+    { "16" },
+    { "15" },
+    { "8" },
+    { "30" },
+};
+
+#define NUM_FORMATS (sizeof(formats) / sizeof(formats[0]))
+
+static Bool useEncoder[NUM_ENCODERS];
+static Bool useFormat[NUM_FORMATS];
+static int compressLevels[MAX_LEVELS], numCompressLevels = 0;
+static int qualityLevels[MAX_LEVELS], numQualityLevels = 0;
+static int rectWidth = 128, rectHeight = 128;
+static int iterations = 4;
+static Bool analysisOnly = FALSE;
+static Bool verifyTight = FALSE;
+static Bool checksumOutput = FALSE;
+static Bool headless = FALSE;
+static int headlessFrames = 300;
+static double scale = 1;
+
+static char *benchFB = NULL;
+
+/* analysisbench.c */
+
+extern Bool rfbAnalysisBench(char *path, char *format, char *pixels, int bpp,
+                             int width, int height, int iterations,
+                             int rectWidth, int rectHeight);
+
+/* tightverify.c */
+
+extern Bool rfbTightVerify(char *path, char *format, char *pixels, rfbPixelFormat *fmt,
+                           int width, int height, int rectWidth, int rectHeight);
+
+
+/*
+ * The bits of main.c, rfbserver.c and mousecursor.c the encoders reach for.
+ * There is only ever the one fake client, which is only on the client list
+ * while a headless workload runs, for damage to reach it.
+ */
+
+rfbScreenInfo rfbScreen;
+int rfbDeferUpdateTime = 0;
+
+struct rfbClientIterator {
+    rfbClientPtr next;
+};
+
+static struct rfbClientIterator benchIterator;
+static rfbClientPtr benchClientList = NULL;
+
+void rfbLog(const char *format, ...) {
+    va_list args;
+
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+void rfbLogPerror(const char *str) {
+    rfbLog("%s: %s\n", str, strerror(errno));
+}
+
+rfbClientIteratorPtr rfbGetClientIterator(void) {
+    benchIterator.next = benchClientList;
+    return &benchIterator;
+}
+
+rfbClientPtr rfbClientIteratorNext(rfbClientIteratorPtr iterator) {
+    rfbClientPtr result = iterator->next;
+
+    iterator->next = NULL;
+    return result;
+}
+
+void rfbReleaseClientIterator(rfbClientIteratorPtr iterator) {
+}
+
+Bool rfbShouldSendNewCursor(rfbClientPtr cl) {
+    return FALSE;
+}
+
+Bool rfbShouldSendNewPosition(rfbClientPtr cl) {
+    return FALSE;
+}
+
+Bool rfbSendRichCursorUpdate(rfbClientPtr cl) {
+    return TRUE;
+}
+
+Bool rfbSendCursorPos(rfbClientPtr cl) {
+    return TRUE;
+}
+
+void rfbRecordDamage(RegionPtr region) {
+}
+
+void rfbWakeClient(rfbClientPtr cl) {
+}
+
+void rfbReactorWantWrite(rfbClientPtr cl) {
+}
+
+void rfbRecordClientBytes(rfbClientPtr cl, char *buf, int len) {
+}
+
+static char *benchGetFramebuffer(void) {
+    return benchFB;
+}
+
+static rfbFramebufferSource benchSource = {
+    "encbench", NULL, benchGetFramebuffer, NULL, NULL, NULL
+};
+
+
+static void SetFormat(rfbPixelFormat *pf, int bpp, int depth, Bool bigEndian,
+                      int redMax, int greenMax, int blueMax,
+                      int redShift, int greenShift, int blueShift) {
+    memset(pf, 0, sizeof(*pf));
+    pf->bitsPerPixel = bpp;
+    pf->depth = depth;
+    pf->bigEndian = bigEndian;
+    pf->trueColour = TRUE;
+    pf->redMax = redMax;
+    pf->greenMax = greenMax;
+    pf->blueMax = blueMax;
+    pf->redShift = redShift;
+    pf->greenShift = greenShift;
+    pf->blueShift = blueShift;
+}
+
+static void SetupFormats(void) {
+    Bool bigEndian = (htonl(1) == 1);
+
+    SetFormat(&formats[0].format, 32, 24, bigEndian, 255, 255, 255, 16, 8, 0);
+    SetFormat(&formats[1].format, 32, 24, !bigEndian, 255, 255, 255, 16, 8, 0);
+    SetFormat(&formats[2].format, 16, 16, bigEndian, 31, 63, 31, 11, 5, 0);
+    SetFormat(&formats[3].format, 16, 15, bigEndian, 31, 31, 31, 10, 5, 0);
+    SetFormat(&formats[4].format, 8, 8, bigEndian, 7, 7, 3, 0, 3, 6);
+    SetFormat(&formats[5].format, 32, 30, bigEndian, 1023, 1023, 1023, 20, 10, 0);
+}
+
+
+/*
+ * Corpus loading.  Both loaders leave the pixels in benchFB and fill in
+ * rfbScreen and rfbServerFormat.
+ */
+
+static char *ReadFile(char *path, long *len) {
+    FILE *f = fopen(path, "rb");
+    char *data;
+
+    if (!f) {
+        rfbLogPerror(path);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    data = (char *)xalloc(*len + 1);
+    if (!data || fread(data, 1, *len, f) != (size_t)*len) {
+        rfbLog("%s: could not read %ld bytes\n", path, *len);
+        if (data)
+            xfree(data);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+static Bool LoadShmSnapshot(char *path, char *data, long len) {
+    rfbShmHeader *hdr = (rfbShmHeader *)data;
+
+    if (hdr->version != rfbShmVersion ||
+        (hdr->bitsPerPixel != 8 && hdr->bitsPerPixel != 16 && hdr->bitsPerPixel != 32) ||
+        hdr->bytesPerRow < hdr->width * (hdr->bitsPerPixel / 8) ||
+        hdr->pixelOffset + (long long)hdr->bytesPerRow * hdr->height > len) {
+        rfbLog("%s: not a usable version %d segment\n", path, rfbShmVersion);
+        return FALSE;
+    }
+
+    rfbScreen.width = hdr->width;
+    rfbScreen.height = hdr->height;
+    rfbScreen.bitsPerPixel = hdr->bitsPerPixel;
+    rfbScreen.depth = hdr->depth;
+    rfbScreen.paddedWidthInBytes = hdr->bytesPerRow;
+
+    SetFormat(&rfbServerFormat, hdr->bitsPerPixel, hdr->depth, hdr->bigEndian,
+              hdr->redMax, hdr->greenMax, hdr->blueMax,
+              hdr->redShift, hdr->greenShift, hdr->blueShift);
+
+    benchFB = (char *)xalloc(hdr->bytesPerRow * hdr->height);
+    if (!benchFB) {
+        rfbLog("%s: out of memory\n", path);
+        return FALSE;
+    }
+    memcpy(benchFB, data + hdr->pixelOffset, hdr->bytesPerRow * hdr->height);
+    return TRUE;
+}
+
+static char *PpmField(char *p, char *end, int *value) {
+    while (p < end) {
+        if (*p == '#') {
+            while (p < end && *p != '\n')
+                p++;
+        } else if (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+            p++;
+        } else {
+            break;
+        }
+    }
+    if (p >= end || *p < '0' || *p > '9')
+        return NULL;
+    for (*value = 0; p < end && *p >= '0' && *p <= '9'; p++)
+        *value = *value * 10 + (*p - '0');
+    return p;
+}
+
+static Bool LoadPpm(char *path, char *data, long len) {
+    char *p = data + 2, *end = data + len;
+    unsigned char *rgb;
+    CARD32 *pix;
+    int width, height, maxval, i;
+
+    if (!(p = PpmField(p, end, &width)) || !(p = PpmField(p, end, &height)) ||
+        !(p = PpmField(p, end, &maxval)) || maxval != 255 ||
+        width <= 0 || height <= 0 || (long long)width * height * 3 > end - p - 1) {
+        rfbLog("%s: only 8 bit binary PPMs (P6) are supported\n", path);
+        return FALSE;
+    }
+    rgb = (unsigned char *)p + 1;
+
+    rfbScreen.width = width;
+    rfbScreen.height = height;
+    rfbScreen.bitsPerPixel = 32;
+    rfbScreen.depth = 24;
+    rfbScreen.paddedWidthInBytes = width * 4;
+    rfbServerFormat = formats[0].format;
+
+    benchFB = (char *)xalloc(width * height * 4);
+    if (!benchFB) {
+        rfbLog("%s: out of memory\n", path);
+        return FALSE;
+    }
+    pix = (CARD32 *)benchFB;
+    for (i = 0; i < width * height; i++, rgb += 3)
+        pix[i] = (rgb[0] << 16) | (rgb[1] << 8) | rgb[2];
+    return TRUE;
+}
+
+static Bool LoadCorpusFile(char *path) {
+    long len;
+    char *data = ReadFile(path, &len);
+    Bool ok = FALSE;
+
+    if (!data)
+        return FALSE;
+
+    if (len >= sizeof(rfbShmHeader) && ((rfbShmHeader *)data)->magic == rfbShmMagic)
+        ok = LoadShmSnapshot(path, data, len);
+    else if (len > 2 && data[0] == 'P' && data[1] == '6')
+        ok = LoadPpm(path, data, len);
+    else
+        rfbLog("%s: neither a framebuffer snapshot nor a PPM\n", path);
+
+    xfree(data);
+    if (ok)
+        rfbScreen.sizeInBytes = rfbScreen.paddedWidthInBytes * rfbScreen.height;
+    return ok;
+}
+
+
+/*
+ * The sink reads everything written to the fake client and counts it.
+ */
+
+typedef struct {
+    int fd;
+    unsigned long long bytes;
+    Bool checksum;
+    uLong crc;
+    pthread_t thread;
+} benchSink;
+
+static void *sinkRun(void *arg) {
+    benchSink *sink = (benchSink *)arg;
+    char buf[65536];
+    ssize_t n;
+
+    while ((n = read(sink->fd, buf, sizeof(buf))) != 0) {
+        if (n < 0 && errno != EINTR)
+            break;
+        if (n > 0) {
+            sink->bytes += n;
+            if (sink->checksum)
+                sink->crc = crc32(sink->crc, (Bytef *)buf, n);
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * A client record set up the way rfbNewClient and SetEncodings would leave
+ * it for the given encoding, format and levels.
+ */
+
+static rfbClientPtr NewBenchClient(int sock, int enc, rfbPixelFormat *format,
+                                   int compress, int quality) {
+    rfbClientPtr cl = (rfbClientPtr)xalloc(sizeof(rfbClientRec));
+
+    memset(cl, 0, sizeof(rfbClientRec));
+    cl->sock = sock;
+    cl->host = "encbench";
+    cl->state = RFB_NORMAL;
+    cl->reactorFd = -1;
+    pthread_mutex_init(&cl->outputMutex, NULL);
+    pthread_mutex_init(&cl->updateMutex, NULL);
+    rfbPacingCondInit(&cl->updateCond);
+    pthread_mutex_init(&cl->writeMutex, NULL);
+
+    cl->preferredEncoding = encoders[enc].encoding;
+    cl->correMaxWidth = 48;
+    cl->correMaxHeight = 48;
+    cl->enableLastRectEncoding = TRUE;
+
+    cl->format = *format;
+    cl->translateFn = rfbTranslateNone;
+    if (!rfbSetTranslateFunctionUsingFormat(cl, rfbServerFormat)) {
+        xfree(cl);
+        return NULL;
+    }
+
+    cl->scalingFactor = 1;
+    cl->scalingFrameBuffer = rfbGetFramebuffer();
+    cl->scalingPaddedWidthInBytes = rfbScreen.paddedWidthInBytes;
+
+    cl->tightCompressLevel = (encoders[enc].levels == LEVELS_TIGHT) ? compress : TIGHT_DEFAULT_COMPRESSION;
+    cl->tightQualityLevel = quality;
+    cl->zlibCompressLevel = (encoders[enc].levels == LEVELS_ZLIB) ? compress : 5;
+    cl->compStreamRaw.total_in = ZLIBHEX_COMP_UNINITED;
+    cl->compStreamHex.total_in = ZLIBHEX_COMP_UNINITED;
+
+    cl->tileCaptureFrom = -1;
+
+    REGION_INIT(&hackScreen, &cl->modifiedRegion, NullBox, 0);
+    REGION_INIT(&hackScreen, &cl->requestedRegion, NullBox, 0);
+
+    rfbResetStats(cl);
+    rfbPacingInit(cl);
+    rfbLinkInit(cl);
+    return cl;
+}
+
+static void FreeBenchClient(rfbClientPtr cl) {
+    int i;
+
+    if (cl->compStreamInited)
+        deflateEnd(&cl->compStream);
+    if (cl->compStreamRaw.total_in != ZLIBHEX_COMP_UNINITED)
+        deflateEnd(&cl->compStreamRaw);
+    if (cl->compStreamHex.total_in != ZLIBHEX_COMP_UNINITED)
+        deflateEnd(&cl->compStreamHex);
+    for (i = 0; i < 4; i++) {
+        if (cl->zsActive[i])
+            deflateEnd(&cl->zsStruct[i]);
+    }
+
+    FreeZrleData(cl);
+    rfbParallelEncodeFree(cl);
+    rfbFreeTightData(cl);
+
+    rfbFreeClientScale(cl);
+    REGION_UNINIT(&hackScreen, &cl->modifiedRegion);
+    REGION_UNINIT(&hackScreen, &cl->requestedRegion);
+
+    rfbFreeTranslateTable(cl);
+    if (cl->client_zlibBeforeBuf)
+        xfree(cl->client_zlibBeforeBuf);
+    if (cl->client_zlibAfterBuf)
+        xfree(cl->client_zlibAfterBuf);
+    if (cl->client_rreBeforeBuf)
+        xfree(cl->client_rreBeforeBuf);
+    if (cl->client_rreAfterBuf)
+        xfree(cl->client_rreAfterBuf);
+    rfbFreeSubrectData(cl);
+    if (cl->pendingBuf)
+        xfree(cl->pendingBuf);
+
+    pthread_cond_destroy(&cl->updateCond);
+    pthread_mutex_destroy(&cl->updateMutex);
+    pthread_mutex_destroy(&cl->outputMutex);
+    pthread_mutex_destroy(&cl->writeMutex);
+    xfree(cl);
+}
+
+
+/*
+ * Send the whole screen, iterations times, with one encoder at one format
+ * and level, and print how it went.
+ */
+
+static Bool SendScreen(rfbClientPtr cl, encoderFn encoder, int *nRects) {
+    rfbFramebufferUpdateMsg *fu = (rfbFramebufferUpdateMsg *)cl->updateBuf;
+    int x, y, w, h;
+
+    fu->type = rfbFramebufferUpdate;
+    fu->nRects = Swap16IfLE(0xFFFF);
+    cl->ublen = sz_rfbFramebufferUpdateMsg;
+    cl->rfbFramebufferUpdateMessagesSent++;
+
+    for (y = 0; y < rfbScreen.height; y += rectHeight) {
+        h = min(rectHeight, rfbScreen.height - y);
+        for (x = 0; x < rfbScreen.width; x += rectWidth) {
+            w = min(rectWidth, rfbScreen.width - x);
+            cl->rfbRawBytesEquivalent += sz_rfbFramebufferUpdateRectHeader
+                                         + w * (cl->format.bitsPerPixel / 8) * h;
+            if (!(*encoder)(cl, x, y, w, h))
+                return FALSE;
+            (*nRects)++;
+        }
+    }
+
+    return (rfbSendLastRectMarker(cl) && rfbSendUpdateBuf(cl));
+}
+
+/*
+ * Play the headless workload from its start for headlessFrames frames.
+ * The client's first update is the whole screen; after that each frame's
+ * damage reaches its modifiedRegion by way of rfbMarkRectsModified and goes
+ * out with rfbSendFramebufferUpdate, as clientSendUpdate in main.c does it.
+ * The screen pixels sent are added to *screenBytes.
+ */
+
+static Bool SendFrames(rfbClientPtr cl, int *nUpdates, double *screenBytes) {
+    BoxRec boxes[4];
+    RegionRec updateRegion;
+    int frame, n, i;
+    Bool ok = TRUE;
+
+    boxes[0].x1 = boxes[0].y1 = 0;
+    boxes[0].x2 = rfbScreen.width;
+    boxes[0].y2 = rfbScreen.height;
+    rfbMarkRectsModified(boxes, 1);
+
+    for (frame = 0; ok && frame <= headlessFrames; frame++) {
+        if (frame > 0 && (n = rfbHeadlessNextFrame(boxes, 4)) > 0)
+            rfbMarkRectsModified(boxes, n);
+
+        pthread_mutex_lock(&cl->updateMutex);
+        if (!REGION_NOTEMPTY(&hackScreen, &cl->modifiedRegion)) {
+            pthread_mutex_unlock(&cl->updateMutex);
+            continue;
+        }
+        REGION_INIT(&hackScreen, &updateRegion, NullBox, 0);
+        REGION_COPY(&hackScreen, &updateRegion, &cl->modifiedRegion);
+        REGION_EMPTY(&hackScreen, &cl->modifiedRegion);
+        pthread_mutex_unlock(&cl->updateMutex);
+
+        for (i = 0; i < REGION_NUM_RECTS(&updateRegion); i++) {
+            BoxPtr box = &REGION_RECTS(&updateRegion)[i];
+
+            *screenBytes += (double)(box->x2 - box->x1) * (box->y2 - box->y1)
+                            * (rfbScreen.bitsPerPixel / 8);
+        }
+
+        pthread_mutex_lock(&cl->outputMutex);
+        ok = rfbSendFramebufferUpdate(cl, updateRegion);
+        pthread_mutex_unlock(&cl->outputMutex);
+        REGION_UNINIT(&hackScreen, &updateRegion);
+        (*nUpdates)++;
+    }
+
+    return ok;
+}
+
+/*
+ * Send the screen iterations times into a sink, leaving what went down it
+ * there, the Raw equivalent in *raw and the time it took in *elapsed.
+ */
+
+static Bool EncodeToSink(char *path, int enc, int fmt, int compress, int quality,
+                         benchSink *sink, unsigned long long *raw,
+                         rfbPaceTime *elapsed, int *nRects, double *screenBytes) {
+    rfbClientPtr cl;
+    int sv[2], i;
+    rfbPaceTime start;
+    Bool ok = TRUE;
+
+    /* Each run plays the workload from the same start */
+    if (headless)
+        rfbHeadlessRestart();
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        rfbLogPerror("encbench: socketpair");
+        return FALSE;
+    }
+    sink->fd = sv[1];
+    sink->bytes = 0;
+    sink->crc = crc32(0L, Z_NULL, 0);
+    if (pthread_create(&sink->thread, NULL, sinkRun, sink) != 0) {
+        rfbLogPerror("encbench: pthread_create");
+        close(sv[0]);
+        close(sv[1]);
+        return FALSE;
+    }
+
+    cl = NewBenchClient(sv[0], enc, &formats[fmt].format, compress, quality);
+    if (cl && scale != 1 && !rfbSetClientScale(cl, scale))
+        rfbLog("encbench: out of memory scaling by %g, sending unscaled\n", scale);
+
+    *screenBytes = 0;
+    start = rfbPacingNow();
+    if (cl && headless) {
+        benchClientList = cl;
+        ok = SendFrames(cl, nRects, screenBytes);
+        benchClientList = NULL;
+    }
+    for (i = 0; cl && !headless && ok && i < iterations; i++)
+        ok = SendScreen(cl, encoders[enc].encoder, nRects);
+    *elapsed = max(rfbPacingNow() - start, 1);
+    if (!headless)
+        *screenBytes = (double)rfbScreen.width * rfbScreen.height * (rfbScreen.bitsPerPixel / 8) * iterations;
+
+    /* Let the sink see end of file, so its count is complete.  A client
+       which failed has been closed already. */
+    if (cl && cl->sock != -1)
+        close(cl->sock);
+    pthread_join(sink->thread, NULL);
+    close(sv[1]);
+
+    if (!cl)
+        return FALSE;
+    *raw = cl->rfbRawBytesEquivalent;
+    FreeBenchClient(cl);
+    if (!ok) {
+        rfbLog("encbench: %s failed on %s\n", encoders[enc].name, path);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void LevelName(char *level, int enc, int compress, int quality) {
+    if (encoders[enc].levels == LEVELS_NONE)
+        strcpy(level, "-");
+    else if (encoders[enc].levels == LEVELS_ZLIB || quality == -1)
+        sprintf(level, "%d", compress);
+    else
+        sprintf(level, "%d/q%d", compress, quality);
+}
+
+static Bool RunOne(char *path, int enc, int fmt, int compress, int quality) {
+    benchSink sink;
+    int nRects = 0;
+    rfbPaceTime elapsed;
+    unsigned long long raw;
+    double seconds, screenBytes;
+    char level[16];
+
+    sink.checksum = checksumOutput;
+    if (!EncodeToSink(path, enc, fmt, compress, quality, &sink, &raw, &elapsed, &nRects,
+                      &screenBytes))
+        return FALSE;
+
+    LevelName(level, enc, compress, quality);
+
+    seconds = elapsed / 1000000.0;
+    printf("%-24s %-8s %-7s %-6s %9.1f %11.0f %8.2f %12llu",
+           path, encoders[enc].name, formats[fmt].name, level,
+           screenBytes / seconds / (1024 * 1024), nRects / seconds,
+           sink.bytes ? (double)raw / sink.bytes : 0.0, sink.bytes);
+    if (checksumOutput)
+        printf(" %08lx", (unsigned long)sink.crc);
+    printf("\n");
+    fflush(stdout);
+    return TRUE;
+}
+
+/*
+ * Send the screen with Tight with the scalar filters and again with the
+ * SIMD ones, and check the client would have got the same bytes.
+ */
+
+static Bool RunVerify(char *path, int enc, int fmt, int compress, int quality) {
+    benchSink scalar, simd;
+    int nRects = 0;
+    rfbPaceTime elapsed;
+    unsigned long long raw;
+    double screenBytes;
+    char level[16];
+    Bool same;
+
+    scalar.checksum = simd.checksum = TRUE;
+    rfbSimdTight = FALSE;
+    if (!EncodeToSink(path, enc, fmt, compress, quality, &scalar, &raw, &elapsed, &nRects,
+                      &screenBytes))
+        return FALSE;
+    rfbSimdTight = TRUE;
+    if (!EncodeToSink(path, enc, fmt, compress, quality, &simd, &raw, &elapsed, &nRects,
+                      &screenBytes))
+        return FALSE;
+
+    same = (scalar.bytes == simd.bytes && scalar.crc == simd.crc);
+    LevelName(level, enc, compress, quality);
+    printf("%-24s %-8s %-7s %-6s %12llu %12llu %-8s\n",
+           path, encoders[enc].name, formats[fmt].name, level,
+           scalar.bytes, simd.bytes, same ? "same" : "DIFFERS");
+    fflush(stdout);
+    return same;
+}
+
+/*
+ * The screen translated to a format, as a client in it would see it.
+ */
+
+static char *TranslateScreen(char *path, int fmt) {
+    rfbClientPtr cl = NewBenchClient(-1, 0, &formats[fmt].format, 0, -1);
+    int bpp = formats[fmt].format.bitsPerPixel;
+    char *pixels;
+
+    if (!cl)
+        return NULL;
+    pixels = (char *)xalloc(rfbScreen.width * rfbScreen.height * (bpp / 8));
+    if (!pixels) {
+        rfbLog("encbench: out of memory for %s\n", path);
+        FreeBenchClient(cl);
+        return NULL;
+    }
+
+    (*cl->translateFn)(cl->translateLookupTable, &rfbServerFormat, &cl->format,
+                       cl->scalingFrameBuffer, pixels,
+                       cl->scalingPaddedWidthInBytes, rfbScreen.width,
+                       rfbScreen.height);
+    FreeBenchClient(cl);
+    return pixels;
+}
+
+/*
+ * Run the colour analyses over the screen in a format.
+ */
+
+static Bool RunAnalysis(char *path, int fmt) {
+    char *pixels = TranslateScreen(path, fmt);
+    Bool ok;
+
+    if (!pixels)
+        return FALSE;
+    ok = rfbAnalysisBench(path, formats[fmt].name, pixels,
+                          formats[fmt].format.bitsPerPixel,
+                          rfbScreen.width, rfbScreen.height, iterations,
+                          rectWidth, rectHeight);
+    xfree(pixels);
+    return ok;
+}
+
+/*
+ * Check Tight's SIMD filters, one by one, on the screen in a format.
+ */
+
+static Bool RunTightVerify(char *path, int fmt) {
+    char *pixels = TranslateScreen(path, fmt);
+    Bool ok;
+
+    if (!pixels)
+        return FALSE;
+    ok = rfbTightVerify(path, formats[fmt].name, pixels, &formats[fmt].format,
+                        rfbScreen.width, rfbScreen.height, rectWidth, rectHeight);
+    xfree(pixels);
+    return ok;
+}
+
+/*
+ * Run every chosen encoder, format and level over the loaded screen or
+ * headless workload.
+ */
+
+static Bool RunEncoders(char *path) {
+    int enc, fmt, c, q;
+    Bool (*run)(char *path, int enc, int fmt, int compress, int quality);
+    Bool ok = TRUE;
+
+    run = verifyTight ? RunVerify : RunOne;
+
+    for (enc = 0; enc < NUM_ENCODERS; enc++) {
+        if (!useEncoder[enc])
+            continue;
+        for (fmt = 0; fmt < NUM_FORMATS; fmt++) {
+            if (!useFormat[fmt])
+                continue;
+            switch (encoders[enc].levels) {
+                case LEVELS_NONE:
+                    ok &= (*run)(path, enc, fmt, 0, -1);
+                    break;
+                case LEVELS_ZLIB:
+                    for (c = 0; c < numCompressLevels; c++)
+                        ok &= (*run)(path, enc, fmt, compressLevels[c], -1);
+                    break;
+                case LEVELS_TIGHT:
+                    for (c = 0; c < numCompressLevels; c++)
+                        for (q = 0; q < numQualityLevels; q++)
+                            ok &= (*run)(path, enc, fmt, compressLevels[c], qualityLevels[q]);
+                    break;
+            }
+        }
+    }
+
+    return ok;
+}
+
+static Bool RunCorpusFile(char *path) {
+    int fmt;
+    Bool ok = TRUE;
+
+    if (!LoadCorpusFile(path))
+        return FALSE;
+
+    for (fmt = 0; analysisOnly && fmt < NUM_FORMATS; fmt++) {
+        if (useFormat[fmt])
+            ok &= RunAnalysis(path, fmt);
+    }
+
+    for (fmt = 0; verifyTight && fmt < NUM_FORMATS; fmt++) {
+        if (useFormat[fmt])
+            ok &= RunTightVerify(path, fmt);
+    }
+
+    if (!analysisOnly)
+        ok &= RunEncoders(path);
+
+    xfree(benchFB);
+    benchFB = NULL;
+    return ok;
+}
+
+/*
+ * Play each of a comma separated list of headless workloads.  The source is
+ * set up once a workload, and EncodeToSink restarts it for every run.
+ */
+
+static Bool RunHeadless(char *list) {
+    char *copy = strdup(list), *name, *save = NULL;
+    char path[64];
+    Bool ok = TRUE;
+
+    rfbSource = &rfbHeadlessSource;
+    for (name = strtok_r(copy, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        if (!rfbHeadlessSetWorkload(name)) {
+            rfbLog("encbench: unknown workload %s\n", name);
+            ok = FALSE;
+            continue;
+        }
+        if (!(*rfbHeadlessSource.init)()) {
+            ok = FALSE;
+            continue;
+        }
+        snprintf(path, sizeof(path), "headless:%s", name);
+        ok &= RunEncoders(path);
+    }
+    rfbSource = &benchSource;
+    free(copy);
+    return ok;
+}
+
+
+/*
+ * Command line.  Lists are comma separated; levels may also be ranges.
+ */
+
+static int FindEncoder(char *name) {
+    int i;
+
+    for (i = 0; i < NUM_ENCODERS; i++) {
+        if (strcasecmp(name, encoders[i].name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static int FindFormat(char *name) {
+    int i;
+
+    for (i = 0; i < NUM_FORMATS; i++) {
+        if (strcasecmp(name, formats[i].name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static Bool ParseNames(char *list, int (*find)(char *name), Bool *use, int count) {
+    char *copy = strdup(list), *name, *save = NULL;
+    int i;
+    Bool ok = TRUE;
+
+    memset(use, 0, count * sizeof(Bool));
+    for (name = strtok_r(copy, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        if ((i = (*find)(name)) < 0) {
+            rfbLog("encbench: unknown name %s\n", name);
+            ok = FALSE;
+        } else {
+            use[i] = TRUE;
+        }
+    }
+    free(copy);
+    return ok;
+}
+
+static Bool ParseLevels(char *list, int lowest, int *levels, int *count) {
+    char *copy = strdup(list), *item, *save = NULL;
+    int from, to;
+    Bool ok = TRUE;
+
+    *count = 0;
+    for (item = strtok_r(copy, ",", &save); item && ok; item = strtok_r(NULL, ",", &save)) {
+        if (sscanf(item, "%d-%d", &from, &to) != 2) {
+            from = to = atoi(item);
+            if (strcasecmp(item, "none") == 0)
+                from = to = -1;
+        }
+        if (from < lowest || to > 9 || from > to) {
+            rfbLog("encbench: bad level %s\n", item);
+            ok = FALSE;
+        }
+        for (; ok && from <= to && *count < MAX_LEVELS; from++)
+            levels[(*count)++] = from;
+    }
+    free(copy);
+    return ok && *count > 0;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: encbench [options] corpus-file ...\n");
+    fprintf(stderr, "       encbench -headless workloads [options]\n\n");
+    fprintf(stderr, "Corpus files are -shmfb segment snapshots or binary PPMs (P6).\n\n");
+    fprintf(stderr, "-encodings list        encoders to run (default raw,rre,corre,hextile,\n");
+    fprintf(stderr, "                       zlib,zlibhex,tight,zrle)\n");
+    fprintf(stderr, "-formats list          client pixel formats (default 32,32swap,16,15,8,\n");
+    fprintf(stderr, "                       or 30 for 10 bits a channel)\n");
+    fprintf(stderr, "-compress levels       Zlib, ZlibHex and Tight levels (default 0-9)\n");
+    fprintf(stderr, "-quality levels        Tight JPEG qualities, none for no JPEG\n");
+    fprintf(stderr, "                       (default none,0-9)\n");
+    fprintf(stderr, "-rect WxH              size of the rectangles sent (default 128x128)\n");
+    fprintf(stderr, "-iterations n          times each screen is sent per run (default 4)\n");
+    fprintf(stderr, "-threads n             encoding threads, see -encodethreads (default 1)\n");
+    fprintf(stderr, "-translate how         simd or tables, see -nosimd (default simd)\n");
+    fprintf(stderr, "-subrectbudget n       see the server's option (default %d)\n", rfbSubrectBudget);
+    fprintf(stderr, "-analysis              time finding the colours in tiles, old against new,\n");
+    fprintf(stderr, "                       instead of running the encoders\n");
+    fprintf(stderr, "-verifytight           check Tight's SIMD filters give the same output as\n");
+    fprintf(stderr, "                       the scalar ones, instead of timing the encoders\n");
+    fprintf(stderr, "-checksum              print the CRC-32 of each run's output, to compare\n");
+    fprintf(stderr, "                       builds\n");
+    fprintf(stderr, "-headless workloads    play idle,scroll,drag,video or cycle through the\n");
+    fprintf(stderr, "                       server's update path instead of sending files\n");
+    fprintf(stderr, "-frames n              headless frames played per run (default %d)\n", headlessFrames);
+    fprintf(stderr, "-size WxH              headless screen size (default %dx%d)\n",
+            rfbHeadlessWidth, rfbHeadlessHeight);
+    fprintf(stderr, "-scale ratio           scale the headless client, see -scale (default 1)\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    char *workloads = NULL;
+    int i;
+    Bool ok = TRUE;
+
+    SetupFormats();
+    for (i = 0; i < NUM_ENCODERS; i++)
+        useEncoder[i] = TRUE;
+    ParseNames("32,32swap,16,15,8", FindFormat, useFormat, NUM_FORMATS);
+    ParseLevels("0-9", 0, compressLevels, &numCompressLevels);
+    ParseLevels("none,0-9", -1, qualityLevels, &numQualityLevels);
+    rfbEncodeThreads = 1;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (i + 1 >= argc)
+            usage();
+        if (strcmp(argv[i], "-analysis") == 0) {
+            analysisOnly = TRUE;
+        } else if (strcmp(argv[i], "-checksum") == 0) {
+            checksumOutput = TRUE;
+        } else if (strcmp(argv[i], "-verifytight") == 0) {
+            verifyTight = TRUE;
+            ParseNames("tight", FindEncoder, useEncoder, NUM_ENCODERS);
+        } else if (strcmp(argv[i], "-headless") == 0) {
+            headless = TRUE;
+            workloads = argv[++i];
+        } else if (strcmp(argv[i], "-frames") == 0) {
+            if ((headlessFrames = atoi(argv[++i])) <= 0)
+                usage();
+        } else if (strcmp(argv[i], "-size") == 0) {
+            if (sscanf(argv[++i], "%dx%d", &rfbHeadlessWidth, &rfbHeadlessHeight) != 2 ||
+                rfbHeadlessWidth <= 0 || rfbHeadlessHeight <= 0)
+                usage();
+        } else if (strcmp(argv[i], "-scale") == 0) {
+            if ((scale = atof(argv[++i])) < 1)
+                usage();
+        } else if (strcmp(argv[i], "-encodings") == 0) {
+            if (!ParseNames(argv[++i], FindEncoder, useEncoder, NUM_ENCODERS))
+                usage();
+        } else if (strcmp(argv[i], "-formats") == 0) {
+            if (!ParseNames(argv[++i], FindFormat, useFormat, NUM_FORMATS))
+                usage();
+        } else if (strcmp(argv[i], "-compress") == 0) {
+            if (!ParseLevels(argv[++i], 0, compressLevels, &numCompressLevels))
+                usage();
+        } else if (strcmp(argv[i], "-quality") == 0) {
+            if (!ParseLevels(argv[++i], -1, qualityLevels, &numQualityLevels))
+                usage();
+        } else if (strcmp(argv[i], "-rect") == 0) {
+            if (sscanf(argv[++i], "%dx%d", &rectWidth, &rectHeight) != 2 ||
+                rectWidth <= 0 || rectHeight <= 0)
+                usage();
+        } else if (strcmp(argv[i], "-iterations") == 0) {
+            if ((iterations = atoi(argv[++i])) <= 0)
+                usage();
+        } else if (strcmp(argv[i], "-threads") == 0) {
+            rfbEncodeThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-subrectbudget") == 0) {
+            rfbSubrectBudget = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-translate") == 0) {
+            i++;
+            if (strcmp(argv[i], "simd") == 0)
+                rfbSimdTranslate = TRUE;
+            else if (strcmp(argv[i], "tables") == 0)
+                rfbSimdTranslate = FALSE;
+            else
+                usage();
+        } else {
+            usage();
+        }
+    }
+    if (i == argc && !headless)
+        usage();
+    if (headless && (analysisOnly || verifyTight))
+        usage();
+
+    rfbSource = &benchSource;
+    rfbWorkPoolStart();
+
+    if (analysisOnly)
+        printf("%-24s %-8s %-7s %-6s %9s %11s %8s\n",
+               "file", "analysis", "format", "code", "MB/s", "tiles/s", "speedup");
+    else if (verifyTight)
+        printf("%-24s %-8s %-7s %-6s %12s %12s %-8s\n",
+               "file", "encoding", "format", "level", "scalar", "simd", "result");
+    else
+        printf("%-24s %-8s %-7s %-6s %9s %11s %8s %12s%s\n",
+               headless ? "workload" : "file", "encoding", "format", "level", "MB/s",
+               headless ? "updates/s" : "rects/s", "ratio", "bytes",
+               checksumOutput ? " crc32" : "");
+    if (headless)
+        ok &= RunHeadless(workloads);
+    for (; i < argc; i++)
+        ok &= RunCorpusFile(argv[i]);
+
+    rfbWorkPoolStop();
+    return ok ? 0 : 1;
+}
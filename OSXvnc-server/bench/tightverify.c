@@ -0,0 +1,459 @@
+/*
+ * tightverify.c - check Tight's SIMD filters against the scalar ones.
+ *
+ * encbench -verifytight runs this on each corpus file and format before
+ * checking whole Tight streams.  The stream can only show a difference in
+ * smoothness detection when it changes the guess, so here each kernel of
+ * tight_simd.c is run on its own over every -rect sized rectangle of the
+ * screen, translated to the client's format, and over the same rectangle
+ * less a column and a row so the ends of rows get checked too.  What it
+ * gives must be exactly what the scalar code gives: the same histogram for
+ * DetectSmoothImage, and the same bytes from the gradient filter and from
+ * Pack24.
+ *
+ * The scalar code is kept here as it is in tight.c, less the client record
+ * it gets its buffers from.
+ */
+
+/*
+ *  OSXvnc Copyright (C) 2002-2004 Redstone Software osxvnc@redstonesoftware.com
+ *  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rfb.h"
+
+#define DETECT_SUBROW_WIDTH     7
+
+#define KERNEL_DETECT24         0
+#define KERNEL_DETECT           1
+#define KERNEL_GRADIENT24       2
+#define KERNEL_GRADIENT         3
+#define KERNEL_PACK24           4
+#define NUM_KERNELS             5
+
+static char *kernelNames[NUM_KERNELS] = {
+    "detect24", "detect", "grad24", "gradient", "pack24"
+};
+
+typedef struct {
+    int checked;        /* rectangles the scalar code was run on */
+    int taken;          /* and the SIMD kernel took */
+    int differ;
+} kernelCount;
+
+
+/*
+ * DetectSmoothImage's sampling.
+ */
+
+static void
+DetectStats24(char *buf, int off, int w, int h, int *diffStat, int *pixelCount)
+{
+    int x, y, d, dx, c;
+    int pix, left[3];
+
+    y = 0, x = 0;
+    while (y < h && x < w) {
+        for (d = 0; d < h - y && d < w - x - DETECT_SUBROW_WIDTH; d++) {
+            for (c = 0; c < 3; c++) {
+                left[c] = (int)buf[((y+d)*w+x+d)*4+off+c] & 0xFF;
+            }
+            for (dx = 1; dx <= DETECT_SUBROW_WIDTH; dx++) {
+                for (c = 0; c < 3; c++) {
+                    pix = (int)buf[((y+d)*w+x+d+dx)*4+off+c] & 0xFF;
+                    diffStat[abs(pix - left[c])]++;
+                    left[c] = pix;
+                }
+                (*pixelCount)++;
+            }
+        }
+        if (w > h) {
+            x += h;
+            y = 0;
+        } else {
+            x = 0;
+            y += w;
+        }
+    }
+}
+
+#define DEFINE_DETECT_FUNCTION(bpp)                                          \
+                                                                             \
+static void                                                                  \
+DetectStats##bpp(CARD##bpp *buf, rfbPixelFormat *fmt, Bool endianMismatch,   \
+                 int w, int h, int *diffStat, int *pixelCount)               \
+{                                                                            \
+    CARD##bpp pix;                                                           \
+    int maxColor[3], shiftBits[3];                                           \
+    int x, y, d, dx, c;                                                      \
+    int sample, sum, left[3];                                                \
+                                                                             \
+    maxColor[0] = fmt->redMax;                                               \
+    maxColor[1] = fmt->greenMax;                                             \
+    maxColor[2] = fmt->blueMax;                                              \
+    shiftBits[0] = fmt->redShift;                                            \
+    shiftBits[1] = fmt->greenShift;                                          \
+    shiftBits[2] = fmt->blueShift;                                           \
+                                                                             \
+    y = 0, x = 0;                                                            \
+    while (y < h && x < w) {                                                 \
+        for (d = 0; d < h - y && d < w - x - DETECT_SUBROW_WIDTH; d++) {     \
+            pix = buf[(y+d)*w+x+d];                                          \
+            if (endianMismatch) {                                            \
+                pix = Swap##bpp(pix);                                        \
+            }                                                                \
+            for (c = 0; c < 3; c++) {                                        \
+                left[c] = (int)(pix >> shiftBits[c] & maxColor[c]);          \
+            }                                                                \
+            for (dx = 1; dx <= DETECT_SUBROW_WIDTH; dx++) {                  \
+                pix = buf[(y+d)*w+x+d+dx];                                   \
+                if (endianMismatch) {                                        \
+                    pix = Swap##bpp(pix);                                    \
+                }                                                            \
+                sum = 0;                                                     \
+                for (c = 0; c < 3; c++) {                                    \
+                    sample = (int)(pix >> shiftBits[c] & maxColor[c]);       \
+                    sum += abs(sample - left[c]);                            \
+                    left[c] = sample;                                        \
+                }                                                            \
+                if (sum > 255)                                               \
+                    sum = 255;                                               \
+                diffStat[sum]++;                                             \
+                (*pixelCount)++;                                             \
+            }                                                                \
+        }                                                                    \
+        if (w > h) {                                                         \
+            x += h;                                                          \
+            y = 0;                                                           \
+        } else {                                                             \
+            x = 0;                                                           \
+            y += w;                                                          \
+        }                                                                    \
+    }                                                                        \
+}
+
+DEFINE_DETECT_FUNCTION(16)
+DEFINE_DETECT_FUNCTION(32)
+
+
+/*
+ * The gradient filter and Pack24.
+ */
+
+static void
+FilterGradient24(char *buf, int *shiftBits, int w, int h, int *prevRows)
+{
+    CARD32 *buf32;
+    CARD32 pix32;
+    int *prevRowPtr;
+    int pixHere[3], pixUpper[3], pixLeft[3], pixUpperLeft[3];
+    int prediction;
+    int x, y, c;
+
+    buf32 = (CARD32 *)buf;
+    memset (prevRows, 0, w * 3 * sizeof(int));
+
+    for (y = 0; y < h; y++) {
+        for (c = 0; c < 3; c++) {
+            pixUpper[c] = 0;
+            pixHere[c] = 0;
+        }
+        prevRowPtr = prevRows;
+        for (x = 0; x < w; x++) {
+            pix32 = *buf32++;
+            for (c = 0; c < 3; c++) {
+                pixUpperLeft[c] = pixUpper[c];
+                pixLeft[c] = pixHere[c];
+                pixUpper[c] = *prevRowPtr;
+                pixHere[c] = (int)(pix32 >> shiftBits[c] & 0xFF);
+                *prevRowPtr++ = pixHere[c];
+
+                prediction = pixLeft[c] + pixUpper[c] - pixUpperLeft[c];
+                if (prediction < 0) {
+                    prediction = 0;
+                } else if (prediction > 0xFF) {
+                    prediction = 0xFF;
+                }
+                *buf++ = (char)(pixHere[c] - prediction);
+            }
+        }
+    }
+}
+
+#define DEFINE_GRADIENT_FILTER_FUNCTION(bpp)                             \
+                                                                         \
+static void                                                              \
+FilterGradient##bpp(CARD##bpp *buf, rfbPixelFormat *fmt,                 \
+                    Bool endianMismatch, int w, int h, int *prevRows)  \
+{                                                                        \
+    CARD##bpp pix, diff;                                                 \
+    int *prevRowPtr;                                                     \
+    int maxColor[3], shiftBits[3];                                       \
+    int pixHere[3], pixUpper[3], pixLeft[3], pixUpperLeft[3];            \
+    int prediction;                                                      \
+    int x, y, c;                                                         \
+                                                                         \
+    memset (prevRows, 0, w * 3 * sizeof(int));                         \
+                                                                         \
+    maxColor[0] = fmt->redMax;                                           \
+    maxColor[1] = fmt->greenMax;                                         \
+    maxColor[2] = fmt->blueMax;                                          \
+    shiftBits[0] = fmt->redShift;                                        \
+    shiftBits[1] = fmt->greenShift;                                      \
+    shiftBits[2] = fmt->blueShift;                                       \
+                                                                         \
+    for (y = 0; y < h; y++) {                                            \
+        for (c = 0; c < 3; c++) {                                        \
+            pixUpper[c] = 0;                                             \
+            pixHere[c] = 0;                                              \
+        }                                                                \
+        prevRowPtr = prevRows;                                         \
+        for (x = 0; x < w; x++) {                                        \
+            pix = *buf;                                                  \
+            if (endianMismatch) {                                        \
+                pix = Swap##bpp(pix);                                    \
+            }                                                            \
+            diff = 0;                                                    \
+            for (c = 0; c < 3; c++) {                                    \
+                pixUpperLeft[c] = pixUpper[c];                           \
+                pixLeft[c] = pixHere[c];                                 \
+                pixUpper[c] = *prevRowPtr;                               \
+                pixHere[c] = (int)(pix >> shiftBits[c] & maxColor[c]);   \
+                *prevRowPtr++ = pixHere[c];                              \
+                                                                         \
+                prediction = pixLeft[c] + pixUpper[c] - pixUpperLeft[c]; \
+                if (prediction < 0) {                                    \
+                    prediction = 0;                                      \
+                } else if (prediction > maxColor[c]) {                   \
+                    prediction = maxColor[c];                            \
+                }                                                        \
+                diff |= ((pixHere[c] - prediction) & maxColor[c])        \
+                    << shiftBits[c];                                     \
+            }                                                            \
+            if (endianMismatch) {                                        \
+                diff = Swap##bpp(diff);                                  \
+            }                                                            \
+            *buf++ = diff;                                               \
+        }                                                                \
+    }                                                                    \
+}
+
+DEFINE_GRADIENT_FILTER_FUNCTION(16)
+DEFINE_GRADIENT_FILTER_FUNCTION(32)
+
+static void
+Pack24(char *buf, int *shiftBits, int count)
+{
+    CARD32 *buf32;
+    CARD32 pix;
+
+    buf32 = (CARD32 *)buf;
+
+    while (count--) {
+        pix = *buf32++;
+        *buf++ = (char)(pix >> shiftBits[0]);
+        *buf++ = (char)(pix >> shiftBits[1]);
+        *buf++ = (char)(pix >> shiftBits[2]);
+    }
+}
+
+
+/*
+ * Run each kernel that applies to the format over one rectangle, in rect,
+ * both ways.
+ */
+
+typedef struct {
+    char *rect;         /* the pixels, w * h of them in a row */
+    char *scalar;       /* copies for the two filters to work on */
+    char *simd;
+    int *prevRows;    /* as big as tight.c's */
+} verifyBuffers;
+
+static void
+Count(kernelCount *count, Bool taken, Bool same)
+{
+    count->checked++;
+    if (taken) {
+        count->taken++;
+        if (!same)
+            count->differ++;
+    }
+}
+
+static void
+VerifyDetect(verifyBuffers *b, rfbPixelFormat *fmt, Bool endianMismatch,
+             Bool use24, int w, int h, kernelCount *counts)
+{
+    int scalarStat[256], simdStat[256];
+    int scalarCount = 0, simdCount = 0;
+    Bool taken;
+
+    memset(scalarStat, 0, sizeof(scalarStat));
+    memset(simdStat, 0, sizeof(simdStat));
+
+    if (use24) {
+        int off = (fmt->bigEndian != 0);
+
+        DetectStats24(b->rect, off, w, h, scalarStat, &scalarCount);
+        taken = rfbTightDetectStats24(b->rect, off, w, h, simdStat, &simdCount);
+        Count(&counts[KERNEL_DETECT24], taken,
+              scalarCount == simdCount && !memcmp(scalarStat, simdStat, sizeof(scalarStat)));
+        return;
+    }
+
+    if (fmt->bitsPerPixel == 32) {
+        DetectStats32((CARD32 *)b->rect, fmt, endianMismatch, w, h, scalarStat, &scalarCount);
+        taken = rfbTightDetectStats32((CARD32 *)b->rect, fmt, endianMismatch, w, h,
+                                      simdStat, &simdCount);
+    } else {
+        DetectStats16((CARD16 *)b->rect, fmt, endianMismatch, w, h, scalarStat, &scalarCount);
+        taken = rfbTightDetectStats16((CARD16 *)b->rect, fmt, endianMismatch, w, h,
+                                      simdStat, &simdCount);
+    }
+    Count(&counts[KERNEL_DETECT], taken,
+          scalarCount == simdCount && !memcmp(scalarStat, simdStat, sizeof(scalarStat)));
+}
+
+static void
+VerifyFilters(verifyBuffers *b, rfbPixelFormat *fmt, Bool endianMismatch,
+              Bool use24, int *shiftBits, int w, int h, kernelCount *counts)
+{
+    int size = w * h * (fmt->bitsPerPixel / 8);
+    Bool taken;
+
+    if (use24) {
+        memcpy(b->scalar, b->rect, size);
+        memcpy(b->simd, b->rect, size);
+        FilterGradient24(b->scalar, shiftBits, w, h, b->prevRows);
+        taken = rfbTightFilterGradient24(b->simd, shiftBits, w, h, b->prevRows);
+        Count(&counts[KERNEL_GRADIENT24], taken, !memcmp(b->scalar, b->simd, w * h * 3));
+
+        memcpy(b->scalar, b->rect, size);
+        memcpy(b->simd, b->rect, size);
+        Pack24(b->scalar, shiftBits, w * h);
+        taken = rfbTightPack24(b->simd, shiftBits, w * h);
+        Count(&counts[KERNEL_PACK24], taken, !memcmp(b->scalar, b->simd, w * h * 3));
+        return;
+    }
+
+    memcpy(b->scalar, b->rect, size);
+    memcpy(b->simd, b->rect, size);
+    if (fmt->bitsPerPixel == 32) {
+        FilterGradient32((CARD32 *)b->scalar, fmt, endianMismatch, w, h, b->prevRows);
+        taken = rfbTightFilterGradient32((CARD32 *)b->simd, fmt, endianMismatch, w, h,
+                                         b->prevRows);
+    } else {
+        FilterGradient16((CARD16 *)b->scalar, fmt, endianMismatch, w, h, b->prevRows);
+        taken = rfbTightFilterGradient16((CARD16 *)b->simd, fmt, endianMismatch, w, h,
+                                         b->prevRows);
+    }
+    Count(&counts[KERNEL_GRADIENT], taken, !memcmp(b->scalar, b->simd, size));
+}
+
+
+/*
+ * rfbTightVerify checks the kernels on the screen in pixels, translated to
+ * fmt, and prints how each went.  It returns FALSE if any differed.
+ */
+
+Bool
+rfbTightVerify(char *path, char *format, char *pixels, rfbPixelFormat *fmt,
+               int width, int height, int rectWidth, int rectHeight)
+{
+    int bytesPerPixel = fmt->bitsPerPixel / 8;
+    kernelCount counts[NUM_KERNELS];
+    verifyBuffers b;
+    Bool endianMismatch, use24;
+    int shiftBits[3];
+    int x, y, w, h, dy, k, less;
+    Bool ok = TRUE;
+
+    if (fmt->bitsPerPixel == 8)
+        return TRUE;
+
+    /* As tight.c decides them */
+    endianMismatch = (!rfbServerFormat.bigEndian != !fmt->bigEndian);
+    use24 = (fmt->bitsPerPixel == 32 && fmt->depth == 24 && fmt->redMax == 0xFF &&
+             fmt->greenMax == 0xFF && fmt->blueMax == 0xFF);
+    if (!endianMismatch) {
+        shiftBits[0] = fmt->redShift;
+        shiftBits[1] = fmt->greenShift;
+        shiftBits[2] = fmt->blueShift;
+    } else {
+        shiftBits[0] = 24 - fmt->redShift;
+        shiftBits[1] = 24 - fmt->greenShift;
+        shiftBits[2] = 24 - fmt->blueShift;
+    }
+
+    b.rect = (char *)xalloc(rectWidth * rectHeight * bytesPerPixel);
+    b.scalar = (char *)xalloc(rectWidth * rectHeight * bytesPerPixel);
+    b.simd = (char *)xalloc(rectWidth * rectHeight * bytesPerPixel);
+    b.prevRows = (int *)xalloc(max(rectWidth, 2048) * 3 * sizeof(int));
+    if (!b.rect || !b.scalar || !b.simd || !b.prevRows) {
+        rfbLog("encbench: out of memory verifying %s\n", path);
+        xfree(b.rect);
+        xfree(b.scalar);
+        xfree(b.simd);
+        xfree((char *)b.prevRows);
+        return FALSE;
+    }
+
+    memset(counts, 0, sizeof(counts));
+    rfbSimdTight = TRUE;
+
+    for (y = 0; y < height; y += rectHeight) {
+        for (x = 0; x < width; x += rectWidth) {
+            for (less = 0; less <= 1; less++) {
+                w = min(rectWidth, width - x) - less;
+                h = min(rectHeight, height - y) - less;
+                if (w <= 0 || h <= 0)
+                    continue;
+
+                for (dy = 0; dy < h; dy++)
+                    memcpy(b.rect + dy * w * bytesPerPixel,
+                           pixels + ((y + dy) * width + x) * bytesPerPixel,
+                           w * bytesPerPixel);
+
+                VerifyDetect(&b, fmt, endianMismatch, use24, w, h, counts);
+                VerifyFilters(&b, fmt, endianMismatch, use24, shiftBits, w, h, counts);
+            }
+        }
+    }
+
+    for (k = 0; k < NUM_KERNELS; k++) {
+        if (!counts[k].checked)
+            continue;
+        printf("%-24s %-8s %-7s %-6s %12d %12d %-8s\n",
+               path, kernelNames[k], format, "-", counts[k].checked, counts[k].taken,
+               counts[k].differ ? "DIFFERS" : "same");
+        if (counts[k].differ)
+            ok = FALSE;
+    }
+    fflush(stdout);
+
+    xfree(b.rect);
+    xfree(b.scalar);
+    xfree(b.simd);
+    xfree((char *)b.prevRows);
+    return ok;
+}
@@ -36,19 +36,14 @@
  * rreBeforeBuf contains pixel data in the client's format.
  * rreAfterBuf contains the RRE encoded version.  If the RRE encoded version is
  * larger than the raw data or if it exceeds rreAfterBufSize then
- * raw encoding is used instead.
+ * raw encoding is used instead.  The buffers are kept in the client record
+ * (see rfb.h) so that clients can encode at the same time.
  */
 
-static int rreBeforeBufSize = 0;
-static char *rreBeforeBuf = NULL;
 
-static int rreAfterBufSize = 0;
-static char *rreAfterBuf = NULL;
-static int rreAfterBufLen;
-
-static int subrectEncode8(CARD8 *data, int w, int h);
-static int subrectEncode16(CARD16 *data, int w, int h);
-static int subrectEncode32(CARD32 *data, int w, int h);
+static int subrectEncode8(rfbClientPtr cl, CARD8 *data, int w, int h);
+static int subrectEncode16(rfbClientPtr cl, CARD16 *data, int w, int h);
+static int subrectEncode32(rfbClientPtr cl, CARD32 *data, int w, int h);
 static CARD32 getBgColour(char *data, int size, int bpp);
 static Bool rfbSendSmallRectEncodingCoRRE(rfbClientPtr cl, int x, int y,
 					  int w, int h);
@@ -98,7 +93,7 @@ rfbSendSmallRectEncodingCoRRE(cl, x, y, w, h)
     char *fbptr = (cl->scalingFrameBuffer + (cl->scalingPaddedWidthInBytes * y)
                    + (x * (rfbScreen.bitsPerPixel / 8)));
 
-    int maxRawSize = (rfbScreen.width * rfbScreen.height
+    int maxRawSize = (w * h
 		      * (cl->format.bitsPerPixel / 8));
 
     if (rreBeforeBufSize < maxRawSize) {
@@ -123,13 +118,13 @@ rfbSendSmallRectEncodingCoRRE(cl, x, y, w, h)
 
     switch (cl->format.bitsPerPixel) {
     case 8:
-	nSubrects = subrectEncode8((CARD8 *)rreBeforeBuf, w, h);
+	nSubrects = subrectEncode8(cl, (CARD8 *)rreBeforeBuf, w, h);
 	break;
     case 16:
-	nSubrects = subrectEncode16((CARD16 *)rreBeforeBuf, w, h);
+	nSubrects = subrectEncode16(cl, (CARD16 *)rreBeforeBuf, w, h);
 	break;
     case 32:
-	nSubrects = subrectEncode32((CARD32 *)rreBeforeBuf, w, h);
+	nSubrects = subrectEncode32(cl, (CARD32 *)rreBeforeBuf, w, h);
 	break;
     default:
 	rfbLog("getBgColour: bpp %d?\n",cl->format.bitsPerPixel);
@@ -197,10 +192,10 @@ rfbSendSmallRectEncodingCoRRE(cl, x, y, w, h)
  * subrectEncode() encodes the given multicoloured rectangle as a background 
  * colour overwritten by single-coloured rectangles.  It returns the number 
  * of subrectangles in the encoded buffer, or -1 if subrect encoding won't
- * fit in the buffer.  It puts the encoded rectangles in rreAfterBuf.  The
- * single-colour rectangle partition is not optimal, but does find the biggest
- * horizontal or vertical rectangle top-left anchored to each consecutive 
- * coordinate position.
+ * fit in the buffer or the search for them takes too long.  It puts the
+ * encoded rectangles in rreAfterBuf.  The single-colour rectangle partition
+ * is not optimal, but does find the biggest horizontal or vertical rectangle
+ * top-left anchored to each consecutive coordinate position (see subrect.c).
  *
  * The coding scheme is simply [<bgcolour><subrect><subrect>...] where each 
  * <subrect> is [<colour><x><y><w><h>].
@@ -208,94 +203,49 @@ rfbSendSmallRectEncodingCoRRE(cl, x, y, w, h)
 
 #define DEFINE_SUBRECT_ENCODE(bpp)					      \
 static int								      \
-subrectEncode##bpp(data,w,h)						      \
+subrectEncode##bpp(cl,data,w,h)						\
+    rfbClientPtr cl;								\
     CARD##bpp *data;							      \
     int w;								      \
     int h;								      \
 {									      \
-    CARD##bpp cl;							      \
+    rfbSubrectSearch search;						      \
+    rfbSubrect sr[rfbSubrectBatch];					      \
     rfbCoRRERectangle subrect;						      \
-    int x,y;								      \
-    int i,j;								      \
-    int hx=0,hy,vx=0,vy;						      \
-    int hyflag;								      \
-    CARD##bpp *seg;							      \
-    CARD##bpp *line;							      \
-    int hw,hh,vw,vh;							      \
-    int thex,they,thew,theh;						      \
     int numsubs = 0;							      \
     int newLen;								      \
+    int i, n;								      \
     CARD##bpp bg = (CARD##bpp)getBgColour((char*)data,w*h,bpp);		      \
 									      \
     *((CARD##bpp*)rreAfterBuf) = bg;					      \
 									      \
     rreAfterBufLen = (bpp/8);						      \
 									      \
-    for (y=0; y<h; y++) {						      \
-      line = data+(y*w);						      \
-      for (x=0; x<w; x++) {						      \
-        if (line[x] != bg) {						      \
-          cl = line[x];							      \
-          hy = y-1;							      \
-          hyflag = 1;							      \
-          for (j=y; j<h; j++) {						      \
-            seg = data+(j*w);						      \
-            if (seg[x] != cl) {break;}					      \
-            i = x;							      \
-            while ((seg[i] == cl) && (i < w)) i += 1;			      \
-            i -= 1;							      \
-            if (j == y) vx = hx = i;					      \
-            if (i < vx) vx = i;						      \
-            if ((hyflag > 0) && (i >= hx)) {hy += 1;} else {hyflag = 0;}      \
-          }								      \
-          vy = j-1;							      \
-									      \
-          /*  We now have two possible subrects: (x,y,hx,hy) and (x,y,vx,vy)  \
-           *  We'll choose the bigger of the two.			      \
-           */								      \
-          hw = hx-x+1;							      \
-          hh = hy-y+1;							      \
-          vw = vx-x+1;							      \
-          vh = vy-y+1;							      \
-									      \
-          thex = x;							      \
-          they = y;							      \
+    if (!rfbSubrectStart(&search, cl, data, bpp, w, h, w, bg))		      \
+	return -1;							      \
 									      \
-          if ((hw*hh) > (vw*vh)) {					      \
-            thew = hw;							      \
-            theh = hh;							      \
-          } else {							      \
-            thew = vw;							      \
-            theh = vh;							      \
-          }								      \
+    while ((n = rfbNextSubrects(&search, sr, rfbSubrectBatch)) > 0) {	      \
+	for (i = 0; i < n; i++) {					      \
+	    subrect.x = sr[i].x;					      \
+	    subrect.y = sr[i].y;					      \
+	    subrect.w = sr[i].w;					      \
+	    subrect.h = sr[i].h;					      \
 									      \
-          subrect.x = thex;						      \
-          subrect.y = they;						      \
-          subrect.w = thew;						      \
-          subrect.h = theh;						      \
+	    newLen = rreAfterBufLen + (bpp/8) + sz_rfbCoRRERectangle;	      \
+	    if ((newLen > (w * h * (bpp/8))) || (newLen > rreAfterBufSize))   \
+		return -1;						      \
 									      \
-	  newLen = rreAfterBufLen + (bpp/8) + sz_rfbCoRRERectangle;	      \
-          if ((newLen > (w * h * (bpp/8))) || (newLen > rreAfterBufSize))     \
-	    return -1;							      \
-									      \
-	  numsubs += 1;							      \
-	  *((CARD##bpp*)(rreAfterBuf + rreAfterBufLen)) = cl;		      \
-	  rreAfterBufLen += (bpp/8);					      \
-	  memcpy(&rreAfterBuf[rreAfterBufLen],&subrect,sz_rfbCoRRERectangle); \
-	  rreAfterBufLen += sz_rfbCoRRERectangle;			      \
-									      \
-          /*								      \
-           * Now mark the subrect as done.				      \
-           */								      \
-          for (j=they; j < (they+theh); j++) {				      \
-            for (i=thex; i < (thex+thew); i++) {			      \
-              data[j*w+i] = bg;						      \
-            }								      \
-          }								      \
-        }								      \
-      }									      \
+	    numsubs += 1;						      \
+	    *((CARD##bpp*)(rreAfterBuf + rreAfterBufLen)) = (CARD##bpp)sr[i].colour; \
+	    rreAfterBufLen += (bpp/8);					      \
+	    memcpy(&rreAfterBuf[rreAfterBufLen],&subrect,sz_rfbCoRRERectangle); \
+	    rreAfterBufLen += sz_rfbCoRRERectangle;			      \
+	}								      \
     }									      \
 									      \
+    if (search.overBudget)						      \
+	return -1;							      \
+									      \
     return numsubs;							      \
 }
 
@@ -316,7 +266,7 @@ getBgColour(data,size,bpp)
     
 #define NUMCLRS 256
   
-  static int counts[NUMCLRS];
+  int counts[NUMCLRS];
   int i,j,k;
 
   int maxcount = 0;
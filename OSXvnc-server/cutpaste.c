@@ -173,7 +173,7 @@ static BOOL debugPB = NO;
 	clientPointer->richClipboardReceivedType = [type retain];
 
 	pthread_mutex_unlock(&clientPointer->updateMutex);
-	pthread_cond_signal(&clientPointer->updateCond);
+	rfbWakeClient(clientPointer);
 	// which will call rfbSendRichClipboardRequest 
 
 	// Wait for flag indicating returned data
@@ -507,7 +507,7 @@ void rfbCheckForPasteboardChange() {
 		// Notify each client
 		while ((cl = rfbClientIteratorNext(iterator)) != NULL) {
 			if (!cl->richClipboardSupport)
-				pthread_cond_signal(&cl->updateCond);
+				rfbWakeClient(cl);
 		}
 		rfbReleaseClientIterator(iterator);
 	}
@@ -555,7 +555,7 @@ void rfbCheckForPasteboardChange() {
 				// Notify each client
 				while ((cl = rfbClientIteratorNext(iterator)) != NULL) {
 					if (cl->richClipboardSupport)
-						pthread_cond_signal(&cl->updateCond);
+						rfbWakeClient(cl);
 				}
 				
 				rfbReleaseClientIterator(iterator);
@@ -1028,7 +1028,7 @@ void rfbReceiveRichClipboardRequest(rfbClientPtr cl) {
 		
 		// Should we note if the ChangeCount is > than our recorded value here?
 		pthread_mutex_unlock(&cl->updateMutex);
-		pthread_cond_signal(&cl->updateCond);		
+		rfbWakeClient(cl);		
 	}
 	else {
 		if (returnCheck != 0)
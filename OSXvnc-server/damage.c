@@ -0,0 +1,253 @@
+/*
+ * damage.c - batched damage ingestion.
+ *
+ * Sources report damage from their own thread (the CoreGraphics refresh
+ * callback, the headless or shmfb threads).  That thread only builds one
+ * region per batch and queues it; the damage thread merges everything that
+ * is pending, trims it against the shadow framebuffer and adds the result to
+ * each client once.  Sources never touch the client list or client locks.
+ */
+
+/*
+ *  OSXvnc Copyright (C) 2002-2004 Redstone Software osxvnc@redstonesoftware.com
+ *  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "rfb.h"
+
+typedef struct damageBatch {
+    RegionRec region;
+    struct timeval queued;
+    struct damageBatch *next;
+} damageBatch;
+
+static pthread_mutex_t damageMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t damageCond = PTHREAD_COND_INITIALIZER;
+static damageBatch *damageHead = NULL, *damageTail = NULL;
+
+static pthread_t damageThread;
+static Bool damageRunning = FALSE;
+
+/* Counters, only written by the damage thread (or by rfbDamageStop once it
+   has gone).  Latency is from a batch being queued to it being merged into
+   the clients, in microseconds. */
+
+unsigned long rfbDamageBatches = 0;
+unsigned long rfbDamageMerges = 0;
+unsigned long long rfbDamageLatencyTotal = 0;
+unsigned long rfbDamageLatencyMax = 0;
+
+
+/*
+ * Add a region to each client's modifiedRegion, taking each client's
+ * updateMutex once.  The scaled screens hear of it first.
+ */
+
+static void DistributeDamage(RegionPtr region) {
+    rfbClientIteratorPtr iterator;
+    rfbClientPtr cl = NULL;
+
+    rfbScaleDamage(region);
+
+    iterator = rfbGetClientIterator();
+    while ((cl = rfbClientIteratorNext(iterator)) != NULL) {
+        pthread_mutex_lock(&cl->updateMutex);
+        REGION_UNION(&hackScreen,&cl->modifiedRegion,&cl->modifiedRegion,region);
+        rfbPacingDamage(cl);
+        pthread_mutex_unlock(&cl->updateMutex);
+        rfbWakeClient(cl);
+    }
+    rfbReleaseClientIterator(iterator);
+}
+
+/*
+ * Merge a list of batches into one region for the clients and free them.
+ */
+
+static void MergeBatches(damageBatch *batch) {
+    damageBatch *next;
+    RegionRec damage;
+    struct timeval now;
+    unsigned long latency;
+
+    REGION_INIT(&hackScreen, &damage, NullBox, 0);
+    for (next = batch; next; next = next->next)
+        REGION_UNION(&hackScreen, &damage, &damage, &next->region);
+
+    rfbShadowFilterRegion(&damage);
+    if (REGION_NOTEMPTY(&hackScreen, &damage))
+        DistributeDamage(&damage);
+    REGION_UNINIT(&hackScreen, &damage);
+
+    gettimeofday(&now, NULL);
+    rfbDamageMerges++;
+    for (; batch; batch = next) {
+        next = batch->next;
+        latency = (now.tv_sec - batch->queued.tv_sec) * 1000000 + (now.tv_usec - batch->queued.tv_usec);
+        rfbDamageBatches++;
+        rfbDamageLatencyTotal += latency;
+        if (latency > rfbDamageLatencyMax)
+            rfbDamageLatencyMax = latency;
+
+        REGION_UNINIT(&hackScreen, &batch->region);
+        xfree(batch);
+    }
+}
+
+static void *damageRun(void *ignore) {
+    damageBatch *batch;
+
+    pthread_mutex_lock(&damageMutex);
+    while (damageRunning) {
+        if (!damageHead) {
+            pthread_cond_wait(&damageCond, &damageMutex);
+            continue;
+        }
+
+        batch = damageHead;
+        damageHead = damageTail = NULL;
+        pthread_mutex_unlock(&damageMutex);
+
+        MergeBatches(batch);
+
+        pthread_mutex_lock(&damageMutex);
+    }
+    pthread_mutex_unlock(&damageMutex);
+
+    return NULL;
+}
+
+
+/*
+ * rfbDamageStart starts the damage thread.  Until it runs (or if it can't be
+ * started) damage is merged directly on the caller's thread.
+ */
+
+void rfbDamageStart(void) {
+    pthread_mutex_lock(&damageMutex);
+    if (!damageRunning) {
+        damageRunning = TRUE;
+        if (pthread_create(&damageThread, NULL, damageRun, NULL) != 0) {
+            rfbLogPerror("damage: pthread_create");
+            damageRunning = FALSE;
+        }
+    }
+    pthread_mutex_unlock(&damageMutex);
+}
+
+void rfbDamageStop(void) {
+    damageBatch *batch;
+
+    pthread_mutex_lock(&damageMutex);
+    if (!damageRunning) {
+        pthread_mutex_unlock(&damageMutex);
+        return;
+    }
+    damageRunning = FALSE;
+    pthread_cond_signal(&damageCond);
+    pthread_mutex_unlock(&damageMutex);
+
+    pthread_join(damageThread, NULL);
+
+    /* Anything queued after the thread's last look still has to reach the
+       clients */
+    pthread_mutex_lock(&damageMutex);
+    batch = damageHead;
+    damageHead = damageTail = NULL;
+    pthread_mutex_unlock(&damageMutex);
+    if (batch)
+        MergeBatches(batch);
+}
+
+
+/*
+ * rfbMarkRegionModified queues a damage region for the clients.  The region
+ * is copied so the caller keeps ownership of it.
+ */
+
+void rfbMarkRegionModified(RegionPtr region) {
+    damageBatch *batch;
+
+    if (!REGION_NOTEMPTY(&hackScreen, region))
+        return;
+
+    rfbRecordDamage(region);
+
+    /* Whether to queue is decided under damageMutex, so nothing is queued
+       once rfbDamageStop has taken what's left */
+    pthread_mutex_lock(&damageMutex);
+    if (!damageRunning) {
+        RegionRec changed;
+
+        pthread_mutex_unlock(&damageMutex);
+
+        REGION_INIT(&hackScreen, &changed, NullBox, 0);
+        REGION_COPY(&hackScreen, &changed, region);
+        rfbShadowFilterRegion(&changed);
+        if (REGION_NOTEMPTY(&hackScreen, &changed))
+            DistributeDamage(&changed);
+        REGION_UNINIT(&hackScreen, &changed);
+        return;
+    }
+
+    batch = (damageBatch *)xalloc(sizeof(damageBatch));
+    if (!batch) {
+        pthread_mutex_unlock(&damageMutex);
+        rfbLog("damage: out of memory, dropping %d rectangles\n", (int)REGION_NUM_RECTS(region));
+        return;
+    }
+    REGION_INIT(&hackScreen, &batch->region, NullBox, 0);
+    REGION_COPY(&hackScreen, &batch->region, region);
+    gettimeofday(&batch->queued, NULL);
+    batch->next = NULL;
+
+    if (damageTail)
+        damageTail->next = batch;
+    else
+        damageHead = batch;
+    damageTail = batch;
+    pthread_cond_signal(&damageCond);
+    pthread_mutex_unlock(&damageMutex);
+}
+
+
+/*
+ * rfbMarkRectsModified is the damage feed every source calls into.  The
+ * boxes are in framebuffer coordinates and are queued as a single batch.
+ */
+
+void rfbMarkRectsModified(BoxPtr boxes, int count) {
+    RegionRec region, tmpRegion;
+    int i;
+
+    REGION_INIT(&hackScreen, &region, NullBox, 0);
+
+    for (i = 0; i < count; i++) {
+        SAFE_REGION_INIT(&hackScreen, &tmpRegion, &boxes[i], 0);
+        REGION_UNION(&hackScreen, &region, &region, &tmpRegion);
+        REGION_UNINIT(&hackScreen, &tmpRegion);
+    }
+
+    rfbMarkRegionModified(&region);
+    REGION_UNINIT(&hackScreen, &region);
+}
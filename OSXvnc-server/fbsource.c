@@ -0,0 +1,52 @@
+/*
+ * fbsource.c - pluggable framebuffer sources.
+ *
+ * A framebuffer source owns the pixels we encode from and feeds damage into
+ * the update path (see damage.c).  The CoreGraphics capture in main.c is the
+ * normal one, headless.c provides a synthetic desktop for profiling without a
+ * display.
+ */
+
+/*
+ *  OSXvnc Copyright (C) 2002-2004 Redstone Software osxvnc@redstonesoftware.com
+ *  Original Xvnc code Copyright (C) 1999 AT&T Laboratories Cambridge.
+ *  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "rfb.h"
+
+/* The source the server is running from, chosen in main.c before
+   rfbScreenInit() is called. */
+
+rfbFramebufferSource *rfbSource = NULL;
+
+
+/*
+ * rfbGetFramebuffer returns the current base address of the source's pixels.
+ * The address may change across a screen reconfiguration so callers should
+ * not hold on to it between updates.
+ */
+
+char *rfbGetFramebuffer(void) {
+    return (*rfbSource->getFramebuffer)();
+}
+
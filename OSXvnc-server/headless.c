@@ -0,0 +1,501 @@
+/*
+ * headless.c - a synthetic framebuffer source.
+ *
+ * Draws a fake desktop into memory and animates it with one of a few
+ * scripted workloads, feeding damage through rfbMarkRectsModified exactly
+ * like the CoreGraphics capture does.  This lets the whole update path and
+ * every encoder be driven without a display, e.g. for profiling.
+ */
+
+/*
+ *  OSXvnc Copyright (C) 2002-2004 Redstone Software osxvnc@redstonesoftware.com
+ *  Original Xvnc code Copyright (C) 1999 AT&T Laboratories Cambridge.
+ *  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "rfb.h"
+
+int rfbHeadlessWidth = 1280;
+int rfbHeadlessHeight = 800;
+int rfbHeadlessFrameRate = 30;
+
+enum {
+    HEADLESS_IDLE,
+    HEADLESS_SCROLL,
+    HEADLESS_DRAG,
+    HEADLESS_VIDEO,
+    HEADLESS_CYCLE
+};
+
+static char *workloadNames[] = { "idle", "scroll", "drag", "video", "cycle", NULL };
+
+static int workload = HEADLESS_SCROLL;
+static int currentScene = HEADLESS_SCROLL;   /* differs from workload when cycling */
+
+static CARD32 *headlessFB = NULL;
+static int fbWidth = 0, fbHeight = 0;
+
+static int frameNumber = 0;
+static unsigned long noiseSeed = 1;
+
+static pthread_t headlessThread;
+static Bool headlessRunning = FALSE;
+
+/* Geometry of the scene's windows, set up by DrawScene() */
+static BoxRec textWindow;       /* scroll and idle */
+static BoxRec dragWindow;       /* drag */
+static BoxRec videoWindow;      /* video */
+static int dragDX = 7, dragDY = 4;
+static int textLine = 0;
+
+#define TITLE_HEIGHT 20
+#define MENU_HEIGHT 22
+#define GLYPH_WIDTH 7
+#define LINE_HEIGHT 12
+
+#define CYCLE_FRAMES (rfbHeadlessFrameRate * 10)
+
+#define HL_RGB(r,g,b) ((((CARD32)(r) & 0xff) << 16) | \
+                       (((CARD32)(g) & 0xff) << 8) | \
+                       ((CARD32)(b) & 0xff))
+
+static unsigned long NextRandom(void) {
+    noiseSeed = noiseSeed * 1103515245 + 12345;
+    return (noiseSeed >> 16) & 0x7fff;
+}
+
+static void ClipBox(BoxPtr box) {
+    if (box->x1 < 0) box->x1 = 0;
+    if (box->y1 < 0) box->y1 = 0;
+    if (box->x2 > fbWidth) box->x2 = fbWidth;
+    if (box->y2 > fbHeight) box->y2 = fbHeight;
+    if (box->x2 < box->x1) box->x2 = box->x1;
+    if (box->y2 < box->y1) box->y2 = box->y1;
+}
+
+static void FillRect(int x1, int y1, int x2, int y2, CARD32 colour) {
+    BoxRec box;
+    int x, y;
+
+    box.x1 = x1; box.y1 = y1; box.x2 = x2; box.y2 = y2;
+    ClipBox(&box);
+
+    for (y = box.y1; y < box.y2; y++) {
+        CARD32 *row = headlessFB + y * fbWidth;
+        for (x = box.x1; x < box.x2; x++)
+            row[x] = colour;
+    }
+}
+
+static void FillBackground(int x1, int y1, int x2, int y2) {
+    BoxRec box;
+    int x, y;
+
+    box.x1 = x1; box.y1 = y1; box.x2 = x2; box.y2 = y2;
+    ClipBox(&box);
+
+    for (y = box.y1; y < box.y2; y++) {
+        CARD32 *row = headlessFB + y * fbWidth;
+        CARD32 colour = HL_RGB(40 + y * 60 / fbHeight,
+                               70 + y * 50 / fbHeight,
+                               110 + y * 80 / fbHeight);
+        if (y < MENU_HEIGHT)
+            colour = HL_RGB(236, 236, 236);
+        for (x = box.x1; x < box.x2; x++)
+            row[x] = colour;
+    }
+}
+
+/* A pseudo glyph: a 5x9 pattern picked by hashing the character cell */
+
+static void DrawGlyph(int x, int y, unsigned long hash, CARD32 colour) {
+    int gx, gy;
+
+    for (gy = 0; gy < 9; gy++) {
+        for (gx = 0; gx < 5; gx++) {
+            if ((hash >> ((gy * 5 + gx) % 31)) & 1) {
+                if (x + gx < fbWidth && y + gy < fbHeight)
+                    headlessFB[(y + gy) * fbWidth + x + gx] = colour;
+            }
+        }
+    }
+}
+
+static void DrawTextLine(int x1, int x2, int y, int line) {
+    int col = 0;
+    int x;
+
+    FillRect(x1, y, x2, y + LINE_HEIGHT, HL_RGB(255, 255, 255));
+    for (x = x1 + 4; x + GLYPH_WIDTH < x2; x += GLYPH_WIDTH, col++) {
+        unsigned long hash = (unsigned long)(line * 131 + col) * 2654435761UL;
+
+        /* Ragged right margin and some spaces between words */
+        if (col > 40 + (line * 7) % 50 || (hash >> 7) % 6 == 0)
+            continue;
+        DrawGlyph(x, y + 1, hash ^ (hash >> 13), HL_RGB(0, 0, 0));
+    }
+}
+
+static void DrawWindow(BoxPtr win) {
+    int y;
+
+    FillRect(win->x1, win->y1, win->x2, win->y2, HL_RGB(80, 80, 80));
+    for (y = win->y1 + 1; y < win->y1 + TITLE_HEIGHT; y++)
+        FillRect(win->x1 + 1, y, win->x2 - 1, y + 1,
+                 HL_RGB(230 - (y - win->y1) * 3, 230 - (y - win->y1) * 3, 232 - (y - win->y1) * 3));
+    FillRect(win->x1 + 1, win->y1 + TITLE_HEIGHT, win->x2 - 1, win->y2 - 1, HL_RGB(255, 255, 255));
+}
+
+static void FillTextWindow(BoxPtr win) {
+    int y;
+
+    textLine = 0;
+    for (y = win->y1 + TITLE_HEIGHT; y + LINE_HEIGHT <= win->y2 - 1; y += LINE_HEIGHT)
+        DrawTextLine(win->x1 + 1, win->x2 - 1, y, textLine++);
+}
+
+static void DrawVideoFrame(BoxPtr win) {
+    int x, y;
+    int t = frameNumber;
+
+    for (y = win->y1 + TITLE_HEIGHT; y < win->y2 - 1 && y < fbHeight; y++) {
+        CARD32 *row = headlessFB + y * fbWidth;
+        for (x = win->x1 + 1; x < win->x2 - 1 && x < fbWidth; x++) {
+            unsigned long noise = NextRandom();
+            int r = ((x * 3 + t * 5) & 0xff) ^ (noise & 0x0f);
+            int g = ((y * 2 + t * 3) & 0xff) ^ ((noise >> 4) & 0x0f);
+            int b = (((x + y) + t * 7) & 0xff) ^ ((noise >> 8) & 0x0f);
+            row[x] = HL_RGB(r, g, b);
+        }
+    }
+}
+
+static void SetBox(BoxPtr box, int x, int y, int w, int h) {
+    box->x1 = x;
+    box->y1 = y;
+    box->x2 = x + w;
+    box->y2 = y + h;
+    ClipBox(box);
+}
+
+static void DrawScene(int scene) {
+    FillBackground(0, 0, fbWidth, fbHeight);
+
+    switch (scene) {
+        case HEADLESS_IDLE:
+        case HEADLESS_SCROLL:
+            SetBox(&textWindow, fbWidth / 16, MENU_HEIGHT + 40, fbWidth * 9 / 16, fbHeight * 3 / 4);
+            DrawWindow(&textWindow);
+            FillTextWindow(&textWindow);
+            break;
+        case HEADLESS_DRAG:
+            SetBox(&textWindow, fbWidth / 3, MENU_HEIGHT + 60, fbWidth / 2, fbHeight / 2);
+            DrawWindow(&textWindow);
+            FillTextWindow(&textWindow);
+            SetBox(&dragWindow, 20, MENU_HEIGHT + 20, 400, 300);
+            DrawWindow(&dragWindow);
+            FillTextWindow(&dragWindow);
+            break;
+        case HEADLESS_VIDEO:
+            SetBox(&videoWindow, (fbWidth - 642) / 2, (fbHeight - 382) / 2, 642, 382);
+            DrawWindow(&videoWindow);
+            DrawVideoFrame(&videoWindow);
+            break;
+    }
+}
+
+/* Each Step function animates one frame and returns the damage it caused */
+
+static int StepIdle(BoxPtr boxes, int maxBoxes) {
+    int n = 0;
+    int blink = rfbHeadlessFrameRate / 2;
+
+    /* Blinking caret at the end of the last line */
+    if (blink > 0 && frameNumber % blink == 0 && n < maxBoxes) {
+        int x = textWindow.x1 + 40;
+        int y = textWindow.y2 - 1 - LINE_HEIGHT;
+        CARD32 colour = ((frameNumber / blink) & 1) ? HL_RGB(0, 0, 0) : HL_RGB(255, 255, 255);
+
+        FillRect(x, y, x + 1, y + LINE_HEIGHT, colour);
+        SetBox(&boxes[n++], x, y, 1, LINE_HEIGHT);
+    }
+
+    /* Menu bar clock once a second */
+    if (rfbHeadlessFrameRate > 0 && frameNumber % rfbHeadlessFrameRate == 0 && n < maxBoxes) {
+        int x = fbWidth - 80;
+        int seconds = frameNumber / rfbHeadlessFrameRate;
+        int i;
+
+        FillBackground(x, 4, x + 5 * GLYPH_WIDTH, 4 + 9);
+        for (i = 0; i < 5; i++)
+            DrawGlyph(x + i * GLYPH_WIDTH, 4, (unsigned long)(seconds + i * 17) * 2654435761UL, HL_RGB(0, 0, 0));
+        SetBox(&boxes[n++], x, 4, 5 * GLYPH_WIDTH, 9);
+    }
+
+    return n;
+}
+
+static int StepScroll(BoxPtr boxes, int maxBoxes) {
+    int top = textWindow.y1 + TITLE_HEIGHT;
+    int bottom = top + ((textWindow.y2 - 1 - top) / LINE_HEIGHT) * LINE_HEIGHT;
+    int bytes = (textWindow.x2 - textWindow.x1 - 2) * sizeof(CARD32);
+    int y;
+
+    if (maxBoxes < 1 || bottom - top < 2 * LINE_HEIGHT)
+        return 0;
+
+    for (y = top; y < bottom - LINE_HEIGHT; y++)
+        memmove(headlessFB + y * fbWidth + textWindow.x1 + 1,
+                headlessFB + (y + LINE_HEIGHT) * fbWidth + textWindow.x1 + 1, bytes);
+    DrawTextLine(textWindow.x1 + 1, textWindow.x2 - 1, bottom - LINE_HEIGHT, textLine++);
+
+    SetBox(&boxes[0], textWindow.x1 + 1, top, textWindow.x2 - textWindow.x1 - 2, bottom - top);
+    return 1;
+}
+
+static int StepDrag(BoxPtr boxes, int maxBoxes) {
+    BoxRec old = dragWindow;
+    int w = dragWindow.x2 - dragWindow.x1;
+    int h = dragWindow.y2 - dragWindow.y1;
+    int x = dragWindow.x1 + dragDX;
+    int y = dragWindow.y1 + dragDY;
+    int n = 0;
+
+    if (maxBoxes < 3)
+        return 0;
+
+    if (x < 0 || x + w > fbWidth) {
+        dragDX = -dragDX;
+        x = dragWindow.x1 + dragDX;
+    }
+    if (y < MENU_HEIGHT || y + h > fbHeight) {
+        dragDY = -dragDY;
+        y = dragWindow.y1 + dragDY;
+    }
+
+    /* Expose what was underneath, then draw the window on top */
+    FillBackground(old.x1, old.y1, old.x2, old.y2);
+    boxes[n++] = old;
+    if (textWindow.x1 < old.x2 && old.x1 < textWindow.x2 &&
+        textWindow.y1 < old.y2 && old.y1 < textWindow.y2) {
+        DrawWindow(&textWindow);
+        FillTextWindow(&textWindow);
+        boxes[n++] = textWindow;
+    }
+
+    SetBox(&dragWindow, x, y, w, h);
+    DrawWindow(&dragWindow);
+    FillTextWindow(&dragWindow);
+    boxes[n++] = dragWindow;
+
+    return n;
+}
+
+static int StepVideo(BoxPtr boxes, int maxBoxes) {
+    if (maxBoxes < 1)
+        return 0;
+
+    DrawVideoFrame(&videoWindow);
+    SetBox(&boxes[0], videoWindow.x1 + 1, videoWindow.y1 + TITLE_HEIGHT,
+           videoWindow.x2 - videoWindow.x1 - 2, videoWindow.y2 - videoWindow.y1 - TITLE_HEIGHT - 1);
+    return 1;
+}
+
+
+/*
+ * rfbHeadlessSetWorkload selects the workload by name, returns FALSE if the
+ * name isn't one we know.
+ */
+
+Bool rfbHeadlessSetWorkload(char *name) {
+    int i;
+
+    for (i = 0; workloadNames[i]; i++) {
+        if (strcmp(name, workloadNames[i]) == 0) {
+            workload = i;
+            currentScene = (i == HEADLESS_CYCLE ? HEADLESS_IDLE : i);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+
+/*
+ * rfbHeadlessNextFrame advances the synthetic desktop by one frame and
+ * returns the number of damaged boxes written to boxes (at most maxBoxes).
+ * It does not feed the damage anywhere itself so it can also be stepped
+ * directly, without a server around it.
+ */
+
+int rfbHeadlessNextFrame(BoxPtr boxes, int maxBoxes) {
+    int n = 0;
+
+    if (!headlessFB)
+        return 0;
+
+    frameNumber++;
+
+    if (workload == HEADLESS_CYCLE && CYCLE_FRAMES > 0 && frameNumber % CYCLE_FRAMES == 0) {
+        currentScene = (currentScene + 1) % HEADLESS_CYCLE;
+        DrawScene(currentScene);
+        if (maxBoxes < 1)
+            return 0;
+        SetBox(&boxes[0], 0, 0, fbWidth, fbHeight);
+        return 1;
+    }
+
+    switch (currentScene) {
+        case HEADLESS_IDLE:
+            n = StepIdle(boxes, maxBoxes);
+            break;
+        case HEADLESS_SCROLL:
+            n = StepScroll(boxes, maxBoxes);
+            break;
+        case HEADLESS_DRAG:
+            n = StepDrag(boxes, maxBoxes);
+            break;
+        case HEADLESS_VIDEO:
+            n = StepVideo(boxes, maxBoxes);
+            break;
+    }
+
+    return n;
+}
+
+/*
+ * rfbHeadlessRestart takes the workload back to its first frame, so the same
+ * frames can be played again.  The source must have been set up by its init
+ * and not be running.
+ */
+
+void rfbHeadlessRestart(void) {
+    currentScene = (workload == HEADLESS_CYCLE ? HEADLESS_IDLE : workload);
+    frameNumber = 0;
+    noiseSeed = 1;
+    dragDX = 7;
+    dragDY = 4;
+    DrawScene(currentScene);
+}
+
+static void *headlessRun(void *ignore) {
+    BoxRec boxes[4];
+    int n;
+
+    while (headlessRunning) {
+        n = rfbHeadlessNextFrame(boxes, 4);
+        if (n > 0)
+            rfbMarkRectsModified(boxes, n);
+        usleep(1000000 / (rfbHeadlessFrameRate > 0 ? rfbHeadlessFrameRate : 1));
+    }
+
+    return NULL;
+}
+
+static Bool headlessInit(void) {
+    union { CARD32 l; CARD8 c[4]; } endianTest;
+
+    if (rfbHeadlessWidth <= 0 || rfbHeadlessHeight <= 0) {
+        rfbLog("headless: invalid geometry %dx%d\n", rfbHeadlessWidth, rfbHeadlessHeight);
+        return FALSE;
+    }
+
+    if (!headlessFB || fbWidth != rfbHeadlessWidth || fbHeight != rfbHeadlessHeight) {
+        free(headlessFB);
+        headlessFB = (CARD32 *)malloc(rfbHeadlessWidth * rfbHeadlessHeight * sizeof(CARD32));
+        if (!headlessFB) {
+            rfbLog("headless: unable to allocate framebuffer\n");
+            return FALSE;
+        }
+        fbWidth = rfbHeadlessWidth;
+        fbHeight = rfbHeadlessHeight;
+    }
+
+    rfbHeadlessRestart();
+
+    rfbScreen.width = fbWidth;
+    rfbScreen.height = fbHeight;
+    rfbScreen.bitsPerPixel = 32;
+    rfbScreen.depth = 24;
+    rfbScreen.paddedWidthInBytes = fbWidth * sizeof(CARD32);
+    rfbScreen.sizeInBytes = rfbScreen.paddedWidthInBytes * fbHeight;
+
+    /* Pixels are stored as native CARD32s */
+    endianTest.l = 1;
+
+    rfbServerFormat.bitsPerPixel = 32;
+    rfbServerFormat.depth = 24;
+    rfbServerFormat.bigEndian = (endianTest.c[0] == 0);
+    rfbServerFormat.trueColour = TRUE;
+    rfbServerFormat.redMax = 255;
+    rfbServerFormat.greenMax = 255;
+    rfbServerFormat.blueMax = 255;
+    rfbServerFormat.redShift = 16;
+    rfbServerFormat.greenShift = 8;
+    rfbServerFormat.blueShift = 0;
+
+    rfbLog("Headless framebuffer %dx%d, workload %s\n", fbWidth, fbHeight, workloadNames[workload]);
+
+    return TRUE;
+}
+
+static char *headlessGetFramebuffer(void) {
+    return (char *)headlessFB;
+}
+
+static void headlessGetGeometry(int *width, int *height, int *bitsPerPixel) {
+    *width = rfbHeadlessWidth;
+    *height = rfbHeadlessHeight;
+    *bitsPerPixel = 32;
+}
+
+static Bool headlessStart(void) {
+    if (headlessRunning)
+        return TRUE;
+
+    headlessRunning = TRUE;
+    if (pthread_create(&headlessThread, NULL, headlessRun, NULL) != 0) {
+        rfbLogPerror("headless: pthread_create");
+        headlessRunning = FALSE;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void headlessStop(void) {
+    if (!headlessRunning)
+        return;
+
+    headlessRunning = FALSE;
+    pthread_join(headlessThread, NULL);
+}
+
+rfbFramebufferSource rfbHeadlessSource = {
+    "headless",
+    headlessInit,
+    headlessGetFramebuffer,
+    headlessGetGeometry,
+    headlessStart,
+    headlessStop
+};
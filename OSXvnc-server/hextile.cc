@@ -0,0 +1,326 @@
+/*
+ * hextile.cc
+ *
+ * Routines to implement Hextile Encoding
+ *
+ * The encoder is a template over the client's pixel type and where each
+ * tile's pixels come from.  A client in the server's own format has its
+ * tiles read straight from the framebuffer: solid tiles, the most common
+ * kind, are sent without copying anything, and a tile that ends up raw is
+ * copied from the framebuffer into the update.  Other clients have each
+ * tile translated once into a buffer, which is kept as it was so that a
+ * raw tile doesn't need translating again.
+ */
+
+/*
+ *  OSXvnc Copyright (C) 2001 Dan McGuirk <mcguirk@incompleteness.net>.
+ *  Original Xvnc code Copyright (C) 1999 AT&T Laboratories Cambridge.
+ *  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+extern "C" {
+#include "rfb.h"
+}
+
+template <class PIXEL>
+static Bool sendHextilesFor(rfbClientPtr cl, int x, int y, int w, int h);
+
+
+/*
+ * rfbSendRectEncodingHextile - send a rectangle using hextile encoding.
+ */
+
+Bool
+rfbSendRectEncodingHextile(rfbClientPtr cl, int x, int y, int w, int h)
+{
+    rfbFramebufferUpdateRectHeader rect;
+
+    if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE) {
+        if (!rfbSendUpdateBuf(cl))
+            return FALSE;
+    }
+
+    rect.r.x = Swap16IfLE(x);
+    rect.r.y = Swap16IfLE(y);
+    rect.r.w = Swap16IfLE(w);
+    rect.r.h = Swap16IfLE(h);
+    rect.encoding = Swap32IfLE(rfbEncodingHextile);
+
+    memcpy(&cl->updateBuf[cl->ublen], (char *)&rect,
+           sz_rfbFramebufferUpdateRectHeader);
+    cl->ublen += sz_rfbFramebufferUpdateRectHeader;
+
+    cl->rfbRectanglesSent[rfbEncodingHextile]++;
+    cl->rfbBytesSent[rfbEncodingHextile] += sz_rfbFramebufferUpdateRectHeader;
+
+    switch (cl->format.bitsPerPixel) {
+    case 8:
+        return sendHextilesFor<CARD8>(cl, x, y, w, h);
+    case 16:
+        return sendHextilesFor<CARD16>(cl, x, y, w, h);
+    case 32:
+        return sendHextilesFor<CARD32>(cl, x, y, w, h);
+    }
+
+    rfbLog("rfbSendRectEncodingHextile: bpp %d?\n", cl->format.bitsPerPixel);
+    return FALSE;
+}
+
+
+template <class PIXEL>
+static inline void putPixel(rfbClientPtr cl, PIXEL pix)
+{
+    memcpy(&cl->updateBuf[cl->ublen], &pix, sizeof(PIXEL));
+    cl->ublen += sizeof(PIXEL);
+}
+
+
+/*
+ * The tile sources.  load() returns the tile's pixels in the client's
+ * format and the number of pixels from one row to the next.
+ */
+
+template <class PIXEL>
+class TranslatedTile {
+public:
+    TranslatedTile(rfbClientPtr cl_) : cl(cl_) {}
+
+    PIXEL *load(char *fbptr, int w, int h, int *stride) {
+        (*cl->translateFn)(cl->translateLookupTable, &rfbServerFormat,
+                           &cl->format, fbptr, (char *)pixels,
+                           cl->scalingPaddedWidthInBytes, w, h);
+        *stride = w;
+        return pixels;
+    }
+
+private:
+    rfbClientPtr cl;
+    PIXEL pixels[16 * 16];
+};
+
+template <class PIXEL>
+class DirectTile {
+public:
+    DirectTile(rfbClientPtr cl_) : cl(cl_) {}
+
+    PIXEL *load(char *fbptr, int w, int h, int *stride) {
+        *stride = cl->scalingPaddedWidthInBytes / sizeof(PIXEL);
+        return (PIXEL *)fbptr;
+    }
+
+private:
+    rfbClientPtr cl;
+};
+
+
+/*
+ * testColours() tests if there are one (solid), two (mono) or more
+ * colours in a tile and gets a reasonable guess at the best background
+ * pixel, and the foreground pixel for mono.  The guess is the commoner of
+ * the first two colours, counted as far as the third.
+ */
+
+template <class PIXEL>
+static void
+testColours(PIXEL *data, int stride, int w, int h, Bool *mono, Bool *solid,
+            PIXEL *bg, PIXEL *fg)
+{
+    rfbTileAnalysis ta;
+
+    rfbAnalyseTile(&ta, data, sizeof(PIXEL) * 8, w, h, stride, 2, 0);
+
+    *solid = (ta.numColours == 1);
+    *mono = (ta.numColours != 0);
+
+    if (*solid) {
+        *bg = ta.colours[0];
+        *fg = 0;
+    } else if (ta.counts[0] > ta.counts[1]) {
+        *bg = ta.colours[0];
+        *fg = ta.colours[1];
+    } else {
+        *bg = ta.colours[1];
+        *fg = ta.colours[0];
+    }
+}
+
+
+/*
+ * subrectEncode() writes the subrectangles of a tile, as subrect.c finds
+ * them.  It returns FALSE if they would take more room than the raw tile,
+ * or if finding them takes too long.
+ */
+
+template <class PIXEL>
+static Bool
+subrectEncode(rfbClientPtr cl, PIXEL *data, int stride, int w, int h,
+              PIXEL bg, PIXEL fg, Bool mono)
+{
+    rfbSubrectSearch search;
+    rfbSubrect sr[rfbSubrectBatch];
+    int numsubs = 0;
+    int newLen;
+    int nSubrectsUblen;
+    int i, n;
+
+    nSubrectsUblen = cl->ublen;
+    cl->ublen++;
+
+    if (!rfbSubrectStart(&search, cl, data, sizeof(PIXEL) * 8, w, h, stride,
+                         bg))
+        return FALSE;
+
+    while ((n = rfbNextSubrects(&search, sr, rfbSubrectBatch)) > 0) {
+        for (i = 0; i < n; i++) {
+            if (mono) {
+                newLen = cl->ublen - nSubrectsUblen + 2;
+            } else {
+                newLen = cl->ublen - nSubrectsUblen + sizeof(PIXEL) + 2;
+            }
+
+            if (newLen > (int)(w * h * sizeof(PIXEL)))
+                return FALSE;
+
+            numsubs += 1;
+
+            if (!mono) putPixel(cl, (PIXEL)sr[i].colour);
+
+            cl->updateBuf[cl->ublen++] = rfbHextilePackXY(sr[i].x,sr[i].y);
+            cl->updateBuf[cl->ublen++] = rfbHextilePackWH(sr[i].w,sr[i].h);
+        }
+    }
+
+    if (search.overBudget)
+        return FALSE;
+
+    cl->updateBuf[nSubrectsUblen] = numsubs;
+
+    return TRUE;
+}
+
+
+/*
+ * sendHextiles
+ */
+
+template <class PIXEL, class Source>
+static Bool
+sendHextiles(rfbClientPtr cl, int rx, int ry, int rw, int rh)
+{
+    Source source(cl);
+    int x, y, w, h, i;
+    int startUblen;
+    char *fbptr;
+    PIXEL *data;
+    int stride;
+    PIXEL bg = 0, fg = 0, newBg, newFg;
+    Bool mono, solid;
+    Bool validBg = FALSE;
+    Bool validFg = FALSE;
+
+    for (y = ry; y < ry+rh; y += 16) {
+        for (x = rx; x < rx+rw; x += 16) {
+            w = h = 16;
+            if (rx+rw - x < 16)
+                w = rx+rw - x;
+            if (ry+rh - y < 16)
+                h = ry+rh - y;
+
+            if ((cl->ublen + 1 + (2 + 16 * 16) * sizeof(PIXEL)) >
+                UPDATE_BUF_SIZE) {
+                if (!rfbSendUpdateBuf(cl))
+                    return FALSE;
+            }
+
+            fbptr = (cl->scalingFrameBuffer + (cl->scalingPaddedWidthInBytes * y)
+                     + (x * (rfbScreen.bitsPerPixel / 8)));
+
+            data = source.load(fbptr, w, h, &stride);
+
+            startUblen = cl->ublen;
+            cl->updateBuf[startUblen] = 0;
+            cl->ublen++;
+
+            testColours(data, stride, w, h, &mono, &solid, &newBg, &newFg);
+
+            if (!validBg || (newBg != bg)) {
+                validBg = TRUE;
+                bg = newBg;
+                cl->updateBuf[startUblen] |= rfbHextileBackgroundSpecified;
+                putPixel(cl, bg);
+            }
+
+            if (solid) {
+                cl->rfbBytesSent[rfbEncodingHextile] += cl->ublen - startUblen;
+                continue;
+            }
+
+            cl->updateBuf[startUblen] |= rfbHextileAnySubrects;
+
+            if (mono) {
+                if (!validFg || (newFg != fg)) {
+                    validFg = TRUE;
+                    fg = newFg;
+                    cl->updateBuf[startUblen] |= rfbHextileForegroundSpecified;
+                    putPixel(cl, fg);
+                }
+            } else {
+                validFg = FALSE;
+                cl->updateBuf[startUblen] |= rfbHextileSubrectsColoured;
+            }
+
+            if (!subrectEncode(cl, data, stride, w, h, bg, fg, mono)) {
+                /* encoding was too large, use raw */
+                validBg = FALSE;
+                validFg = FALSE;
+                cl->ublen = startUblen;
+                cl->updateBuf[cl->ublen++] = rfbHextileRaw;
+
+                for (i = 0; i < h; i++) {
+                    memcpy(&cl->updateBuf[cl->ublen], &data[i * stride],
+                           w * sizeof(PIXEL));
+                    cl->ublen += w * sizeof(PIXEL);
+                }
+            }
+
+            cl->rfbBytesSent[rfbEncodingHextile] += cl->ublen - startUblen;
+        }
+    }
+
+    return TRUE;
+}
+
+
+/*
+ * sendHextilesFor picks the tile source: the framebuffer itself if the
+ * client's format is the server's and its rows are whole pixels apart.
+ */
+
+template <class PIXEL>
+static Bool
+sendHextilesFor(rfbClientPtr cl, int x, int y, int w, int h)
+{
+    if (cl->translateFn == rfbTranslateNone &&
+        rfbScreen.bitsPerPixel == (int)sizeof(PIXEL) * 8 &&
+        cl->scalingPaddedWidthInBytes % sizeof(PIXEL) == 0)
+        return sendHextiles<PIXEL, DirectTile<PIXEL> >(cl, x, y, w, h);
+
+    return sendHextiles<PIXEL, TranslatedTile<PIXEL> >(cl, x, y, w, h);
+}
@@ -0,0 +1,226 @@
+/*
+ * linkest.c - per-client link estimate and adaptive encoding.
+ *
+ * Each update is timed from when it starts going out until the client's next
+ * FramebufferUpdateRequest arrives, which viewers send once they have
+ * received and drawn it.  Small updates give the round trip time; bigger
+ * ones, less the round trip, give throughput.  The time spent writing an
+ * update is a lower bound on its delivery time, which matters when a viewer
+ * asks for its next update early.
+ *
+ * From the estimate a client is put in one of a few classes of link, each
+ * with an order of preference among encodings and Tight, JPEG and zlib
+ * levels to use.  Encodings are only switched among those the client said
+ * it accepts, and JPEG quality is only adjusted for clients which asked for
+ * JPEG in the first place.  Moving between classes needs a clear margin and
+ * a few seconds in between, so an estimate near a boundary doesn't flap.
+ */
+
+/*
+ *  OSXvnc Copyright (C) 2002-2004 Redstone Software osxvnc@redstonesoftware.com
+ *  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "rfb.h"
+
+Bool rfbAdaptiveEncoding = TRUE;
+
+/* Averages move 1/4 of the way towards each new sample, a link can change
+   quickly when a user moves */
+#define LINK_EWMA(avg, sample) ((avg) += ((long long)(sample) - (long long)(avg)) / 4)
+
+#define LINK_RTT_BYTES 2048         /* updates up to this size time the round trip */
+#define LINK_BANDWIDTH_BYTES 16384  /* and from this size the throughput */
+#define LINK_MIN_SAMPLES 3          /* throughput samples before adapting */
+#define LINK_HOLD_TIME 3000000ULL   /* us between changes of class */
+
+/* An estimate has to be this far (in percent) past a boundary to cross it */
+#define LINK_MARGIN 25
+
+static const int fastOrder[] = {
+    rfbEncodingHextile, rfbEncodingZRLE, rfbEncodingTight, rfbEncodingZlibHex,
+    rfbEncodingZlib, rfbEncodingCoRRE, rfbEncodingRRE, rfbEncodingRaw, -1
+};
+
+static const int mediumOrder[] = {
+    rfbEncodingZRLE, rfbEncodingTight, rfbEncodingZlibHex, rfbEncodingZlib,
+    rfbEncodingHextile, rfbEncodingCoRRE, rfbEncodingRRE, rfbEncodingRaw, -1
+};
+
+static const int slowOrder[] = {
+    rfbEncodingTight, rfbEncodingZRLE, rfbEncodingZlibHex, rfbEncodingZlib,
+    rfbEncodingHextile, rfbEncodingCoRRE, rfbEncodingRRE, rfbEncodingRaw, -1
+};
+
+static const struct {
+    char *name;
+    unsigned long long minBandwidth;    /* bytes per second */
+    const int *order;
+    int tightCompress;
+    int jpegQuality;
+    int zlibLevel;                      /* for Zlib and ZlibHex */
+} linkClasses[] = {
+    { "LAN",    4000000, fastOrder,   1, 9, 1 },
+    { "WAN",     500000, mediumOrder, 6, 7, 6 },
+    { "slow",         0, slowOrder,   9, 4, 9 },
+};
+
+#define LINK_CLASSES (sizeof(linkClasses) / sizeof(linkClasses[0]))
+
+
+void rfbLinkInit(rfbClientPtr cl) {
+    cl->linkEncodings = 0;
+    cl->linkClientQualityLevel = -1;
+    cl->linkClass = -1;
+    cl->linkSentAt = 0;
+    cl->linkSentBytes = 0;
+    cl->linkSendTime = 0;
+    cl->linkBandwidth = 0;
+    cl->linkRtt = 0;
+    cl->linkSamples = 0;
+    cl->linkLastChange = 0;
+    cl->linkBytesBefore = 0;
+}
+
+
+/*
+ * rfbLinkSetEncodings is called, with outputMutex held, once SetEncodings
+ * has been read.  The client's own choices stand until the next update.
+ */
+
+void rfbLinkSetEncodings(rfbClientPtr cl) {
+    cl->linkClass = -1;
+}
+
+
+/*
+ * rfbLinkRequestArrived is called, with updateMutex held, for every
+ * FramebufferUpdateRequest.  It takes the samples from the update it
+ * answers, if any.
+ */
+
+void rfbLinkRequestArrived(rfbClientPtr cl) {
+    rfbPaceTime now = rfbPacingNow(), delivery, rtt;
+
+    if (!cl->linkSentAt)
+        return;
+    delivery = now - cl->linkSentAt;
+    cl->linkSentAt = 0;
+
+    if (cl->linkSentBytes <= LINK_RTT_BYTES) {
+        if (!cl->linkRtt)
+            cl->linkRtt = delivery;
+        else
+            LINK_EWMA(cl->linkRtt, delivery);
+    } else if (cl->linkSentBytes >= LINK_BANDWIDTH_BYTES) {
+        rtt = min(cl->linkRtt, delivery / 2);
+        delivery = max(max(delivery - rtt, cl->linkSendTime), 1000);
+        if (!cl->linkSamples++)
+            cl->linkBandwidth = cl->linkSentBytes * 1000000ULL / delivery;
+        else
+            LINK_EWMA(cl->linkBandwidth, cl->linkSentBytes * 1000000ULL / delivery);
+    }
+}
+
+
+/*
+ * Work out the class for the estimate, staying put unless it's clearly
+ * better or worse than the current one.
+ */
+
+static int ChooseClass(rfbClientPtr cl) {
+    unsigned long long bw = cl->linkBandwidth;
+    int c = 0, current = cl->linkClass;
+
+    while (c < LINK_CLASSES - 1 && bw < linkClasses[c].minBandwidth)
+        c++;
+
+    if (current < 0 || c == current)
+        return c;
+    if (c < current)    /* faster, must clear the boundary above current */
+        return (bw * 100 >= linkClasses[current - 1].minBandwidth * (100 + LINK_MARGIN)) ? c : current;
+    else                /* slower, must fall well below current's floor */
+        return (bw * 100 < linkClasses[current].minBandwidth * (100 - LINK_MARGIN)) ? c : current;
+}
+
+static void ApplyClass(rfbClientPtr cl, int c, unsigned long long bw, rfbPaceTime rtt) {
+    const int *enc;
+    int accepted = 0, i;
+
+    for (i = 0; i < MAX_ENCODINGS; i++)
+        if (cl->linkEncodings & (1 << i))
+            accepted++;
+
+    if (accepted > 1) {
+        for (enc = linkClasses[c].order; *enc != -1; enc++) {
+            if (cl->linkEncodings & (1 << *enc)) {
+                cl->preferredEncoding = *enc;
+                break;
+            }
+        }
+    }
+
+    cl->tightCompressLevel = linkClasses[c].tightCompress;
+    cl->zlibCompressLevel = linkClasses[c].zlibLevel;
+    if (cl->linkClientQualityLevel != -1)
+        cl->tightQualityLevel = linkClasses[c].jpegQuality;
+
+    rfbLog("Link to %s looks %s (%llu KB/s, round trip %llu ms), using %s\n",
+           cl->host, linkClasses[c].name, bw / 1024, rtt / 1000,
+           encNames[cl->preferredEncoding]);
+}
+
+
+/*
+ * rfbLinkUpdateSent is called by the output thread, with outputMutex held,
+ * once an update has been written.  start is when it began on it.  It may
+ * change the client's encoding and levels for the next one.
+ */
+
+void rfbLinkUpdateSent(rfbClientPtr cl, rfbPaceTime start) {
+    rfbPaceTime now = rfbPacingNow(), rtt;
+    unsigned long long bw;
+    int c;
+
+    pthread_mutex_lock(&cl->updateMutex);
+    cl->linkSentAt = start;
+    cl->linkSentBytes = rfbStatsBytesSent(cl) - cl->linkBytesBefore;
+    cl->linkSendTime = now - start;
+    cl->linkBytesBefore = rfbStatsBytesSent(cl);
+
+    if (!rfbAdaptiveEncoding || cl->linkSamples < LINK_MIN_SAMPLES ||
+        (cl->linkClass != -1 && now - cl->linkLastChange < LINK_HOLD_TIME)) {
+        pthread_mutex_unlock(&cl->updateMutex);
+        return;
+    }
+
+    c = ChooseClass(cl);
+    bw = cl->linkBandwidth;
+    rtt = cl->linkRtt;
+    pthread_mutex_unlock(&cl->updateMutex);
+
+    if (c != cl->linkClass) {
+        cl->linkClass = c;
+        cl->linkLastChange = now;
+        ApplyClass(cl, c, bw, rtt);
+    }
+}
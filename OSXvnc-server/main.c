@@ -133,7 +133,7 @@ static bool rfbScreenInit(void);
  * rfbLog prints a time-stamped message to the log file (stderr).
  */
 
-void rfbLog(char *format, ...) {
+void rfbLog(const char *format, ...) {
     va_list args;
     NSString *nsFormat = [[NSString alloc] initWithCString:format];
 
@@ -146,7 +146,7 @@ void rfbLog(char *format, ...) {
     pthread_mutex_unlock(&logMutex);
 }
 
-void rfbDebugLog(char *format, ...) {
+void rfbDebugLog(const char *format, ...) {
 #ifdef __DEBUGGING__
     va_list args;
     NSString *nsFormat = [[NSString alloc] initWithCString:format];
@@ -162,7 +162,7 @@ void rfbDebugLog(char *format, ...) {
 }
 
 
-void rfbLogPerror(char *str) {
+void rfbLogPerror(const char *str) {
     rfbLog("%s: %s\n", str, strerror(errno));
 }
 
@@ -288,30 +288,21 @@ void displayReconfigurationCallback (
 }
 
 void refreshCallback(CGRectCount count, const CGRect *rectArray, void *ignore) {
-    BoxRec box;
-    RegionRec region;
-    rfbClientIteratorPtr iterator;
-    rfbClientPtr cl = NULL;
-    int i;
-
-    for (i = 0; i < count; i++) {
-        box.x1 = rectArray[i].origin.x;
-        box.y1 = rectArray[i].origin.y;
-        box.x2 = box.x1 + rectArray[i].size.width;
-        box.y2 = box.y1 + rectArray[i].size.height;
-
-        SAFE_REGION_INIT(&hackScreen, &region, &box, 0);
-
-        iterator = rfbGetClientIterator();
-        while ((cl = rfbClientIteratorNext(iterator)) != NULL) {
-            pthread_mutex_lock(&cl->updateMutex);
-            REGION_UNION(&hackScreen,&cl->modifiedRegion,&cl->modifiedRegion,&region);
-            pthread_mutex_unlock(&cl->updateMutex);
-            pthread_cond_signal(&cl->updateCond);
+    BoxRec boxes[32];
+    int i, n;
+
+    /* Passed on 32 at a time, so there's nothing to allocate here */
+    while (count > 0) {
+        n = min(count, 32);
+        for (i = 0; i < n; i++) {
+            boxes[i].x1 = rectArray[i].origin.x;
+            boxes[i].y1 = rectArray[i].origin.y;
+            boxes[i].x2 = boxes[i].x1 + rectArray[i].size.width;
+            boxes[i].y2 = boxes[i].y1 + rectArray[i].size.height;
         }
-        rfbReleaseClientIterator(iterator);
-
-        REGION_UNINIT(&hackScreen, &region);
+        rfbMarkRectsModified(boxes, n);
+        rectArray += n;
+        count -= n;
     }
 }
 
@@ -322,11 +313,14 @@ void refreshCallback(CGRectCount count, const CGRect *rectArray, void *ignore) {
 
 
 void rfbCheckForScreenResolutionChange() {
-    BOOL sizeChange = (rfbScreen.width != CGDisplayPixelsWide(displayID) ||
-                       rfbScreen.height != CGDisplayPixelsHigh(displayID));
+    int width, height, bitsPerPixel;
+    BOOL sizeChange;
+
+    (*rfbSource->getGeometry)(&width, &height, &bitsPerPixel);
+    sizeChange = (rfbScreen.width != width || rfbScreen.height != height);
 
     // See if screen changed
-    if (sizeChange || rfbScreen.bitsPerPixel != CGDisplayBitsPerPixel(displayID)) {
+    if (sizeChange || rfbScreen.bitsPerPixel != bitsPerPixel) {
         rfbClientIteratorPtr iterator;
         rfbClientPtr cl = NULL;
 		BOOL screenOK = TRUE;
@@ -338,6 +332,7 @@ void rfbCheckForScreenResolutionChange() {
         iterator = rfbGetClientIterator();
         // Disconnect Existing Clients
         while ((cl = rfbClientIteratorNext(iterator))) {
+            pthread_mutex_lock(&cl->outputMutex);
             pthread_mutex_lock(&cl->updateMutex);
             // Keep locked until after screen change
         }
@@ -348,11 +343,13 @@ void rfbCheckForScreenResolutionChange() {
 		} while (!screenOK && maxTries-- && usleep(2000000)==0);
 		if (!screenOK)
 			exit(1);
+		rfbRecordScreen();
+		rfbScaleScreenChanged();
 		
 		rfbLog("Screen Geometry Changed - (%d,%d) Depth: %d\n",
-               CGDisplayPixelsWide(displayID),
-               CGDisplayPixelsHigh(displayID),
-               CGDisplayBitsPerPixel(displayID));
+               rfbScreen.width,
+               rfbScreen.height,
+               rfbScreen.bitsPerPixel);
 		
 		
 		iterator = rfbGetClientIterator();
@@ -369,21 +366,8 @@ void rfbCheckForScreenResolutionChange() {
                     rfbSendScreenUpdateEncoding(cl);
 
 					// Reset Frame Buffer
-					if (cl->scalingFrameBuffer && cl->scalingFrameBuffer != rfbGetFramebuffer())
-						free(cl->scalingFrameBuffer);
-					
-					if (cl->scalingFactor == 1) {
-						cl->scalingFrameBuffer = rfbGetFramebuffer();
-						cl->scalingPaddedWidthInBytes = rfbScreen.paddedWidthInBytes;
-					}
-					else {
-						const unsigned long csh = (rfbScreen.height+cl->scalingFactor-1)/ cl->scalingFactor;
-						const unsigned long csw = (rfbScreen.width +cl->scalingFactor-1)/ cl->scalingFactor;
-						
-						cl->scalingFrameBuffer = malloc( csw*csh*rfbScreen.bitsPerPixel/8 );
-						cl->scalingPaddedWidthInBytes = csw * rfbScreen.bitsPerPixel/8;
-					}
-					
+					rfbSetClientScale(cl, cl->scalingFactor);
+
                     box.x1 = box.y1 = 0;
                     box.x2 = rfbScreen.width;
                     box.y2 = rfbScreen.height;
@@ -401,7 +385,8 @@ void rfbCheckForScreenResolutionChange() {
 
 			sleep(2); // We may detect the new depth before OS X has quite finished getting everything ready for it.
             pthread_mutex_unlock(&cl->updateMutex);
-            pthread_cond_signal(&cl->updateCond);
+            pthread_mutex_unlock(&cl->outputMutex);
+            rfbWakeClient(cl);
         }
         rfbReleaseClientIterator(iterator);
 
@@ -410,98 +395,191 @@ void rfbCheckForScreenResolutionChange() {
     }
 }
 
+/*
+ * clientHasUpdate is called with updateMutex held and says whether there's
+ * an update the client should get.
+ */
+
+static Bool clientHasUpdate(rfbClientPtr cl) {
+    RegionRec updateRegion;
+    Bool haveUpdate = FALSE;
+
+    if (cl->sock == -1)
+        return FALSE;
+
+    // Check for (and send immediately) pending PB changes
+    rfbClientUpdatePasteboard(cl);
+
+    // Only do checks if we HAVE an outstanding request
+    if (REGION_NOTEMPTY(&hackScreen, &cl->requestedRegion)) {
+        /* REDSTONE */
+        if (rfbDeferUpdateTime > 0 && !cl->immediateUpdate) {
+            // Compare Request with Update Area
+            REGION_INIT(&hackScreen, &updateRegion, NullBox, 0);
+            REGION_INTERSECT(&hackScreen, &updateRegion, &cl->modifiedRegion, &cl->requestedRegion);
+            haveUpdate = REGION_NOTEMPTY(&hackScreen, &updateRegion);
+
+            REGION_UNINIT(&hackScreen, &updateRegion);
+        }
+        else {
+            /*  If we've turned off deferred updating
+            We are going to send an update as soon as we have a requested,
+            regardless of if we have a "change" intersection */
+            haveUpdate = TRUE;
+        }
+
+        if (rfbShouldSendNewCursor(cl))
+            haveUpdate = TRUE;
+        else if (rfbShouldSendNewPosition(cl))
+            // Could Compare with the request area but for now just always send it
+            haveUpdate = TRUE;
+        else if (cl->needNewScreenSize)
+            haveUpdate = TRUE;
+    }
+
+    return haveUpdate;
+}
+
+/*
+ * clientSendUpdate is called with updateMutex held, which it releases, and
+ * sends the update.
+ */
+
+static void clientSendUpdate(rfbClientPtr cl) {
+    RegionRec updateRegion, screenRegion;
+    BoxRec screenBox;
+    rfbPaceTime sendStart, damageSince;
+
+    /* Now, get the region we're going to update, and remove
+        it from cl->modifiedRegion _before_ we send the update.
+        That way, if anything that overlaps the region we're sending
+        is updated, we'll be sure to do another update later. */
+    REGION_INIT(&hackScreen, &updateRegion, NullBox, 0);
+    REGION_INTERSECT(&hackScreen, &updateRegion, &cl->modifiedRegion, &cl->requestedRegion);
+    REGION_SUBTRACT(&hackScreen, &cl->modifiedRegion, &cl->modifiedRegion, &updateRegion);
+    /* REDSTONE - We also want to clear out the requested region, so we don't process
+        graphic updates in previously requested regions */
+    REGION_UNINIT(&hackScreen, &cl->requestedRegion);
+    REGION_INIT(&hackScreen, &cl->requestedRegion,NullBox,0);
+    damageSince = cl->statsDamageSince;
+    cl->statsDamageSince = 0;
+
+    /* The snapshot is ours, new damage and requests can come in while
+        we encode and write it. */
+    pthread_mutex_unlock(&cl->updateMutex);
+    pthread_mutex_lock(&cl->outputMutex);
+    sendStart = rfbPacingNow();
+
+    /* The screen may have been reconfigured since the snapshot */
+    screenBox.x1 = screenBox.y1 = 0;
+    screenBox.x2 = rfbScreen.width;
+    screenBox.y2 = rfbScreen.height;
+    REGION_INIT(&hackScreen, &screenRegion, &screenBox, 0);
+    REGION_INTERSECT(&hackScreen, &updateRegion, &updateRegion, &screenRegion);
+    REGION_UNINIT(&hackScreen, &screenRegion);
+
+    /*  This does happen but it's asynchronous (and slow to occur)
+        what we really want to happen is to just temporarily hide the cursor (while sending to the remote screen)
+        -- It's not even usually there (as it's handled by the display driver - but under certain occasions it does appear
+     displayErr = CGDisplayHideCursor(displayID);
+     if (displayErr != 0)
+     rfbLog("Error Hiding Cursor %d", displayErr);
+     CGDisplayMoveCursorToPoint(displayID, CGPointZero);
+                                            */
+
+    /* Now actually send the update. */
+    if (cl->sock != -1) {
+        rfbSendFramebufferUpdate(cl, updateRegion);
+        rfbPacingUpdateSent(cl, sendStart);
+        rfbLinkUpdateSent(cl, sendStart);
+        rfbStatsUpdateSent(cl, damageSince);
+    }
+    /* If we were hiding it before make it reappear now
+        displayErr = CGDisplayShowCursor(displayID);
+    if (displayErr != 0)
+        rfbLog("Error Showing Cursor %d", displayErr);
+    */
+
+    pthread_mutex_unlock(&cl->outputMutex);
+    REGION_UNINIT(&hackScreen, &updateRegion);
+}
+
 static void *clientOutput(void *data) {
     rfbClientPtr cl = (rfbClientPtr)data;
-    RegionRec updateRegion;
-    Bool haveUpdate = false;
 
     while (1) {
-        haveUpdate = false;
-		
         pthread_mutex_lock(&cl->updateMutex);
-        while (!haveUpdate) {
+        while (!clientHasUpdate(cl)) {
             if (cl->sock == -1) {
                 /* Client has disconnected. */
                 pthread_mutex_unlock(&cl->updateMutex);
                 return NULL;
             }
+            pthread_cond_wait(&cl->updateCond, &cl->updateMutex);
+        }
 
-            // Check for (and send immediately) pending PB changes
-            rfbClientUpdatePasteboard(cl);
-
-			// Only do checks if we HAVE an outstanding request
-			if (REGION_NOTEMPTY(&hackScreen, &cl->requestedRegion)) {
-				/* REDSTONE */
-				if (rfbDeferUpdateTime > 0 && !cl->immediateUpdate) {
-					// Compare Request with Update Area
-					REGION_INIT(&hackScreen, &updateRegion, NullBox, 0);
-					REGION_INTERSECT(&hackScreen, &updateRegion, &cl->modifiedRegion, &cl->requestedRegion);
-					haveUpdate = REGION_NOTEMPTY(&hackScreen, &updateRegion);
+        // OK, now, to save bandwidth, wait a little while for more updates to come along.
+        /* The wait is worked out per client, see pacing.c */
+        rfbPacingWait(cl, rfbPacingNow());
 
-					REGION_UNINIT(&hackScreen, &updateRegion);
-				}
-				else {
-					/*  If we've turned off deferred updating
-					We are going to send an update as soon as we have a requested,
-					regardless of if we have a "change" intersection */
-					haveUpdate = TRUE;
-				}
+        clientSendUpdate(cl);
+    }
 
-				if (rfbShouldSendNewCursor(cl))
-					haveUpdate = TRUE;
-				else if (rfbShouldSendNewPosition(cl))
-					// Could Compare with the request area but for now just always send it
-					haveUpdate = TRUE;
-				else if (cl->needNewScreenSize)
-					haveUpdate = TRUE;
-			}
+    return NULL;
+}
 
-			if (!haveUpdate)
-				pthread_cond_wait(&cl->updateCond, &cl->updateMutex);
-        }
+/*
+ * rfbClientServiceOutput is clientOutput for the reactor.  It sends an
+ * update if one is due and returns at once: with the time to look again if
+ * pacing is holding one back, otherwise 0.
+ */
 
-        // OK, now, to save bandwidth, wait a little while for more updates to come along.
-        /* REDSTONE - Lets send it right away if no rfbDeferUpdateTime */
-        if (rfbDeferUpdateTime > 0 && !cl->immediateUpdate && !cl->needNewScreenSize) {
-            pthread_mutex_unlock(&cl->updateMutex);
-            usleep(rfbDeferUpdateTime * 1000);
-            pthread_mutex_lock(&cl->updateMutex);
-        }
+rfbPaceTime rfbClientServiceOutput(rfbClientPtr cl) {
+    rfbPaceTime now = rfbPacingNow(), deadline;
 
-        /* Now, get the region we're going to update, and remove
-            it from cl->modifiedRegion _before_ we send the update.
-            That way, if anything that overlaps the region we're sending
-            is updated, we'll be sure to do another update later. */
-        REGION_INIT(&hackScreen, &updateRegion, NullBox, 0);
-        REGION_INTERSECT(&hackScreen, &updateRegion, &cl->modifiedRegion, &cl->requestedRegion);
-        REGION_SUBTRACT(&hackScreen, &cl->modifiedRegion, &cl->modifiedRegion, &updateRegion);
-        /* REDSTONE - We also want to clear out the requested region, so we don't process
-            graphic updates in previously requested regions */
-        REGION_UNINIT(&hackScreen, &cl->requestedRegion);
-        REGION_INIT(&hackScreen, &cl->requestedRegion,NullBox,0);
-
-        /*  This does happen but it's asynchronous (and slow to occur)
-			what we really want to happen is to just temporarily hide the cursor (while sending to the remote screen)
-			-- It's not even usually there (as it's handled by the display driver - but under certain occasions it does appear
-         displayErr = CGDisplayHideCursor(displayID);
-         if (displayErr != 0)
-         rfbLog("Error Hiding Cursor %d", displayErr);
-         CGDisplayMoveCursorToPoint(displayID, CGPointZero);
-											*/
-
-        /* Now actually send the update. */
-        rfbSendFramebufferUpdate(cl, updateRegion);
-        /* If we were hiding it before make it reappear now
-            displayErr = CGDisplayShowCursor(displayID);
-        if (displayErr != 0)
-            rfbLog("Error Showing Cursor %d", displayErr);
-        */
+    pthread_mutex_lock(&cl->updateMutex);
+    if (!clientHasUpdate(cl)) {
+        cl->reactorReady = 0;
+        pthread_mutex_unlock(&cl->updateMutex);
+        return 0;
+    }
 
-        REGION_UNINIT(&hackScreen, &updateRegion);
+    if (!cl->reactorReady)
+        cl->reactorReady = now;
+    deadline = rfbPacingDeadline(cl, cl->reactorReady);
+    if (now < deadline || (deadline = rfbPacingBacklog(cl)) != 0) {
         pthread_mutex_unlock(&cl->updateMutex);
+        return deadline;
     }
 
-    return NULL;
+    cl->reactorReady = 0;
+    clientSendUpdate(cl);
+    return 0;
+}
+
+/*
+ * rfbClientProcessInput handles one message from the client, on its input
+ * thread or as a reactor input job.
+ */
+
+void rfbClientProcessInput(rfbClientPtr cl) {
+    bundlesPerformSelector(@selector(rfbReceivedClientMessage));
+    rfbProcessClientMessage(cl);
+
+    // Some people will connect but not request screen updates - just send events, this will delay registering the CG callback until then
+    if (rfbShouldSendUpdates && !registered && REGION_NOTEMPTY(&hackScreen, &cl->requestedRegion)) {
+        rfbLog("Client Connected - Registering Screen Update Notification\n");
+        if (!(*rfbSource->start)()) {
+            NSLog(@"Error starting %s screen updates", rfbSource->name);
+        }
+        bundlesPerformSelector(@selector(rfbConnect));
+        //CGScreenRegisterMoveCallback(screenUpdateMoveCallback, NULL);
+        registered = TRUE;
+    }
+    CGError result = CGDisplayRegisterReconfigurationCallback(displayReconfigurationCallback, NULL);
+    if (result != kCGErrorSuccess) {
+        NSLog(@"Error (%d) registering for Display Reconfiguration Notification", result);
+    }
 }
 
 void *clientInput(void *data) {
@@ -511,25 +589,8 @@ void *clientInput(void *data) {
     pthread_create(&output_thread, NULL, clientOutput, (void *)cl);
 
     while (1) {
-        bundlesPerformSelector(@selector(rfbReceivedClientMessage));
-        rfbProcessClientMessage(cl);
-
-        // Some people will connect but not request screen updates - just send events, this will delay registering the CG callback until then
-        if (rfbShouldSendUpdates && !registered && REGION_NOTEMPTY(&hackScreen, &cl->requestedRegion)) {
-            rfbLog("Client Connected - Registering Screen Update Notification\n");
-            CGError result = CGRegisterScreenRefreshCallback(refreshCallback, NULL);
-			if (result != kCGErrorSuccess) {
-				NSLog(@"Error (%d) registering for Screen Update Notification", result);
-			}
-			bundlesPerformSelector(@selector(rfbConnect));
-			//CGScreenRegisterMoveCallback(screenUpdateMoveCallback, NULL);
-            registered = TRUE;
-        }
-		CGError result = CGDisplayRegisterReconfigurationCallback(displayReconfigurationCallback, NULL);
-		if (result != kCGErrorSuccess) {
-			NSLog(@"Error (%d) registering for Display Reconfiguration Notification", result);
-		}
-        
+        rfbClientProcessInput(cl);
+
         if (cl->sock == -1) {
             /* Client has disconnected. */
             break;
@@ -559,11 +620,23 @@ void rfbStartClientWithFD(int client_fd) {
 	
 	if (setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, (void *)&one, sizeof(one)) < 0)
 		rfbLogPerror("setsockopt TCP_NODELAY failed"); 
+
+#ifdef TCP_NOTSENT_LOWAT
+	/* Keep no more queued in the kernel than we hold updates back at,
+	   so a backed up link is seen by rfbPacingBacklog rather than hidden in
+	   a deep send buffer */
+	if (rfbMaxUnsentBytes > 0 &&
+		setsockopt(client_fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (void *)&rfbMaxUnsentBytes, sizeof(rfbMaxUnsentBytes)) < 0)
+		rfbLogPerror("setsockopt TCP_NOTSENT_LOWAT failed");
+#endif
 	
 	rfbUndim();
 	cl = rfbNewClient(client_fd);
 	
-	pthread_create(&client_thread, NULL, clientInput, (void *)cl);
+	if (!rfbUseReactor)
+		pthread_create(&client_thread, NULL, clientInput, (void *)cl);
+	else if (cl)
+		rfbReactorAddClient(cl);
 	
 	pthread_mutex_unlock(&listenerAccepting);
 	pthread_cond_signal(&listenerGotNewClient);	
@@ -646,7 +719,10 @@ void connectReverseClient(char *hostName, int portNum) {
     rfbUndim();
     cl = rfbReverseConnection(hostName, portNum);
 	if (cl) {	
-		pthread_create(&client_thread, NULL, clientInput, (void *)cl);
+		if (rfbUseReactor)
+			rfbReactorAddClient(cl);
+		else
+			pthread_create(&client_thread, NULL, clientInput, (void *)cl);
 		pthread_mutex_unlock(&listenerAccepting);
 		pthread_cond_signal(&listenerGotNewClient);
 	}
@@ -655,7 +731,9 @@ void connectReverseClient(char *hostName, int portNum) {
 	}
 }
 
-char *rfbGetFramebuffer(void) {
+/* CoreGraphics framebuffer source */
+
+static char *cgGetFramebuffer(void) {
 	int maxWait =  5000000;
 	int retryWait = 500000;
 	
@@ -676,7 +754,7 @@ char *rfbGetFramebuffer(void) {
 	return returnValue;
 }
 
-static bool rfbScreenInit(void) {
+static Bool cgScreenInit(void) {
 	int bitsPerSample = 8;
 
 	if (floor(NSAppKitVersionNumber) <= floor(NSAppKitVersionNumber10_3))
@@ -723,6 +801,41 @@ static bool rfbScreenInit(void) {
 	rfbServerFormat.greenShift = bitsPerSample * 1;
 	rfbServerFormat.blueShift = bitsPerSample * 0;
 
+	return TRUE;
+}
+
+static void cgGetGeometry(int *width, int *height, int *bitsPerPixel) {
+	*width = CGDisplayPixelsWide(displayID);
+	*height = CGDisplayPixelsHigh(displayID);
+	*bitsPerPixel = CGDisplayBitsPerPixel(displayID);
+}
+
+static Bool cgStart(void) {
+	CGError result = CGRegisterScreenRefreshCallback(refreshCallback, NULL);
+	if (result != kCGErrorSuccess) {
+		NSLog(@"Error (%d) registering for Screen Update Notification", result);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void cgStop(void) {
+	CGUnregisterScreenRefreshCallback(refreshCallback, NULL);
+}
+
+rfbFramebufferSource rfbCoreGraphicsSource = {
+	"coregraphics",
+	cgScreenInit,
+	cgGetFramebuffer,
+	cgGetGeometry,
+	cgStart,
+	cgStop
+};
+
+static bool rfbScreenInit(void) {
+	if (!(*rfbSource->init)())
+		return FALSE;
+
     /* We want to use the X11 REGION_* macros without having an actual
         X11 ScreenPtr, so we do this.  Pretty ugly, but at least it lets us
         avoid hacking up regionstr.h, or changing every call to REGION_* */
@@ -744,6 +857,9 @@ static bool rfbScreenInit(void) {
     hackScreen.RegionExtents = miRegionExtents;
     hackScreen.RegionAppend = miRegionAppend;
     hackScreen.RegionValidate = miRegionValidate;
+
+	rfbShadowInit();
+	rfbTileCacheFlush();
 	
 	return TRUE;
 }
@@ -758,7 +874,10 @@ static void usage(void) {
 	fprintf(stderr, "                       (use 'storepasswd' to create a password file)\n");
     fprintf(stderr, "-maxauthattempts num   Maximum Number of auth tries before disabling access from a host\n");
 	fprintf(stderr, "                       (default: 5), zero disables\n");
-    fprintf(stderr, "-deferupdate time      Time in ms to defer updates (default %d)\n", rfbDeferUpdateTime);
+    fprintf(stderr, "-deferupdate time      Longest time in ms to defer updates (default %d)\n", rfbDeferUpdateTime);
+    fprintf(stderr, "-maxfps rate           Most updates per second to send each client (default: no limit)\n");
+    fprintf(stderr, "-lowlatency time       Send updates without deferring for this many ms after\n");
+    fprintf(stderr, "                       a key press or click (default %d, 0 disables)\n", rfbLowLatencyWindow);
     fprintf(stderr, "-desktop name          VNC desktop name (default \"MacOS X\")\n");
     fprintf(stderr, "-alwaysshared          Always treat new clients as shared\n");
     fprintf(stderr, "-nevershared           Never treat new clients as shared\n");
@@ -809,6 +928,38 @@ static void usage(void) {
             fprintf(stderr, "\t\t%d = (%ld,%ld)\n", index, CGDisplayPixelsWide(activeDisplays[index]), CGDisplayPixelsHigh(activeDisplays[index]));
     }
     */
+    fprintf(stderr, "-headless workload     Serve a synthetic desktop instead of the display, for profiling\n");
+    fprintf(stderr, "                       (idle, scroll, drag, video or cycle)\n");
+    fprintf(stderr, "-headlesssize WxH      Size of the synthetic desktop (default %dx%d)\n", rfbHeadlessWidth, rfbHeadlessHeight);
+    fprintf(stderr, "-shmfb path            Serve a framebuffer written by another process into this\n");
+    fprintf(stderr, "                       shared memory segment (see shmfb.h)\n");
+    fprintf(stderr, "-noshadow              Don't keep a shadow copy of the screen to trim damage\n");
+    fprintf(stderr, "                       (saves memory at the cost of sending unchanged pixels)\n");
+    fprintf(stderr, "-tilecache MB          Memory for Raw, RRE, CoRRE and Hextile output shared between\n");
+    fprintf(stderr, "                       clients (default %d, 0 disables)\n", rfbTileCacheSize);
+    fprintf(stderr, "-encodethreads n       Threads used to encode large Raw, RRE, CoRRE, Hextile, ZRLE and\n");
+    fprintf(stderr, "                       Tight updates (default one per CPU, 1 encodes on the client's\n");
+    fprintf(stderr, "                       own thread)\n");
+    fprintf(stderr, "-noadaptiveencoding    Keep to the client's choice of encoding and levels instead of\n");
+    fprintf(stderr, "                       following the measured speed of its link\n");
+    fprintf(stderr, "-statssocket path      Serve live per-client statistics, in Prometheus' text format,\n");
+    fprintf(stderr, "                       to anything connecting to this UNIX socket\n");
+    fprintf(stderr, "-maxunsent KB          Hold updates while more than this is waiting to be sent to a\n");
+    fprintf(stderr, "                       client, sending the latest screen once it drains (default %d, 0 disables)\n", rfbMaxUnsentBytes / 1024);
+    fprintf(stderr, "-reactor               Serve all clients from one event loop instead of two threads each\n");
+    fprintf(stderr, "-reactorthreads n      Threads handling client messages and updates with -reactor (default %d)\n", rfbReactorThreads);
+    fprintf(stderr, "-subrectbudget n       Work, per pixel, RRE, CoRRE, Hextile and ZlibHex may spend looking for\n");
+    fprintf(stderr, "                       subrectangles before sending the pixels raw (default %d, 0 for no limit)\n", rfbSubrectBudget);
+    fprintf(stderr, "-nosimd                Translate pixels for clients in other formats with lookup tables,\n");
+    fprintf(stderr, "                       look for the colours in tiles and filter Tight rectangles, and\n");
+    fprintf(stderr, "                       find subrectangles, without the SIMD kernels\n");
+    fprintf(stderr, "-scale ratio           Show clients the screen scaled down by this ratio, which needn't be\n");
+    fprintf(stderr, "                       whole (default 1, clients can still ask for their own)\n");
+    fprintf(stderr, "-record file           Record the screen's changes and the clients' messages to this file\n");
+    fprintf(stderr, "-replay file           Serve a recording made with -record instead of the display, replaying\n");
+    fprintf(stderr, "                       its clients over the loopback and exiting at the end (needs -rfbnoauth)\n");
+    fprintf(stderr, "-replayspeed n         Speed of -replay as a multiple of the recorded one (default 1, 0 is\n");
+    fprintf(stderr, "                       as fast as possible)\n");
     fprintf(stderr, "-localhost             Only allow connections from the same machine, literally localhost (127.0.0.1)\n");
     fprintf(stderr, "                       If you use SSH and want to stop non-SSH connections from any other hosts \n");
     fprintf(stderr, "                       (default: no, allow remote connections)\n");
@@ -888,6 +1039,12 @@ static void processArguments(int argc, char *argv[]) {
 		} else if (strcmp(argv[i], "-deferupdate") == 0) {  // -deferupdate ms
             if (i + 1 >= argc) usage();
             rfbDeferUpdateTime = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-maxfps") == 0) {  // -maxfps rate
+            if (i + 1 >= argc) usage();
+            rfbMaxFrameRate = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-lowlatency") == 0) {  // -lowlatency ms
+            if (i + 1 >= argc) usage();
+            rfbLowLatencyWindow = atoi(argv[++i]);
         } else if (strcmp(argv[i], "-maxdepth") == 0) {  // -maxdepth
             if (i + 1 >= argc) usage();
             rfbMaxBitDepth = atoi(argv[++i]);
@@ -945,6 +1102,66 @@ static void processArguments(int argc, char *argv[]) {
             rfbInhibitEvents = TRUE;
 		} else if (strcmp(argv[i], "-noupdates") == 0) {
 			rfbShouldSendUpdates = FALSE;
+		} else if (strcmp(argv[i], "-headless") == 0) {
+            if (i + 1 >= argc) usage();
+			if (!rfbHeadlessSetWorkload(argv[++i])) {
+				rfbLog("Unknown headless workload %s", argv[i]);
+				usage();
+			}
+			rfbSource = &rfbHeadlessSource;
+		} else if (strcmp(argv[i], "-headlesssize") == 0) {
+            if (i + 1 >= argc) usage();
+			if (sscanf(argv[++i], "%dx%d", &rfbHeadlessWidth, &rfbHeadlessHeight) != 2)
+				usage();
+		} else if (strcmp(argv[i], "-shmfb") == 0) {
+            if (i + 1 >= argc) usage();
+			rfbShmFramebufferPath = argv[++i];
+			rfbSource = &rfbSharedMemorySource;
+		} else if (strcmp(argv[i], "-noshadow") == 0) {
+			rfbShadowEnabled = FALSE;
+		} else if (strcmp(argv[i], "-tilecache") == 0) {  // -tilecache MB
+            if (i + 1 >= argc) usage();
+			rfbTileCacheSize = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-encodethreads") == 0) {  // -encodethreads n
+            if (i + 1 >= argc) usage();
+			rfbEncodeThreads = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-noadaptiveencoding") == 0) {
+			rfbAdaptiveEncoding = FALSE;
+		} else if (strcmp(argv[i], "-statssocket") == 0) {  // -statssocket path
+            if (i + 1 >= argc) usage();
+			rfbStatsSocketPath = argv[++i];
+		} else if (strcmp(argv[i], "-maxunsent") == 0) {  // -maxunsent KB
+            if (i + 1 >= argc) usage();
+			rfbMaxUnsentBytes = atoi(argv[++i]) * 1024;
+		} else if (strcmp(argv[i], "-reactor") == 0) {
+			rfbUseReactor = TRUE;
+		} else if (strcmp(argv[i], "-reactorthreads") == 0) {  // -reactorthreads n
+            if (i + 1 >= argc) usage();
+			rfbReactorThreads = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-subrectbudget") == 0) {  // -subrectbudget n
+            if (i + 1 >= argc) usage();
+			rfbSubrectBudget = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-nosimd") == 0) {
+			rfbSimdTranslate = FALSE;
+			rfbSimdAnalysis = FALSE;
+			rfbSimdTight = FALSE;
+			rfbSimdSubrect = FALSE;
+		} else if (strcmp(argv[i], "-scale") == 0) {  // -scale ratio
+            if (i + 1 >= argc) usage();
+			rfbDefaultScale = atof(argv[++i]);
+			if (rfbDefaultScale < 1)
+				usage();
+		} else if (strcmp(argv[i], "-record") == 0) {  // -record file
+            if (i + 1 >= argc) usage();
+			rfbRecordPath = argv[++i];
+		} else if (strcmp(argv[i], "-replay") == 0) {  // -replay file
+            if (i + 1 >= argc) usage();
+			rfbReplayPath = argv[++i];
+			rfbSource = &rfbReplaySource;
+			rfbDisableRemote = TRUE;
+		} else if (strcmp(argv[i], "-replayspeed") == 0) {  // -replayspeed n
+            if (i + 1 >= argc) usage();
+			rfbReplaySpeed = atof(argv[++i]);
 		} else if (strcmp(argv[i], "-littleendian") == 0) {
 			littleEndian = TRUE;
 		} else if (strcmp(argv[i], "-bigendian") == 0) {
@@ -975,7 +1192,13 @@ void rfbShutdown(void) {
     bundlesPerformSelector(@selector(rfbShutdown));
     [bundleArray release];
 
-    CGUnregisterScreenRefreshCallback(refreshCallback, NULL);
+    (*rfbSource->stop)();
+    rfbDamageStop();
+    rfbWorkPoolStop();
+    rfbReactorStop();
+    rfbStatsSocketStop();
+    rfbReplayStop();
+    rfbRecordStop();
 	CGDisplayRemoveReconfigurationCallback(displayReconfigurationCallback, NULL);
     //CGDisplayShowCursor(displayID);
     rfbDimmingShutdown();
@@ -1136,6 +1359,8 @@ int main(int argc, char *argv[]) {
 
     loadKeyTable();
 
+	rfbSource = &rfbCoreGraphicsSource;
+
 	[[NSUserDefaults standardUserDefaults] addSuiteNamed:@"com.robohippo.hippovnc"];
 	
     processArguments(argc, argv);
@@ -1152,6 +1377,8 @@ int main(int argc, char *argv[]) {
 	
 	if (!rfbScreenInit())
 		exit(1);
+	if (!rfbRecordStart())
+		exit(1);
 
     rfbClientListInit();
     rfbDimmingInit();
@@ -1207,7 +1434,12 @@ int main(int argc, char *argv[]) {
     }
 
 	nonBlocking = [[NSUserDefaults standardUserDefaults] boolForKey:@"NonBlocking"];
+    rfbDamageStart();
+    rfbWorkPoolStart();
+    rfbReactorStart();
+    rfbStatsSocketStart();
     pthread_create(&listener_thread, NULL, listenerRun, NULL);
+    rfbReplayStart();
 	
 	if (strlen(reverseHost) > 0)
 		connectReverseClient(reverseHost, reversePort);
@@ -1227,7 +1459,7 @@ int main(int argc, char *argv[]) {
 				// But it seems that unregistering but keeping the process (or event loop) around can cause a stuttering behavior in OS X.
 				if (registered && unregisterWhenNoConnections) {
 					rfbLog("UnRegistering Screen Update Notification - waiting for clients\n");
-					CGUnregisterScreenRefreshCallback(refreshCallback, NULL);
+					(*rfbSource->stop)();
 					bundlesPerformSelector(@selector(rfbDisconnect));
 					registered = NO;
 				}
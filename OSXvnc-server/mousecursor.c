@@ -252,7 +252,7 @@ void rfbCheckForCursorChange() {
         // Notify each client
         while ((cl = rfbClientIteratorNext(iterator)) != NULL) {
             if (rfbShouldSendNewCursor(cl) || (rfbShouldSendNewPosition(cl)))
-                pthread_cond_signal(&cl->updateCond);
+                rfbWakeClient(cl);
         }
         rfbReleaseClientIterator(iterator);
     }
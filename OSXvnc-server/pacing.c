@@ -0,0 +1,261 @@
+/*
+ * pacing.c - per-client update deferral.
+ *
+ * Instead of always sleeping rfbDeferUpdateTime before sending, each client
+ * works out how long to hold an update from what it has measured:
+ *
+ *   - how long its updates take to encode and write (which includes waiting
+ *     for the socket, so a slow link shows up here),
+ *   - how quickly damage is arriving for it, and
+ *   - whether the user has just typed or clicked, in which case latency
+ *     matters more than batching.
+ *
+ * rfbDeferUpdateTime remains the upper bound, and rfbMaxFrameRate can cap
+ * the update rate outright.
+ *
+ * A link that backs up anyway gets no new updates until the socket has
+ * drained below rfbMaxUnsentBytes.  Damage keeps merging meanwhile, so what
+ * goes out then is the latest state rather than a queue of stale frames.
+ */
+
+/*
+ *  OSXvnc Copyright (C) 2002-2004 Redstone Software osxvnc@redstonesoftware.com
+ *  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#if defined(__APPLE__)
+#include <mach/mach_time.h>
+#endif
+
+#include "rfb.h"
+
+int rfbMaxFrameRate = 0;            /* updates per second per client, 0 for no cap */
+int rfbLowLatencyWindow = 250;      /* in ms after input to send without deferring, 0 disables */
+int rfbMaxUnsentBytes = 128 * 1024; /* socket backlog at which updates are held, 0 for no limit */
+
+/* Averages move 1/8th of the way towards each new sample */
+#define PACE_EWMA(avg, sample) ((avg) += ((long long)(sample) - (long long)(avg)) / 8)
+
+/* Samples longer than this are clamped, so an idle minute doesn't dominate */
+#define PACE_MAX_SAMPLE 1000000ULL
+
+/* How often to look at a backed up socket again */
+#define PACE_BACKLOG_POLL 20000ULL
+
+
+/*
+ * rfbPacingNow returns monotonic time in microseconds, so setting the clock
+ * can neither hold updates back nor skew the averages.
+ */
+
+rfbPaceTime rfbPacingNow(void) {
+#if defined(__APPLE__)
+    static mach_timebase_info_data_t timebase;
+
+    if (timebase.denom == 0)
+        mach_timebase_info(&timebase);
+    return mach_absolute_time() * timebase.numer / timebase.denom / 1000;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (rfbPaceTime)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+
+/*
+ * rfbPacingCondInit initialises a client's updateCond.  Elsewhere than OS X
+ * it has to be told to time out by the same clock as rfbPacingNow.
+ */
+
+void rfbPacingCondInit(pthread_cond_t *cond) {
+#if defined(__APPLE__)
+    pthread_cond_init(cond, NULL);
+#else
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+#endif
+}
+
+
+/*
+ * TimedWait waits on cond until it is signalled or rfbPacingNow reaches
+ * deadline.  OS X can only wait for so long rather than until a time, so is
+ * given what's left.
+ */
+
+static void TimedWait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                      rfbPaceTime deadline) {
+    struct timespec ts;
+#if defined(__APPLE__)
+    rfbPaceTime now = rfbPacingNow(), left;
+
+    left = (deadline > now) ? deadline - now : 0;
+    ts.tv_sec = left / 1000000;
+    ts.tv_nsec = (left % 1000000) * 1000;
+    pthread_cond_timedwait_relative_np(cond, mutex, &ts);
+#else
+    ts.tv_sec = deadline / 1000000;
+    ts.tv_nsec = (deadline % 1000000) * 1000;
+    pthread_cond_timedwait(cond, mutex, &ts);
+#endif
+}
+
+void rfbPacingInit(rfbClientPtr cl) {
+    cl->paceEncodeTime = 0;
+    cl->paceDamageInterval = PACE_MAX_SAMPLE;
+    cl->paceLastDamage = 0;
+    cl->paceLastUpdate = 0;
+    cl->paceLastInput = 0;
+    cl->paceBacklogDamage = 0;
+}
+
+
+/*
+ * rfbPacingDamage is called with updateMutex held whenever damage is added
+ * to the client.
+ */
+
+void rfbPacingDamage(rfbClientPtr cl) {
+    rfbPaceTime now = rfbPacingNow();
+
+    if (cl->paceLastDamage)
+        PACE_EWMA(cl->paceDamageInterval, min(now - cl->paceLastDamage, PACE_MAX_SAMPLE));
+    cl->paceLastDamage = now;
+    if (!cl->statsDamageSince)
+        cl->statsDamageSince = now;
+}
+
+
+/*
+ * rfbPacingInput is called from the input thread for key presses and
+ * pointer events with a button down.  A deferring output thread is woken
+ * so it can send right away.
+ */
+
+void rfbPacingInput(rfbClientPtr cl) {
+    pthread_mutex_lock(&cl->updateMutex);
+    cl->paceLastInput = rfbPacingNow();
+    pthread_mutex_unlock(&cl->updateMutex);
+    rfbWakeClient(cl);
+}
+
+
+/*
+ * rfbPacingUpdateSent records how long an update took to encode and write,
+ * start being when the output thread began on it.
+ */
+
+void rfbPacingUpdateSent(rfbClientPtr cl, rfbPaceTime start) {
+    rfbPaceTime now = rfbPacingNow();
+
+    PACE_EWMA(cl->paceEncodeTime, min(now - start, PACE_MAX_SAMPLE));
+    cl->paceLastUpdate = now;
+}
+
+
+/*
+ * rfbPacingDeadline returns the time at which an update that became ready
+ * at the given time should go out.
+ */
+
+rfbPaceTime rfbPacingDeadline(rfbClientPtr cl, rfbPaceTime ready) {
+    rfbPaceTime defer = 0, deadline, cap = rfbDeferUpdateTime * 1000;
+    Bool interactive = (rfbLowLatencyWindow > 0 && cl->paceLastInput &&
+                        cl->paceLastInput + rfbLowLatencyWindow * 1000 > rfbPacingNow());
+
+    if (rfbDeferUpdateTime > 0 && !cl->immediateUpdate && !cl->needNewScreenSize && !interactive) {
+        /* Updates can't usefully go out faster than we get them written */
+        defer = cl->paceEncodeTime;
+
+        /* If damage is streaming in, give a couple more batches a chance to
+           join this update.  If it's sparse, waiting won't gain anything. */
+        if (cl->paceDamageInterval < cap)
+            defer = max(defer, 2 * cl->paceDamageInterval);
+
+        defer = min(defer, cap);
+    }
+
+    deadline = ready + defer;
+
+    if (rfbMaxFrameRate > 0 && cl->paceLastUpdate)
+        deadline = max(deadline, cl->paceLastUpdate + 1000000 / rfbMaxFrameRate);
+
+    return deadline;
+}
+
+
+/*
+ * rfbPacingBacklog is called, with updateMutex held, when an update is due.
+ * If the client's socket is backed up it returns when to look again instead
+ * of letting the update be encoded, otherwise 0.  An update held back with
+ * fresh damage in it counts as a dropped frame.
+ */
+
+rfbPaceTime rfbPacingBacklog(rfbClientPtr cl) {
+    int unsent;
+
+    if (rfbMaxUnsentBytes <= 0 || (unsent = rfbSocketUnsentBytes(cl)) < 0)
+        return 0;
+
+    cl->rfbSendQueueDepth = unsent;
+    if (unsent > cl->rfbSendQueueMax)
+        cl->rfbSendQueueMax = unsent;
+    if (unsent <= rfbMaxUnsentBytes)
+        return 0;
+
+    if (cl->paceBacklogDamage != cl->paceLastDamage) {
+        cl->paceBacklogDamage = cl->paceLastDamage;
+        cl->rfbFramesDropped++;
+    }
+    return rfbPacingNow() + PACE_BACKLOG_POLL;
+}
+
+
+/*
+ * rfbPacingWait holds the update, with updateMutex held, until its deadline
+ * and the socket isn't backed up.
+ * It waits on updateCond so input and disconnects are noticed at once; the
+ * deadline is recomputed every time we wake.
+ */
+
+void rfbPacingWait(rfbClientPtr cl, rfbPaceTime ready) {
+    rfbPaceTime deadline;
+
+    while (cl->sock != -1) {
+        deadline = rfbPacingDeadline(cl, ready);
+        if (rfbPacingNow() >= deadline)
+            break;
+
+        TimedWait(&cl->updateCond, &cl->updateMutex, deadline);
+    }
+
+    /* Then until the socket has drained */
+    while (cl->sock != -1 && (deadline = rfbPacingBacklog(cl)) != 0) {
+        TimedWait(&cl->updateCond, &cl->updateMutex, deadline);
+    }
+}
@@ -0,0 +1,363 @@
+/*
+ * parallel.c - encode big Raw, RRE, CoRRE and Hextile updates on the pool.
+ *
+ * These encodings only depend on the pixels of the rectangle being encoded,
+ * so an update can be cut into bands which are encoded at the same time and
+ * then written in order.  Each worker encodes into a scratch client record
+ * that shares the real client's pixel format and translation table; what it
+ * would have written is collected in the task instead (see rfbSendUpdateBuf).
+ *
+ * Bands are a multiple of the hextile tile height, and of correMaxHeight for
+ * CoRRE, so the tiles and subrectangles sent are the ones a serial encode
+ * would have produced.
+ *
+ * Tight keeps state from one subrectangle to the next in its zlib streams,
+ * so it makes its own tasks (see tight.c) but uses the same scratch records.
+ */
+
+/*
+ *  OSXvnc Copyright (C) 2002-2004 Redstone Software osxvnc@redstonesoftware.com
+ *  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rfb.h"
+
+/* Updates smaller than this (in pixels) aren't worth handing out */
+#define PARALLEL_MIN_AREA (256 * 256)
+
+/* Band height, a multiple of the 16 pixel hextile tile */
+#define PARALLEL_BAND_HEIGHT 96
+
+
+/*
+ * rfbAddEncodeTask adds a task to the client's list, which is emptied by
+ * setting encodeTaskCount to 0.  Returns NULL if out of memory.
+ */
+
+rfbEncodeTask *rfbAddEncodeTask(rfbClientPtr cl, int x, int y, int w, int h) {
+    rfbEncodeTask *task;
+
+    if (cl->encodeTaskCount == cl->encodeTaskSize) {
+        int size = cl->encodeTaskSize ? cl->encodeTaskSize * 2 : 64;
+        rfbEncodeTask *tasks = (rfbEncodeTask *)xrealloc(cl->encodeTasks, size * sizeof(rfbEncodeTask));
+
+        if (!tasks)
+            return NULL;
+        memset(tasks + cl->encodeTaskSize, 0, (size - cl->encodeTaskSize) * sizeof(rfbEncodeTask));
+        cl->encodeTasks = tasks;
+        cl->encodeTaskSize = size;
+    }
+
+    task = &cl->encodeTasks[cl->encodeTaskCount++];
+    task->x = x;
+    task->y = y;
+    task->w = w;
+    task->h = h;
+    task->flags = 0;
+    task->len = 0;
+    task->ok = FALSE;
+    task->streamId = -1;
+    task->deferLen = 0;
+    task->zlen = 0;
+    return task;
+}
+
+
+/*
+ * Each worker number gets a scratch record, brought up to date with the
+ * client before every update.  Only what the encoders read is copied; the
+ * buffers a scratch record owns are its own.
+ */
+
+static Bool AllocScratch(rfbClientPtr cl) {
+    int i;
+
+    if (!cl->encodeScratch) {
+        cl->encodeScratch = (rfbClientPtr *)xalloc(WORKPOOL_MAX_THREADS * sizeof(rfbClientPtr));
+        if (!cl->encodeScratch)
+            return FALSE;
+        memset(cl->encodeScratch, 0, WORKPOOL_MAX_THREADS * sizeof(rfbClientPtr));
+    }
+
+    for (i = 0; i < rfbWorkPoolThreads(); i++) {
+        rfbClientPtr scratch = cl->encodeScratch[i];
+
+        if (scratch)
+            continue;
+        scratch = (rfbClientPtr)xalloc(sizeof(rfbClientRec));
+        if (!scratch)
+            return FALSE;
+        memset(scratch, 0, sizeof(rfbClientRec));
+        scratch->sock = -1;
+        scratch->tileCaptureFrom = -1;
+        cl->encodeScratch[i] = scratch;
+    }
+
+    return TRUE;
+}
+
+static void SetupScratch(rfbClientPtr cl, rfbClientPtr scratch) {
+    scratch->host = cl->host;
+    scratch->format = cl->format;
+    scratch->translateFn = cl->translateFn;
+    scratch->translateLookupTable = cl->translateLookupTable;
+    scratch->preferredEncoding = cl->preferredEncoding;
+    scratch->correMaxWidth = cl->correMaxWidth;
+    scratch->correMaxHeight = cl->correMaxHeight;
+    scratch->scalingFactor = cl->scalingFactor;
+    scratch->scalingFrameBuffer = cl->scalingFrameBuffer;
+    scratch->scalingPaddedWidthInBytes = cl->scalingPaddedWidthInBytes;
+    scratch->scaledScreen = cl->scaledScreen;
+    scratch->tightCompressLevel = cl->tightCompressLevel;
+    scratch->tightQualityLevel = cl->tightQualityLevel;
+
+    scratch->ublen = 0;
+    memset(scratch->rfbBytesSent, 0, sizeof(scratch->rfbBytesSent));
+    memset(scratch->rfbRectanglesSent, 0, sizeof(scratch->rfbRectanglesSent));
+}
+
+static void EncodeTask(void *arg, int index, int worker) {
+    rfbClientPtr cl = (rfbClientPtr)arg;
+    rfbClientPtr scratch = cl->encodeScratch[worker];
+    rfbEncodeTask *task = &cl->encodeTasks[index];
+    Bool (*encoder)(rfbClientPtr cl, int x, int y, int w, int h);
+
+    switch (cl->preferredEncoding) {
+        case rfbEncodingRRE:
+            encoder = rfbSendRectEncodingRRE;
+            break;
+        case rfbEncodingCoRRE:
+            encoder = rfbSendRectEncodingCoRRE;
+            break;
+        case rfbEncodingHextile:
+            encoder = rfbSendRectEncodingHextile;
+            break;
+        default:
+            encoder = rfbSendRectEncodingRaw;
+            break;
+    }
+
+    scratch->encodeTask = task;
+    task->ok = (rfbTileCacheSend(scratch, task->x, task->y, task->w, task->h, encoder) &&
+                rfbSendUpdateBuf(scratch));
+    scratch->encodeTask = NULL;
+}
+
+
+/*
+ * rfbSetupEncodeScratch gets a scratch record ready for every worker number.
+ * rfbMergeEncodeStats adds up what the scratch records have counted since.
+ */
+
+Bool rfbSetupEncodeScratch(rfbClientPtr cl) {
+    int i;
+
+    if (!AllocScratch(cl))
+        return FALSE;
+    for (i = 0; i < rfbWorkPoolThreads(); i++)
+        SetupScratch(cl, cl->encodeScratch[i]);
+    return TRUE;
+}
+
+void rfbMergeEncodeStats(rfbClientPtr cl) {
+    int i, e;
+
+    for (i = 0; i < rfbWorkPoolThreads(); i++) {
+        rfbClientPtr scratch = cl->encodeScratch[i];
+
+        for (e = 0; e < MAX_ENCODINGS; e++) {
+            cl->rfbBytesSent[e] += scratch->rfbBytesSent[e];
+            cl->rfbRectanglesSent[e] += scratch->rfbRectanglesSent[e];
+        }
+    }
+}
+
+
+/*
+ * rfbAppendEncodeTask is rfbSendUpdateBuf for a scratch record: the contents
+ * of updateBuf are added to the task's output.  rfbAppendEncodeTaskBytes
+ * adds other data after them.
+ */
+
+Bool rfbAppendEncodeTask(rfbClientPtr cl) {
+    if (!rfbAppendEncodeTaskBytes(cl, cl->updateBuf, cl->ublen))
+        return FALSE;
+    cl->ublen = 0;
+    return TRUE;
+}
+
+Bool rfbAppendEncodeTaskBytes(rfbClientPtr cl, char *data, int len) {
+    rfbEncodeTask *task = cl->encodeTask;
+
+    if (task->len + len > task->size) {
+        int size = max(task->size * 2, task->len + len);
+        char *buf = (char *)xrealloc(task->buf, size);
+
+        if (!buf) {
+            rfbLog("parallel: out of memory for %d bytes of output\n", size);
+            return FALSE;
+        }
+        task->buf = buf;
+        task->size = size;
+    }
+
+    memcpy(task->buf + task->len, data, len);
+    task->len += len;
+    return TRUE;
+}
+
+
+/*
+ * rfbParallelEncodePrepare decides whether an update should be encoded on
+ * the pool and if so cuts it into tasks.  Scaled clients have their scaling
+ * buffer brought up to date here.  Returns the number of rectangles the
+ * update will contain, or 0 to encode it serially.
+ */
+
+int rfbParallelEncodePrepare(rfbClientPtr cl, RegionPtr updateRegion) {
+    int i, nRects = 0, area = 0, rawBytes = 0, band = PARALLEL_BAND_HEIGHT;
+
+    cl->encodeTaskCount = 0;
+
+    if (rfbWorkPoolThreads() <= 1)
+        return 0;
+
+    switch (cl->preferredEncoding) {
+        case rfbEncodingRaw:
+        case rfbEncodingRRE:
+        case rfbEncodingHextile:
+            break;
+        case rfbEncodingCoRRE:
+            band = ((PARALLEL_BAND_HEIGHT + cl->correMaxHeight - 1) / cl->correMaxHeight) * cl->correMaxHeight;
+            break;
+        default:
+            return 0;
+    }
+
+    for (i = 0; i < REGION_NUM_RECTS(updateRegion); i++) {
+        BoxPtr box = &REGION_RECTS(updateRegion)[i];
+
+        area += (box->x2 - box->x1) * (box->y2 - box->y1);
+    }
+    if (area < PARALLEL_MIN_AREA)
+        return 0;
+
+    if (!rfbSetupEncodeScratch(cl))
+        return 0;
+
+    for (i = 0; i < REGION_NUM_RECTS(updateRegion); i++) {
+        int x = REGION_RECTS(updateRegion)[i].x1;
+        int y = REGION_RECTS(updateRegion)[i].y1;
+        int w = REGION_RECTS(updateRegion)[i].x2 - x;
+        int h = REGION_RECTS(updateRegion)[i].y2 - y;
+        int by = 0;
+
+        if (cl->scalingFactor != 1)
+            CopyScalingRect(cl, &x, &y, &w, &h, TRUE);
+        else
+            cl->scalingFrameBuffer = rfbGetFramebuffer();
+
+        rawBytes += (sz_rfbFramebufferUpdateRectHeader
+                     + w * (cl->format.bitsPerPixel / 8) * h);
+
+        do {
+            int bh = (h > 0) ? min(band, h - by) : h;
+
+            if (!rfbAddEncodeTask(cl, x, y + by, w, bh)) {
+                cl->encodeTaskCount = 0;
+                return 0;
+            }
+            if (cl->preferredEncoding == rfbEncodingCoRRE)
+                nRects += (((w-1) / cl->correMaxWidth + 1) * ((bh-1) / cl->correMaxHeight + 1));
+            else
+                nRects++;
+            by += band;
+        } while (by < h);
+    }
+
+    cl->rfbRawBytesEquivalent += rawBytes;
+    return nRects;
+}
+
+
+/*
+ * rfbParallelEncodeSend encodes the tasks set up by rfbParallelEncodePrepare
+ * and adds their output to the client's update in order.  The output is
+ * queued rather than copied, which is fine because nothing uses the tasks
+ * again before the update has been written.
+ */
+
+Bool rfbParallelEncodeSend(rfbClientPtr cl) {
+    int i;
+
+    rfbWorkPoolRun(EncodeTask, cl, cl->encodeTaskCount);
+    rfbMergeEncodeStats(cl);
+
+    for (i = 0; i < cl->encodeTaskCount; i++) {
+        rfbEncodeTask *task = &cl->encodeTasks[i];
+
+        if (!task->ok) {
+            rfbLog("parallel: encoding %dx%d at %d,%d failed\n", task->w, task->h, task->x, task->y);
+            rfbCloseClient(cl);
+            return FALSE;
+        }
+        if (!rfbQueueUpdateBytes(cl, task->buf, task->len))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+void rfbParallelEncodeFree(rfbClientPtr cl) {
+    int i;
+
+    for (i = 0; i < cl->encodeTaskSize; i++) {
+        if (cl->encodeTasks[i].buf)
+            xfree(cl->encodeTasks[i].buf);
+        if (cl->encodeTasks[i].deferBuf)
+            xfree(cl->encodeTasks[i].deferBuf);
+        if (cl->encodeTasks[i].zbuf)
+            xfree(cl->encodeTasks[i].zbuf);
+    }
+    if (cl->encodeTasks)
+        xfree(cl->encodeTasks);
+
+    if (cl->encodeScratch) {
+        for (i = 0; i < WORKPOOL_MAX_THREADS; i++) {
+            rfbClientPtr scratch = cl->encodeScratch[i];
+
+            if (!scratch)
+                continue;
+            if (scratch->tileCaptureBuf)
+                xfree(scratch->tileCaptureBuf);
+            if (scratch->client_rreBeforeBuf)
+                xfree(scratch->client_rreBeforeBuf);
+            if (scratch->client_rreAfterBuf)
+                xfree(scratch->client_rreAfterBuf);
+            rfbFreeSubrectData(scratch);
+            rfbFreeTightData(scratch);
+            xfree(scratch);
+        }
+        xfree(cl->encodeScratch);
+    }
+}
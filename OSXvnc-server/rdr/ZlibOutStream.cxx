@@ -25,13 +25,15 @@ using namespace rdr;
 enum { DEFAULT_BUF_SIZE = 16384 };
 
 ZlibOutStream::ZlibOutStream(OutStream* os, int bufSize_)
-  : underlying(os), bufSize(bufSize_ ? bufSize_ : DEFAULT_BUF_SIZE), offset(0)
+  : underlying(os), bufSize(bufSize_ ? bufSize_ : DEFAULT_BUF_SIZE), offset(0),
+    headerPending(true)
 {
   zs = new z_stream;
   zs->zalloc    = Z_NULL;
   zs->zfree     = Z_NULL;
   zs->opaque    = Z_NULL;
-  if (deflateInit(zs, Z_DEFAULT_COMPRESSION) != Z_OK) {
+  if (deflateInit2(zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
     delete zs;
     throw Exception("ZlibOutStream: deflateInit failed");
   }
@@ -60,11 +62,35 @@ int ZlibOutStream::length()
   return offset + ptr - start;
 }
 
+// writeHeader() writes the two byte zlib header that deflateInit() would
+// have produced, before the first compressed data.
+
+void ZlibOutStream::writeHeader()
+{
+  if (headerPending) {
+    underlying->writeU8(0x78);
+    underlying->writeU8(0x9c);
+    headerPending = false;
+  }
+}
+
+void ZlibOutStream::setDictionary(const void* data, int length)
+{
+  flush();
+
+  if (deflateReset(zs) != Z_OK ||
+      deflateSetDictionary(zs, (const Bytef*)data, length) != Z_OK)
+    throw Exception("ZlibOutStream: deflateSetDictionary failed");
+}
+
 void ZlibOutStream::flush()
 {
   zs->next_in = start;
   zs->avail_in = ptr - start;
 
+  if (zs->avail_in != 0)
+    writeHeader();
+
 //    fprintf(stderr,"zos flush: avail_in %d\n",zs->avail_in);
 
   while (zs->avail_in != 0) {
@@ -101,6 +127,8 @@ int ZlibOutStream::overrun(int itemSize, int nItems)
     zs->next_in = start;
     zs->avail_in = ptr - start;
 
+    writeHeader();
+
     do {
       underlying->check(1);
       zs->next_out = underlying->getptr();
@@ -20,6 +20,10 @@
 // ZlibOutStream streams to a compressed data stream (underlying), compressing
 // with zlib on the fly.
 //
+// The zlib header is written by hand and the data deflated raw, so that
+// setDictionary() can be used part way through the stream.  The stream is
+// never finished, so no trailer is needed.
+//
 
 #ifndef __RDR_ZLIBOUTSTREAM_H__
 #define __RDR_ZLIBOUTSTREAM_H__
@@ -41,15 +45,24 @@ namespace rdr {
     void flush();
     int length();
 
+    // setDictionary() flushes and then restarts compression as if the given
+    // data, which must be the end of what has been written to the stream so
+    // far, were all that came before.  Used when other streams have produced
+    // some of the compressed data.
+
+    void setDictionary(const void* data, int length);
+
   private:
 
     int overrun(int itemSize, int nItems);
+    void writeHeader();
 
     OutStream* underlying;
     int bufSize;
     int offset;
     z_stream_s* zs;
     U8* start;
+    bool headerPending;
   };
 
 } // end of namespace rdr
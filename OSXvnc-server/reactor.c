@@ -0,0 +1,568 @@
+/*
+ * reactor.c - event driven client handling.
+ *
+ * By default every client gets an input thread and an output thread.  With
+ * -reactor one thread waits on all the client sockets at once (epoll, or
+ * kqueue on OS X) and a small pool of service threads does the work:
+ *
+ *   - an input job when a socket is readable, which reads what has come in
+ *     and handles every message that has arrived whole,
+ *   - an output job when an update may be due or a backed up socket can take
+ *     more, which sends one update if pacing says it's time.
+ *
+ * A client never has two input jobs or two output jobs going at once, so the
+ * per-client state is used just as it is by the two threads.  The sockets
+ * don't block.  Input is kept in the client's input buffer until a whole
+ * message is there (see rfbClientMessageLength), so a client that sends half
+ * a message ties up no thread while it takes its time over the rest.
+ * Whatever the socket won't take is kept back (see WriteQueued in sockets.c)
+ * and the client gets no new update until it has gone.
+ *
+ * Held updates are timers rather than sleeping threads, and a client whose
+ * socket has closed is let go of by the reactor thread once its jobs are
+ * done.
+ */
+
+/*
+ *  OSXvnc Copyright (C) 2002-2004 Redstone Software osxvnc@redstonesoftware.com
+ *  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#if defined(__APPLE__) || defined(__FreeBSD__)
+#define USE_KQUEUE
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#else
+#include <sys/epoll.h>
+#endif
+
+#include "rfb.h"
+
+Bool rfbUseReactor = FALSE;
+int rfbReactorThreads = 4;          /* service threads for input and output jobs */
+
+#define REACTOR_MAX_THREADS 32
+#define REACTOR_MAX_EVENTS 64
+
+/* reactorFlags */
+#define INPUT_QUEUED    0x01
+#define INPUT_RUNNING   0x02
+#define OUTPUT_QUEUED   0x04
+#define OUTPUT_RUNNING  0x08
+#define OUTPUT_AGAIN    0x10        /* woken while the output job was running */
+#define WANT_WRITE      0x20        /* output is waiting for the socket */
+#define CLIENT_GONE     0x40        /* being let go of, ignore it */
+
+#define JOB_FLAGS (INPUT_QUEUED | INPUT_RUNNING | OUTPUT_QUEUED | OUTPUT_RUNNING)
+
+typedef struct {
+    rfbClientPtr cl;                /* NULL for the wakeup pipe */
+    Bool readable, writable;
+} reactorEvent;
+
+static pthread_mutex_t reactorMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t serviceCond = PTHREAD_COND_INITIALIZER;
+
+static rfbClientPtr reactorClients = NULL;              /* linked by reactorNext */
+static rfbClientPtr inputHead = NULL, inputTail = NULL; /* by reactorNextInput */
+static rfbClientPtr outputHead = NULL, outputTail = NULL; /* by reactorNextOutput */
+static rfbClientPtr goneClients = NULL;                 /* by reactorNextInput */
+
+static int pollFd = -1;
+static int wakePipe[2] = { -1, -1 };
+static pthread_t reactorThread;
+static pthread_t serviceThread[REACTOR_MAX_THREADS];
+static int serviceThreads = 0;
+static Bool reactorRunning = FALSE;
+
+
+/*
+ * The parts that differ between epoll and kqueue.  Interest is one-shot in
+ * both, so an event is only reported once until Watch asks again.
+ */
+
+#ifdef USE_KQUEUE
+
+static Bool PollInit(void) {
+    struct kevent change;
+
+    if ((pollFd = kqueue()) < 0)
+        return FALSE;
+    EV_SET(&change, wakePipe[0], EVFILT_READ, EV_ADD, 0, 0, NULL);
+    return kevent(pollFd, &change, 1, NULL, 0, NULL) == 0;
+}
+
+static void PollWatch(int fd, rfbClientPtr cl, Bool read, Bool write, Bool add) {
+    struct kevent changes[2];
+    int n = 0;
+
+    if (read)
+        EV_SET(&changes[n++], fd, EVFILT_READ, EV_ADD | EV_ONESHOT, 0, 0, cl);
+    if (write)
+        EV_SET(&changes[n++], fd, EVFILT_WRITE, EV_ADD | EV_ONESHOT, 0, 0, cl);
+    if (n)
+        kevent(pollFd, changes, n, NULL, 0, NULL);
+}
+
+static void PollForget(int fd) {
+    /* Closing the descriptor drops its events */
+}
+
+static int PollWait(reactorEvent *events, int timeout) {
+    struct kevent kevents[REACTOR_MAX_EVENTS];
+    struct timespec ts, *tsp = NULL;
+    int i, n;
+
+    if (timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000;
+        tsp = &ts;
+    }
+    n = kevent(pollFd, NULL, 0, kevents, REACTOR_MAX_EVENTS, tsp);
+    for (i = 0; i < n; i++) {
+        events[i].cl = (rfbClientPtr)kevents[i].udata;
+        events[i].readable = (kevents[i].filter == EVFILT_READ);
+        events[i].writable = (kevents[i].filter == EVFILT_WRITE);
+    }
+    return n;
+}
+
+#else
+
+static Bool PollInit(void) {
+    struct epoll_event ev;
+
+    if ((pollFd = epoll_create(REACTOR_MAX_EVENTS)) < 0)
+        return FALSE;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    return epoll_ctl(pollFd, EPOLL_CTL_ADD, wakePipe[0], &ev) == 0;
+}
+
+static void PollWatch(int fd, rfbClientPtr cl, Bool read, Bool write, Bool add) {
+    struct epoll_event ev;
+
+    ev.events = EPOLLONESHOT | (read ? EPOLLIN : 0) | (write ? EPOLLOUT : 0);
+    ev.data.ptr = cl;
+    epoll_ctl(pollFd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev);
+}
+
+static void PollForget(int fd) {
+    struct epoll_event ev;
+
+    epoll_ctl(pollFd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+static int PollWait(reactorEvent *events, int timeout) {
+    struct epoll_event eevents[REACTOR_MAX_EVENTS];
+    int i, n;
+
+    n = epoll_wait(pollFd, eevents, REACTOR_MAX_EVENTS, timeout);
+    for (i = 0; i < n; i++) {
+        events[i].cl = (rfbClientPtr)eevents[i].data.ptr;
+        events[i].readable = (eevents[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0;
+        events[i].writable = (eevents[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) != 0;
+    }
+    return n;
+}
+
+#endif
+
+
+/*
+ * The rest is called with reactorMutex held unless it says otherwise.
+ */
+
+static void Poke(void) {
+    char c = 0;
+
+    write(wakePipe[1], &c, 1);
+}
+
+/* Ask for whichever events the client is waiting on */
+
+static void Watch(rfbClientPtr cl) {
+    Bool read, write;
+
+    if (cl->reactorFlags & CLIENT_GONE)
+        return;
+    read = !(cl->reactorFlags & (INPUT_QUEUED | INPUT_RUNNING)) && cl->sock != -1;
+    write = (cl->reactorFlags & WANT_WRITE) != 0;
+    PollWatch(cl->reactorFd, cl, read, write, FALSE);
+}
+
+static void QueueInput(rfbClientPtr cl) {
+    cl->reactorFlags |= INPUT_QUEUED;
+    cl->reactorNextInput = NULL;
+    if (inputTail)
+        inputTail->reactorNextInput = cl;
+    else
+        inputHead = cl;
+    inputTail = cl;
+    pthread_cond_signal(&serviceCond);
+}
+
+static void QueueOutput(rfbClientPtr cl) {
+    if (cl->reactorFlags & CLIENT_GONE)
+        return;
+    if (cl->reactorFlags & OUTPUT_RUNNING) {
+        cl->reactorFlags |= OUTPUT_AGAIN;
+        return;
+    }
+    if (cl->reactorFlags & OUTPUT_QUEUED)
+        return;
+
+    cl->reactorFlags |= OUTPUT_QUEUED;
+    cl->reactorNextOutput = NULL;
+    if (outputTail)
+        outputTail->reactorNextOutput = cl;
+    else
+        outputHead = cl;
+    outputTail = cl;
+    pthread_cond_signal(&serviceCond);
+}
+
+/* Once the socket has closed and no job has the client, hand it back */
+
+static void CheckGone(rfbClientPtr cl) {
+    if (cl->sock != -1 || (cl->reactorFlags & (JOB_FLAGS | CLIENT_GONE)))
+        return;
+
+    cl->reactorFlags |= CLIENT_GONE;
+    cl->reactorNextInput = goneClients;
+    goneClients = cl;
+    Poke();
+}
+
+/* Called without reactorMutex, on the reactor thread */
+
+static void ReleaseClient(rfbClientPtr cl) {
+    rfbClientPtr *prev;
+
+    pthread_mutex_lock(&reactorMutex);
+    for (prev = &reactorClients; *prev; prev = &(*prev)->reactorNext) {
+        if (*prev == cl) {
+            *prev = cl->reactorNext;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&reactorMutex);
+
+    if (cl->reactorFd != -1) {
+        PollForget(cl->reactorFd);
+        close(cl->reactorFd);
+    }
+    rfbClientConnectionGone(cl);
+}
+
+/* Queue output for held updates that are now due.  Returns the time in ms
+   until the next one, or -1 if there isn't one. */
+
+static int RunTimers(void) {
+    rfbPaceTime now = rfbPacingNow(), next = 0;
+    rfbClientPtr cl;
+
+    for (cl = reactorClients; cl; cl = cl->reactorNext) {
+        if (!cl->reactorTimer)
+            continue;
+        if (cl->reactorTimer <= now) {
+            cl->reactorTimer = 0;
+            QueueOutput(cl);
+        } else if (!next || cl->reactorTimer < next) {
+            next = cl->reactorTimer;
+        }
+    }
+
+    if (!next)
+        return -1;
+    return (int)((next - now + 999) / 1000);
+}
+
+static void HandleEvent(rfbClientPtr cl, Bool readable, Bool writable) {
+    if (cl->reactorFlags & CLIENT_GONE)
+        return;
+
+    if (readable && !(cl->reactorFlags & (INPUT_QUEUED | INPUT_RUNNING)))
+        QueueInput(cl);
+    if (writable && (cl->reactorFlags & WANT_WRITE)) {
+        cl->reactorFlags &= ~WANT_WRITE;
+        QueueOutput(cl);
+    }
+    Watch(cl);
+}
+
+
+/*
+ * The input job: read what has arrived and handle each message that is all
+ * there.  The rest of a message waits in the input buffer for the next time
+ * the socket is readable.  Called without reactorMutex.
+ */
+
+static void InputJob(rfbClientPtr cl) {
+    int n;
+
+    if (cl->sock == -1)
+        return;
+
+    if ((n = rfbReadAvailable(cl)) <= 0) {
+        if (n < 0)
+            rfbLogPerror("reactor: read");
+        rfbCloseClient(cl);
+        return;
+    }
+
+    while (cl->sock != -1 && cl->inputLen > 0 &&
+           rfbClientMessageLength(cl) <= cl->inputLen)
+        rfbClientProcessInput(cl);
+}
+
+
+/*
+ * The output job: finish off anything the socket wouldn't take, then send an
+ * update if one is due.  Returns when to look again for a held update.
+ * Called without reactorMutex.
+ */
+
+static rfbPaceTime OutputJob(rfbClientPtr cl) {
+    int n;
+
+    if (cl->sock == -1)
+        return 0;
+
+    n = rfbFlushPendingOutput(cl);
+    if (n < 0) {
+        rfbLogPerror("reactor: write");
+        rfbCloseClient(cl);
+        return 0;
+    }
+    if (n == 0)
+        return 0;       /* still backed up, we're run again when it drains */
+
+    return rfbClientServiceOutput(cl);
+}
+
+static void *serviceRun(void *ignore) {
+    rfbClientPtr cl;
+    rfbPaceTime timer;
+
+    pthread_mutex_lock(&reactorMutex);
+    while (reactorRunning) {
+        if ((cl = inputHead) != NULL) {
+            /* Input first, it's what makes the session feel responsive */
+            if (!(inputHead = cl->reactorNextInput))
+                inputTail = NULL;
+            cl->reactorFlags = (cl->reactorFlags & ~INPUT_QUEUED) | INPUT_RUNNING;
+            pthread_mutex_unlock(&reactorMutex);
+
+            InputJob(cl);
+
+            pthread_mutex_lock(&reactorMutex);
+            cl->reactorFlags &= ~INPUT_RUNNING;
+            Watch(cl);
+            CheckGone(cl);
+
+        } else if ((cl = outputHead) != NULL) {
+            if (!(outputHead = cl->reactorNextOutput))
+                outputTail = NULL;
+            cl->reactorFlags = (cl->reactorFlags & ~OUTPUT_QUEUED) | OUTPUT_RUNNING;
+            pthread_mutex_unlock(&reactorMutex);
+
+            timer = OutputJob(cl);
+
+            pthread_mutex_lock(&reactorMutex);
+            cl->reactorFlags &= ~OUTPUT_RUNNING;
+            cl->reactorTimer = timer;
+            if (timer)
+                Poke();
+            if (cl->reactorFlags & OUTPUT_AGAIN) {
+                cl->reactorFlags &= ~OUTPUT_AGAIN;
+                QueueOutput(cl);
+            }
+            CheckGone(cl);
+
+        } else {
+            pthread_cond_wait(&serviceCond, &reactorMutex);
+        }
+    }
+    pthread_mutex_unlock(&reactorMutex);
+
+    return NULL;
+}
+
+static void *reactorRun(void *ignore) {
+    reactorEvent events[REACTOR_MAX_EVENTS];
+    rfbClientPtr gone, cl;
+    int timeout, i, n;
+    char drain[64];
+
+    while (1) {
+        pthread_mutex_lock(&reactorMutex);
+        if (!reactorRunning) {
+            pthread_mutex_unlock(&reactorMutex);
+            break;
+        }
+        timeout = RunTimers();
+        gone = goneClients;
+        goneClients = NULL;
+        pthread_mutex_unlock(&reactorMutex);
+
+        while ((cl = gone) != NULL) {
+            gone = cl->reactorNextInput;
+            ReleaseClient(cl);
+        }
+
+        n = PollWait(events, timeout);
+        if (n < 0) {
+            if (errno != EINTR)
+                rfbLogPerror("reactor: wait");
+            continue;
+        }
+
+        pthread_mutex_lock(&reactorMutex);
+        for (i = 0; i < n; i++) {
+            if (events[i].cl)
+                HandleEvent(events[i].cl, events[i].readable, events[i].writable);
+            else
+                while (read(wakePipe[0], drain, sizeof(drain)) > 0)
+                    ;
+        }
+        pthread_mutex_unlock(&reactorMutex);
+    }
+
+    return NULL;
+}
+
+
+/*
+ * rfbReactorStart starts the reactor if -reactor was given.  If it can't,
+ * clients get their own threads as usual.
+ */
+
+void rfbReactorStart(void) {
+    int n = max(1, min(rfbReactorThreads, REACTOR_MAX_THREADS));
+
+    if (!rfbUseReactor || reactorRunning)
+        return;
+
+    if (pipe(wakePipe) < 0 ||
+        fcntl(wakePipe[0], F_SETFL, O_NONBLOCK) < 0 ||
+        fcntl(wakePipe[1], F_SETFL, O_NONBLOCK) < 0 ||
+        !PollInit()) {
+        rfbLogPerror("reactor: setup failed, using a thread per client");
+        rfbUseReactor = FALSE;
+        return;
+    }
+
+    reactorRunning = TRUE;
+    if (pthread_create(&reactorThread, NULL, reactorRun, NULL) != 0) {
+        rfbLogPerror("reactor: pthread_create, using a thread per client");
+        reactorRunning = FALSE;
+        rfbUseReactor = FALSE;
+        return;
+    }
+    for (serviceThreads = 0; serviceThreads < n; serviceThreads++) {
+        if (pthread_create(&serviceThread[serviceThreads], NULL, serviceRun, NULL) != 0) {
+            rfbLogPerror("reactor: pthread_create");
+            break;
+        }
+    }
+    rfbLog("Serving clients with %d reactor threads\n", serviceThreads);
+}
+
+void rfbReactorStop(void) {
+    int i;
+
+    pthread_mutex_lock(&reactorMutex);
+    if (!reactorRunning) {
+        pthread_mutex_unlock(&reactorMutex);
+        return;
+    }
+    reactorRunning = FALSE;
+    pthread_cond_broadcast(&serviceCond);
+    Poke();
+    pthread_mutex_unlock(&reactorMutex);
+
+    pthread_join(reactorThread, NULL);
+    for (i = 0; i < serviceThreads; i++)
+        pthread_join(serviceThread[i], NULL);
+    serviceThreads = 0;
+}
+
+
+/*
+ * rfbReactorAddClient hands a new client to the reactor, in place of
+ * starting its threads.
+ */
+
+void rfbReactorAddClient(rfbClientPtr cl) {
+    pthread_mutex_lock(&reactorMutex);
+    cl->reactorNext = reactorClients;
+    reactorClients = cl;
+
+    if (cl->sock == -1) {
+        /* Didn't make it through rfbNewClient */
+        CheckGone(cl);
+    } else {
+        cl->reactorFd = cl->sock;
+        if (fcntl(cl->sock, F_SETFL, fcntl(cl->sock, F_GETFL) | O_NONBLOCK) < 0)
+            rfbLogPerror("reactor: fcntl O_NONBLOCK");
+        PollWatch(cl->reactorFd, cl, TRUE, FALSE, TRUE);
+    }
+    pthread_mutex_unlock(&reactorMutex);
+}
+
+
+/*
+ * rfbWakeClient is called whenever something may have given a client an
+ * update to send, or has closed it.  It signals the output thread or, with
+ * the reactor, queues an output job.
+ */
+
+void rfbWakeClient(rfbClientPtr cl) {
+    pthread_cond_signal(&cl->updateCond);
+
+    if (cl->reactorFd == -1)
+        return;
+
+    pthread_mutex_lock(&reactorMutex);
+    QueueOutput(cl);
+    pthread_mutex_unlock(&reactorMutex);
+}
+
+
+/*
+ * rfbReactorWantWrite is called from sockets.c when output has been kept
+ * back, so an output job runs once the socket can take more.
+ */
+
+void rfbReactorWantWrite(rfbClientPtr cl) {
+    pthread_mutex_lock(&reactorMutex);
+    if (!(cl->reactorFlags & CLIENT_GONE)) {
+        cl->reactorFlags |= WANT_WRITE;
+        Watch(cl);
+    }
+    pthread_mutex_unlock(&reactorMutex);
+}
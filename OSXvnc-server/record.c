@@ -0,0 +1,722 @@
+/*
+ * record.c - recording a session and replaying it.
+ *
+ * -record writes everything that drives the server to a file as it
+ * happens: the screen's pixels to start with, then each batch of damage
+ * from the framebuffer source together with the pixels under it, and every
+ * message the clients send once they're past the handshake.  Each record
+ * carries the time since the recording started.
+ *
+ * -replay serves such a recording instead of the display.  A replay
+ * thread puts the damaged pixels back into its own framebuffer and reports
+ * the damage through rfbMarkRectsModified, and for each recorded client it
+ * connects to the server over the loopback, does the handshake and sends
+ * the client's messages back.  What the server sends is read and counted.
+ * Everything in between, the damage thread, pacing and the client threads
+ * down to the encoders and socket writes, is the server's own code, so a
+ * slow session can be re-run offline and CPU time and bytes compared across
+ * builds.  Replaying can run at the recorded speed, a multiple of it, or as
+ * fast as possible (-replayspeed 0).
+ *
+ * The file is in the byte order of the machine that made it and is meant
+ * to be replayed on the same kind of machine.  Replayed clients can't send
+ * real input events (-replay implies -disableremoteevents) and need the
+ * server to run with -rfbnoauth.
+ */
+
+/*
+ *  OSXvnc Copyright (C) 2002-2004 Redstone Software osxvnc@redstonesoftware.com
+ *  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "rfb.h"
+
+char *rfbRecordPath = NULL;
+char *rfbReplayPath = NULL;
+double rfbReplaySpeed = 1.0;    /* times the recorded speed, 0 for flat out */
+
+#define RECORD_MAGIC 0x52464252         /* "RFBR" */
+#define RECORD_VERSION 1
+
+enum {
+    RECORD_SCREEN = 1,      /* recordScreen, then every row of the screen */
+    RECORD_DAMAGE,          /* count, count recordBoxes, then their pixels */
+    RECORD_CLIENT_OPEN,     /* client is past the handshake */
+    RECORD_CLIENT_BYTES,    /* bytes read from the client */
+    RECORD_CLIENT_CLOSE
+};
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+} recordFileHeader;
+
+typedef struct {
+    uint64_t time;          /* us since the recording started */
+    uint32_t length;        /* of the data which follows */
+    uint16_t client;        /* for the client records */
+    uint8_t type;
+    uint8_t pad;
+} recordHeader;
+
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    rfbPixelFormat format;
+} recordScreen;
+
+typedef struct {
+    uint16_t x;
+    uint16_t y;
+    uint16_t w;
+    uint16_t h;
+} recordBox;
+
+
+/*
+ * Recording.  Records come from the source's thread, the damage thread and
+ * the client input threads, so writes are under recordMutex.
+ */
+
+static FILE *recordFile = NULL;
+static pthread_mutex_t recordMutex = PTHREAD_MUTEX_INITIALIZER;
+static rfbPaceTime recordStart;
+static int recordNextClient = 1;
+static Bool recording = FALSE;
+
+static void WriteRecordHeader(int type, int client, int length) {
+    recordHeader rec;
+
+    rec.time = rfbPacingNow() - recordStart;
+    rec.length = length;
+    rec.client = client;
+    rec.type = type;
+    rec.pad = 0;
+    fwrite(&rec, sizeof(rec), 1, recordFile);
+}
+
+/* Pixels of a box of the framebuffer, row by row without padding */
+static void WritePixels(char *fb, int x, int y, int w, int h) {
+    int bytesPerPixel = rfbScreen.bitsPerPixel / 8;
+
+    fb += y * rfbScreen.paddedWidthInBytes + x * bytesPerPixel;
+    for (; h > 0; h--) {
+        fwrite(fb, bytesPerPixel, w, recordFile);
+        fb += rfbScreen.paddedWidthInBytes;
+    }
+}
+
+static void WriteScreen(void) {
+    recordScreen screen;
+
+    screen.width = rfbScreen.width;
+    screen.height = rfbScreen.height;
+    screen.format = rfbServerFormat;
+
+    WriteRecordHeader(RECORD_SCREEN, 0, sizeof(screen) +
+                      rfbScreen.width * rfbScreen.height * (rfbScreen.bitsPerPixel / 8));
+    fwrite(&screen, sizeof(screen), 1, recordFile);
+    WritePixels(rfbGetFramebuffer(), 0, 0, rfbScreen.width, rfbScreen.height);
+}
+
+Bool rfbRecordStart(void) {
+    recordFileHeader hdr;
+
+    if (!rfbRecordPath)
+        return TRUE;
+
+    if (!(recordFile = fopen(rfbRecordPath, "wb"))) {
+        rfbLogPerror(rfbRecordPath);
+        return FALSE;
+    }
+    setvbuf(recordFile, NULL, _IOFBF, 1024 * 1024);
+
+    hdr.magic = RECORD_MAGIC;
+    hdr.version = RECORD_VERSION;
+    fwrite(&hdr, sizeof(hdr), 1, recordFile);
+
+    recordStart = rfbPacingNow();
+    WriteScreen();
+    recording = TRUE;
+
+    rfbLog("Recording to %s\n", rfbRecordPath);
+    return TRUE;
+}
+
+void rfbRecordStop(void) {
+    pthread_mutex_lock(&recordMutex);
+    if (recordFile) {
+        recording = FALSE;
+        if (fclose(recordFile) != 0)
+            rfbLogPerror("record: fclose");
+        recordFile = NULL;
+    }
+    pthread_mutex_unlock(&recordMutex);
+}
+
+
+/*
+ * rfbRecordScreen is called after the screen has been set up again, e.g.
+ * for a change of resolution.
+ */
+
+void rfbRecordScreen(void) {
+    if (!recording)
+        return;
+
+    pthread_mutex_lock(&recordMutex);
+    if (recordFile)
+        WriteScreen();
+    pthread_mutex_unlock(&recordMutex);
+}
+
+
+/*
+ * rfbRecordDamage is called with each region a source reports, before it
+ * is queued, while the pixels under it are still the ones it was for.
+ */
+
+void rfbRecordDamage(RegionPtr region) {
+    RegionRec clipped;
+    BoxRec screenBox;
+    BoxPtr pScreenBox = &screenBox;
+    BoxPtr rects;
+    recordBox box;
+    uint32_t count;
+    int length, i;
+    char *fb;
+
+    if (!recording)
+        return;
+
+    /* Sources may report damage hanging off the edge of the screen */
+    screenBox.x1 = screenBox.y1 = 0;
+    screenBox.x2 = rfbScreen.width;
+    screenBox.y2 = rfbScreen.height;
+    REGION_INIT(&hackScreen, &clipped, pScreenBox, 0);
+    REGION_INTERSECT(&hackScreen, &clipped, &clipped, region);
+    count = REGION_NUM_RECTS(&clipped);
+    rects = REGION_RECTS(&clipped);
+
+    length = sizeof(uint32_t);
+    for (i = 0; i < count; i++) {
+        length += sizeof(recordBox) + (rects[i].x2 - rects[i].x1) *
+                  (rects[i].y2 - rects[i].y1) * (rfbScreen.bitsPerPixel / 8);
+    }
+
+    pthread_mutex_lock(&recordMutex);
+    if (recordFile && count) {
+        fb = rfbGetFramebuffer();
+        WriteRecordHeader(RECORD_DAMAGE, 0, length);
+        fwrite(&count, sizeof(count), 1, recordFile);
+        for (i = 0; i < count; i++) {
+            box.x = rects[i].x1;
+            box.y = rects[i].y1;
+            box.w = rects[i].x2 - rects[i].x1;
+            box.h = rects[i].y2 - rects[i].y1;
+            fwrite(&box, sizeof(box), 1, recordFile);
+        }
+        for (i = 0; i < count; i++) {
+            WritePixels(fb, rects[i].x1, rects[i].y1,
+                        rects[i].x2 - rects[i].x1, rects[i].y2 - rects[i].y1);
+        }
+    }
+    pthread_mutex_unlock(&recordMutex);
+
+    REGION_UNINIT(&hackScreen, &clipped);
+}
+
+
+/*
+ * The client records.  A client is only recorded from when it has finished
+ * the handshake; replaying does its own.
+ */
+
+void rfbRecordClientOpen(rfbClientPtr cl) {
+    if (!recording)
+        return;
+
+    pthread_mutex_lock(&recordMutex);
+    if (recordFile) {
+        cl->recordId = recordNextClient++;
+        WriteRecordHeader(RECORD_CLIENT_OPEN, cl->recordId, 0);
+    }
+    pthread_mutex_unlock(&recordMutex);
+}
+
+void rfbRecordClientBytes(rfbClientPtr cl, char *buf, int len) {
+    pthread_mutex_lock(&recordMutex);
+    if (recordFile) {
+        WriteRecordHeader(RECORD_CLIENT_BYTES, cl->recordId, len);
+        fwrite(buf, 1, len, recordFile);
+    }
+    pthread_mutex_unlock(&recordMutex);
+}
+
+void rfbRecordClientClose(rfbClientPtr cl) {
+    if (!cl->recordId)
+        return;
+
+    pthread_mutex_lock(&recordMutex);
+    if (recordFile)
+        WriteRecordHeader(RECORD_CLIENT_CLOSE, cl->recordId, 0);
+    pthread_mutex_unlock(&recordMutex);
+    cl->recordId = 0;
+}
+
+
+/*
+ * Replaying.  The framebuffer source only hands out the replay's pixels;
+ * the replay thread, started once the listener is up, does the rest.
+ */
+
+typedef struct replayViewer {
+    int id;                 /* the recorded client's */
+    int sock;
+    pthread_t drainThread;
+    unsigned long long bytes;
+    struct replayViewer *next;
+} replayViewer;
+
+static FILE *replayFile = NULL;
+static char *replayFB = NULL;
+static int replayWidth = 0, replayHeight = 0, replayBitsPerPixel = 0;
+static char *replayBuf = NULL;
+static unsigned int replayBufSize = 0;
+static replayViewer *replayViewers = NULL;
+static pthread_t replayThread;
+static Bool replayRunning = FALSE;
+static Bool replayStopped = FALSE;
+
+static Bool ReadRecord(recordHeader *rec) {
+    if (fread(rec, sizeof(*rec), 1, replayFile) != 1)
+        return FALSE;
+
+    if (rec->length > replayBufSize) {
+        char *buf = (char *)xrealloc(replayBuf, rec->length);
+
+        if (!buf) {
+            rfbLog("replay: out of memory for a %u byte record\n", rec->length);
+            return FALSE;
+        }
+        replayBuf = buf;
+        replayBufSize = rec->length;
+    }
+    if (rec->length && fread(replayBuf, 1, rec->length, replayFile) != rec->length) {
+        rfbLog("replay: %s is cut short\n", rfbReplayPath);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Copy packed rows from the recording into the framebuffer */
+static char *ReadPixels(char *pixels, int x, int y, int w, int h) {
+    int bytesPerPixel = replayBitsPerPixel / 8;
+    int bytesPerRow = replayWidth * bytesPerPixel;
+    char *fb = replayFB + y * bytesPerRow + x * bytesPerPixel;
+
+    for (; h > 0; h--) {
+        memcpy(fb, pixels, w * bytesPerPixel);
+        fb += bytesPerRow;
+        pixels += w * bytesPerPixel;
+    }
+    return pixels;
+}
+
+static Bool ReadScreen(recordHeader *rec) {
+    recordScreen *screen = (recordScreen *)replayBuf;
+    int bytesPerPixel;
+
+    if (rec->length < sizeof(recordScreen))
+        return FALSE;
+    bytesPerPixel = screen->format.bitsPerPixel / 8;
+    if ((bytesPerPixel != 1 && bytesPerPixel != 2 && bytesPerPixel != 4) ||
+        rec->length != sizeof(recordScreen) + (unsigned long long)screen->width * screen->height * bytesPerPixel) {
+        rfbLog("replay: bad screen record\n");
+        return FALSE;
+    }
+
+    if (!replayFB) {
+        replayFB = (char *)xalloc(screen->width * screen->height * bytesPerPixel);
+        if (!replayFB) {
+            rfbLog("replay: unable to allocate framebuffer\n");
+            return FALSE;
+        }
+        replayWidth = screen->width;
+        replayHeight = screen->height;
+        replayBitsPerPixel = screen->format.bitsPerPixel;
+        rfbServerFormat = screen->format;
+    } else if (screen->width != replayWidth || screen->height != replayHeight ||
+               screen->format.bitsPerPixel != replayBitsPerPixel) {
+        rfbLog("replay: the screen changed to %dx%d, which replaying can't follow\n",
+               screen->width, screen->height);
+        return FALSE;
+    }
+
+    ReadPixels(replayBuf + sizeof(recordScreen), 0, 0, replayWidth, replayHeight);
+    return TRUE;
+}
+
+static Bool ReadDamage(recordHeader *rec, BoxPtr *boxes, int *count) {
+    recordBox *box = (recordBox *)(replayBuf + sizeof(uint32_t));
+    unsigned long long length;
+    char *pixels;
+    int n, i;
+
+    if (rec->length < sizeof(uint32_t)) {
+        rfbLog("replay: bad damage record\n");
+        return FALSE;
+    }
+    n = *(uint32_t *)replayBuf;
+    pixels = (char *)(box + n);
+    length = sizeof(uint32_t) + n * (unsigned long long)sizeof(recordBox);
+
+    for (i = 0; i < n && length <= rec->length; i++) {
+        length += box[i].w * box[i].h * (replayBitsPerPixel / 8);
+        if (box[i].x + box[i].w > replayWidth || box[i].y + box[i].h > replayHeight)
+            break;
+    }
+    if (i < n || length != rec->length) {
+        rfbLog("replay: bad damage record\n");
+        return FALSE;
+    }
+
+    *boxes = (BoxPtr)xalloc(max(n, 1) * sizeof(BoxRec));
+    if (!*boxes)
+        return FALSE;
+    for (i = 0; i < n; i++) {
+        pixels = ReadPixels(pixels, box[i].x, box[i].y, box[i].w, box[i].h);
+        (*boxes)[i].x1 = box[i].x;
+        (*boxes)[i].y1 = box[i].y;
+        (*boxes)[i].x2 = box[i].x + box[i].w;
+        (*boxes)[i].y2 = box[i].y + box[i].h;
+    }
+    *count = n;
+    return TRUE;
+}
+
+static Bool replayInit(void) {
+    recordFileHeader hdr;
+    recordHeader rec;
+
+    /* Only the first time, the screen never changes under the server */
+    if (replayFile)
+        return TRUE;
+
+    if (!(replayFile = fopen(rfbReplayPath, "rb"))) {
+        rfbLogPerror(rfbReplayPath);
+        return FALSE;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, replayFile) != 1 ||
+        hdr.magic != RECORD_MAGIC || hdr.version != RECORD_VERSION) {
+        rfbLog("replay: %s is not a version %d recording from this kind of machine\n",
+               rfbReplayPath, RECORD_VERSION);
+        return FALSE;
+    }
+    if (!ReadRecord(&rec) || rec.type != RECORD_SCREEN || !ReadScreen(&rec))
+        return FALSE;
+
+    rfbScreen.width = replayWidth;
+    rfbScreen.height = replayHeight;
+    rfbScreen.bitsPerPixel = replayBitsPerPixel;
+    rfbScreen.depth = rfbServerFormat.depth;
+    rfbScreen.paddedWidthInBytes = replayWidth * (replayBitsPerPixel / 8);
+    rfbScreen.sizeInBytes = rfbScreen.paddedWidthInBytes * replayHeight;
+
+    rfbLog("Replaying %s, %dx%d\n", rfbReplayPath, replayWidth, replayHeight);
+    return TRUE;
+}
+
+static char *replayGetFramebuffer(void) {
+    return replayFB;
+}
+
+static void replayGetGeometry(int *width, int *height, int *bitsPerPixel) {
+    *width = replayWidth;
+    *height = replayHeight;
+    *bitsPerPixel = replayBitsPerPixel;
+}
+
+static Bool replayStart(void) {
+    return TRUE;
+}
+
+static void replayStop(void) {
+}
+
+rfbFramebufferSource rfbReplaySource = {
+    "replay",
+    replayInit,
+    replayGetFramebuffer,
+    replayGetGeometry,
+    replayStart,
+    replayStop
+};
+
+
+/*
+ * The replayed viewers.  Each is a loopback connection which does a
+ * protocol 3.3 handshake, then sends what the recorded client sent while a
+ * drain thread reads and counts what the server sends back.
+ */
+
+static Bool ReadAll(int sock, char *buf, int len) {
+    int n;
+
+    while (len > 0) {
+        if ((n = read(sock, buf, len)) <= 0)
+            return FALSE;
+        buf += n;
+        len -= n;
+    }
+    return TRUE;
+}
+
+static Bool WriteAll(int sock, char *buf, int len) {
+    int n;
+
+    while (len > 0) {
+        if ((n = write(sock, buf, len)) <= 0)
+            return FALSE;
+        buf += n;
+        len -= n;
+    }
+    return TRUE;
+}
+
+static Bool ViewerHandshake(int sock) {
+    rfbProtocolVersionMsg pv;
+    rfbClientInitMsg ci;
+    char si[sz_rfbServerInitMsg], name[256];
+    CARD32 scheme, nameLength;
+
+    if (!ReadAll(sock, pv, sz_rfbProtocolVersionMsg))
+        return FALSE;
+    sprintf(pv, rfbProtocolVersionFormat, 3, 3);
+    if (!WriteAll(sock, pv, sz_rfbProtocolVersionMsg))
+        return FALSE;
+
+    if (!ReadAll(sock, (char *)&scheme, 4))
+        return FALSE;
+    if (Swap32IfLE(scheme) != rfbNoAuth) {
+        rfbLog("replay: the server wants a password, replay with -rfbnoauth\n");
+        return FALSE;
+    }
+
+    ci.shared = 1;
+    if (!WriteAll(sock, (char *)&ci, sz_rfbClientInitMsg) ||
+        !ReadAll(sock, si, sz_rfbServerInitMsg))
+        return FALSE;
+
+    nameLength = Swap32IfLE(((rfbServerInitMsg *)si)->nameLength);
+    while (nameLength > 0) {
+        int n = min(nameLength, sizeof(name));
+
+        if (!ReadAll(sock, name, n))
+            return FALSE;
+        nameLength -= n;
+    }
+    return TRUE;
+}
+
+static void *drainRun(void *arg) {
+    replayViewer *viewer = (replayViewer *)arg;
+    char buf[65536];
+    int n;
+
+    while ((n = read(viewer->sock, buf, sizeof(buf))) > 0)
+        viewer->bytes += n;
+    return NULL;
+}
+
+static replayViewer *FindViewer(int id) {
+    replayViewer *viewer;
+
+    for (viewer = replayViewers; viewer; viewer = viewer->next) {
+        if (viewer->id == id)
+            return viewer;
+    }
+    return NULL;
+}
+
+static void OpenViewer(int id) {
+    replayViewer *viewer;
+    struct sockaddr_in addr;
+    int sock, one = 1;
+
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        rfbLogPerror("replay: socket");
+        return;
+    }
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void *)&one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(rfbPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        rfbLogPerror("replay: connect");
+        close(sock);
+        return;
+    }
+    if (!ViewerHandshake(sock)) {
+        rfbLog("replay: handshake for client %d failed\n", id);
+        close(sock);
+        return;
+    }
+
+    viewer = (replayViewer *)xalloc(sizeof(replayViewer));
+    if (!viewer) {
+        close(sock);
+        return;
+    }
+    viewer->id = id;
+    viewer->sock = sock;
+    viewer->bytes = 0;
+    if (pthread_create(&viewer->drainThread, NULL, drainRun, viewer) != 0) {
+        rfbLogPerror("replay: pthread_create");
+        close(sock);
+        xfree(viewer);
+        return;
+    }
+    viewer->next = replayViewers;
+    replayViewers = viewer;
+}
+
+/* Stop sending and wait for the server to finish with the client.  Returns
+   everything the client received, counted once its drain thread is done. */
+static unsigned long long CloseViewer(replayViewer *viewer) {
+    replayViewer **prev;
+    unsigned long long bytes;
+
+    shutdown(viewer->sock, SHUT_WR);
+    pthread_join(viewer->drainThread, NULL);
+    close(viewer->sock);
+
+    bytes = viewer->bytes;
+    rfbLog("replay: client %d received %llu bytes\n", viewer->id, bytes);
+
+    for (prev = &replayViewers; *prev != viewer; prev = &(*prev)->next)
+        ;
+    *prev = viewer->next;
+    xfree(viewer);
+    return bytes;
+}
+
+
+static void *replayRun(void *ignore) {
+    recordHeader rec;
+    replayViewer *viewer;
+    rfbPaceTime start = rfbPacingNow(), due, now;
+    struct rusage usage;
+    unsigned long long total = 0;
+    int clients = 0, count;
+    BoxPtr boxes;
+    BoxRec screenBox;
+    Bool ok = TRUE;
+
+    while (ok && !replayStopped && ReadRecord(&rec)) {
+        if (rfbReplaySpeed > 0) {
+            due = start + (rfbPaceTime)(rec.time / rfbReplaySpeed);
+            if ((now = rfbPacingNow()) < due)
+                usleep(due - now);
+        }
+
+        switch (rec.type) {
+            case RECORD_SCREEN:
+                if (!(ok = ReadScreen(&rec)))
+                    break;
+                screenBox.x1 = screenBox.y1 = 0;
+                screenBox.x2 = replayWidth;
+                screenBox.y2 = replayHeight;
+                rfbMarkRectsModified(&screenBox, 1);
+                break;
+            case RECORD_DAMAGE:
+                if (!(ok = ReadDamage(&rec, &boxes, &count)))
+                    break;
+                rfbMarkRectsModified(boxes, count);
+                xfree(boxes);
+                break;
+            case RECORD_CLIENT_OPEN:
+                OpenViewer(rec.client);
+                clients++;
+                break;
+            case RECORD_CLIENT_BYTES:
+                if ((viewer = FindViewer(rec.client)) && !WriteAll(viewer->sock, replayBuf, rec.length)) {
+                    rfbLog("replay: server closed client %d early\n", rec.client);
+                    total += CloseViewer(viewer);
+                }
+                break;
+            case RECORD_CLIENT_CLOSE:
+                if ((viewer = FindViewer(rec.client))) {
+                    total += CloseViewer(viewer);
+                }
+                break;
+        }
+    }
+
+    while (replayViewers)
+        total += CloseViewer(replayViewers);
+
+    getrusage(RUSAGE_SELF, &usage);
+    rfbLog("Replay finished in %.2fs, %d clients got %llu bytes, CPU user %.2fs system %.2fs\n",
+           (rfbPacingNow() - start) / 1000000.0, clients, total,
+           usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1000000.0,
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1000000.0);
+
+    /* Shut down the way a kill would, so the run can be scripted */
+    if (!replayStopped)
+        kill(getpid(), SIGTERM);
+    return NULL;
+}
+
+void rfbReplayStart(void) {
+    if (!rfbReplayPath || replayRunning)
+        return;
+
+    replayRunning = TRUE;
+    if (pthread_create(&replayThread, NULL, replayRun, NULL) != 0) {
+        rfbLogPerror("replay: pthread_create");
+        replayRunning = FALSE;
+    }
+}
+
+
+/*
+ * rfbReplayStop is called on shutdown, possibly from a signal the replay
+ * thread sent itself, so it only asks the thread to stop.
+ */
+
+void rfbReplayStop(void) {
+    replayStopped = TRUE;
+}
@@ -33,7 +33,11 @@
 #include <rfbproto.h>
 #include <vncauth.h>
 #include <zlib.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
 #include "tight.h"
+#include "tileanalysis.h"
+#include "subrect.h"
 
 //#include "Keyboards.h"
 //#import <Carbon/Carbon.h>
@@ -65,6 +69,7 @@ typedef struct CGRect CGRect;
 #endif
 
 #define MAX_ENCODINGS 17
+#define STATS_HIST_BUCKETS 21       /* powers of two from 1us, the last open ended */
 #define RH_MAX_DISPLAYS	5		// RoboHippo: Max number of displays supported
 
 /*
@@ -83,6 +88,29 @@ typedef struct
 } rfbScreenInfo, *rfbScreenInfoPtr;
 
 
+/*
+ * A framebuffer source is where the pixels come from.  init() fills in
+ * rfbScreen and rfbServerFormat, getFramebuffer() returns the base address
+ * of the pixels, getGeometry() reports the size and depth the source would
+ * have if re-initialised (so we can spot resolution changes), and start() /
+ * stop() begin and end the damage feed into rfbMarkRectsModified().
+ */
+
+typedef struct rfbFramebufferSource {
+    char *name;
+    Bool (*init)(void);
+    char *(*getFramebuffer)(void);
+    void (*getGeometry)(int *width, int *height, int *bitsPerPixel);
+    Bool (*start)(void);
+    void (*stop)(void);
+} rfbFramebufferSource;
+
+
+/* Timestamps and durations used for update pacing, in microseconds */
+
+typedef unsigned long long rfbPaceTime;
+
+
 /*
  * rfbTranslateFnType is the type of translation functions.
  */
@@ -110,6 +138,8 @@ enum client_state {
 	RFB_NORMAL              /* normal protocol messages */
 } ;
 
+typedef struct rfbScaledScreen rfbScaledScreen;
+
 typedef struct rfbClientRec {
 
     int sock;
@@ -117,6 +147,10 @@ typedef struct rfbClientRec {
     // Version
     int major, minor;
 
+    /* outputMutex is held while an update is encoded and written, and by
+       anything that changes the encoding, pixel format or scaling state the
+       encoders use.  When both are needed take it before updateMutex. */
+
     pthread_mutex_t outputMutex;
 
                                 /* Possible client states: */
@@ -125,6 +159,7 @@ typedef struct rfbClientRec {
     int correMaxWidth, correMaxHeight;
     void* zrleData;
     void* mosData;
+    void* zrleParallelData;     /* see zrle.cc */
 
     /* The following member is only used during VNC authentication */
 
@@ -139,9 +174,12 @@ typedef struct rfbClientRec {
        supported, because there's no way I can get the OS to tell me
        something has been copied.
 
-       updateMutex should be held, and updateCond signalled, whenever
+       updateMutex should be held, and rfbWakeClient called, whenever
        either modifiedRegion or requestedRegion is changed (as either
-       of these may trigger sending an update out to the client). */
+       of these may trigger sending an update out to the client).  The
+       output thread only holds it to take and clear its snapshot of the
+       two regions, never while encoding or writing, so the damage thread
+       is never held up by a slow client. */
 
     pthread_mutex_t updateMutex;
     pthread_cond_t updateCond;
@@ -165,30 +203,113 @@ typedef struct rfbClientRec {
     rfbPixelFormat format;
 
     /* SERVER SCALING EXTENSIONS */
-    int	  scalingFactor;
+    double scalingFactor;
     char* scalingFrameBuffer;
     int   scalingPaddedWidthInBytes;
-
-    /* statistics */
-
-    int rfbBytesSent[MAX_ENCODINGS];
-    int rfbRectanglesSent[MAX_ENCODINGS];
-    int rfbLastRectMarkersSent;
-    int rfbLastRectBytesSent;
-    int rfbFramebufferUpdateMessagesSent;
-    int rfbRawBytesEquivalent;
-    int rfbKeyEventsRcvd;
-    int rfbPointerEventsRcvd;
+    rfbScaledScreen *scaledScreen;  /* shared with clients at the same ratio, see scale.c */
+
+    /* While a rectangle is being captured for the tile cache the bytes
+       written are collected in tileCaptureBuf.  tileCaptureFrom is where
+       in updateBuf they start, -1 when not capturing.  See tilecache.c. */
+
+    char *tileCaptureBuf;
+    int tileCaptureSize;
+    int tileCaptureLen;
+    int tileCaptureFrom;
+
+    /* parallel encoding, see parallel.c.  Big updates are split into tasks
+       that pool threads encode with their own scratch client records.  A
+       scratch record has encodeTask set, and rfbSendUpdateBuf collects its
+       output there instead of writing it. */
+
+    struct rfbEncodeTask *encodeTasks;
+    int encodeTaskCount;
+    int encodeTaskSize;
+    struct rfbClientRec **encodeScratch;
+    struct rfbEncodeTask *encodeTask;
+
+    /* update pacing, see pacing.c.  Times are in microseconds. */
+
+    rfbPaceTime paceEncodeTime;         /* average time to encode and write an update */
+    rfbPaceTime paceDamageInterval;     /* average time between damage arriving */
+    rfbPaceTime paceLastDamage;
+    rfbPaceTime paceLastUpdate;
+    rfbPaceTime paceLastInput;          /* last key press or button down */
+    rfbPaceTime paceBacklogDamage;      /* paceLastDamage when last held for backlog */
+
+    /* -reactor, see reactor.c.  Input waits in inputBuf until a whole
+       message has arrived; only the input job touches it.  Output the
+       socket won't take yet waits in pendingBuf; writeMutex covers it and
+       the writes themselves. */
+
+    int reactorFd;                      /* -1 unless the reactor is watching */
+    int reactorFlags;
+    rfbPaceTime reactorReady;           /* when the held update became ready */
+    rfbPaceTime reactorTimer;           /* when to look at it again, 0 for never */
+    struct rfbClientRec *reactorNext;
+    struct rfbClientRec *reactorNextInput;
+    struct rfbClientRec *reactorNextOutput;
+
+    char *inputBuf;
+    int inputStart;
+    int inputLen;
+    int inputSize;
+
+    pthread_mutex_t writeMutex;
+    char *pendingBuf;
+    int pendingStart;
+    int pendingLen;
+    int pendingSize;
+
+    /* link estimate and adaptive encoding, see linkest.c.  The estimate
+       is covered by updateMutex, the choices made from it by outputMutex. */
+
+    CARD32 linkEncodings;               /* bit per encoding the client accepts */
+    int linkClientQualityLevel;         /* -1 if the client didn't ask for JPEG */
+    int linkClass;                      /* -1 for the client's own choices */
+    rfbPaceTime linkSentAt;             /* last update, 0 once its reply is in */
+    int linkSentBytes;
+    unsigned long long linkBytesBefore;
+    rfbPaceTime linkSendTime;
+    unsigned long long linkBandwidth;   /* bytes per second */
+    rfbPaceTime linkRtt;
+    int linkSamples;
+    rfbPaceTime linkLastChange;
+
+    int recordId;                       /* in a -record session, 0 if not recorded */
+
+    /* statistics, see stats.c.  Written by the thread doing the work and
+       read live by the stats socket. */
+
+    unsigned long long rfbBytesSent[MAX_ENCODINGS];
+    unsigned long long rfbRectanglesSent[MAX_ENCODINGS];
+    unsigned long long rfbLastRectMarkersSent;
+    unsigned long long rfbLastRectBytesSent;
+    unsigned long long rfbFramebufferUpdateMessagesSent;
+    unsigned long long rfbRawBytesEquivalent;
+    unsigned long long rfbKeyEventsRcvd;
+    unsigned long long rfbPointerEventsRcvd;
+    unsigned long long rfbZlibBytesIn;  /* through deflate, for all encodings using it */
+    unsigned long long rfbZlibBytesOut;
+    unsigned long long rfbEncodeTimeHist[MAX_ENCODINGS][STATS_HIST_BUCKETS];
+    unsigned long long rfbUpdateLatencyHist[STATS_HIST_BUCKETS];
+    rfbPaceTime statsDamageSince;       /* first damage not yet sent, under updateMutex */
+    unsigned long long rfbFramesDropped;    /* updates merged away while backed up */
+    int rfbSendQueueDepth;              /* unsent bytes when last looked at */
+    int rfbSendQueueMax;
 
   /* zlib encoding -- necessary compression state info per client */
 
     struct z_stream_s compStream;
     Bool compStreamInited;
+    int compStreamLevel;
 
     CARD32 zlibCompressLevel;
 
     struct z_stream_s compStreamRaw;
     struct z_stream_s compStreamHex;
+    int compStreamRawLevel;
+    int compStreamHexLevel;
 
     /*
      * zlibBeforeBuf contains pixel data in the client's format.
@@ -213,6 +334,28 @@ typedef struct rfbClientRec {
 #define zlibAfterBufSize  cl->client_zlibAfterBufSize
 #define zlibAfterBuf      cl->client_zlibAfterBuf
 #define zlibAfterBufLen   cl->client_zlibAfterBufLen
+
+    /* rre and corre encoding -- working buffers, shared by both encoders */
+
+    int client_rreBeforeBufSize;
+    char *client_rreBeforeBuf;
+
+    int client_rreAfterBufSize;
+    char *client_rreAfterBuf;
+    int client_rreAfterBufLen;
+
+#define rreBeforeBufSize cl->client_rreBeforeBufSize
+#define rreBeforeBuf     cl->client_rreBeforeBuf
+
+#define rreAfterBufSize  cl->client_rreAfterBufSize
+#define rreAfterBuf      cl->client_rreAfterBuf
+#define rreAfterBufLen   cl->client_rreAfterBufLen
+
+    /* rre, corre, hextile and zlibhex -- the subrectangle search's
+       bitmasks (see subrect.c) */
+
+    int subrectMasksSize;
+    CARD32 *subrectMasks;
     
     /* tight encoding -- preserve zlib streams' state for each client */
 
@@ -246,7 +389,7 @@ typedef struct rfbClientRec {
 
     int paletteNumColors, paletteMaxColors;
     CARD32 monoBackground, monoForeground;
-    PALETTE palette;
+    rfbTileAnalysis tileAnalysis;
 
     /* tight encoding -- Pointers to dynamically-allocated buffers. */
 
@@ -264,7 +407,16 @@ typedef struct rfbClientRec {
     Bool jpegError;
     int jpegDstDataLen;
 
-    j_compress_ptr cinfo;  /* tight encoding -- GetClient() uses this to map cinfos to client records */
+    /* tight encoding -- big rectangles are being split into tasks for the work pool */
+    Bool tightParallel;
+
+    /* tight encoding -- the solid-area search's index of horizontal runs,
+       and the rectangles it has still to send */
+    int tightRunsSize;
+    CARD16 *tightRuns;
+    int tightRunsX, tightRunsY, tightRunsWidth;
+    int tightPendingSize;
+    struct tightPendingRect *tightPending;
 
     // These defines will "hopefully" allow us to keep the rest of the code looking roughly the same
     // but reference them out of the client record pointer, where they need to be, instead of as globals
@@ -327,15 +479,18 @@ typedef struct rfbClientRec {
     
     /* REDSTONE - These (updateBuf, ublen) need to be in the CL, not global, for multiple clients */
 
-    /*
-     * UPDATE_BUF_SIZE must be big enough to send at least one whole line of the
-     * framebuffer.  So for a max screen width of say 2K with 32-bit pixels this
-     * means 8K minimum.
-     */
-
 #define UPDATE_BUF_SIZE 30000
     char updateBuf[UPDATE_BUF_SIZE];
     int ublen;
+
+    /* Output queued to go out ahead of the rest of updateBuf: the first
+       ubqueued bytes of updateBuf and data passed to rfbQueueUpdateBytes,
+       in order.  rfbSendUpdateBuf writes it all with one writev. */
+
+#define UPDATE_MAX_VECS 64
+    struct iovec updateVec[UPDATE_MAX_VECS];
+    int uvcount;
+    int ubqueued;
     
     struct rfbClientRec *prev;
     struct rfbClientRec *next;
@@ -407,9 +562,11 @@ extern int rfbProtocolMinorVersion;
 
 extern int rfbPort;
 
-extern char *rfbGetFramebuffer();
+extern rfbFramebufferSource rfbCoreGraphicsSource;
 
 extern void rfbStartClientWithFD(int client_fd);
+extern void rfbClientProcessInput(rfbClientPtr cl);
+extern rfbPaceTime rfbClientServiceOutput(rfbClientPtr cl);
 extern void connectReverseClient(char *hostName, int portNum);
 
 extern ScreenRec hackScreen;
@@ -419,6 +576,7 @@ extern char desktopName[256];
 
 extern BOOL littleEndian;
 extern int  rfbMaxBitDepth;
+extern int  rfbDeferUpdateTime;
 extern Bool rfbAlwaysShared;
 extern Bool rfbNeverShared;
 extern Bool rfbDontDisconnect;
@@ -430,19 +588,191 @@ extern Bool rfbDisableRichClipboards;
 
 extern Bool rfbLocalBuffer;
 
-extern void rfbLog(char *format, ...);
-extern void rfbDebugLog(char *format, ...);
-extern void rfbLogPerror(char *str);
+extern void rfbLog(const char *format, ...);
+extern void rfbDebugLog(const char *format, ...);
+extern void rfbLogPerror(const char *str);
 
 extern void rfbShutdown();
 
+/* fbsource.c */
+
+extern rfbFramebufferSource *rfbSource;
+
+extern char *rfbGetFramebuffer(void);
+
+
+/* damage.c */
+
+extern unsigned long rfbDamageBatches;
+extern unsigned long rfbDamageMerges;
+extern unsigned long long rfbDamageLatencyTotal;
+extern unsigned long rfbDamageLatencyMax;
+
+extern void rfbDamageStart(void);
+extern void rfbDamageStop(void);
+extern void rfbMarkRectsModified(BoxPtr boxes, int count);
+extern void rfbMarkRegionModified(RegionPtr region);
+
+
+/* headless.c */
+
+extern int rfbHeadlessWidth;
+extern int rfbHeadlessHeight;
+extern int rfbHeadlessFrameRate;
+extern rfbFramebufferSource rfbHeadlessSource;
+
+extern Bool rfbHeadlessSetWorkload(char *name);
+extern int rfbHeadlessNextFrame(BoxPtr boxes, int maxBoxes);
+extern void rfbHeadlessRestart(void);
+
+
+/* shmsource.c */
+
+extern char *rfbShmFramebufferPath;
+extern int rfbShmPollInterval;
+extern rfbFramebufferSource rfbSharedMemorySource;
+
+
+/* record.c */
+
+extern char *rfbRecordPath;
+extern char *rfbReplayPath;
+extern double rfbReplaySpeed;
+extern rfbFramebufferSource rfbReplaySource;
+
+extern Bool rfbRecordStart(void);
+extern void rfbRecordStop(void);
+extern void rfbRecordScreen(void);
+extern void rfbRecordDamage(RegionPtr region);
+extern void rfbRecordClientOpen(rfbClientPtr cl);
+extern void rfbRecordClientBytes(rfbClientPtr cl, char *buf, int len);
+extern void rfbRecordClientClose(rfbClientPtr cl);
+extern void rfbReplayStart(void);
+extern void rfbReplayStop(void);
+
+
+/* shadow.c */
+
+#define SHADOW_TILE_SIZE 64
+
+typedef unsigned long long rfbTileHash;
+
+extern Bool rfbShadowEnabled;
+extern unsigned long long rfbShadowPixelsReported;
+extern unsigned long long rfbShadowPixelsChanged;
+
+extern rfbTileHash rfbHashPixels(char *ptr, int bytesPerRow, int stride, int h);
+extern void rfbShadowInit(void);
+extern void rfbShadowFilterRegion(RegionPtr region);
+
+
+/* workpool.c */
+
+#define WORKPOOL_MAX_THREADS 16
+
+typedef void (*rfbWorkFn)(void *arg, int task, int worker);
+
+extern int rfbEncodeThreads;
+
+extern void rfbWorkPoolStart(void);
+extern void rfbWorkPoolStop(void);
+extern int rfbWorkPoolThreads(void);
+extern void rfbWorkPoolRun(rfbWorkFn fn, void *arg, int count);
+
+
+/* parallel.c */
+
+typedef struct rfbEncodeTask {
+    int x, y, w, h;
+    int flags;                      /* up to the encoder */
+    char *buf;                      /* encoded output, written in task order */
+    int len;
+    int size;
+    Bool ok;
+
+    /* Tight data left for the client's zlib stream streamId (-1 for none) */
+    int streamId;
+    int zlibLevel, zlibStrategy;
+    char *deferBuf;
+    int deferLen, deferSize;
+    char *zbuf;                     /* ... and what it compressed to */
+    int zlen, zsize;
+} rfbEncodeTask;
+
+extern int rfbParallelEncodePrepare(rfbClientPtr cl, RegionPtr updateRegion);
+extern Bool rfbParallelEncodeSend(rfbClientPtr cl);
+extern rfbEncodeTask *rfbAddEncodeTask(rfbClientPtr cl, int x, int y, int w, int h);
+extern Bool rfbSetupEncodeScratch(rfbClientPtr cl);
+extern void rfbMergeEncodeStats(rfbClientPtr cl);
+extern Bool rfbAppendEncodeTask(rfbClientPtr cl);
+extern Bool rfbAppendEncodeTaskBytes(rfbClientPtr cl, char *data, int len);
+extern void rfbParallelEncodeFree(rfbClientPtr cl);
+
+
+/* tilecache.c */
+
+extern int rfbTileCacheSize;
+extern unsigned long rfbTileCacheHits;
+extern unsigned long rfbTileCacheMisses;
+extern unsigned long rfbTileCacheEvictions;
+
+extern void rfbTileCacheFlush(void);
+extern void rfbTileCacheCapture(rfbClientPtr cl);
+extern void rfbTileCacheCaptureBytes(rfbClientPtr cl, char *data, int len);
+extern Bool rfbTileCacheSend(rfbClientPtr cl, int x, int y, int w, int h,
+                             Bool (*encoder)(rfbClientPtr cl, int x, int y, int w, int h));
+
+
+/* pacing.c */
+
+extern int rfbMaxFrameRate;
+extern int rfbLowLatencyWindow;
+extern int rfbMaxUnsentBytes;
+
+extern rfbPaceTime rfbPacingNow(void);
+extern void rfbPacingCondInit(pthread_cond_t *cond);
+extern void rfbPacingInit(rfbClientPtr cl);
+extern void rfbPacingDamage(rfbClientPtr cl);
+extern void rfbPacingInput(rfbClientPtr cl);
+extern void rfbPacingUpdateSent(rfbClientPtr cl, rfbPaceTime start);
+extern rfbPaceTime rfbPacingDeadline(rfbClientPtr cl, rfbPaceTime ready);
+extern rfbPaceTime rfbPacingBacklog(rfbClientPtr cl);
+extern void rfbPacingWait(rfbClientPtr cl, rfbPaceTime ready);
+
+
+/* linkest.c */
+
+extern Bool rfbAdaptiveEncoding;
+
+extern void rfbLinkInit(rfbClientPtr cl);
+extern void rfbLinkSetEncodings(rfbClientPtr cl);
+extern void rfbLinkRequestArrived(rfbClientPtr cl);
+extern void rfbLinkUpdateSent(rfbClientPtr cl, rfbPaceTime start);
+
+
 /* sockets.c */
 
 extern int rfbMaxClientWait;
 
 extern void rfbCloseClient(rfbClientPtr cl);
 extern int ReadExact(rfbClientPtr cl, char *buf, int len);
+extern int rfbReadAvailable(rfbClientPtr cl);
 extern int WriteExact(rfbClientPtr cl, char *buf, int len);
+extern int WriteExactV(rfbClientPtr cl, struct iovec *iov, int count);
+extern int rfbFlushPendingOutput(rfbClientPtr cl);
+extern int rfbSocketUnsentBytes(rfbClientPtr cl);
+
+
+/* reactor.c */
+
+extern Bool rfbUseReactor;
+extern int rfbReactorThreads;
+
+extern void rfbReactorStart(void);
+extern void rfbReactorStop(void);
+extern void rfbReactorAddClient(rfbClientPtr cl);
+extern void rfbReactorWantWrite(rfbClientPtr cl);
+extern void rfbWakeClient(rfbClientPtr cl);
 
 /* cutpaste.c */
 
@@ -480,13 +810,11 @@ extern void keyboardReleaseKeysForClient(rfbClientPtr cl);
 
 extern rfbClientPtr pointerClient;
 
-extern rfbClientPtr rfbClientHead;  /* tight encoding -- GetClient() in tight.c accesses this list, so make it global */
+extern rfbClientPtr rfbClientHead;
 
 extern void rfbProcessClientProtocolVersion(rfbClientPtr cl);
 extern void rfbProcessClientNormalMessage(rfbClientPtr cl);
 extern void rfbProcessClientInitMessage(rfbClientPtr cl);
-extern Bool rfbSendScreenUpdateEncoding(rfbClientPtr cl);
-extern Bool rfbSendLastRectMarker(rfbClientPtr cl);
 
 
 /* Routines to iterate over the client list in a thread-safe way.
@@ -504,18 +832,41 @@ extern rfbClientPtr rfbNewClient(int sock);
 extern rfbClientPtr rfbReverseConnection(char *host, int port);
 extern void rfbClientConnectionGone(rfbClientPtr cl);
 extern void rfbProcessClientMessage(rfbClientPtr cl);
+extern int rfbClientMessageLength(rfbClientPtr cl);
 extern void rfbClientConnFailed(rfbClientPtr cl, char *reason);
 extern void rfbNewUDPConnection(int sock);
 extern void rfbProcessUDPInput(int sock);
-extern Bool rfbSendFramebufferUpdate(rfbClientPtr cl, RegionRec updateRegion);
-extern Bool rfbSendRectEncodingRaw(rfbClientPtr cl, int x,int y,int w,int h);
-extern Bool rfbSendUpdateBuf(rfbClientPtr cl);
 extern void rfbSendServerCutText(rfbClientPtr cl, char *str, int len);
 
 extern void setScaling (rfbClientPtr cl);
+
+
+/* scale.c */
+
+extern double rfbDefaultScale;
+
+extern Bool rfbSetClientScale(rfbClientPtr cl, double ratio);
+extern void rfbFreeClientScale(rfbClientPtr cl);
+extern int rfbScaledWidth(rfbClientPtr cl);
+extern int rfbScaledHeight(rfbClientPtr cl);
+extern void rfbScaleBoxToScreen(rfbClientPtr cl, BoxPtr box);
+extern void rfbScalePointToScreen(rfbClientPtr cl, int *x, int *y);
+extern void rfbScaleDamage(RegionPtr region);
+extern void rfbScaleScreenChanged(void);
 extern void CopyScalingRect( rfbClientPtr cl, int* x, int* y, int* w, int* h, Bool bDoScaling );
 
 
+/* updatebuf.c */
+
+extern Bool rfbSendFramebufferUpdate(rfbClientPtr cl, RegionRec updateRegion);
+extern Bool rfbSendScreenUpdateEncoding(rfbClientPtr cl);
+extern Bool rfbSendRectEncodingRaw(rfbClientPtr cl, int x,int y,int w,int h);
+extern Bool rfbSendLastRectMarker(rfbClientPtr cl);
+extern Bool rfbSendUpdateBuf(rfbClientPtr cl);
+extern Bool rfbSendUpdateBytes(rfbClientPtr cl, char *data, int len);
+extern Bool rfbQueueUpdateBytes(rfbClientPtr cl, char *data, int len);
+
+
 /* translate.c */
 
 /*
@@ -546,9 +897,55 @@ extern void rfbTranslateNone(char *table, rfbPixelFormat *in,
                              int width, int height);
 extern Bool rfbSetTranslateFunction(rfbClientPtr cl);
 extern Bool rfbSetTranslateFunctionUsingFormat(rfbClientPtr cl, rfbPixelFormat inFormat);
+extern void rfbFreeTranslateTable(rfbClientPtr cl);
 extern void PrintPixelFormat(rfbPixelFormat *pf);
 
 
+/* tileanalysis.c */
+
+extern Bool rfbSimdAnalysis;
+
+extern void rfbAnalyseTile(rfbTileAnalysis *ta, void *data, int bitsPerPixel,
+                           int w, int h, int stride, int maxColours, int flags);
+extern void rfbSortTileColours(rfbTileAnalysis *ta);
+
+
+/* subrect.c */
+
+extern int rfbSubrectBudget;
+extern Bool rfbSimdSubrect;
+
+extern Bool rfbSubrectStart(rfbSubrectSearch *s, rfbClientPtr cl, void *data,
+                            int bitsPerPixel, int w, int h, int stride, CARD32 bg);
+extern int rfbNextSubrects(rfbSubrectSearch *s, rfbSubrect *sr, int max);
+extern void rfbFreeSubrectData(rfbClientPtr cl);
+
+
+/* translate_simd.c */
+
+extern Bool rfbSimdTranslate;
+
+extern rfbTranslateFnType rfbSimdTranslateFunction(rfbPixelFormat *in, rfbPixelFormat *out);
+
+
+/* tight_simd.c */
+
+extern Bool rfbSimdTight;
+
+extern Bool rfbTightPack24(char *buf, int *shiftBits, int count);
+extern Bool rfbTightFilterGradient24(char *buf, int *shiftBits, int w, int h, void *rows);
+extern Bool rfbTightFilterGradient16(CARD16 *buf, rfbPixelFormat *fmt, Bool endianMismatch,
+                                     int w, int h, void *rows);
+extern Bool rfbTightFilterGradient32(CARD32 *buf, rfbPixelFormat *fmt, Bool endianMismatch,
+                                     int w, int h, void *rows);
+extern Bool rfbTightDetectStats24(char *buf, int off, int w, int h, int *diffStat,
+                                  int *pixelCount);
+extern Bool rfbTightDetectStats16(CARD16 *buf, rfbPixelFormat *fmt, Bool endianMismatch,
+                                  int w, int h, int *diffStat, int *pixelCount);
+extern Bool rfbTightDetectStats32(CARD32 *buf, rfbPixelFormat *fmt, Bool endianMismatch,
+                                  int w, int h, int *diffStat, int *pixelCount);
+
+
 /* httpd.c */
 
 extern int httpPort;
@@ -612,6 +1009,7 @@ extern Bool rfbTightDisableGradient;
 
 extern int rfbNumCodedRectsTight(rfbClientPtr cl, int x,int y,int w,int h);
 extern Bool rfbSendRectEncodingTight(rfbClientPtr cl, int x,int y,int w,int h);
+extern void rfbFreeTightData(rfbClientPtr cl);
 
 
 /* zlibhex.c */
@@ -641,6 +1039,13 @@ extern char* encNames[];
 
 extern void rfbResetStats(rfbClientPtr cl);
 extern void rfbPrintStats(rfbClientPtr cl);
+extern unsigned long long rfbStatsBytesSent(rfbClientPtr cl);
+extern void rfbStatsHistAdd(unsigned long long *hist, rfbPaceTime us);
+extern void rfbStatsUpdateSent(rfbClientPtr cl, rfbPaceTime damageSince);
+
+extern char *rfbStatsSocketPath;
+extern void rfbStatsSocketStart(void);
+extern void rfbStatsSocketStop(void);
 
 
 /* dimming.c */
@@ -48,7 +48,7 @@
 
 rfbClientPtr pointerClient = NULL;  /* Mutex for pointer events with buttons down*/
 
-rfbClientPtr rfbClientHead;  /* tight encoding -- GetClient() in tight.c accesses this list, so make it global */
+rfbClientPtr rfbClientHead;
 
 struct rfbClientIterator {
     rfbClientPtr next;
@@ -277,6 +277,7 @@ rfbClientPtr rfbNewClient(int sock) {
     cl->correMaxHeight = 48;
     cl->zrleData = 0;
     cl->mosData = 0;
+    cl->zrleParallelData = 0;
 
     box.x1 = box.y1 = 0;
     box.x2 = rfbScreen.width;
@@ -284,7 +285,16 @@ rfbClientPtr rfbNewClient(int sock) {
     REGION_INIT(pScreen,&cl->modifiedRegion,&box,0);
 
     pthread_mutex_init(&cl->updateMutex, NULL);
-    pthread_cond_init(&cl->updateCond, NULL);
+    rfbPacingCondInit(&cl->updateCond);
+
+    cl->reactorFd = -1;
+    cl->reactorFlags = 0;
+    cl->reactorReady = cl->reactorTimer = 0;
+    cl->inputBuf = NULL;
+    cl->inputStart = cl->inputLen = cl->inputSize = 0;
+    pthread_mutex_init(&cl->writeMutex, NULL);
+    cl->pendingBuf = NULL;
+    cl->pendingStart = cl->pendingLen = cl->pendingSize = 0;
 
     REGION_INIT(pScreen,&cl->requestedRegion,NullBox,0);
 
@@ -312,17 +322,28 @@ rfbClientPtr rfbNewClient(int sock) {
 			break;
 	}
 	// This will 
+	cl->translateLookupTable = NULL;
 	rfbSetTranslateFunctionUsingFormat(cl, rfbServerFormat);
 
-    /* SERVER SCALING EXTENSIONS -- Server Scaling is off by default */
-    cl->scalingFactor = 1;
-    cl->scalingFrameBuffer = rfbGetFramebuffer();
-	cl->scalingPaddedWidthInBytes = rfbScreen.paddedWidthInBytes;
+    /* SERVER SCALING EXTENSIONS -- Server Scaling is off unless -scale is given */
+    cl->scaledScreen = NULL;
+    rfbSetClientScale(cl, rfbDefaultScale);
 
     cl->tightCompressLevel = TIGHT_DEFAULT_COMPRESSION;
     cl->tightQualityLevel = -1;
     for (i = 0; i < 4; i++)
         cl->zsActive[i] = FALSE;
+    cl->tightParallel = FALSE;
+
+    tightBeforeBufSize = 0;
+    tightBeforeBuf = NULL;
+    tightAfterBufSize = 0;
+    tightAfterBuf = NULL;
+    prevRowBuf = NULL;
+    cl->tightRunsSize = 0;
+    cl->tightRuns = NULL;
+    cl->tightPendingSize = 0;
+    cl->tightPending = NULL;
 
     cl->enableLastRectEncoding = FALSE;
     cl->enableXCursorShapeUpdates = FALSE;
@@ -341,6 +362,24 @@ rfbClientPtr rfbNewClient(int sock) {
     pthread_mutex_unlock(&rfbClientListMutex);
 
     rfbResetStats(cl);
+    rfbPacingInit(cl);
+    rfbLinkInit(cl);
+    cl->recordId = 0;
+
+    cl->tileCaptureBuf = NULL;
+    cl->tileCaptureSize = 0;
+    cl->tileCaptureLen = 0;
+    cl->tileCaptureFrom = -1;
+
+    cl->encodeTasks = NULL;
+    cl->encodeTaskCount = 0;
+    cl->encodeTaskSize = 0;
+    cl->encodeScratch = NULL;
+    cl->encodeTask = NULL;
+
+    cl->ublen = 0;
+    cl->uvcount = 0;
+    cl->ubqueued = 0;
 
     cl->compStreamInited = FALSE;
     cl->compStream.total_in = 0;
@@ -360,6 +399,16 @@ rfbClientPtr rfbNewClient(int sock) {
     cl->client_zlibAfterBufSize = 0;
     cl->client_zlibAfterBuf = NULL;
     cl->client_zlibAfterBufLen = 0;
+
+    cl->client_rreBeforeBufSize = 0;
+    cl->client_rreBeforeBuf = NULL;
+
+    cl->client_rreAfterBufSize = 0;
+    cl->client_rreAfterBuf = NULL;
+    cl->client_rreAfterBufLen = 0;
+
+    cl->subrectMasksSize = 0;
+    cl->subrectMasks = NULL;
 	
 	
 	cl->profile = NULL;
@@ -443,6 +492,7 @@ void rfbClientConnectionGone(rfbClientPtr cl) {
     keyboardReleaseKeysForClient(cl);
 
 	freePasteboardForClient(cl);
+	rfbRecordClientClose(cl);
 	
     pthread_mutex_lock(&rfbClientListMutex);
 
@@ -482,17 +532,31 @@ void rfbClientConnectionGone(rfbClientPtr cl) {
 
     free(cl->host);
 
-    if (cl->translateLookupTable)
-        free(cl->translateLookupTable);
+    rfbFreeTranslateTable(cl);
+
+    if (cl->tileCaptureBuf)
+        xfree(cl->tileCaptureBuf);
+
+    rfbParallelEncodeFree(cl);
+    rfbFreeTightData(cl);
+
+    if (cl->client_rreBeforeBuf)
+        xfree(cl->client_rreBeforeBuf);
+    if (cl->client_rreAfterBuf)
+        xfree(cl->client_rreAfterBuf);
+    rfbFreeSubrectData(cl);
 
     /* SERVER SCALING EXTENSIONS */
-    if( cl->scalingFrameBuffer && cl->scalingFrameBuffer != rfbGetFramebuffer() ){
-        free(cl->scalingFrameBuffer);
-    }
+    rfbFreeClientScale(cl);
 
     pthread_cond_destroy(&cl->updateCond);
     pthread_mutex_destroy(&cl->updateMutex);
     pthread_mutex_destroy(&cl->outputMutex);
+    pthread_mutex_destroy(&cl->writeMutex);
+    if (cl->pendingBuf)
+        xfree(cl->pendingBuf);
+    if (cl->inputBuf)
+        xfree(cl->inputBuf);
 
     xfree(cl);
     // Not sure why but this log message seems to prevent a crash
@@ -525,6 +589,105 @@ void rfbProcessClientMessage(rfbClientPtr cl) {
 }
 
 
+/*
+ * rfbClientMessageLength is how many bytes of input the client's next message
+ * takes, as far as the part of it in the reactor's input buffer can tell.
+ * Until a length field has arrived it counts up to the end of that field,
+ * so once the buffer holds this many bytes the whole message is there and
+ * rfbProcessClientMessage won't have to wait for any of it.
+ */
+
+static CARD32 BufferedCard32(rfbClientPtr cl, int offset) {
+    CARD32 value;
+
+    memcpy(&value, cl->inputBuf + cl->inputStart + offset, 4);
+    return Swap32IfLE(value);
+}
+
+/* Step over count strings each sent as a CARD32 length and the bytes */
+static unsigned long long BufferedStrings(rfbClientPtr cl, unsigned long long length, int count) {
+    while (count-- > 0) {
+        if (cl->inputLen < length + 4)
+            return length + 4;
+        length += 4 + BufferedCard32(cl, (int)length);
+    }
+    return length;
+}
+
+int rfbClientMessageLength(rfbClientPtr cl) {
+    unsigned char *msg = (unsigned char *)cl->inputBuf + cl->inputStart;
+    unsigned long long length = 1;
+
+    switch (cl->state) {
+        case RFB_PROTOCOL_VERSION:
+            return sz_rfbProtocolVersionMsg;
+        case RFB_AUTH_VERSION:
+            return 1;
+        case RFB_AUTHENTICATION:
+            return CHALLENGESIZE;
+        case RFB_INITIALISATION:
+            return sz_rfbClientInitMsg;
+        default:
+            break;
+    }
+
+    if (cl->inputLen < 1)
+        return 1;
+
+    switch (msg[0]) {
+        case rfbSetPixelFormat:
+            length = sz_rfbSetPixelFormatMsg;
+            break;
+        case rfbFixColourMapEntries:
+            length = sz_rfbFixColourMapEntriesMsg;
+            break;
+        case rfbSetEncodings:
+            length = sz_rfbSetEncodingsMsg;
+            if (cl->inputLen >= length)
+                length += 4 * ((msg[2] << 8) | msg[3]);
+            break;
+        case rfbFramebufferUpdateRequest:
+            length = sz_rfbFramebufferUpdateRequestMsg;
+            break;
+        case 23:
+        case 24:
+        case rfbKeyEvent:
+            length = sz_rfbKeyEventMsg;
+            break;
+        case 25:
+        case rfbPointerEvent:
+            length = sz_rfbPointerEventMsg;
+            break;
+        case 26:
+            length = 2;
+            if (cl->inputLen >= length)
+                length += msg[1];
+            break;
+        case rfbClientCutText:
+            length = sz_rfbClientCutTextMsg;
+            if (cl->inputLen >= length)
+                length += BufferedCard32(cl, 4);
+            break;
+        case rfbSetScaleFactorULTRA:
+        case rfbSetScaleFactor:
+            length = sz_rfbSetScaleFactorMsg;
+            break;
+        /* Type, padding and a change count, then the strings */
+        case rfbRichClipboardAvailable:
+        case rfbRichClipboardRequest:
+            length = BufferedStrings(cl, 8, 2);
+            break;
+        case rfbRichClipboardData:
+            length = BufferedStrings(cl, 8, 3);
+            break;
+    }
+
+    /* Unknown types take the one byte rfbProcessClientNormalMessage needs
+       to turn them away */
+    return (int)min(length, 0x7fffffff);
+}
+
+
 /*
  * rfbProcessClientProtocolVersion is called when the client sends its
  * protocol version.
@@ -617,8 +780,8 @@ void rfbProcessClientInitMessage(rfbClientPtr cl) {
         return;
     }
 
-    si->framebufferWidth = Swap16IfLE(rfbScreen.width);
-    si->framebufferHeight = Swap16IfLE(rfbScreen.height);
+    si->framebufferWidth = Swap16IfLE(rfbScaledWidth(cl));
+    si->framebufferHeight = Swap16IfLE(rfbScaledHeight(cl));
     si->format = rfbServerFormat;
     si->format.redMax = Swap16IfLE(si->format.redMax);
     si->format.greenMax = Swap16IfLE(si->format.greenMax);
@@ -638,6 +801,7 @@ void rfbProcessClientInitMessage(rfbClientPtr cl) {
     }
 
     cl->state = RFB_NORMAL;
+    rfbRecordClientOpen(cl);
 
     if (!cl->reverseConnection &&
         (rfbNeverShared || (!rfbAlwaysShared && !ci.shared))) {
@@ -803,6 +967,9 @@ void rfbProcessClientNormalMessage(rfbClientPtr cl) {
             }
 
 			if (!rfbMaxBitDepth || msg.spf.format.bitsPerPixel <= rfbMaxBitDepth) {
+				/* The output thread encodes without updateMutex, so it
+				   mustn't see the new format with the old translator */
+				pthread_mutex_lock(&cl->outputMutex);
 				cl->format.bitsPerPixel = msg.spf.format.bitsPerPixel;
 				cl->format.depth = msg.spf.format.depth;
 				cl->format.bigEndian = (msg.spf.format.bigEndian ? 1 : 0);
@@ -814,6 +981,7 @@ void rfbProcessClientNormalMessage(rfbClientPtr cl) {
 				cl->format.greenShift = msg.spf.format.greenShift;
 				cl->format.blueShift = msg.spf.format.blueShift;
 				rfbSetTranslateFunction(cl);
+				pthread_mutex_unlock(&cl->outputMutex);
 			}
 			else
 				rfbLog("rfbProcessClientNormalMessage: Unable to set requested bit depth %d to greater than MaxBitDepth (%d)", msg.spf.format.bitsPerPixel, rfbMaxBitDepth);
@@ -838,7 +1006,7 @@ void rfbProcessClientNormalMessage(rfbClientPtr cl) {
 			
         case rfbSetEncodings: {
             int i;
-            CARD32 enc;
+            CARD32 enc, *encs;
 
             if ((n = ReadExact(cl, ((char *)&msg) + 1,
                                sz_rfbSetEncodingsMsg - 1)) <= 0) {
@@ -850,7 +1018,25 @@ void rfbProcessClientNormalMessage(rfbClientPtr cl) {
 
             msg.se.nEncodings = Swap16IfLE(msg.se.nEncodings);
 
-            pthread_mutex_lock(&cl->updateMutex);
+            /* Read the whole list before taking outputMutex, so a client
+               that stalls in the middle of it holds nothing up */
+            encs = (CARD32 *)xalloc(max(msg.se.nEncodings, 1) * sizeof(CARD32));
+            if (encs == NULL) {
+                rfbLog("rfbProcessClientNormalMessage: out of memory reading %d encodings\n",
+                       msg.se.nEncodings);
+                rfbCloseClient(cl);
+                return;
+            }
+            if (msg.se.nEncodings > 0 &&
+                (n = ReadExact(cl, (char *)encs, msg.se.nEncodings * 4)) <= 0) {
+                if (n != 0)
+                    rfbLogPerror("rfbProcessClientNormalMessage: read");
+                xfree(encs);
+                rfbCloseClient(cl);
+                return;
+            }
+
+            pthread_mutex_lock(&cl->outputMutex);
 
             // Since there is not protocol to "clear" these extensions we always clear them and expect them to be re-sent if
             // the client continues to support those options
@@ -861,15 +1047,11 @@ void rfbProcessClientNormalMessage(rfbClientPtr cl) {
             cl->enableCursorPosUpdates = FALSE;
             cl->desktopSizeUpdate = FALSE;
             cl->immediateUpdate = FALSE;
+            cl->linkEncodings = 0;
+            cl->linkClientQualityLevel = -1;
 
             for (i = 0; i < msg.se.nEncodings; i++) {
-                if ((n = ReadExact(cl, (char *)&enc, 4)) <= 0) {
-                    if (n != 0)
-                        rfbLogPerror("rfbProcessClientNormalMessage: read");
-                    rfbCloseClient(cl);
-                    return;
-                }
-                enc = Swap32IfLE(enc);
+                enc = Swap32IfLE(encs[i]);
 
                 switch (enc) {
                     case rfbEncodingCopyRect:
@@ -882,6 +1064,7 @@ void rfbProcessClientNormalMessage(rfbClientPtr cl) {
                     case rfbEncodingTight:
                     case rfbEncodingZlibHex:
                     case rfbEncodingZRLE:
+                        cl->linkEncodings |= 1 << enc;
                         if (cl->preferredEncoding == -1) {
                             cl->preferredEncoding = enc;
                             rfbLog("ENCODING: %s for client %s\n", encNames[cl->preferredEncoding], cl->host);
@@ -943,6 +1126,7 @@ void rfbProcessClientNormalMessage(rfbClientPtr cl) {
                         else if ( enc >= (CARD32)rfbEncodingQualityLevel0 &&
                                     enc <= (CARD32)rfbEncodingQualityLevel9 ) {
                             cl->tightQualityLevel = enc & 0x0F;
+                            cl->linkClientQualityLevel = cl->tightQualityLevel;
                             rfbLog("\tUsing jpeg image quality level %d for client %s\n",
                                    cl->tightQualityLevel, cl->host);
                         }
@@ -955,12 +1139,14 @@ void rfbProcessClientNormalMessage(rfbClientPtr cl) {
             if (cl->preferredEncoding == -1) {
                 cl->preferredEncoding = rfbEncodingRaw;
             }
+            rfbLinkSetEncodings(cl);
 
-            pthread_mutex_unlock(&cl->updateMutex);
+            pthread_mutex_unlock(&cl->outputMutex);
+            xfree(encs);
 
             // Force a new update to the client
             if (rfbShouldSendNewCursor(cl) || (rfbShouldSendNewPosition(cl)))
-                pthread_cond_signal(&cl->updateCond);
+                rfbWakeClient(cl);
             
             return;
         }
@@ -981,13 +1167,15 @@ void rfbProcessClientNormalMessage(rfbClientPtr cl) {
 
             //rfbLog("FUR: %d (%d,%d x %d,%d)\n", msg.fur.incremental, msg.fur.x, msg.fur.y,  msg.fur.w, msg.fur.h);
 
-            box.x1 = Swap16IfLE(msg.fur.x)*cl->scalingFactor;
-            box.y1 = Swap16IfLE(msg.fur.y)*cl->scalingFactor;
-            box.x2 = (box.x1 + Swap16IfLE(msg.fur.w))*cl->scalingFactor;
-            box.y2 = (box.y1 + Swap16IfLE(msg.fur.h))*cl->scalingFactor;
+            box.x1 = Swap16IfLE(msg.fur.x);
+            box.y1 = Swap16IfLE(msg.fur.y);
+            box.x2 = box.x1 + Swap16IfLE(msg.fur.w);
+            box.y2 = box.y1 + Swap16IfLE(msg.fur.h);
+            rfbScaleBoxToScreen(cl, &box);
             SAFE_REGION_INIT(pScreen,&tmpRegion,&box,0);
 
             pthread_mutex_lock(&cl->updateMutex);
+            rfbLinkRequestArrived(cl);
             REGION_UNION(pScreen, &cl->requestedRegion, &cl->requestedRegion,
                          &tmpRegion);
             if (!msg.fur.incremental) {
@@ -995,7 +1183,7 @@ void rfbProcessClientNormalMessage(rfbClientPtr cl) {
                              &tmpRegion);
             }
             pthread_mutex_unlock(&cl->updateMutex);
-            pthread_cond_signal(&cl->updateCond);
+            rfbWakeClient(cl);
             REGION_UNINIT(pScreen,&tmpRegion);
 
             return;
@@ -1016,6 +1204,8 @@ void rfbProcessClientNormalMessage(rfbClientPtr cl) {
 			if (!cl->disableRemoteEvents) {
 				NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
 
+				rfbPacingInput(cl);
+
 				TISInputSourceRef currentKeyboard = TISCopyCurrentKeyboardInputSource();
 				CFDataRef uchr = (CFDataRef)TISGetInputSourceProperty(currentKeyboard, kTISPropertyUnicodeKeyLayoutData);
 				const UCKeyboardLayout *keyboardLayout = (const UCKeyboardLayout*)CFDataGetBytePtr(uchr);
@@ -1187,6 +1377,8 @@ void rfbProcessClientNormalMessage(rfbClientPtr cl) {
 			
 			if (!cl->disableRemoteEvents) {
 				NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+
+				rfbPacingInput(cl);
 				CGEventRef keyEventDown = NULL;
 				
 				if (msg.ke.down & 0x01)
@@ -1314,8 +1506,11 @@ void rfbProcessClientNormalMessage(rfbClientPtr cl) {
                 return;
             }
 
-			if (!cl->disableRemoteEvents)
+			if (!cl->disableRemoteEvents) {
+				if (msg.ke.down)
+					rfbPacingInput(cl);
 				KbdAddEvent(msg.ke.down, (KeySym)Swap32IfLE(msg.ke.key), cl);
+			}
 
 			return;
 		}
@@ -1337,14 +1532,23 @@ void rfbProcessClientNormalMessage(rfbClientPtr cl) {
 
             if (msg.pe.buttonMask == 0)
                 pointerClient = NULL;
-            else
+            else {
                 pointerClient = cl;
+                rfbPacingInput(cl);
+            }
 
 			// If using relative positioning/delta mouse events, 
 			// need to remove offset of 32768 since this amount was added by HippoRemote.
 			int relativePositionOffset = (25 == msg.type) ? 32768 : 0;
-			int x = (Swap16IfLE(msg.pe.x)-relativePositionOffset+cl->scalingFactor-1)*cl->scalingFactor;
-			int y = (Swap16IfLE(msg.pe.y)-relativePositionOffset+cl->scalingFactor-1)*cl->scalingFactor;
+			int x = Swap16IfLE(msg.pe.x)-relativePositionOffset;
+			int y = Swap16IfLE(msg.pe.y)-relativePositionOffset;
+
+			if (25 == msg.type) {	// a delta is just stretched
+				x = (int)(x * cl->scalingFactor);
+				y = (int)(y * cl->scalingFactor);
+			}
+			else
+				rfbScalePointToScreen(cl, &x, &y);
 
 			if (25 == msg.type)	// delta mouse movements
 			{
@@ -1432,36 +1636,26 @@ void rfbProcessClientNormalMessage(rfbClientPtr cl) {
                 return;
             }
 
+            pthread_mutex_lock(&cl->outputMutex);
+            if (msg.ssf.scale == 0)
+                msg.ssf.scale = 1;
             if( cl->scalingFactor != msg.ssf.scale ){
-				const unsigned long csh = (rfbScreen.height+msg.ssf.scale-1) / msg.ssf.scale;
-				const unsigned long csw = (rfbScreen.width +msg.ssf.scale-1) / msg.ssf.scale;
-
-                cl->scalingFactor = msg.ssf.scale;
-
 				rfbLog("Server Side Scaling: %d for client %s\n", msg.ssf.scale, cl->host);
-							
-				if (cl->scalingFrameBuffer && cl->scalingFrameBuffer != rfbGetFramebuffer())
-					free(cl->scalingFrameBuffer);
-				
-				if (cl->scalingFactor == 1) {
-					cl->scalingFrameBuffer = rfbGetFramebuffer();
-					cl->scalingPaddedWidthInBytes = rfbScreen.paddedWidthInBytes;
-				}
-				else {					
-					cl->scalingFrameBuffer = malloc( csw*csh*rfbScreen.bitsPerPixel/8 );
-					cl->scalingPaddedWidthInBytes = csw * rfbScreen.bitsPerPixel/8;
-				}
+
+				if (!rfbSetClientScale(cl, msg.ssf.scale))
+					rfbLog("Server Side Scaling: out of memory, client %s left unscaled\n", cl->host);
 
 				/* Now notify the client of the new desktop area */
 				if (msg.type == rfbSetScaleFactor) {
 					rsfb.type = rfbReSizeFrameBuffer;
 					rsfb.desktop_w = Swap16IfLE(rfbScreen.width);
 					rsfb.desktop_h = Swap16IfLE(rfbScreen.height);
-					rsfb.buffer_w = Swap16IfLE(csw);
-					rsfb.buffer_h = Swap16IfLE(csh);
+					rsfb.buffer_w = Swap16IfLE(rfbScaledWidth(cl));
+					rsfb.buffer_h = Swap16IfLE(rfbScaledHeight(cl));
 					
 					if (WriteExact(cl, (char *)&rsfb, sizeof(rsfb)) < 0) {
 						rfbLogPerror("rfbProcessClientNormalMessage: write");
+						pthread_mutex_unlock(&cl->outputMutex);
 						rfbCloseClient(cl);
 						return;
 					}
@@ -1476,6 +1670,7 @@ void rfbProcessClientNormalMessage(rfbClientPtr cl) {
                     rfbSendScreenUpdateEncoding(cl);
 				}
 			}
+            pthread_mutex_unlock(&cl->outputMutex);
 			
             return;
         }
@@ -1503,314 +1698,6 @@ void rfbProcessClientNormalMessage(rfbClientPtr cl) {
 }
 
 
-/*
- * rfbSendFramebufferUpdate - send the currently pending framebuffer update to
- * the RFB client.
- */
-
-Bool rfbSendFramebufferUpdate(rfbClientPtr cl, RegionRec updateRegion) {
-    int i;
-    int nUpdateRegionRects = 0;
-    Bool sendRichCursorEncoding = FALSE;
-    Bool sendCursorPositionEncoding = FALSE;
-
-    rfbFramebufferUpdateMsg *fu = (rfbFramebufferUpdateMsg *)cl->updateBuf;
-
-    /* Now send the update */
-
-    cl->rfbFramebufferUpdateMessagesSent++;
-
-    if (cl->preferredEncoding == rfbEncodingCoRRE) {
-        for (i = 0; i < REGION_NUM_RECTS(&updateRegion); i++) {
-            int x = REGION_RECTS(&updateRegion)[i].x1;
-            int y = REGION_RECTS(&updateRegion)[i].y1;
-            int w = REGION_RECTS(&updateRegion)[i].x2 - x;
-            int h = REGION_RECTS(&updateRegion)[i].y2 - y;
-            nUpdateRegionRects += (((w-1) / cl->correMaxWidth + 1)
-                                   * ((h-1) / cl->correMaxHeight + 1));
-        }
-    } else if (cl->preferredEncoding == rfbEncodingZlib) {
-        for (i = 0; i < REGION_NUM_RECTS(&updateRegion); i++) {
-            int x = REGION_RECTS(&updateRegion)[i].x1;
-            int y = REGION_RECTS(&updateRegion)[i].y1;
-            int w = REGION_RECTS(&updateRegion)[i].x2 - x;
-            int h = REGION_RECTS(&updateRegion)[i].y2 - y;
-            nUpdateRegionRects += (((h-1) / (ZLIB_MAX_SIZE( w ) / w)) + 1);
-        }
-    } else if (cl->preferredEncoding == rfbEncodingTight) {
-        for (i = 0; i < REGION_NUM_RECTS(&updateRegion); i++) {
-            int x = REGION_RECTS(&updateRegion)[i].x1;
-            int y = REGION_RECTS(&updateRegion)[i].y1;
-            int w = REGION_RECTS(&updateRegion)[i].x2 - x;
-            int h = REGION_RECTS(&updateRegion)[i].y2 - y;
-            int n = rfbNumCodedRectsTight(cl, x, y, w, h);
-            if (n == 0) {
-                nUpdateRegionRects = 0xFFFF;
-                break;
-            }
-            nUpdateRegionRects += n;
-        }
-    } else {
-        nUpdateRegionRects = REGION_NUM_RECTS(&updateRegion);
-    }
-
-    // Sometimes send the mouse cursor update also
-
-    if (nUpdateRegionRects != 0xFFFF) {
-        if (rfbShouldSendNewCursor(cl)) {
-            sendRichCursorEncoding = TRUE;
-            nUpdateRegionRects++;
-        }
-        if (rfbShouldSendNewPosition(cl)) {
-            sendCursorPositionEncoding = TRUE;
-            nUpdateRegionRects++;
-        }
-		if (cl->needNewScreenSize) {
-			nUpdateRegionRects++;
-		}        
-    }
-
-    fu->type = rfbFramebufferUpdate;
-    fu->nRects = Swap16IfLE(nUpdateRegionRects);
-    cl->ublen = sz_rfbFramebufferUpdateMsg;
-	
-    // Sometimes send the mouse cursor update (this can fail with big cursors so we'll try it first
-    if (sendRichCursorEncoding) {
-        if (!rfbSendRichCursorUpdate(cl)) {
-            // rfbLog("Error Sending Cursor\n"); // We'll log at the lower level if it fails and only fail a few times
-            // return FALSE;  Since this is the first update we can "skip the cursor update" instead of failing the whole thing
-			--nUpdateRegionRects;
-			fu->nRects = Swap16IfLE(nUpdateRegionRects);
-        }
-    }
-    if (sendCursorPositionEncoding) {
-        if (!rfbSendCursorPos(cl)) {
-            rfbLog("Error Sending Cursor Position\n");
-            return FALSE;
-        }
-
-    }
-	if (cl->needNewScreenSize) {
-        if (rfbSendScreenUpdateEncoding(cl)) {
-            cl->needNewScreenSize = FALSE;
-        }
-        else {
-            rfbLog("Error Sending New Screen Size\n");
-            return FALSE;
-        }            
-    }
-	
-    for (i = 0; i < REGION_NUM_RECTS(&updateRegion); i++) {
-        int x = REGION_RECTS(&updateRegion)[i].x1;
-        int y = REGION_RECTS(&updateRegion)[i].y1;
-        int w = REGION_RECTS(&updateRegion)[i].x2 - x;
-        int h = REGION_RECTS(&updateRegion)[i].y2 - y;
-
-		// Refresh with latest pointer (should be "read-locked" throughout here with CG but I don't see that option)
-		if (cl->scalingFactor != 1)
-			CopyScalingRect( cl, &x, &y, &w, &h, TRUE);
-		else 
-			cl->scalingFrameBuffer = rfbGetFramebuffer();
-		
-        cl->rfbRawBytesEquivalent += (sz_rfbFramebufferUpdateRectHeader
-                                      + w * (cl->format.bitsPerPixel / 8) * h);
-
-        switch (cl->preferredEncoding) {
-            case rfbEncodingRaw:
-                if (!rfbSendRectEncodingRaw(cl, x, y, w, h)) {
-                    return FALSE;
-                }
-                break;
-            case rfbEncodingRRE:
-                if (!rfbSendRectEncodingRRE(cl, x, y, w, h)) {
-                    return FALSE;
-                }
-                break;
-            case rfbEncodingCoRRE:
-                if (!rfbSendRectEncodingCoRRE(cl, x, y, w, h)) {
-                    return FALSE;
-                }
-                break;
-            case rfbEncodingHextile:
-                if (!rfbSendRectEncodingHextile(cl, x, y, w, h)) {
-                    return FALSE;
-                }
-                break;
-            case rfbEncodingZlib:
-                if (!rfbSendRectEncodingZlib(cl, x, y, w, h)) {
-                    return FALSE;
-                }
-                break;
-            case rfbEncodingTight:
-                if (!rfbSendRectEncodingTight(cl, x, y, w, h)) {
-                    return FALSE;
-                }
-                break;
-            case rfbEncodingZlibHex:
-                if (!rfbSendRectEncodingZlibHex(cl, x, y, w, h)) {
-                    return FALSE;
-                }
-                break;
-            case rfbEncodingZRLE:
-                if (!rfbSendRectEncodingZRLE(cl, x, y, w, h)) {
-                    return FALSE;
-                }
-                break;
-        }
-    }
-
-    if (nUpdateRegionRects == 0xFFFF && !rfbSendLastRectMarker(cl))
-        return FALSE;
-
-    if (!rfbSendUpdateBuf(cl))
-        return FALSE;
-
-    return TRUE;
-}
-
-Bool rfbSendScreenUpdateEncoding(rfbClientPtr cl) {
-    rfbFramebufferUpdateRectHeader rect;
-				
-    if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE) {
-        if (!rfbSendUpdateBuf(cl))
-            return FALSE;
-    }
-
-    rect.r.x = 0;
-    rect.r.y = 0;
-    rect.r.w = Swap16IfLE((rfbScreen.width +cl->scalingFactor-1) / cl->scalingFactor);
-    rect.r.h = Swap16IfLE((rfbScreen.height+cl->scalingFactor-1) / cl->scalingFactor);
-    rect.encoding = Swap32IfLE(rfbEncodingDesktopResize);
-
-    memcpy(&cl->updateBuf[cl->ublen], (char *)&rect,sz_rfbFramebufferUpdateRectHeader);
-    cl->ublen += sz_rfbFramebufferUpdateRectHeader;
-
-    cl->rfbRectanglesSent[rfbStatsDesktopResize]++;
-    cl->rfbBytesSent[rfbStatsDesktopResize] += sz_rfbFramebufferUpdateRectHeader;
-
-    // Let's push this out right away
-    return rfbSendUpdateBuf(cl);
-}
-
-/*
- * Send a given rectangle in raw encoding (rfbEncodingRaw).
- */
-
-Bool rfbSendRectEncodingRaw(rfbClientPtr cl, int x, int y, int w, int h) {
-    rfbFramebufferUpdateRectHeader rect;
-    int nlines;
-    int bytesPerLine = w * (cl->format.bitsPerPixel / 8);
-    char *fbptr = (cl->scalingFrameBuffer + (cl->scalingPaddedWidthInBytes * y)
-                   + (x * (rfbScreen.bitsPerPixel / 8)));
-
-    if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE) {
-        if (!rfbSendUpdateBuf(cl))
-            return FALSE;
-    }
-
-    rect.r.x = Swap16IfLE(x);
-    rect.r.y = Swap16IfLE(y);
-    rect.r.w = Swap16IfLE(w);
-    rect.r.h = Swap16IfLE(h);
-    rect.encoding = Swap32IfLE(rfbEncodingRaw);
-
-    memcpy(&cl->updateBuf[cl->ublen], (char *)&rect,sz_rfbFramebufferUpdateRectHeader);
-    cl->ublen += sz_rfbFramebufferUpdateRectHeader;
-
-    cl->rfbRectanglesSent[rfbEncodingRaw]++;
-    cl->rfbBytesSent[rfbEncodingRaw] += sz_rfbFramebufferUpdateRectHeader + bytesPerLine * h;
-
-    nlines = (UPDATE_BUF_SIZE - cl->ublen) / bytesPerLine;
-
-    while (TRUE) {
-        if (nlines > h)
-            nlines = h;
-
-        (*cl->translateFn)(cl->translateLookupTable, &rfbServerFormat,
-                           &cl->format, fbptr, &cl->updateBuf[cl->ublen],
-                           cl->scalingPaddedWidthInBytes, w, nlines);
-
-        cl->ublen += nlines * bytesPerLine;
-        h -= nlines;
-
-        if (h == 0)     /* rect fitted in buffer, do next one */
-            return TRUE;
-
-        /* buffer full - flush partial rect and do another nlines */
-
-        if (!rfbSendUpdateBuf(cl))
-            return FALSE;
-
-        fbptr += (cl->scalingPaddedWidthInBytes * nlines);
-
-        nlines = (UPDATE_BUF_SIZE - cl->ublen) / bytesPerLine;
-        if (nlines == 0) {
-            rfbLog("rfbSendRectEncodingRaw: send buffer too small for %d "
-                   "bytes per line\n", bytesPerLine);
-            rfbCloseClient(cl);
-            return FALSE;
-        }
-    }
-}
-
-
-
-/*
- * Send an empty rectangle with encoding field set to value of
- * rfbEncodingLastRect to notify client that this is the last
- * rectangle in framebuffer update ("LastRect" extension of RFB
-                                    * protocol).
- */
-
-Bool rfbSendLastRectMarker(rfbClientPtr cl) {
-    rfbFramebufferUpdateRectHeader rect;
-
-    if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE) {
-        if (!rfbSendUpdateBuf(cl))
-            return FALSE;
-    }
-
-    rect.encoding = Swap32IfLE(rfbEncodingLastRect);
-    rect.r.x = 0;
-    rect.r.y = 0;
-    rect.r.w = 0;
-    rect.r.h = 0;
-
-    memcpy(&cl->updateBuf[cl->ublen], (char *)&rect,sz_rfbFramebufferUpdateRectHeader);
-    cl->ublen += sz_rfbFramebufferUpdateRectHeader;
-
-    cl->rfbLastRectMarkersSent++;
-    cl->rfbLastRectBytesSent += sz_rfbFramebufferUpdateRectHeader;
-
-    return TRUE;
-}
-
-
-/*
- * Send the contents of updateBuf.  Returns 1 if successful, -1 if
- * not (errno should be set).
- */
-
-Bool rfbSendUpdateBuf(rfbClientPtr cl) {
-    /*
-     int i;
-     for (i = 0; i < cl->ublen; i++) {
-         fprintf(stderr,"%02x ",((unsigned char *)cl->updateBuf)[i]);
-     }
-     fprintf(stderr,"\n");
-     */
-
-    if (WriteExact(cl, cl->updateBuf, cl->ublen) < 0) {
-        rfbLogPerror("rfbSendUpdateBuf: write");
-        rfbCloseClient(cl);
-        return FALSE;
-    }
-
-    cl->ublen = 0;
-    return TRUE;
-}
-
-
 /*
  * rfbSendServerCutText sends a ServerCutText message to all the clients.
  */
@@ -1859,114 +1746,3 @@ void rfbSendServerCutText(rfbClientPtr cl, char *str, int len) {
  }
  */
 
-/* SERVER SCALING EXTENSIONS */
-void CopyScalingRect( rfbClientPtr cl, int* x, int* y, int* w, int* h, Bool bDoScaling ){
-    unsigned long cx, cy, cw, ch;
-    unsigned long rx, ry, rw, rh;
-    unsigned char* srcptr;
-    unsigned char* dstptr;
-    unsigned char* tmpptr;
-    unsigned long pixel_value=0, red, green, blue;
-    unsigned long xx, yy, u, v;
-    const unsigned long bytesPerPixel = rfbScreen.bitsPerPixel/8;
-    const unsigned long csh = (rfbScreen.height+cl->scalingFactor-1)/ cl->scalingFactor;
-    const unsigned long csw = (rfbScreen.width +cl->scalingFactor-1)/ cl->scalingFactor;
-
-    cy = (*y) / cl->scalingFactor;
-    ch = (*h+cl->scalingFactor-1) / cl->scalingFactor+1;
-    cx = (*x) / cl->scalingFactor;
-    cw = (*w+cl->scalingFactor-1) / cl->scalingFactor+1;
-
-    if( cy > csh ){
-        cy = csh;
-    }
-    if( cy + ch > csh ){
-        ch = csh - cy;
-    }
-    if( cx > csw ){
-        cx = csw;
-    }
-    if( cx + cw > csw ){
-        cw = csw - cx;
-    }
-
-    if( bDoScaling ){
-        ry = cy * cl->scalingFactor;
-        rh = ch * cl->scalingFactor;
-        rx = cx * cl->scalingFactor;
-        rw = cw * cl->scalingFactor;
-
-        /* Copy and scale data from screen buffer to scaling buffer */
-        srcptr = (unsigned char*)rfbGetFramebuffer() + (ry * rfbScreen.paddedWidthInBytes ) + (rx * bytesPerPixel);
-        dstptr = (unsigned char*)cl->scalingFrameBuffer+ (cy * cl->scalingPaddedWidthInBytes) + (cx * bytesPerPixel);
-
-        if( cl->format.trueColour ) { /* Blend neighbouring pixels together */
-            for( yy=0; yy < ch; yy++ ){
-                for( xx=0; xx < cw; xx++ ){
-                    red = green = blue = 0;
-                    for( v = 0; v < (unsigned long)cl->scalingFactor; v++ ){
-                        tmpptr = srcptr;
-                        for( u = 0; u < (unsigned long)cl->scalingFactor; u++ ){
-                            switch( bytesPerPixel ){
-                            case 1:
-                                pixel_value = (unsigned long)*(unsigned char* )tmpptr;
-                                break;
-                            case 2:
-                                pixel_value = (unsigned long)*(unsigned short*)tmpptr;
-                                break;
-                            case 3:    /* 24bpp may cause bus error? */
-                            case 4:
-                                pixel_value = (unsigned long)*(unsigned long* )tmpptr;
-                                break;
-                            }
-                            red   += (pixel_value >> rfbServerFormat.redShift  )& rfbServerFormat.redMax;
-                            green += (pixel_value >> rfbServerFormat.greenShift)& rfbServerFormat.greenMax;
-                            blue  += (pixel_value >> rfbServerFormat.blueShift )& rfbServerFormat.blueMax;
-                            tmpptr  += rfbScreen.paddedWidthInBytes;
-                        }
-                        srcptr  += bytesPerPixel;
-                    }
-                    red   /= cl->scalingFactor * cl->scalingFactor;
-                    green /= cl->scalingFactor * cl->scalingFactor;
-                    blue  /= cl->scalingFactor * cl->scalingFactor;
-
-                    pixel_value = (red   << rfbServerFormat.redShift)
-                                + (green << rfbServerFormat.greenShift)
-                                + (blue  << rfbServerFormat.blueShift);
-
-                    switch( bytesPerPixel ){
-                    case 1:
-                        *(unsigned char* )dstptr = (unsigned char )pixel_value;
-                        break;
-                    case 2:
-                        *(unsigned short*)dstptr = (unsigned short)pixel_value;
-                        break;
-                    case 3:    /* 24bpp may cause bus error? */
-                    case 4:
-                        *(unsigned long* )dstptr = (unsigned long )pixel_value;
-                        break;
-                    }
-                    dstptr += bytesPerPixel;
-                }
-                srcptr += (rfbScreen.paddedWidthInBytes - cw * bytesPerPixel)* cl->scalingFactor;
-                dstptr += cl->scalingPaddedWidthInBytes - cw * bytesPerPixel;
-            }
-        }else{ /* Not truecolour, so we can't blend. Just use the top-left pixel instead */
-            for( yy=0; yy < ch; yy++ ){
-                for( xx=0; xx < cw; xx++ ){
-                    memcpy( dstptr, srcptr, bytesPerPixel);
-                    srcptr += bytesPerPixel * cl->scalingFactor;
-                    dstptr += bytesPerPixel;
-                }
-                srcptr += (rfbScreen.paddedWidthInBytes - cw * bytesPerPixel)* cl->scalingFactor;
-                dstptr += cl->scalingPaddedWidthInBytes - cw * bytesPerPixel;
-            }
-        }
-    }
-
-    *y = cy;
-    *h = ch;
-    *x = cx;
-    *w = cw;
-}
-
@@ -0,0 +1,665 @@
+/*
+ * scale.c - server side scaling.
+ *
+ * A client can ask for the screen scaled down by a whole factor
+ * (rfbSetScaleFactor), and -scale gives every client a default ratio,
+ * which needn't be whole: 1.5 shows a HiDPI screen at a sensible size on
+ * a laptop.  Each ratio in use has one scaled copy of the screen shared by
+ * every client at that ratio, and it is only rescaled where the screen has
+ * changed and a client is about to send.  The screen's damage is added to
+ * each copy's stale region as it goes to the clients; CopyScalingRect then
+ * rescales the stale part of the area a client is sending, so a second
+ * client at the same ratio finds it already done.
+ *
+ * Whole ratios average each square of screen pixels (a box filter).
+ * Others are interpolated between the four nearest screen pixels
+ * (bilinear), which is fine for the modest ratios fractional scaling is
+ * used for.  Both are done in two passes, down the columns a row at a time
+ * and then along the row.  With 8 bit channels in a 32 bit pixel, the usual
+ * screen, every byte is handled alike and the first pass uses SSE2 where
+ * there is one; other formats go a channel at a time.
+ */
+
+/*
+ *  OSXvnc Copyright (C) 2002-2004 Redstone Software osxvnc@redstonesoftware.com
+ *  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "rfb.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define SCALE_SSE2
+#endif
+
+double rfbDefaultScale = 1.0;
+
+/* Bilinear weights are out of this */
+#define WEIGHT_SHIFT 7
+#define WEIGHT_ONE (1 << WEIGHT_SHIFT)
+
+struct rfbScaledScreen {
+    double ratio;               /* screen pixels per scaled pixel */
+    int refCount;
+
+    int width, height;
+    int paddedWidthInBytes;
+    char *frameBuffer;
+
+    /* Screen pixels changed since they were last scaled */
+    RegionRec stale;
+
+    /* A whole ratio is averaged, anything else is bilinear */
+    int factor;
+
+    /* Bilinear: for each scaled column and row, the screen pixel before
+       it, the one after and the weight of the one after */
+    int *xIndex, *xNext, *yIndex, *yNext;
+    int *xWeight, *yWeight;
+
+    /* Scratch for a row of the first pass */
+    CARD16 *sums;
+    CARD8 *rowBuf;
+
+    pthread_mutex_t mutex;
+    rfbScaledScreen *next;
+};
+
+static rfbScaledScreen *scaledScreens = NULL;
+static pthread_mutex_t scaledScreensMutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static int ScaledSize(int size, double ratio) {
+    int scaled = (int)ceil(size / ratio - 1e-9);
+
+    return (scaled < 1 ? 1 : scaled);
+}
+
+static void SetupAxis(int *index, int *next, int *weight, int size,
+                      int screenSize, double ratio) {
+    int i;
+
+    for (i = 0; i < size; i++) {
+        double pos = (i + 0.5) * ratio - 0.5;
+        int at;
+
+        if (pos < 0)
+            pos = 0;
+        at = (int)pos;
+        if (at >= screenSize - 1) {
+            index[i] = next[i] = screenSize - 1;
+            weight[i] = 0;
+        } else {
+            index[i] = at;
+            next[i] = at + 1;
+            weight[i] = (int)((pos - at) * WEIGHT_ONE + 0.5);
+        }
+    }
+}
+
+static void FreeScaledScreenBuffers(rfbScaledScreen *ss) {
+    xfree(ss->frameBuffer);
+    xfree(ss->xIndex);
+    xfree(ss->xNext);
+    xfree(ss->xWeight);
+    xfree(ss->yIndex);
+    xfree(ss->yNext);
+    xfree(ss->yWeight);
+    xfree(ss->sums);
+    xfree(ss->rowBuf);
+    ss->frameBuffer = NULL;
+    ss->xIndex = ss->xNext = ss->xWeight = NULL;
+    ss->yIndex = ss->yNext = ss->yWeight = NULL;
+    ss->sums = NULL;
+    ss->rowBuf = NULL;
+}
+
+
+/*
+ * SetupScaledScreen sizes a scaled screen for the current screen, with
+ * everything stale.
+ */
+
+static Bool SetupScaledScreen(rfbScaledScreen *ss) {
+    int bytesPerPixel = rfbScreen.bitsPerPixel / 8;
+    BoxRec box;
+    BoxPtr pBox = &box;
+
+    FreeScaledScreenBuffers(ss);
+
+    ss->width = ScaledSize(rfbScreen.width, ss->ratio);
+    ss->height = ScaledSize(rfbScreen.height, ss->ratio);
+    ss->paddedWidthInBytes = ss->width * bytesPerPixel;
+    ss->factor = (ss->ratio == floor(ss->ratio) ? (int)ss->ratio : 0);
+
+    ss->frameBuffer = (char *)xalloc(ss->paddedWidthInBytes * ss->height);
+    ss->sums = (CARD16 *)xalloc(rfbScreen.width * 4 * sizeof(CARD16));
+    ss->rowBuf = (CARD8 *)xalloc(rfbScreen.width * 4);
+    if (!ss->frameBuffer || !ss->sums || !ss->rowBuf)
+        goto fail;
+
+    if (!ss->factor) {
+        ss->xIndex = (int *)xalloc(ss->width * sizeof(int));
+        ss->xNext = (int *)xalloc(ss->width * sizeof(int));
+        ss->xWeight = (int *)xalloc(ss->width * sizeof(int));
+        ss->yIndex = (int *)xalloc(ss->height * sizeof(int));
+        ss->yNext = (int *)xalloc(ss->height * sizeof(int));
+        ss->yWeight = (int *)xalloc(ss->height * sizeof(int));
+        if (!ss->xIndex || !ss->xNext || !ss->xWeight ||
+            !ss->yIndex || !ss->yNext || !ss->yWeight)
+            goto fail;
+        SetupAxis(ss->xIndex, ss->xNext, ss->xWeight, ss->width, rfbScreen.width, ss->ratio);
+        SetupAxis(ss->yIndex, ss->yNext, ss->yWeight, ss->height, rfbScreen.height, ss->ratio);
+    }
+
+    box.x1 = box.y1 = 0;
+    box.x2 = rfbScreen.width;
+    box.y2 = rfbScreen.height;
+    REGION_UNINIT(&hackScreen, &ss->stale);
+    REGION_INIT(&hackScreen, &ss->stale, pBox, 0);
+    return TRUE;
+
+fail:
+    rfbLog("SetupScaledScreen: out of memory scaling by %g\n", ss->ratio);
+    FreeScaledScreenBuffers(ss);
+    return FALSE;
+}
+
+
+/*
+ * GetScaledScreen finds or makes the scaled screen for a ratio and takes a
+ * reference to it, returning NULL if there's no memory for it.
+ */
+
+static rfbScaledScreen *GetScaledScreen(double ratio) {
+    rfbScaledScreen *ss;
+
+    pthread_mutex_lock(&scaledScreensMutex);
+    for (ss = scaledScreens; ss; ss = ss->next) {
+        if (fabs(ss->ratio - ratio) < 1e-6) {
+            ss->refCount++;
+            pthread_mutex_unlock(&scaledScreensMutex);
+            return ss;
+        }
+    }
+
+    ss = (rfbScaledScreen *)xalloc(sizeof(rfbScaledScreen));
+    if (ss) {
+        memset(ss, 0, sizeof(rfbScaledScreen));
+        ss->ratio = ratio;
+        REGION_INIT(&hackScreen, &ss->stale, NullBox, 0);
+        if (!SetupScaledScreen(ss)) {
+            REGION_UNINIT(&hackScreen, &ss->stale);
+            xfree(ss);
+            ss = NULL;
+        } else {
+            pthread_mutex_init(&ss->mutex, NULL);
+            ss->refCount = 1;
+            ss->next = scaledScreens;
+            scaledScreens = ss;
+        }
+    }
+    pthread_mutex_unlock(&scaledScreensMutex);
+    return ss;
+}
+
+static void ReleaseScaledScreen(rfbScaledScreen *ss) {
+    rfbScaledScreen **link;
+
+    pthread_mutex_lock(&scaledScreensMutex);
+    if (--ss->refCount == 0) {
+        for (link = &scaledScreens; *link != ss; link = &(*link)->next)
+            ;
+        *link = ss->next;
+        FreeScaledScreenBuffers(ss);
+        REGION_UNINIT(&hackScreen, &ss->stale);
+        pthread_mutex_destroy(&ss->mutex);
+        xfree(ss);
+    }
+    pthread_mutex_unlock(&scaledScreensMutex);
+}
+
+
+/*
+ * rfbSetClientScale sets the ratio a client's screen is scaled down by and
+ * points its scalingFrameBuffer at the scaled screen.  Called with the
+ * client's outputMutex held, and again after the screen has changed size.
+ * Returns FALSE, leaving the client unscaled, if there's no memory.
+ */
+
+Bool rfbSetClientScale(rfbClientPtr cl, double ratio) {
+    rfbScaledScreen *old = cl->scaledScreen;
+    Bool ok = TRUE;
+
+    cl->scaledScreen = NULL;
+    if (ratio > 1) {
+        cl->scaledScreen = GetScaledScreen(ratio);
+        ok = (cl->scaledScreen != NULL);
+    }
+    if (old)
+        ReleaseScaledScreen(old);
+
+    if (cl->scaledScreen) {
+        cl->scalingFactor = ratio;
+        cl->scalingFrameBuffer = cl->scaledScreen->frameBuffer;
+        cl->scalingPaddedWidthInBytes = cl->scaledScreen->paddedWidthInBytes;
+    } else {
+        cl->scalingFactor = 1;
+        cl->scalingFrameBuffer = rfbGetFramebuffer();
+        cl->scalingPaddedWidthInBytes = rfbScreen.paddedWidthInBytes;
+    }
+    return ok;
+}
+
+void rfbFreeClientScale(rfbClientPtr cl) {
+    if (cl->scaledScreen) {
+        ReleaseScaledScreen(cl->scaledScreen);
+        cl->scaledScreen = NULL;
+    }
+}
+
+int rfbScaledWidth(rfbClientPtr cl) {
+    return (cl->scaledScreen ? cl->scaledScreen->width : rfbScreen.width);
+}
+
+int rfbScaledHeight(rfbClientPtr cl) {
+    return (cl->scaledScreen ? cl->scaledScreen->height : rfbScreen.height);
+}
+
+
+/*
+ * rfbScaleBoxToScreen turns a box in the client's coordinates into the
+ * screen pixels it covers, and rfbScalePointToScreen a pointer position
+ * into the screen pixel under the middle of the client's.
+ */
+
+void rfbScaleBoxToScreen(rfbClientPtr cl, BoxPtr box) {
+    double ratio = cl->scalingFactor;
+
+    box->x1 = min((int)floor(box->x1 * ratio), rfbScreen.width);
+    box->y1 = min((int)floor(box->y1 * ratio), rfbScreen.height);
+    box->x2 = min((int)ceil(box->x2 * ratio), rfbScreen.width);
+    box->y2 = min((int)ceil(box->y2 * ratio), rfbScreen.height);
+}
+
+void rfbScalePointToScreen(rfbClientPtr cl, int *x, int *y) {
+    if (cl->scalingFactor != 1) {
+        *x = (int)floor((*x + 0.5) * cl->scalingFactor);
+        *y = (int)floor((*y + 0.5) * cl->scalingFactor);
+    }
+}
+
+
+/*
+ * rfbScaleDamage is given the screen's damage before the clients are.
+ */
+
+void rfbScaleDamage(RegionPtr region) {
+    rfbScaledScreen *ss;
+
+    if (!scaledScreens)
+        return;
+
+    pthread_mutex_lock(&scaledScreensMutex);
+    for (ss = scaledScreens; ss; ss = ss->next) {
+        pthread_mutex_lock(&ss->mutex);
+        REGION_UNION(&hackScreen, &ss->stale, &ss->stale, region);
+        pthread_mutex_unlock(&ss->mutex);
+    }
+    pthread_mutex_unlock(&scaledScreensMutex);
+}
+
+
+/*
+ * rfbScaleScreenChanged resizes the scaled screens for a new screen.  The
+ * clients using them are then given their buffers with rfbSetClientScale.
+ */
+
+void rfbScaleScreenChanged(void) {
+    rfbScaledScreen *ss;
+
+    pthread_mutex_lock(&scaledScreensMutex);
+    for (ss = scaledScreens; ss; ss = ss->next) {
+        pthread_mutex_lock(&ss->mutex);
+        SetupScaledScreen(ss);
+        pthread_mutex_unlock(&ss->mutex);
+    }
+    pthread_mutex_unlock(&scaledScreensMutex);
+}
+
+
+/*
+ * The kernels.  Each scales the box of the scaled screen from src, the
+ * screen.  The byte-wise ones are for 32 bit pixels with 8 bit channels.
+ */
+
+static Bool ByteChannels(void) {
+    return (rfbServerFormat.bitsPerPixel == 32 &&
+            rfbServerFormat.redMax == 255 && rfbServerFormat.greenMax == 255 &&
+            rfbServerFormat.blueMax == 255 &&
+            rfbServerFormat.redShift % 8 == 0 && rfbServerFormat.greenShift % 8 == 0 &&
+            rfbServerFormat.blueShift % 8 == 0);
+}
+
+static CARD32 GetPixel(unsigned char *ptr, int bytesPerPixel) {
+    switch (bytesPerPixel) {
+        case 1: return *ptr;
+        case 2: return *(CARD16 *)ptr;
+        default: return *(CARD32 *)ptr;
+    }
+}
+
+static void PutPixel(unsigned char *ptr, int bytesPerPixel, CARD32 pixel) {
+    switch (bytesPerPixel) {
+        case 1: *ptr = pixel; break;
+        case 2: *(CARD16 *)ptr = pixel; break;
+        default: *(CARD32 *)ptr = pixel; break;
+    }
+}
+
+/* Add n bytes of a row to 16 bit sums */
+
+static void AddRow(CARD16 *sums, CARD8 *row, int n) {
+    int i = 0;
+
+#ifdef SCALE_SSE2
+    __m128i zero = _mm_setzero_si128();
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i bytes = _mm_loadu_si128((__m128i *)(row + i));
+        __m128i lo = _mm_loadu_si128((__m128i *)(sums + i));
+        __m128i hi = _mm_loadu_si128((__m128i *)(sums + i + 8));
+
+        lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(bytes, zero));
+        hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(bytes, zero));
+        _mm_storeu_si128((__m128i *)(sums + i), lo);
+        _mm_storeu_si128((__m128i *)(sums + i + 8), hi);
+    }
+#endif
+    for (; i < n; i++)
+        sums[i] += row[i];
+}
+
+/* out = a + (b - a) * weight, for n bytes */
+
+static void BlendRows(CARD8 *out, CARD8 *a, CARD8 *b, int weight, int n) {
+    int i = 0;
+
+#ifdef SCALE_SSE2
+    __m128i zero = _mm_setzero_si128();
+    __m128i w = _mm_set1_epi16(weight);
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128((__m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((__m128i *)(b + i));
+        __m128i alo = _mm_unpacklo_epi8(va, zero), ahi = _mm_unpackhi_epi8(va, zero);
+        __m128i blo = _mm_unpacklo_epi8(vb, zero), bhi = _mm_unpackhi_epi8(vb, zero);
+
+        alo = _mm_add_epi16(alo, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(blo, alo), w), WEIGHT_SHIFT));
+        ahi = _mm_add_epi16(ahi, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(bhi, ahi), w), WEIGHT_SHIFT));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(alo, ahi));
+    }
+#endif
+    for (; i < n; i++)
+        out[i] = a[i] + (((b[i] - a[i]) * weight) >> WEIGHT_SHIFT);
+}
+
+static void BoxBytes(rfbScaledScreen *ss, unsigned char *src, int srcStride,
+                     BoxPtr box) {
+    int f = ss->factor;
+    int x0 = box->x1 * f, x1 = min(box->x2 * f, rfbScreen.width);
+    int sx, sy, y, i, c;
+
+    for (sy = box->y1; sy < box->y2; sy++) {
+        int y0 = sy * f, y1 = min(y0 + f, rfbScreen.height);
+        CARD8 *out = (CARD8 *)ss->frameBuffer + sy * ss->paddedWidthInBytes + box->x1 * 4;
+        CARD16 *sums = ss->sums;
+
+        memset(sums, 0, (x1 - x0) * 4 * sizeof(CARD16));
+        for (y = y0; y < y1; y++)
+            AddRow(sums, src + y * srcStride + x0 * 4, (x1 - x0) * 4);
+
+        for (sx = box->x1; sx < box->x2; sx++) {
+            int cols = min(f, rfbScreen.width - sx * f);
+            int count = cols * (y1 - y0);
+
+            for (c = 0; c < 4; c++) {
+                unsigned long sum = 0;
+
+                for (i = 0; i < cols; i++)
+                    sum += sums[i * 4 + c];
+                *out++ = sum / count;
+            }
+            sums += f * 4;
+        }
+    }
+}
+
+static void BilinearBytes(rfbScaledScreen *ss, unsigned char *src, int srcStride,
+                          BoxPtr box) {
+    int x0 = ss->xIndex[box->x1], x1 = ss->xNext[box->x2 - 1] + 1;
+    int sx, sy, c;
+
+    for (sy = box->y1; sy < box->y2; sy++) {
+        CARD8 *out = (CARD8 *)ss->frameBuffer + sy * ss->paddedWidthInBytes + box->x1 * 4;
+        CARD8 *row = ss->rowBuf - x0 * 4;
+
+        BlendRows(ss->rowBuf,
+                  src + ss->yIndex[sy] * srcStride + x0 * 4,
+                  src + ss->yNext[sy] * srcStride + x0 * 4,
+                  ss->yWeight[sy], (x1 - x0) * 4);
+
+        for (sx = box->x1; sx < box->x2; sx++) {
+            CARD8 *a = row + ss->xIndex[sx] * 4;
+            CARD8 *b = row + ss->xNext[sx] * 4;
+            int weight = ss->xWeight[sx];
+
+            for (c = 0; c < 4; c++)
+                *out++ = a[c] + (((b[c] - a[c]) * weight) >> WEIGHT_SHIFT);
+        }
+    }
+}
+
+#define CHANNEL(pixel, which) \
+    (((pixel) >> rfbServerFormat.which##Shift) & rfbServerFormat.which##Max)
+
+static void BoxChannels(rfbScaledScreen *ss, unsigned char *src, int srcStride,
+                        BoxPtr box) {
+    int bytesPerPixel = rfbScreen.bitsPerPixel / 8;
+    int f = ss->factor;
+    int sx, sy, x, y;
+
+    for (sy = box->y1; sy < box->y2; sy++) {
+        int y0 = sy * f, y1 = min(y0 + f, rfbScreen.height);
+        unsigned char *out = (unsigned char *)ss->frameBuffer + sy * ss->paddedWidthInBytes
+                             + box->x1 * bytesPerPixel;
+
+        for (sx = box->x1; sx < box->x2; sx++) {
+            int x0 = sx * f, x1 = min(x0 + f, rfbScreen.width);
+            unsigned long red = 0, green = 0, blue = 0, count = (x1 - x0) * (y1 - y0);
+
+            for (y = y0; y < y1; y++) {
+                unsigned char *ptr = src + y * srcStride + x0 * bytesPerPixel;
+
+                for (x = x0; x < x1; x++, ptr += bytesPerPixel) {
+                    CARD32 pixel = GetPixel(ptr, bytesPerPixel);
+
+                    red += CHANNEL(pixel, red);
+                    green += CHANNEL(pixel, green);
+                    blue += CHANNEL(pixel, blue);
+                }
+            }
+            PutPixel(out, bytesPerPixel,
+                     ((red / count) << rfbServerFormat.redShift) |
+                     ((green / count) << rfbServerFormat.greenShift) |
+                     ((blue / count) << rfbServerFormat.blueShift));
+            out += bytesPerPixel;
+        }
+    }
+}
+
+static int Blend(int a, int b, int weight) {
+    return a + (((b - a) * weight) >> WEIGHT_SHIFT);
+}
+
+static void BilinearChannels(rfbScaledScreen *ss, unsigned char *src, int srcStride,
+                             BoxPtr box) {
+    int bytesPerPixel = rfbScreen.bitsPerPixel / 8;
+    int sx, sy;
+
+    for (sy = box->y1; sy < box->y2; sy++) {
+        unsigned char *top = src + ss->yIndex[sy] * srcStride;
+        unsigned char *bottom = src + ss->yNext[sy] * srcStride;
+        int wy = ss->yWeight[sy];
+        unsigned char *out = (unsigned char *)ss->frameBuffer + sy * ss->paddedWidthInBytes
+                             + box->x1 * bytesPerPixel;
+
+        for (sx = box->x1; sx < box->x2; sx++) {
+            int a = ss->xIndex[sx] * bytesPerPixel, b = ss->xNext[sx] * bytesPerPixel;
+            int wx = ss->xWeight[sx];
+            CARD32 tl = GetPixel(top + a, bytesPerPixel), tr = GetPixel(top + b, bytesPerPixel);
+            CARD32 bl = GetPixel(bottom + a, bytesPerPixel), br = GetPixel(bottom + b, bytesPerPixel);
+            CARD32 red, green, blue;
+
+            red = Blend(Blend(CHANNEL(tl, red), CHANNEL(bl, red), wy),
+                        Blend(CHANNEL(tr, red), CHANNEL(br, red), wy), wx);
+            green = Blend(Blend(CHANNEL(tl, green), CHANNEL(bl, green), wy),
+                          Blend(CHANNEL(tr, green), CHANNEL(br, green), wy), wx);
+            blue = Blend(Blend(CHANNEL(tl, blue), CHANNEL(bl, blue), wy),
+                         Blend(CHANNEL(tr, blue), CHANNEL(br, blue), wy), wx);
+            PutPixel(out, bytesPerPixel,
+                     (red << rfbServerFormat.redShift) |
+                     (green << rfbServerFormat.greenShift) |
+                     (blue << rfbServerFormat.blueShift));
+            out += bytesPerPixel;
+        }
+    }
+}
+
+static void ScaleBox(rfbScaledScreen *ss, BoxPtr box) {
+    unsigned char *src = (unsigned char *)rfbGetFramebuffer();
+    int srcStride = rfbScreen.paddedWidthInBytes;
+
+    if (box->x1 >= box->x2 || box->y1 >= box->y2)
+        return;
+
+    if (ByteChannels()) {
+        if (ss->factor)
+            BoxBytes(ss, src, srcStride, box);
+        else
+            BilinearBytes(ss, src, srcStride, box);
+    } else {
+        if (ss->factor)
+            BoxChannels(ss, src, srcStride, box);
+        else
+            BilinearChannels(ss, src, srcStride, box);
+    }
+}
+
+
+/*
+ * The scaled pixels a box of screen pixels affects, and the screen pixels a
+ * box of scaled pixels is made from.  Both are generous by a pixel for the
+ * bilinear filter, which reaches a little beyond the pixel's own area.
+ */
+
+static void ScaledBoxOf(rfbScaledScreen *ss, BoxPtr box, BoxPtr scaled) {
+    scaled->x1 = max((int)floor(box->x1 / ss->ratio) - 1, 0);
+    scaled->y1 = max((int)floor(box->y1 / ss->ratio) - 1, 0);
+    scaled->x2 = min((int)ceil(box->x2 / ss->ratio) + 1, ss->width);
+    scaled->y2 = min((int)ceil(box->y2 / ss->ratio) + 1, ss->height);
+}
+
+static void ScreenBoxOf(rfbScaledScreen *ss, BoxPtr scaled, BoxPtr box) {
+    box->x1 = max((int)floor(scaled->x1 * ss->ratio) - 1, 0);
+    box->y1 = max((int)floor(scaled->y1 * ss->ratio) - 1, 0);
+    box->x2 = min((int)ceil(scaled->x2 * ss->ratio) + 1, rfbScreen.width);
+    box->y2 = min((int)ceil(scaled->y2 * ss->ratio) + 1, rfbScreen.height);
+}
+
+
+/* SERVER SCALING EXTENSIONS */
+
+/*
+ * CopyScalingRect turns a rectangle of the screen into the rectangle of
+ * the client's scaled screen covering it, first rescaling anything stale
+ * there if bDoScaling is set.
+ */
+
+void CopyScalingRect(rfbClientPtr cl, int* x, int* y, int* w, int* h, Bool bDoScaling) {
+    rfbScaledScreen *ss = cl->scaledScreen;
+    BoxRec box, scaled;
+    BoxPtr pBox = &box;
+
+    if (!ss)
+        return;
+
+    /* The buffer moves when the screen changes size */
+    cl->scalingFrameBuffer = ss->frameBuffer;
+    cl->scalingPaddedWidthInBytes = ss->paddedWidthInBytes;
+
+    scaled.x1 = min((int)floor(*x / ss->ratio), ss->width);
+    scaled.y1 = min((int)floor(*y / ss->ratio), ss->height);
+    scaled.x2 = min((int)ceil((*x + *w) / ss->ratio), ss->width);
+    scaled.y2 = min((int)ceil((*y + *h) / ss->ratio), ss->height);
+
+    if (bDoScaling) {
+        RegionRec todo, rescale;
+        BoxRec tmp;
+        BoxPtr pTmp = &tmp;
+        int i;
+
+        /* Everything stale that the rectangle's pixels are made from, and
+           every scaled pixel made from that */
+
+        ScreenBoxOf(ss, &scaled, &box);
+        REGION_INIT(&hackScreen, &todo, pBox, 0);
+        REGION_INIT(&hackScreen, &rescale, NullBox, 0);
+
+        pthread_mutex_lock(&ss->mutex);
+        REGION_INTERSECT(&hackScreen, &todo, &todo, &ss->stale);
+        if (REGION_NOTEMPTY(&hackScreen, &todo)) {
+            for (i = 0; i < REGION_NUM_RECTS(&todo); i++) {
+                RegionRec one;
+
+                ScaledBoxOf(ss, &REGION_RECTS(&todo)[i], &tmp);
+                REGION_INIT(&hackScreen, &one, pTmp, 0);
+                REGION_UNION(&hackScreen, &rescale, &rescale, &one);
+                REGION_UNINIT(&hackScreen, &one);
+            }
+            for (i = 0; i < REGION_NUM_RECTS(&rescale); i++)
+                ScaleBox(ss, &REGION_RECTS(&rescale)[i]);
+            REGION_SUBTRACT(&hackScreen, &ss->stale, &ss->stale, &todo);
+        }
+        pthread_mutex_unlock(&ss->mutex);
+
+        REGION_UNINIT(&hackScreen, &rescale);
+        REGION_UNINIT(&hackScreen, &todo);
+    }
+
+    *x = scaled.x1;
+    *y = scaled.y1;
+    *w = scaled.x2 - scaled.x1;
+    *h = scaled.y2 - scaled.y1;
+}
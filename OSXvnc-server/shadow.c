@@ -0,0 +1,271 @@
+/*
+ * shadow.c - server-wide shadow framebuffer used to trim damage.
+ *
+ * The OS reports damage in coarse rectangles, often a whole window for a
+ * blinking caret.  We keep a copy of the framebuffer and a content hash for
+ * every SHADOW_TILE_SIZE square tile.  Before damage reaches the clients each
+ * touched tile is hashed; unchanged tiles are dropped and changed ones are
+ * compared against the shadow to find the box that really changed.
+ */
+
+/*
+ *  OSXvnc Copyright (C) 2002-2004 Redstone Software osxvnc@redstonesoftware.com
+ *  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "rfb.h"
+
+Bool rfbShadowEnabled = TRUE;
+
+/* Damage area (in pixels) handed to us and what was left after trimming */
+unsigned long long rfbShadowPixelsReported = 0;
+unsigned long long rfbShadowPixelsChanged = 0;
+
+static pthread_mutex_t shadowMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static char *shadowFB = NULL;
+static int shadowBytesPerRow = 0;
+static int shadowBytesPerPixel = 0;
+static int shadowWidth = 0, shadowHeight = 0;
+
+static int tilesX = 0, tilesY = 0;
+static rfbTileHash *tileHashes = NULL;
+static unsigned char *tileTouched = NULL;
+
+#define HASH_PRIME 0x9E3779B97F4A7C15ULL
+
+/*
+ * rfbHashPixels hashes h rows of bytesPerRow bytes each, stride bytes apart.
+ * It only needs to be fast and well mixed, not cryptographic.
+ */
+
+rfbTileHash rfbHashPixels(char *ptr, int bytesPerRow, int stride, int h) {
+    rfbTileHash hash = HASH_PRIME ^ ((rfbTileHash)bytesPerRow << 32) ^ h;
+    int y, i;
+
+    for (y = 0; y < h; y++) {
+        unsigned char *p = (unsigned char *)ptr + y * stride;
+        rfbTileHash word;
+
+        for (i = 0; i + 8 <= bytesPerRow; i += 8) {
+            memcpy(&word, p + i, 8);
+            hash = (hash ^ word) * HASH_PRIME;
+            hash ^= hash >> 29;
+        }
+        for (; i < bytesPerRow; i++) {
+            hash = (hash ^ p[i]) * HASH_PRIME;
+            hash ^= hash >> 29;
+        }
+    }
+
+    return hash;
+}
+
+static void TileBox(int tx, int ty, BoxPtr box) {
+    box->x1 = tx * SHADOW_TILE_SIZE;
+    box->y1 = ty * SHADOW_TILE_SIZE;
+    box->x2 = min(box->x1 + SHADOW_TILE_SIZE, shadowWidth);
+    box->y2 = min(box->y1 + SHADOW_TILE_SIZE, shadowHeight);
+}
+
+
+/*
+ * rfbShadowInit (re)builds the shadow from the current framebuffer.  Called
+ * whenever the screen is (re)initialised.
+ */
+
+void rfbShadowInit(void) {
+    char *fb;
+    int y, tx, ty;
+
+    pthread_mutex_lock(&shadowMutex);
+
+    free(shadowFB);
+    free(tileHashes);
+    free(tileTouched);
+    shadowFB = NULL;
+    tileHashes = NULL;
+    tileTouched = NULL;
+
+    if (!rfbShadowEnabled) {
+        pthread_mutex_unlock(&shadowMutex);
+        return;
+    }
+
+    shadowWidth = rfbScreen.width;
+    shadowHeight = rfbScreen.height;
+    shadowBytesPerPixel = rfbScreen.bitsPerPixel / 8;
+    shadowBytesPerRow = shadowWidth * shadowBytesPerPixel;
+    tilesX = (shadowWidth + SHADOW_TILE_SIZE - 1) / SHADOW_TILE_SIZE;
+    tilesY = (shadowHeight + SHADOW_TILE_SIZE - 1) / SHADOW_TILE_SIZE;
+
+    shadowFB = (char *)malloc(shadowBytesPerRow * shadowHeight);
+    tileHashes = (rfbTileHash *)malloc(tilesX * tilesY * sizeof(rfbTileHash));
+    tileTouched = (unsigned char *)calloc(tilesX * tilesY, 1);
+    if (!shadowFB || !tileHashes || !tileTouched) {
+        rfbLog("Unable to allocate shadow framebuffer, damage will not be trimmed\n");
+        free(shadowFB);
+        free(tileHashes);
+        free(tileTouched);
+        shadowFB = NULL;
+        tileHashes = NULL;
+        tileTouched = NULL;
+        pthread_mutex_unlock(&shadowMutex);
+        return;
+    }
+
+    fb = rfbGetFramebuffer();
+    for (y = 0; y < shadowHeight; y++)
+        memcpy(shadowFB + y * shadowBytesPerRow, fb + y * rfbScreen.paddedWidthInBytes, shadowBytesPerRow);
+
+    for (ty = 0; ty < tilesY; ty++) {
+        for (tx = 0; tx < tilesX; tx++) {
+            BoxRec box;
+
+            TileBox(tx, ty, &box);
+            tileHashes[ty * tilesX + tx] =
+                rfbHashPixels(shadowFB + box.y1 * shadowBytesPerRow + box.x1 * shadowBytesPerPixel,
+                              (box.x2 - box.x1) * shadowBytesPerPixel, shadowBytesPerRow, box.y2 - box.y1);
+        }
+    }
+
+    pthread_mutex_unlock(&shadowMutex);
+}
+
+
+/*
+ * Compare one tile against the shadow.  Returns FALSE if nothing changed,
+ * otherwise updates the shadow and hash and returns the box that changed.
+ */
+
+static Bool UpdateTile(char *fb, int tx, int ty, BoxPtr changed) {
+    BoxRec box;
+    rfbTileHash hash;
+    int bpp = shadowBytesPerPixel;
+    int rowBytes, y, x1, x2, y1 = -1, y2 = -1;
+    char *fbptr, *shptr;
+
+    TileBox(tx, ty, &box);
+    rowBytes = (box.x2 - box.x1) * bpp;
+    fbptr = fb + box.y1 * rfbScreen.paddedWidthInBytes + box.x1 * bpp;
+    shptr = shadowFB + box.y1 * shadowBytesPerRow + box.x1 * bpp;
+
+    hash = rfbHashPixels(fbptr, rowBytes, rfbScreen.paddedWidthInBytes, box.y2 - box.y1);
+    if (hash == tileHashes[ty * tilesX + tx])
+        return FALSE;
+    tileHashes[ty * tilesX + tx] = hash;
+
+    x1 = box.x2 - box.x1;
+    x2 = 0;
+    for (y = 0; y < box.y2 - box.y1; y++) {
+        char *f = fbptr + y * rfbScreen.paddedWidthInBytes;
+        char *s = shptr + y * shadowBytesPerRow;
+        int left, right;
+
+        if (memcmp(f, s, rowBytes) == 0)
+            continue;
+
+        for (left = 0; left < x1 && memcmp(f + left * bpp, s + left * bpp, bpp) == 0; left++)
+            ;
+        for (right = box.x2 - box.x1; right > x2 && memcmp(f + (right - 1) * bpp, s + (right - 1) * bpp, bpp) == 0; right--)
+            ;
+        if (left < x1) x1 = left;
+        if (right > x2) x2 = right;
+        if (y1 < 0) y1 = y;
+        y2 = y + 1;
+
+        memcpy(s, f, rowBytes);
+    }
+
+    if (y1 < 0)
+        return FALSE;
+
+    changed->x1 = box.x1 + x1;
+    changed->x2 = box.x1 + x2;
+    changed->y1 = box.y1 + y1;
+    changed->y2 = box.y1 + y2;
+    return TRUE;
+}
+
+
+/*
+ * rfbShadowFilterRegion replaces region with the parts of the tiles it
+ * touches that really changed since we last looked.  Changes elsewhere in a
+ * touched tile are kept too, since the shadow now includes them.
+ */
+
+void rfbShadowFilterRegion(RegionPtr region) {
+    RegionRec result, tmpRegion;
+    BoxPtr rects;
+    BoxRec changed;
+    BoxPtr pChanged = &changed;
+    char *fb;
+    int i, nrects, tx, ty;
+
+    pthread_mutex_lock(&shadowMutex);
+
+    if (!shadowFB || !REGION_NOTEMPTY(&hackScreen, region) ||
+        shadowWidth != rfbScreen.width || shadowHeight != rfbScreen.height) {
+        pthread_mutex_unlock(&shadowMutex);
+        return;
+    }
+
+    fb = rfbGetFramebuffer();
+    nrects = REGION_NUM_RECTS(region);
+    rects = REGION_RECTS(region);
+
+    for (i = 0; i < nrects; i++) {
+        int x1 = max(rects[i].x1, 0) / SHADOW_TILE_SIZE;
+        int y1 = max(rects[i].y1, 0) / SHADOW_TILE_SIZE;
+        int x2 = (min(rects[i].x2, shadowWidth) + SHADOW_TILE_SIZE - 1) / SHADOW_TILE_SIZE;
+        int y2 = (min(rects[i].y2, shadowHeight) + SHADOW_TILE_SIZE - 1) / SHADOW_TILE_SIZE;
+
+        rfbShadowPixelsReported += (rects[i].x2 - rects[i].x1) * (rects[i].y2 - rects[i].y1);
+
+        for (ty = y1; ty < y2; ty++)
+            for (tx = x1; tx < x2; tx++)
+                tileTouched[ty * tilesX + tx] = 1;
+    }
+
+    REGION_INIT(&hackScreen, &result, NullBox, 0);
+
+    for (ty = 0; ty < tilesY; ty++) {
+        for (tx = 0; tx < tilesX; tx++) {
+            if (!tileTouched[ty * tilesX + tx])
+                continue;
+            tileTouched[ty * tilesX + tx] = 0;
+
+            if (UpdateTile(fb, tx, ty, &changed)) {
+                rfbShadowPixelsChanged += (changed.x2 - changed.x1) * (changed.y2 - changed.y1);
+                REGION_INIT(&hackScreen, &tmpRegion, pChanged, 0);
+                REGION_UNION(&hackScreen, &result, &result, &tmpRegion);
+                REGION_UNINIT(&hackScreen, &tmpRegion);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&shadowMutex);
+
+    REGION_COPY(&hackScreen, region, &result);
+    REGION_UNINIT(&hackScreen, &result);
+}
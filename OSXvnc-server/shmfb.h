@@ -0,0 +1,114 @@
+/*
+ * shmfb.h - layout of a shared memory framebuffer segment.
+ *
+ * An external producer (a compositor, a test harness, ...) creates a file or
+ * POSIX shared memory object, fills in the header below, writes pixels at
+ * pixelOffset and pushes damage rectangles into the ring.  The server maps
+ * the same segment (-shmfb), encodes straight from the pixels and consumes
+ * the ring.
+ *
+ * The ring is single producer / single consumer: only the producer advances
+ * ringHead and only the server advances ringTail, so no locks are needed.
+ * If the ring is full the producer sets overflow instead and the server
+ * treats the whole screen as damaged.
+ *
+ * This header is self contained so producers can include it on its own.
+ */
+
+/*
+ *  OSXvnc Copyright (C) 2002-2004 Redstone Software osxvnc@redstonesoftware.com
+ *  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#ifndef __SHMFB_H__
+#define __SHMFB_H__
+
+#include <stdint.h>
+
+#define rfbShmMagic 0x52464253          /* "RFBS" */
+#define rfbShmVersion 1
+#define rfbShmRingSize 1024             /* entries, must be a power of two */
+
+/* Full memory barrier, needed between writing a ring entry and publishing it */
+#define rfbShmBarrier() __sync_synchronize()
+
+typedef struct {
+    uint16_t x;
+    uint16_t y;
+    uint16_t w;
+    uint16_t h;
+} rfbShmDamage;
+
+typedef struct {
+    uint32_t magic;                     /* rfbShmMagic */
+    uint32_t version;                   /* rfbShmVersion */
+
+    /* Geometry and pixel format, as in rfbPixelFormat.  Only change these
+       together with a resize of the segment. */
+
+    uint32_t width;
+    uint32_t height;
+    uint32_t bytesPerRow;
+    uint32_t pixelOffset;               /* from the start of the segment */
+    uint8_t  bitsPerPixel;
+    uint8_t  depth;
+    uint8_t  bigEndian;
+    uint8_t  pad1;
+    uint16_t redMax;
+    uint16_t greenMax;
+    uint16_t blueMax;
+    uint8_t  redShift;
+    uint8_t  greenShift;
+    uint8_t  blueShift;
+    uint8_t  pad2[3];
+
+    /* Damage ring */
+
+    uint32_t ringSize;                  /* rfbShmRingSize */
+    volatile uint32_t ringHead;         /* next entry the producer writes */
+    volatile uint32_t ringTail;         /* next entry the server reads */
+    volatile uint32_t overflow;         /* ring was full, everything is damaged */
+
+    rfbShmDamage ring[rfbShmRingSize];
+} rfbShmHeader;
+
+
+/*
+ * rfbShmPushDamage is the producer side of the ring.  Returns 0 if the entry
+ * went into the ring, 1 if the ring was full and overflow was set instead.
+ */
+
+static __inline__ int rfbShmPushDamage(rfbShmHeader *hdr, int x, int y, int w, int h) {
+    uint32_t head = hdr->ringHead;
+
+    if (head - hdr->ringTail >= rfbShmRingSize) {
+        hdr->overflow = 1;
+        return 1;
+    }
+
+    hdr->ring[head & (rfbShmRingSize - 1)].x = x;
+    hdr->ring[head & (rfbShmRingSize - 1)].y = y;
+    hdr->ring[head & (rfbShmRingSize - 1)].w = w;
+    hdr->ring[head & (rfbShmRingSize - 1)].h = h;
+    rfbShmBarrier();
+    hdr->ringHead = head + 1;
+
+    return 0;
+}
+
+#endif
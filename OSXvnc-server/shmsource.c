@@ -0,0 +1,247 @@
+/*
+ * shmsource.c - framebuffer source backed by a shared memory segment.
+ *
+ * An external producer writes pixels and damage into a segment laid out as
+ * described in shmfb.h.  We encode straight out of the mapping and a
+ * consumer thread drains the damage ring, so there is no dependency on the
+ * CoreGraphics callback or the run loop.
+ */
+
+/*
+ *  OSXvnc Copyright (C) 2002-2004 Redstone Software osxvnc@redstonesoftware.com
+ *  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "rfb.h"
+#include "shmfb.h"
+
+char *rfbShmFramebufferPath = NULL;
+int rfbShmPollInterval = 2;     /* in ms, how often to look at an empty ring */
+
+static int shmFd = -1;
+static size_t shmSize = 0;
+static rfbShmHeader *shmHeader = NULL;
+
+static pthread_t shmThread;
+static Bool shmRunning = FALSE;
+
+static void shmUnmap(void) {
+    if (shmHeader)
+        munmap((void *)shmHeader, shmSize);
+    if (shmFd != -1)
+        close(shmFd);
+    shmHeader = NULL;
+    shmFd = -1;
+    shmSize = 0;
+}
+
+static Bool shmMap(void) {
+    struct stat st;
+    void *addr;
+
+    if (!rfbShmFramebufferPath) {
+        rfbLog("shmfb: no segment given\n");
+        return FALSE;
+    }
+
+    /* A path on disk (or in /dev/shm), otherwise a POSIX shm object name */
+    shmFd = open(rfbShmFramebufferPath, O_RDWR);
+    if (shmFd == -1 && errno == ENOENT)
+        shmFd = shm_open(rfbShmFramebufferPath, O_RDWR, 0);
+    if (shmFd == -1) {
+        rfbLogPerror("shmfb: open");
+        return FALSE;
+    }
+
+    if (fstat(shmFd, &st) != 0 || st.st_size < (off_t)sizeof(rfbShmHeader)) {
+        rfbLog("shmfb: %s is too small for a header\n", rfbShmFramebufferPath);
+        shmUnmap();
+        return FALSE;
+    }
+
+    addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, shmFd, 0);
+    if (addr == MAP_FAILED) {
+        rfbLogPerror("shmfb: mmap");
+        shmUnmap();
+        return FALSE;
+    }
+    shmHeader = (rfbShmHeader *)addr;
+    shmSize = st.st_size;
+
+    if (shmHeader->magic != rfbShmMagic || shmHeader->version != rfbShmVersion ||
+        shmHeader->ringSize != rfbShmRingSize) {
+        rfbLog("shmfb: %s is not a version %d segment\n", rfbShmFramebufferPath, rfbShmVersion);
+        shmUnmap();
+        return FALSE;
+    }
+
+    if (shmHeader->bitsPerPixel != 8 && shmHeader->bitsPerPixel != 16 && shmHeader->bitsPerPixel != 32) {
+        rfbLog("shmfb: unsupported bits per pixel %d\n", shmHeader->bitsPerPixel);
+        shmUnmap();
+        return FALSE;
+    }
+
+    if (shmHeader->bytesPerRow < shmHeader->width * (shmHeader->bitsPerPixel / 8) ||
+        (size_t)shmHeader->pixelOffset + (size_t)shmHeader->bytesPerRow * shmHeader->height > shmSize) {
+        rfbLog("shmfb: %s is too small for %dx%d pixels\n", rfbShmFramebufferPath,
+               shmHeader->width, shmHeader->height);
+        shmUnmap();
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+/*
+ * The consumer thread.  Everything pending in the ring is collected into a
+ * single region which is then handed to the clients in one go.
+ */
+
+static void *shmRun(void *ignore) {
+    RegionRec damage, tmpRegion;
+    BoxRec box;
+    BoxPtr pBox = &box;
+    uint32_t head, tail;
+
+    while (shmRunning) {
+        head = shmHeader->ringHead;
+        rfbShmBarrier();
+        tail = shmHeader->ringTail;
+
+        if (head == tail && !shmHeader->overflow) {
+            usleep(rfbShmPollInterval * 1000);
+            continue;
+        }
+
+        REGION_INIT(&hackScreen, &damage, NullBox, 0);
+
+        if (__sync_lock_test_and_set(&shmHeader->overflow, 0)) {
+            box.x1 = box.y1 = 0;
+            box.x2 = rfbScreen.width;
+            box.y2 = rfbScreen.height;
+            REGION_RESET(&hackScreen, &damage, &box);
+        }
+
+        while (tail != head) {
+            rfbShmDamage *entry = &shmHeader->ring[tail & (rfbShmRingSize - 1)];
+
+            box.x1 = min(entry->x, rfbScreen.width);
+            box.y1 = min(entry->y, rfbScreen.height);
+            box.x2 = min(entry->x + entry->w, rfbScreen.width);
+            box.y2 = min(entry->y + entry->h, rfbScreen.height);
+            tail++;
+
+            SAFE_REGION_INIT(&hackScreen, &tmpRegion, pBox, 0);
+            REGION_UNION(&hackScreen, &damage, &damage, &tmpRegion);
+            REGION_UNINIT(&hackScreen, &tmpRegion);
+        }
+
+        /* Entries are copied out, let the producer reuse them */
+        rfbShmBarrier();
+        shmHeader->ringTail = tail;
+
+        rfbMarkRegionModified(&damage);
+        REGION_UNINIT(&hackScreen, &damage);
+    }
+
+    return NULL;
+}
+
+static Bool shmInit(void) {
+    shmUnmap();
+    if (!shmMap())
+        return FALSE;
+
+    rfbScreen.width = shmHeader->width;
+    rfbScreen.height = shmHeader->height;
+    rfbScreen.bitsPerPixel = shmHeader->bitsPerPixel;
+    rfbScreen.depth = shmHeader->depth;
+    rfbScreen.paddedWidthInBytes = shmHeader->bytesPerRow;
+    rfbScreen.sizeInBytes = shmHeader->bytesPerRow * shmHeader->height;
+
+    rfbServerFormat.bitsPerPixel = shmHeader->bitsPerPixel;
+    rfbServerFormat.depth = shmHeader->depth;
+    rfbServerFormat.bigEndian = shmHeader->bigEndian ? 1 : 0;
+    rfbServerFormat.trueColour = TRUE;
+    rfbServerFormat.redMax = shmHeader->redMax;
+    rfbServerFormat.greenMax = shmHeader->greenMax;
+    rfbServerFormat.blueMax = shmHeader->blueMax;
+    rfbServerFormat.redShift = shmHeader->redShift;
+    rfbServerFormat.greenShift = shmHeader->greenShift;
+    rfbServerFormat.blueShift = shmHeader->blueShift;
+
+    rfbLog("Shared memory framebuffer %s %dx%d depth %d\n", rfbShmFramebufferPath,
+           rfbScreen.width, rfbScreen.height, rfbScreen.depth);
+
+    return TRUE;
+}
+
+static char *shmGetFramebuffer(void) {
+    return (char *)shmHeader + shmHeader->pixelOffset;
+}
+
+static void shmGetGeometry(int *width, int *height, int *bitsPerPixel) {
+    *width = shmHeader->width;
+    *height = shmHeader->height;
+    *bitsPerPixel = shmHeader->bitsPerPixel;
+}
+
+static Bool shmStart(void) {
+    if (shmRunning)
+        return TRUE;
+
+    /* Whatever was queued before anyone was watching is stale */
+    shmHeader->ringTail = shmHeader->ringHead;
+
+    shmRunning = TRUE;
+    if (pthread_create(&shmThread, NULL, shmRun, NULL) != 0) {
+        rfbLogPerror("shmfb: pthread_create");
+        shmRunning = FALSE;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void shmStop(void) {
+    if (!shmRunning)
+        return;
+
+    shmRunning = FALSE;
+    pthread_join(shmThread, NULL);
+}
+
+rfbFramebufferSource rfbSharedMemorySource = {
+    "shmfb",
+    shmInit,
+    shmGetFramebuffer,
+    shmGetGeometry,
+    shmStart,
+    shmStop
+};
@@ -44,12 +44,18 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/sockios.h>
+#endif
 #include <netinet/in.h>
 //#include <netinet/tcp.h> -- This conflicts with Carbon
 #include <netdb.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
+#include <string.h>
 #include <pthread.h>
 
 #include "rfb.h"
@@ -57,20 +63,65 @@
 int rfbMaxClientWait = 20000;   /* time (ms) after which we decide client has
                                    gone away - needed to stop us hanging */
 
+static int WriteQueued(rfbClientPtr cl, struct iovec *iov, int count);
+
 
 void
 rfbCloseClient(cl)
      rfbClientPtr cl;
 {
-    close(cl->sock);
+    /* The reactor closes the descriptor itself once it has let go of the
+       client, so the number can't be handed out again under it */
+    if (cl->reactorFd != -1)
+        shutdown(cl->sock, SHUT_RDWR);
+    else
+        close(cl->sock);
     cl->sock = -1;
+    rfbWakeClient(cl);
+}
+
+
+/*
+ * rfbSocketUnsentBytes is how much output to the client hasn't gone yet:
+ * what the socket is still holding plus anything the reactor has kept back.
+ * Returns -1 if the system can't say.
+ */
+
+int
+rfbSocketUnsentBytes(cl)
+     rfbClientPtr cl;
+{
+    int n = -1;
+#if defined(SO_NWRITE)
+    socklen_t len = sizeof(n);
+
+    if (getsockopt(cl->sock, SOL_SOCKET, SO_NWRITE, &n, &len) < 0)
+        return -1;
+#elif defined(SIOCOUTQ)
+    if (ioctl(cl->sock, SIOCOUTQ, &n) < 0)
+        return -1;
+#endif
+    if (n < 0)
+        return -1;
+
+    pthread_mutex_lock(&cl->writeMutex);
+    n += cl->pendingLen;
+    pthread_mutex_unlock(&cl->writeMutex);
+    return n;
 }
 
 
+/* How much room rfbReadAvailable keeps free for each read */
+#define INPUT_CHUNK 4096
+
 /*
  * ReadExact reads an exact number of bytes from a client.  Returns 1 if
  * those bytes have been read, 0 if the other end has closed, or -1 if an error
  * occurred (errno is set to ETIMEDOUT if it timed out).
+ *
+ * Clients of the reactor are read from their input buffer instead, which
+ * already holds the whole message (see rfbClientMessageLength), so this
+ * never waits for them.
  */
 
 int
@@ -83,6 +134,21 @@ ReadExact(cl, buf, len)
     int n;
     fd_set fds;
     struct timeval tv;
+    char *start = buf;
+
+    if (cl->reactorFd != -1) {
+        if (cl->inputLen < len) {
+            rfbLog("ReadExact: only %d of a %d byte read has arrived\n", cl->inputLen, len);
+            errno = EIO;
+            return -1;
+        }
+        memcpy(buf, cl->inputBuf + cl->inputStart, len);
+        cl->inputStart += len;
+        cl->inputLen -= len;
+        if (cl->recordId)
+            rfbRecordClientBytes(cl, start, len);
+        return 1;
+    }
 
     while (len > 0) {
         n = read(sock, buf, len);
@@ -116,11 +182,58 @@ ReadExact(cl, buf, len)
             }
         }
     }
+
+    if (cl->recordId)
+        rfbRecordClientBytes(cl, start, buf - start);
     return 1;
 }
 
 
 
+/*
+ * rfbReadAvailable is how clients of the reactor read.  It adds whatever the
+ * socket has to the client's input buffer without waiting, growing the
+ * buffer as a long message arrives.  Returns 1 if it read anything or there
+ * was nothing to read yet, 0 if the other end has closed, or -1 on error.
+ */
+
+int
+rfbReadAvailable(cl)
+     rfbClientPtr cl;
+{
+    char *newBuf;
+    int n, size;
+
+    if (cl->inputStart > 0) {
+        memmove(cl->inputBuf, cl->inputBuf + cl->inputStart, cl->inputLen);
+        cl->inputStart = 0;
+    }
+
+    if (cl->inputSize - cl->inputLen < INPUT_CHUNK) {
+        size = (cl->inputSize > 0x3fffffff) ? -1 :
+               max(cl->inputSize * 2, cl->inputLen + INPUT_CHUNK);
+        if (size < 0 || (newBuf = (char *)xrealloc(cl->inputBuf, size)) == NULL) {
+            rfbLog("rfbReadAvailable: out of memory keeping %d bytes of input\n", cl->inputLen);
+            errno = ENOMEM;
+            return -1;
+        }
+        cl->inputBuf = newBuf;
+        cl->inputSize = size;
+    }
+
+    n = recv(cl->sock, cl->inputBuf + cl->inputLen, cl->inputSize - cl->inputLen, MSG_DONTWAIT);
+    if (n > 0) {
+        cl->inputLen += n;
+        return 1;
+    }
+    if (n == 0)
+        return 0;
+    if (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR)
+        return 1;
+    return -1;
+}
+
+
 /*
  * WriteExact writes an exact number of bytes to a client.  Returns 1 if
  * those bytes have been written, or -1 if an error occurred (errno is set to
@@ -139,6 +252,13 @@ WriteExact(cl, buf, len)
     struct timeval tv;
     int totalTimeWaited = 0;
 
+    if (cl->reactorFd != -1) {
+        struct iovec iov;
+
+        iov.iov_base = buf;
+        iov.iov_len = len;
+        return WriteQueued(cl, &iov, 1);
+    }
 
 	//    pthread_mutex_lock(&cl->outputMutex);
     while (len > 0) {
@@ -189,3 +309,223 @@ WriteExact(cl, buf, len)
     //pthread_mutex_unlock(&cl->outputMutex);
     return 1;
 }
+
+
+/*
+ * Step past n bytes of written iovecs.
+ */
+
+static void
+ConsumeIov(iovp, countp, n)
+     struct iovec **iovp;
+     int *countp;
+     int n;
+{
+    struct iovec *iov = *iovp;
+    int count = *countp;
+
+    while (count > 0 && (size_t)n >= iov->iov_len) {
+        n -= iov->iov_len;
+        iov++;
+        count--;
+    }
+    if (n > 0) {
+        iov->iov_base = (char *)iov->iov_base + n;
+        iov->iov_len -= n;
+    }
+    *iovp = iov;
+    *countp = count;
+}
+
+
+/*
+ * WriteExactV is WriteExact for count pieces of data gathered with writev.
+ * The iovecs are used up as they are written, and count should be no more
+ * than IOV_MAX.
+ */
+
+static int WriteBlocking(rfbClientPtr cl, struct iovec *iov, int count);
+
+int
+WriteExactV(cl, iov, count)
+     rfbClientPtr cl;
+     struct iovec *iov;
+     int count;
+{
+    if (cl->reactorFd != -1)
+        return WriteQueued(cl, iov, count);
+    return WriteBlocking(cl, iov, count);
+}
+
+static int
+WriteBlocking(cl, iov, count)
+     rfbClientPtr cl;
+     struct iovec *iov;
+     int count;
+{
+    int sock = cl->sock;
+    int n;
+    fd_set fds;
+    struct timeval tv;
+    int totalTimeWaited = 0;
+
+    while (count > 0) {
+        if (iov->iov_len == 0) {
+            iov++;
+            count--;
+            continue;
+        }
+
+        n = writev(sock, iov, count);
+
+        if (n > 0) {
+
+            ConsumeIov(&iov, &count, n);
+
+        } else if (n == 0) {
+
+            rfbLog("WriteExactV: writev returned 0?\n");
+            exit(1);
+
+        } else {
+            if (errno != EWOULDBLOCK && errno != EAGAIN)
+                return n;
+
+            /* As in WriteExact */
+
+            FD_ZERO(&fds);
+            FD_SET(sock, &fds);
+            tv.tv_sec = 5;
+            tv.tv_usec = 0;
+            n = select(sock+1, NULL, &fds, NULL, &tv);
+            if (n < 0) {
+                rfbLogPerror("WriteExactV: select");
+                return n;
+            }
+            if (n == 0) {
+                totalTimeWaited += 5000;
+                if (totalTimeWaited >= rfbMaxClientWait) {
+                    errno = ETIMEDOUT;
+                    return -1;
+                }
+            } else {
+                totalTimeWaited = 0;
+            }
+        }
+    }
+    return 1;
+}
+
+
+/*
+ * WriteQueued is how clients of the reactor write.  It writes what the socket
+ * will take without waiting and keeps the rest back for rfbFlushPendingOutput,
+ * which the reactor runs once the socket can take more.  Anything written
+ * while output is waiting goes behind it.  It never waits for a slow client:
+ * the output job sends the client no new update until what is kept back has
+ * gone, so at most one update and the odd small message pile up here.
+ */
+
+static int
+WriteQueued(cl, iov, count)
+     rfbClientPtr cl;
+     struct iovec *iov;
+     int count;
+{
+    struct msghdr msg;
+    int n, i, total = 0;
+
+    pthread_mutex_lock(&cl->writeMutex);
+
+    if (cl->pendingLen == 0) {
+        while (count > 0) {
+            if (iov->iov_len == 0) {
+                iov++;
+                count--;
+                continue;
+            }
+
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+            n = sendmsg(cl->sock, &msg, MSG_DONTWAIT);
+
+            if (n < 0) {
+                if (errno == EWOULDBLOCK || errno == EAGAIN)
+                    break;
+                pthread_mutex_unlock(&cl->writeMutex);
+                return n;
+            }
+            ConsumeIov(&iov, &count, n);
+        }
+    }
+
+    for (i = 0; i < count; i++)
+        total += iov[i].iov_len;
+    if (total == 0) {
+        pthread_mutex_unlock(&cl->writeMutex);
+        return 1;
+    }
+
+    if (cl->pendingStart + cl->pendingLen + total > cl->pendingSize) {
+        memmove(cl->pendingBuf, cl->pendingBuf + cl->pendingStart, cl->pendingLen);
+        cl->pendingStart = 0;
+        if (cl->pendingLen + total > cl->pendingSize) {
+            char *newBuf = (char *)xrealloc(cl->pendingBuf, cl->pendingLen + total);
+            if (newBuf == NULL) {
+                rfbLog("WriteQueued: out of memory keeping back %d bytes\n",
+                       cl->pendingLen + total);
+                cl->pendingLen = 0;
+                pthread_mutex_unlock(&cl->writeMutex);
+                rfbCloseClient(cl);
+                return -1;
+            }
+            cl->pendingBuf = newBuf;
+            cl->pendingSize = cl->pendingLen + total;
+        }
+    }
+    for (i = 0; i < count; i++) {
+        memcpy(cl->pendingBuf + cl->pendingStart + cl->pendingLen, iov[i].iov_base, iov[i].iov_len);
+        cl->pendingLen += iov[i].iov_len;
+    }
+    pthread_mutex_unlock(&cl->writeMutex);
+
+    rfbReactorWantWrite(cl);
+    return 1;
+}
+
+
+/*
+ * rfbFlushPendingOutput writes as much of the kept back output as the socket
+ * will take.  Returns 1 once it has all gone, 0 if some is still waiting (and
+ * the reactor has been asked to say when it can go) or -1 on error.
+ */
+
+int
+rfbFlushPendingOutput(cl)
+     rfbClientPtr cl;
+{
+    int n, result = 1;
+
+    pthread_mutex_lock(&cl->writeMutex);
+    if (cl->sock == -1)
+        cl->pendingLen = 0;
+
+    while (cl->pendingLen > 0) {
+        n = send(cl->sock, cl->pendingBuf + cl->pendingStart, cl->pendingLen, MSG_DONTWAIT);
+        if (n > 0) {
+            cl->pendingStart += n;
+            cl->pendingLen -= n;
+        } else {
+            result = (n < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) ? 0 : -1;
+            break;
+        }
+    }
+    if (cl->pendingLen == 0)
+        cl->pendingStart = 0;
+    pthread_mutex_unlock(&cl->writeMutex);
+
+    if (result == 0)
+        rfbReactorWantWrite(cl);
+    return result;
+}
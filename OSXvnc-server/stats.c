@@ -1,5 +1,10 @@
 /*
  * stats.c
+ *
+ * Per-client counters, printed when a client goes and readable while it's
+ * connected from -statssocket.  Anything connecting to that UNIX socket
+ * gets a snapshot of every client in Prometheus' text format and is then
+ * disconnected.  Histograms have power of two buckets in microseconds.
  */
 
 /*
@@ -25,8 +30,21 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include "rfb.h"
 
+char *rfbStatsSocketPath = NULL;
+
+static int statsListenFd = -1;
+
 char* encNames[] = {
     "Raw", "CopyRect", "RRE", "[encoding 3]", "CoRRE", "Hextile",
     "Zlib", "Tight", "ZlibHextile", "[encoding 9]",
@@ -46,19 +64,69 @@ void rfbResetStats(rfbClientPtr cl) {
     cl->rfbRawBytesEquivalent = 0;
     cl->rfbKeyEventsRcvd = 0;
     cl->rfbPointerEventsRcvd = 0;
+    cl->rfbZlibBytesIn = 0;
+    cl->rfbZlibBytesOut = 0;
+    memset(cl->rfbEncodeTimeHist, 0, sizeof(cl->rfbEncodeTimeHist));
+    memset(cl->rfbUpdateLatencyHist, 0, sizeof(cl->rfbUpdateLatencyHist));
+    cl->statsDamageSince = 0;
+    cl->rfbFramesDropped = 0;
+    cl->rfbSendQueueDepth = 0;
+    cl->rfbSendQueueMax = 0;
+}
+
+/*
+ * rfbStatsBytesSent is the total sent in framebuffer updates so far.
+ */
+
+unsigned long long rfbStatsBytesSent(rfbClientPtr cl) {
+    unsigned long long total = cl->rfbLastRectBytesSent;
+    int i;
+
+    for (i = 0; i < MAX_ENCODINGS; i++)
+        total += cl->rfbBytesSent[i];
+    return total;
+}
+
+void rfbStatsHistAdd(unsigned long long *hist, rfbPaceTime us) {
+    int b = 0;
+
+    while (us > 1 && b < STATS_HIST_BUCKETS - 1) {
+        us >>= 1;
+        b++;
+    }
+    hist[b]++;
+}
+
+/*
+ * rfbStatsUpdateSent is called once an update has been written, with the
+ * time the oldest damage in it arrived (0 if none did).
+ */
+
+void rfbStatsUpdateSent(rfbClientPtr cl, rfbPaceTime damageSince) {
+    if (damageSince)
+        rfbStatsHistAdd(cl->rfbUpdateLatencyHist, rfbPacingNow() - damageSince);
+}
+
+static unsigned long long HistTotal(unsigned long long *hist) {
+    unsigned long long total = 0;
+    int b;
+
+    for (b = 0; b < STATS_HIST_BUCKETS; b++)
+        total += hist[b];
+    return total;
 }
 
 void
 rfbPrintStats(rfbClientPtr cl)
 {
     int i;
-    int totalRectanglesSent = 0;
-    int totalBytesSent = 0;
+    unsigned long long totalRectanglesSent = 0;
+    unsigned long long totalBytesSent = 0;
 
     rfbLog("Statistics:\n");
 
     if ((cl->rfbKeyEventsRcvd != 0) || (cl->rfbPointerEventsRcvd != 0))
-        rfbLog("  key events received %d, pointer events %d\n",
+        rfbLog("  key events received %llu, pointer events %llu\n",
                 cl->rfbKeyEventsRcvd, cl->rfbPointerEventsRcvd);
 
     for (i = 0; i < MAX_ENCODINGS; i++) {
@@ -68,26 +136,254 @@ rfbPrintStats(rfbClientPtr cl)
     totalRectanglesSent += cl->rfbLastRectMarkersSent;
     totalBytesSent += cl->rfbLastRectBytesSent;
 
-    rfbLog("  framebuffer updates %d, rectangles %d, bytes %d\n",
+    rfbLog("  framebuffer updates %llu, rectangles %llu, bytes %llu\n",
             cl->rfbFramebufferUpdateMessagesSent, totalRectanglesSent,
             totalBytesSent);
 
     if (cl->rfbLastRectMarkersSent != 0)
-        rfbLog("    LastRect markers %d, bytes %d\n",
+        rfbLog("    LastRect markers %llu, bytes %llu\n",
                 cl->rfbLastRectMarkersSent, cl->rfbLastRectBytesSent);
 
     for (i = 0; i < MAX_ENCODINGS; i++) {
         if (cl->rfbRectanglesSent[i] != 0)
-            rfbLog("    %s rectangles %d, bytes %d\n",
+            rfbLog("    %s rectangles %llu, bytes %llu\n",
                    encNames[i], cl->rfbRectanglesSent[i], cl->rfbBytesSent[i]);
     }
 
     if ((totalBytesSent - cl->rfbBytesSent[rfbEncodingCopyRect]) != 0) {
-        rfbLog("  raw bytes equivalent %d, compression ratio %f\n",
+        rfbLog("  raw bytes equivalent %llu, compression ratio %f\n",
                 cl->rfbRawBytesEquivalent,
                 (double)cl->rfbRawBytesEquivalent
                 / (double)(totalBytesSent -
                            cl->rfbBytesSent[rfbEncodingCopyRect] -
                            cl->rfbLastRectBytesSent));
     }
+
+    if (cl->rfbFramebufferUpdateMessagesSent != 0)
+        rfbLog("  average time to encode and write an update %llu us\n",
+                cl->paceEncodeTime);
+
+    if (cl->rfbZlibBytesOut != 0)
+        rfbLog("  zlib in %llu, out %llu bytes, ratio %f\n",
+                cl->rfbZlibBytesIn, cl->rfbZlibBytesOut,
+                (double)cl->rfbZlibBytesIn / (double)cl->rfbZlibBytesOut);
+
+    if (cl->linkSamples != 0)
+        rfbLog("  link estimate %llu KB/s, round trip %llu ms\n",
+                cl->linkBandwidth / 1024, cl->linkRtt / 1000);
+
+    if (cl->rfbSendQueueMax != 0)
+        rfbLog("  frames dropped while backed up %llu, send queue now %d max %d bytes\n",
+                cl->rfbFramesDropped, cl->rfbSendQueueDepth, cl->rfbSendQueueMax);
+
+    if (rfbDamageBatches != 0)
+        rfbLog("  server damage batches %lu in %lu merges, latency avg %lu max %lu us\n",
+                rfbDamageBatches, rfbDamageMerges,
+                (unsigned long)(rfbDamageLatencyTotal / rfbDamageBatches),
+                rfbDamageLatencyMax);
+
+    if (rfbTileCacheHits + rfbTileCacheMisses != 0)
+        rfbLog("  server tile cache hits %lu, misses %lu, evictions %lu\n",
+                rfbTileCacheHits, rfbTileCacheMisses, rfbTileCacheEvictions);
+
+    if (rfbShadowPixelsReported != 0)
+        rfbLog("  shadow kept %llu of %llu damaged pixels (%.1f%%)\n",
+                rfbShadowPixelsChanged, rfbShadowPixelsReported,
+                100.0 * rfbShadowPixelsChanged / rfbShadowPixelsReported);
+}
+
+
+/*
+ * Write every client's statistics to a buffer in Prometheus' text format.
+ * The buffer grows as it's written; once it can't, the rest is dropped and
+ * failed is set.
+ */
+
+typedef struct {
+    char *data;
+    int len, size;
+    Bool failed;
+} statsBuffer;
+
+static void Append(statsBuffer *b, const char *format, ...) {
+    va_list args;
+    char *newData;
+    int n, newSize;
+
+    while (!b->failed) {
+        va_start(args, format);
+        n = vsnprintf(b->data + b->len, b->size - b->len, format, args);
+        va_end(args);
+        if (n < 0) {
+            b->failed = TRUE;
+            return;
+        }
+        if (n < b->size - b->len) {
+            b->len += n;
+            return;
+        }
+
+        newSize = max(b->size * 2, b->len + n + 1);
+        if ((newData = (char *)xrealloc(b->data, newSize)) == NULL) {
+            b->failed = TRUE;
+            return;
+        }
+        b->data = newData;
+        b->size = newSize;
+    }
+}
+
+static void WriteHist(statsBuffer *out, char *name, char *labels, unsigned long long *hist) {
+    unsigned long long count = 0;
+    int b;
+
+    for (b = 0; b < STATS_HIST_BUCKETS; b++) {
+        count += hist[b];
+        if (b < STATS_HIST_BUCKETS - 1)
+            Append(out, "%s_bucket{%s,le=\"%llu\"} %llu\n", name, labels, (2ULL << b) - 1, count);
+    }
+    Append(out, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels, count);
+    Append(out, "%s_count{%s} %llu\n", name, labels, count);
+}
+
+static void WriteClientStats(statsBuffer *out, rfbClientPtr cl, int n) {
+    char labels[300], encLabels[400];
+    int i, unsent;
+
+    snprintf(labels, sizeof(labels), "client=\"%d\",host=\"%s\"", n, cl->host);
+
+    Append(out, "vnc_client_updates{%s} %llu\n", labels, cl->rfbFramebufferUpdateMessagesSent);
+    Append(out, "vnc_client_bytes_sent{%s} %llu\n", labels, rfbStatsBytesSent(cl));
+    Append(out, "vnc_client_raw_bytes_equivalent{%s} %llu\n", labels, cl->rfbRawBytesEquivalent);
+    Append(out, "vnc_client_key_events{%s} %llu\n", labels, cl->rfbKeyEventsRcvd);
+    Append(out, "vnc_client_pointer_events{%s} %llu\n", labels, cl->rfbPointerEventsRcvd);
+    Append(out, "vnc_client_zlib_bytes_in{%s} %llu\n", labels, cl->rfbZlibBytesIn);
+    Append(out, "vnc_client_zlib_bytes_out{%s} %llu\n", labels, cl->rfbZlibBytesOut);
+    Append(out, "vnc_client_frames_dropped{%s} %llu\n", labels, cl->rfbFramesDropped);
+    unsent = (cl->sock != -1) ? rfbSocketUnsentBytes(cl) : 0;
+    Append(out, "vnc_client_bytes_in_flight{%s} %d\n", labels, max(unsent, 0));
+    Append(out, "vnc_client_send_queue_max{%s} %d\n", labels, cl->rfbSendQueueMax);
+    Append(out, "vnc_client_link_bandwidth{%s} %llu\n", labels, cl->linkBandwidth);
+    Append(out, "vnc_client_link_rtt_us{%s} %llu\n", labels, cl->linkRtt);
+    Append(out, "vnc_client_encode_time_avg_us{%s} %llu\n", labels, cl->paceEncodeTime);
+
+    for (i = 0; i < MAX_ENCODINGS; i++) {
+        if (!encNames[i] || (cl->rfbRectanglesSent[i] == 0 && HistTotal(cl->rfbEncodeTimeHist[i]) == 0))
+            continue;
+        snprintf(encLabels, sizeof(encLabels), "%s,encoding=\"%s\"", labels, encNames[i]);
+        Append(out, "vnc_client_rectangles{%s} %llu\n", encLabels, cl->rfbRectanglesSent[i]);
+        Append(out, "vnc_client_encoding_bytes{%s} %llu\n", encLabels, cl->rfbBytesSent[i]);
+        if (HistTotal(cl->rfbEncodeTimeHist[i]))
+            WriteHist(out, "vnc_client_encode_time_us", encLabels, cl->rfbEncodeTimeHist[i]);
+    }
+
+    WriteHist(out, "vnc_client_update_latency_us", labels, cl->rfbUpdateLatencyHist);
+}
+
+static void WriteStats(statsBuffer *out) {
+    rfbClientIteratorPtr iterator;
+    rfbClientPtr cl;
+    int n = 0;
+
+    iterator = rfbGetClientIterator();
+    while ((cl = rfbClientIteratorNext(iterator)) != NULL)
+        WriteClientStats(out, cl, n++);
+    rfbReleaseClientIterator(iterator);
+
+    Append(out, "vnc_clients %d\n", n);
+    Append(out, "vnc_damage_batches %lu\n", rfbDamageBatches);
+    Append(out, "vnc_damage_merges %lu\n", rfbDamageMerges);
+    Append(out, "vnc_tile_cache_hits %lu\n", rfbTileCacheHits);
+    Append(out, "vnc_tile_cache_misses %lu\n", rfbTileCacheMisses);
+    Append(out, "vnc_shadow_pixels_reported %llu\n", rfbShadowPixelsReported);
+    Append(out, "vnc_shadow_pixels_changed %llu\n", rfbShadowPixelsChanged);
+}
+
+/*
+ * The snapshot is put together in memory and only written once the client
+ * list is let go, so a reader that stops reading holds up nothing but us.
+ */
+
+static void *statsRun(void *ignore) {
+    int fd, n, len;
+    statsBuffer b;
+    char *p;
+
+    for (;;) {
+        if ((fd = accept(statsListenFd, NULL, NULL)) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        b.len = 0;
+        b.size = 4096;
+        b.failed = ((b.data = (char *)xalloc(b.size)) == NULL);
+        WriteStats(&b);
+        if (b.failed) {
+            rfbLog("stats socket: out of memory writing statistics\n");
+            b.len = 0;
+        }
+
+        for (p = b.data, len = b.len; len > 0; p += n, len -= n) {
+            if ((n = write(fd, p, len)) < 0) {
+                if (errno == EINTR) {
+                    n = 0;
+                    continue;
+                }
+                break;
+            }
+        }
+        if (b.data)
+            xfree(b.data);
+        close(fd);
+    }
+    return NULL;
+}
+
+
+/*
+ * rfbStatsSocketStart listens on rfbStatsSocketPath, if it was given.  The
+ * socket is only accessible to our own user.
+ */
+
+void rfbStatsSocketStart(void) {
+    struct sockaddr_un addr;
+    pthread_t thread;
+
+    if (!rfbStatsSocketPath || statsListenFd != -1)
+        return;
+
+    if (strlen(rfbStatsSocketPath) >= sizeof(addr.sun_path)) {
+        rfbLog("Stats socket path %s is too long\n", rfbStatsSocketPath);
+        return;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, rfbStatsSocketPath);
+    unlink(rfbStatsSocketPath);
+
+    if ((statsListenFd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        rfbLogPerror("stats socket");
+        return;
+    }
+    if (bind(statsListenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        chmod(rfbStatsSocketPath, S_IRUSR | S_IWUSR) < 0 ||
+        listen(statsListenFd, 5) < 0 ||
+        pthread_create(&thread, NULL, statsRun, NULL) != 0) {
+        rfbLogPerror("stats socket");
+        close(statsListenFd);
+        statsListenFd = -1;
+        return;
+    }
+    pthread_detach(thread);
+    rfbLog("Statistics available from %s\n", rfbStatsSocketPath);
+}
+
+void rfbStatsSocketStop(void) {
+    if (statsListenFd == -1)
+        return;
+    shutdown(statsListenFd, SHUT_RDWR);
+    close(statsListenFd);
+    statsListenFd = -1;
+    unlink(rfbStatsSocketPath);
 }
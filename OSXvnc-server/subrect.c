@@ -0,0 +1,358 @@
+/*
+ * subrect.c - cut a rectangle into single-coloured subrectangles on a
+ * background, for RRE, CoRRE, Hextile and ZlibHex.
+ *
+ * The partition is the one krw's javatel code made, which the encoders
+ * have always sent: at each pixel, in order, that isn't background or
+ * already covered, take the bigger of the widest rectangle running down
+ * from it as far as the first row's run goes and the tallest one as wide
+ * as its narrowest row.
+ *
+ * Rather than overwriting each subrectangle with the background and
+ * looking at every pixel again, each row is first turned into two
+ * bitmasks, one bit a pixel:
+ *
+ *	- done, set for the background, and for each pixel as it's covered;
+ *	- starts, set where a run of one colour starts.
+ *
+ * Then the next subrectangle starts at the first bit of done that isn't
+ * set, 32 pixels at a time, and each of its rows runs to the next bit of
+ * either, so the rows that are looked at again and again are a few
+ * instructions each whatever their length.  The pixels are only read to
+ * make the bitmasks and to see if a row below has the same colour.
+ *
+ * Each row of a subrectangle and each word of done passed over is
+ * counted, and the search gives up once that's more than
+ * rfbSubrectBudget times the number of pixels, for the encoder to send
+ * the pixels raw instead.  A rectangle's rows are never more than its
+ * pixels, so no tile takes more than about two a pixel and the default
+ * only guards against the worst; -subrectbudget 1 trades some compression
+ * on busy tiles for less time.
+ */
+
+/*
+ *  OSXvnc Copyright (C) 2002-2004 Redstone Software osxvnc@redstonesoftware.com
+ *  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rfb.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define SUBRECT_SSE2
+#endif
+
+int rfbSubrectBudget = 4;
+Bool rfbSimdSubrect = TRUE;
+
+
+/* The first pixel after x where a row's run of one colour stops, which
+   the bit past the end of the row makes sure there is */
+
+static inline int RunEnd(CARD32 *done, CARD32 *starts, int x) {
+    int k = (x + 1) >> 5;
+    CARD32 bits = (done[k] | starts[k]) & ((CARD32)0xffffffff << ((x + 1) & 31));
+
+    while (!bits) {
+        k++;
+        bits = done[k] | starts[k];
+    }
+    return (k << 5) + __builtin_ctz(bits);
+}
+
+/* Marks n pixels from x in a row of a bitmask */
+
+static inline void SetBits(CARD32 *row, int x, int n) {
+    int k;
+
+    if ((x & 31) + n < 32) {
+        row[x >> 5] |= (((CARD32)1 << n) - 1) << (x & 31);
+        return;
+    }
+    for (; n > 0; x += k, n -= k) {
+        k = 32 - (x & 31);
+        if (k > n)
+            k = n;
+        row[x >> 5] |= (k == 32) ? 0xffffffff : (((CARD32)1 << k) - 1) << (x & 31);
+    }
+}
+
+
+/*
+ * With SSE2 the bitmasks are made from 128 / bpp pixels at a time, the
+ * starts by comparing them with the same pixels one to the left.
+ */
+
+#ifdef SUBRECT_SSE2
+static inline int PixelBits8(__m128i eq) {
+    return _mm_movemask_epi8(eq);
+}
+
+static inline int PixelBits16(__m128i eq) {
+    return _mm_movemask_epi8(_mm_packs_epi16(eq, eq)) & 0xFF;
+}
+
+static inline int PixelBits32(__m128i eq) {
+    return _mm_movemask_ps(_mm_castsi128_ps(eq));
+}
+
+#define SSE2_FIND_MASKS(bpp)                                                  \
+            if (rfbSimdSubrect) {                                             \
+                __m128i vbg = _mm_set1_epi##bpp(bg);                          \
+                                                                              \
+                for (; i + 128 / bpp <= n; i += 128 / bpp) {                  \
+                    __m128i v = _mm_loadu_si128((const __m128i *)(line + x + i)); \
+                    __m128i prev = (x + i > 0)                                \
+                        ? _mm_loadu_si128((const __m128i *)(line + x + i - 1)) \
+                        : _mm_slli_si128(v, bpp / 8);                         \
+                                                                              \
+                    doneBits |= (CARD32)PixelBits##bpp(_mm_cmpeq_epi##bpp(v, vbg)) << i; \
+                    startBits |= (CARD32)(~PixelBits##bpp(_mm_cmpeq_epi##bpp(v, prev)) \
+                                          & ((1 << (128 / bpp)) - 1)) << i;   \
+                }                                                             \
+            }
+#else
+#define SSE2_FIND_MASKS(bpp)
+#endif
+
+
+#define DEFINE_SUBRECT_FUNCTIONS(bpp)                                         \
+                                                                              \
+static void                                                                   \
+FindMasks##bpp(rfbSubrectSearch *s)                                           \
+{                                                                             \
+    CARD##bpp *line = (CARD##bpp *)s->data;                                   \
+    CARD##bpp bg = (CARD##bpp)s->bg;                                          \
+    CARD32 *done = s->done, *starts = s->starts;                              \
+    CARD32 doneBits, startBits;                                               \
+    int x, y, i, n;                                                           \
+                                                                              \
+    for (y = 0; y < s->h; y++, line += s->stride) {                           \
+        for (x = 0; x < s->w; x += 32) {                                      \
+            n = (s->w - x < 32) ? s->w - x : 32;                              \
+            doneBits = 0;                                                     \
+            startBits = (x == 0);                                             \
+            i = 0;                                                            \
+            SSE2_FIND_MASKS(bpp)                                              \
+            for (; i < n; i++) {                                              \
+                doneBits |= (CARD32)(line[x + i] == bg) << i;                 \
+                if (x + i > 0)                                                \
+                    startBits |= (CARD32)(line[x + i] != line[x + i - 1]) << i; \
+            }                                                                 \
+            if (n < 32) {                                                     \
+                doneBits |= (CARD32)0xffffffff << n;                          \
+                startBits |= (CARD32)0xffffffff << n;                         \
+            }                                                                 \
+            *done++ = doneBits;                                               \
+            *starts++ = startBits;                                            \
+        }                                                                     \
+        if (s->w % 32 == 0) {                                                 \
+            *done++ = 0xffffffff;                                             \
+            *starts++ = 0xffffffff;                                           \
+        }                                                                     \
+    }                                                                         \
+}                                                                             \
+                                                                              \
+static int                                                                    \
+NextSubrects##bpp(rfbSubrectSearch *s, rfbSubrect *sr, int max)               \
+{                                                                             \
+    CARD##bpp *data = (CARD##bpp *)s->data;                                   \
+    CARD##bpp fg;                                                             \
+    CARD32 *done;                                                             \
+    CARD32 bits;                                                              \
+    int w = s->w, h = s->h, stride = s->stride;                               \
+    int wordsPerRow = s->wordsPerRow;                                         \
+    int x = s->x, y = s->y;                                                   \
+    int work = s->work, budget = s->budget;                                   \
+    int found = 0;                                                            \
+    int i, j;                                                                 \
+    int hx, hy, vx, vy;                                                       \
+    Bool hyflag;                                                              \
+                                                                              \
+    for (; y < h; y++, x = 0) {                                               \
+        done = s->done + y * wordsPerRow;                                     \
+        while (x < w) {                                                       \
+            bits = ~done[x >> 5] >> (x & 31);                                 \
+            if (!bits) {                                                      \
+                x = (x | 31) + 1;                                             \
+                work++;                                                       \
+                continue;                                                     \
+            }                                                                 \
+            x += __builtin_ctz(bits);                                         \
+            if (x >= w)                                                       \
+                break;                                                        \
+                                                                              \
+            if (budget && ++work > budget) {                                  \
+                s->work = work;                                               \
+                s->overBudget = TRUE;                                         \
+                return found;                                                 \
+            }                                                                 \
+                                                                              \
+            fg = data[y * stride + x];                                        \
+            hx = vx = w;                                                      \
+            hy = y - 1;                                                       \
+            hyflag = TRUE;                                                    \
+            for (j = y; j < h; j++) {                                         \
+                done = s->done + j * wordsPerRow;                             \
+                if (((done[x >> 5] >> (x & 31)) & 1) ||                       \
+                    data[j * stride + x] != fg)                               \
+                    break;                                                    \
+                i = RunEnd(done, s->starts + j * wordsPerRow, x) - 1;         \
+                if (j == y)                                                   \
+                    vx = hx = i;                                              \
+                if (i < vx)                                                   \
+                    vx = i;                                                   \
+                if (hyflag && i >= hx)                                        \
+                    hy++;                                                     \
+                else                                                          \
+                    hyflag = FALSE;                                           \
+            }                                                                 \
+            vy = j - 1;                                                       \
+            work += j - y;                                                    \
+                                                                              \
+            /* The bigger of (x,y,hx,hy) and (x,y,vx,vy) */                   \
+            sr->x = x;                                                        \
+            sr->y = y;                                                        \
+            if ((hx - x + 1) * (hy - y + 1) > (vx - x + 1) * (vy - y + 1)) {  \
+                sr->w = hx - x + 1;                                           \
+                sr->h = hy - y + 1;                                           \
+            } else {                                                          \
+                sr->w = vx - x + 1;                                           \
+                sr->h = vy - y + 1;                                           \
+            }                                                                 \
+            sr->colour = fg;                                                  \
+                                                                              \
+            done = s->done + y * wordsPerRow;                                 \
+            for (j = 0; j < sr->h; j++)                                       \
+                SetBits(done + j * wordsPerRow, x, sr->w);                    \
+                                                                              \
+            x += sr->w;                                                       \
+            sr++;                                                             \
+            if (++found == max) {                                             \
+                s->x = x;                                                     \
+                s->y = y;                                                     \
+                s->work = work;                                               \
+                return found;                                                 \
+            }                                                                 \
+        }                                                                     \
+    }                                                                         \
+                                                                              \
+    s->x = 0;                                                                 \
+    s->y = h;                                                                 \
+    s->work = work;                                                           \
+    return found;                                                             \
+}
+
+DEFINE_SUBRECT_FUNCTIONS(8)
+DEFINE_SUBRECT_FUNCTIONS(16)
+DEFINE_SUBRECT_FUNCTIONS(32)
+
+
+/*
+ * rfbSubrectStart sets up a search of the w by h pixels at data, stride
+ * pixels from one row to the next, for subrectangles on the background bg.
+ * The bitmasks are kept in the client record.  It returns FALSE if there
+ * wasn't memory for them.
+ */
+
+Bool
+rfbSubrectStart(rfbSubrectSearch *s, rfbClientPtr cl, void *data,
+                int bitsPerPixel, int w, int h, int stride, CARD32 bg)
+{
+    int masksSize;
+
+    s->data = (char *)data;
+    s->bitsPerPixel = bitsPerPixel;
+    s->w = w;
+    s->h = h;
+    s->stride = stride;
+    s->bg = bg;
+    s->wordsPerRow = w / 32 + 1;    /* always a bit past the end */
+    s->x = s->y = 0;
+    s->work = 0;
+    s->budget = rfbSubrectBudget * w * h;
+    s->overBudget = FALSE;
+
+    masksSize = 2 * s->wordsPerRow * h;
+
+    if (cl->subrectMasksSize < masksSize) {
+        CARD32 *masks = (CARD32 *)xrealloc(cl->subrectMasks, masksSize * sizeof(CARD32));
+        if (masks == NULL) {
+            rfbLog("rfbSubrectStart: out of memory for %dx%d\n", w, h);
+            return FALSE;
+        }
+        cl->subrectMasks = masks;
+        cl->subrectMasksSize = masksSize;
+    }
+
+    s->done = cl->subrectMasks;
+    s->starts = s->done + s->wordsPerRow * h;
+
+    switch (bitsPerPixel) {
+    case 8:
+        FindMasks8(s);
+        break;
+    case 16:
+        FindMasks16(s);
+        break;
+    case 32:
+        FindMasks32(s);
+        break;
+    default:
+        rfbLog("rfbSubrectStart: bpp %d?\n", bitsPerPixel);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+/*
+ * rfbNextSubrects finds up to max more subrectangles, marking them
+ * covered, and returns how many.  It returns fewer when there are no more,
+ * or if the search has gone over its budget, in which case overBudget is
+ * set.
+ */
+
+int
+rfbNextSubrects(rfbSubrectSearch *s, rfbSubrect *sr, int max)
+{
+    switch (s->bitsPerPixel) {
+    case 8:
+        return NextSubrects8(s, sr, max);
+    case 16:
+        return NextSubrects16(s, sr, max);
+    case 32:
+        return NextSubrects32(s, sr, max);
+    }
+    return 0;
+}
+
+
+void
+rfbFreeSubrectData(rfbClientPtr cl)
+{
+    if (cl->subrectMasks)
+        xfree((char *)cl->subrectMasks);
+
+    cl->subrectMasksSize = 0;
+    cl->subrectMasks = NULL;
+}
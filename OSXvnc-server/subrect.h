@@ -0,0 +1,56 @@
+/*
+ * subrect.h - cut a rectangle into single-coloured subrectangles on a
+ * background, for RRE, CoRRE, Hextile and ZlibHex.
+ */
+
+/*
+ *  OSXvnc Copyright (C) 2002-2004 Redstone Software osxvnc@redstonesoftware.com
+ *  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#ifndef __SUBRECT_H__
+#define __SUBRECT_H__
+
+/* How many subrectangles the encoders ask for at a time */
+#define rfbSubrectBatch 32
+
+typedef struct rfbSubrect {
+    int x, y, w, h;
+    CARD32 colour;
+} rfbSubrect;
+
+/* Where a search has got to.  The pixels aren't changed: the ones already
+   covered by a subrectangle are marked in a bitmask instead. */
+
+typedef struct rfbSubrectSearch {
+    char *data;
+    int bitsPerPixel;
+    int w, h;
+    int stride;                 /* in pixels */
+    CARD32 bg;
+
+    CARD32 *done;               /* background or covered, one bit a pixel */
+    CARD32 *starts;             /* where each run of one colour starts */
+    int wordsPerRow;
+
+    int x, y;                   /* where to look for the next subrectangle */
+    int work, budget;
+    Bool overBudget;
+} rfbSubrectSearch;
+
+#endif
@@ -67,6 +67,8 @@ rfbInitTrueColourSingleTableOUT (char **table, rfbPixelFormat *in,
 
     if (*table) free(*table);
     *table = (char *)xalloc(nEntries * sizeof(OUT_T));
+    if (!*table)
+        return;
     t = (OUT_T *)*table;
 
     for (i = 0; i < nEntries; i++) {
@@ -106,6 +108,8 @@ rfbInitTrueColourRGBTablesOUT (char **table, rfbPixelFormat *in,
     if (*table) free(*table);
     *table = (char *)xalloc((in->redMax + in->greenMax + in->blueMax + 3)
                             * sizeof(OUT_T));
+    if (!*table)
+        return;
     redTable = (OUT_T *)*table;
     greenTable = redTable + in->redMax + 1;
     blueTable = greenTable + in->greenMax + 1;
@@ -25,7 +25,6 @@
  */
 
 #include <stdio.h>
-#include <pthread.h>
 #include "rfb.h"
 #include "tight.h"
 
@@ -38,6 +37,18 @@
 #define MIN_SOLID_SUBRECT_SIZE  2048
 #define MAX_SPLIT_TILE_SIZE       16
 
+/* Rectangles of at least this many pixels are encoded on the work pool. */
+#define PARALLEL_MIN_RECT_SIZE (256 * 256)
+
+/* Task flag for a solid-color area found by rfbSendRectEncodingTight. */
+#define TASK_SOLID_AREA 1
+
+/* A rectangle the solid-area search has still to send. */
+typedef struct tightPendingRect {
+    int x, y, w, h;
+    Bool solid;
+} tightPendingRect;
+
 /* May be set to TRUE with "-lazytight" Xvnc option. */
 Bool rfbTightDisableGradient = FALSE;
 
@@ -71,6 +82,11 @@ static TIGHT_CONF tightConf[10] = {
 
 /* Prototypes for static functions. */
 
+static Bool SendRectSplit     (rfbClientPtr cl, int x, int y, int w, int h);
+static Bool SplitRect         (rfbClientPtr cl, int x, int y, int w, int h,
+                               int *nPending);
+static Bool AddPendingRect    (rfbClientPtr cl, int *nPending,
+                               int x, int y, int w, int h, Bool solid);
 static void FindBestSolidArea (rfbClientPtr cl, int x, int y, int w, int h,
                                CARD32 colorValue, int *w_ptr, int *h_ptr);
 static void ExtendSolidArea   (rfbClientPtr cl, int x, int y, int w, int h,
@@ -78,15 +94,23 @@ static void ExtendSolidArea   (rfbClientPtr cl, int x, int y, int w, int h,
                                int *x_ptr, int *y_ptr, int *w_ptr, int *h_ptr);
 static Bool CheckSolidTile    (rfbClientPtr cl, int x, int y, int w, int h,
                                CARD32 *colorPtr, Bool needSameColor);
-static Bool CheckSolidTile8   (rfbClientPtr cl, int x, int y, int w, int h,
-                               CARD32 *colorPtr, Bool needSameColor);
-static Bool CheckSolidTile16  (rfbClientPtr cl, int x, int y, int w, int h,
-                               CARD32 *colorPtr, Bool needSameColor);
-static Bool CheckSolidTile32  (rfbClientPtr cl, int x, int y, int w, int h,
-                               CARD32 *colorPtr, Bool needSameColor);
+static Bool SetupRunIndex     (rfbClientPtr cl, int x, int y, int w, int h);
+static CARD16 *GetRuns        (rfbClientPtr cl, int y);
+static CARD32 GetFramebufferPixel(rfbClientPtr cl, int x, int y);
+static void FindRuns8         (CARD8 *fbptr, CARD16 *runs, int w);
+static void FindRuns16        (CARD16 *fbptr, CARD16 *runs, int w);
+static void FindRuns32        (CARD32 *fbptr, CARD16 *runs, int w);
+
+static void SetupTightState   (rfbClientPtr cl);
+static void CheckBufferSizes  (rfbClientPtr cl);
+
+static Bool SendRectParallel  (rfbClientPtr cl, int x, int y, int w, int h);
+static void EncodeTask        (void *arg, int index, int worker);
+static void CompressStream    (void *arg, int streamId, int worker);
 
 static Bool SendRectSimple    (rfbClientPtr cl, int x, int y, int w, int h);
 static Bool SendSubrect       (rfbClientPtr cl, int x, int y, int w, int h);
+static Bool SendSolidSubrect  (rfbClientPtr cl, int x, int y, int w, int h);
 static Bool SendTightHeader   (rfbClientPtr cl, int x, int y, int w, int h);
 
 static Bool SendSolidRect     (rfbClientPtr cl);
@@ -97,14 +121,13 @@ static Bool SendGradientRect  (rfbClientPtr cl, int w, int h);
 
 static Bool CompressData(rfbClientPtr cl, int streamId, int dataLen,
                          int zlibLevel, int zlibStrategy);
-static Bool SendCompressedData(rfbClientPtr cl, int compressedLen);
-
-static void FillPalette8(rfbClientPtr cl, int count);
-static void FillPalette16(rfbClientPtr cl, int count);
-static void FillPalette32(rfbClientPtr cl, int count);
+static Bool DeferCompression(rfbClientPtr cl, int streamId, int dataLen,
+                             int zlibLevel, int zlibStrategy);
+static int DeflateData(rfbClientPtr cl, int streamId, char *src, int srcLen,
+                       char *dst, int dstSize, int zlibLevel, int zlibStrategy);
+static Bool SendCompressedData(rfbClientPtr cl, char *data, int compressedLen);
 
-static void PaletteReset(rfbClientPtr cl);
-static int PaletteInsert(rfbClientPtr cl, CARD32 rgb, int numPixels, int bpp);
+static void FillPalette(rfbClientPtr cl, int w, int h);
 
 static void Pack24(char *buf, rfbPixelFormat *fmt, int count);
 
@@ -138,12 +161,7 @@ static void JpegSetDstManager(rfbClientPtr cl, j_compress_ptr cinfo);
 
 // These defines will "hopefully" allow us to keep the rest of the code looking roughly the same
 // but call them with the client record pointer, instead of without it
-#define FillPalette8(x)              FillPalette8(cl, x)
-#define FillPalette16(x)             FillPalette16(cl, x)
-#define FillPalette32(x)             FillPalette32(cl, x)
-
-#define PaletteReset()               PaletteReset(cl)
-#define PaletteInsert(x, y, z)       PaletteInsert(cl, x, y, z)
+#define FillPalette(x, y)            FillPalette(cl, x, y)
 
 #define EncodeIndexedRect16(x, y)    EncodeIndexedRect16(cl, x, y)
 #define EncodeIndexedRect32(x, y)    EncodeIndexedRect32(cl, x, y)
@@ -163,8 +181,6 @@ static void JpegSetDstManager(rfbClientPtr cl, j_compress_ptr cinfo);
 
 #define JpegSetDstManager(x)         JpegSetDstManager(cl, x)
 
-#define palette cl->palette
-
 
 /*
  * Tight encoding implementation.
@@ -201,21 +217,11 @@ rfbSendRectEncodingTight(cl, x, y, w, h)
     rfbClientPtr cl;
     int x, y, w, h;
 {
-    int nMaxRows;
-    CARD32 colorValue;
-    int dx, dy, dw, dh;
-    int x_best, y_best, w_best, h_best;
-    char *fbptr;
-
-    compressLevel = cl->tightCompressLevel;
-    qualityLevel = cl->tightQualityLevel;
+    if ( !cl->tightParallel && rfbWorkPoolThreads() > 1 &&
+         w * h >= PARALLEL_MIN_RECT_SIZE && rfbSetupEncodeScratch(cl) )
+        return SendRectParallel(cl, x, y, w, h);
 
-    if ( cl->format.depth == 24 && cl->format.redMax == 0xFF &&
-         cl->format.greenMax == 0xFF && cl->format.blueMax == 0xFF ) {
-        usePixelFormat24 = TRUE;
-    } else {
-        usePixelFormat24 = FALSE;
-    }
+    SetupTightState(cl);
 
     if (!cl->enableLastRectEncoding || w * h < MIN_SPLIT_RECT_SIZE)
         return SendRectSimple(cl, x, y, w, h);
@@ -231,6 +237,105 @@ rfbSendRectEncodingTight(cl, x, y, w, h)
                                               tightBeforeBufSize);
     }
 
+    return SendRectSplit(cl, x, y, w, h);
+}
+
+/*
+ * Large solid-color areas are sent separately from the rest.  The search
+ * finds one, sends what's above it and leaves the parts left of it, right
+ * of it and below it, which are searched in turn, to be sent before and
+ * after it.  They wait on a stack in the order the client is to get them,
+ * so the rectangles go out in the same order as a search calling itself on
+ * each part would send them.
+ *
+ * The search asks many times whether areas of the framebuffer are one
+ * color.  It's answered from an index of the rectangle's horizontal runs:
+ * for each pixel, how many pixels from it to the right edge are the same
+ * color.  A row is indexed the first time it's asked about, so the
+ * framebuffer is read once however often the search goes over a row, and
+ * an area is solid if each of its rows starts with the same color and a
+ * run as wide as the area.
+ */
+
+static Bool
+SendRectSplit(cl, x, y, w, h)
+    rfbClientPtr cl;
+    int x, y, w, h;
+{
+    tightPendingRect rect;
+    int nPending = 0;
+
+    if (!SetupRunIndex(cl, x, y, w, h) ||
+        !AddPendingRect(cl, &nPending, x, y, w, h, FALSE)) {
+        rfbLog("tight: out of memory splitting %dx%d rectangle\n", w, h);
+        rfbCloseClient(cl);
+        return FALSE;
+    }
+
+    while (nPending > 0) {
+        rect = cl->tightPending[--nPending];
+
+        if (rect.solid) {
+            if (!SendSolidSubrect(cl, rect.x, rect.y, rect.w, rect.h))
+                return FALSE;
+        } else if (rect.w * rect.h < MIN_SPLIT_RECT_SIZE) {
+            if (!SendRectSimple(cl, rect.x, rect.y, rect.w, rect.h))
+                return FALSE;
+        } else {
+            if (!SplitRect(cl, rect.x, rect.y, rect.w, rect.h, &nPending))
+                return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static Bool
+AddPendingRect(cl, nPending, x, y, w, h, solid)
+    rfbClientPtr cl;
+    int *nPending;
+    int x, y, w, h;
+    Bool solid;
+{
+    tightPendingRect *rect;
+
+    if (*nPending == cl->tightPendingSize) {
+        int size = cl->tightPendingSize ? cl->tightPendingSize * 2 : 16;
+        tightPendingRect *pending = (tightPendingRect *)
+            xrealloc(cl->tightPending, size * sizeof(tightPendingRect));
+
+        if (pending == NULL)
+            return FALSE;
+        cl->tightPending = pending;
+        cl->tightPendingSize = size;
+    }
+
+    rect = &cl->tightPending[(*nPending)++];
+    rect->x = x;
+    rect->y = y;
+    rect->w = w;
+    rect->h = h;
+    rect->solid = solid;
+    return TRUE;
+}
+
+/*
+ * Look for a large enough solid-color area in a rectangle.  If there is
+ * one, send the part above it and leave the others to be searched.
+ * Otherwise send the rectangle.
+ */
+
+static Bool
+SplitRect(cl, x, y, w, h, nPending)
+    rfbClientPtr cl;
+    int x, y, w, h;
+    int *nPending;
+{
+    int nMaxRows;
+    CARD32 colorValue;
+    int dx, dy, dw, dh;
+    int x_best, y_best, w_best, h_best;
+
     /* Calculate maximum number of rows in one non-solid rectangle. */
 
     {
@@ -283,55 +388,235 @@ rfbSendRectEncodingTight(cl, x, y, w, h)
                 ExtendSolidArea(cl, x, y, w, h, colorValue,
                                 &x_best, &y_best, &w_best, &h_best);
 
-                /* Send rectangles at top and left to solid-color area. */
+                /* Send rectangle at top to solid-color area. */
 
                 if ( y_best != y &&
                      !SendRectSimple(cl, x, y, w, y_best-y) )
                     return FALSE;
+
+                /* Leave the rest to be sent: those at left, the solid-color
+                   rectangle, and those at right and bottom.  The last one
+                   added is sent first. */
+
+                if ( y_best + h_best != y + h &&
+                     !AddPendingRect(cl, nPending, x, y_best+h_best,
+                                     w, h-(y_best-y)-h_best, FALSE) )
+                    goto outOfMemory;
+                if ( x_best + w_best != x + w &&
+                     !AddPendingRect(cl, nPending, x_best+w_best, y_best,
+                                     w-(x_best-x)-w_best, h_best, FALSE) )
+                    goto outOfMemory;
+                if (!AddPendingRect(cl, nPending, x_best, y_best,
+                                    w_best, h_best, TRUE))
+                    goto outOfMemory;
                 if ( x_best != x &&
-                     !rfbSendRectEncodingTight(cl, x, y_best,
-                                               x_best-x, h_best) )
-                    return FALSE;
+                     !AddPendingRect(cl, nPending, x, y_best,
+                                     x_best-x, h_best, FALSE) )
+                    goto outOfMemory;
 
-                /* Send solid-color rectangle. */
+                return TRUE;
+            }
 
-                if (!SendTightHeader(cl, x_best, y_best, w_best, h_best))
-                    return FALSE;
+        }
 
-                fbptr = (cl->scalingFrameBuffer +
-                         (cl->scalingPaddedWidthInBytes * y_best) +
-                         (x_best * (rfbScreen.bitsPerPixel / 8)));
+    }
 
-                (*cl->translateFn)(cl->translateLookupTable, &rfbServerFormat,
-                                   &cl->format, fbptr, tightBeforeBuf,
-                                   cl->scalingPaddedWidthInBytes, 1, 1);
+    /* No suitable solid-color rectangles found. */
 
-                if (!SendSolidRect(cl))
-                    return FALSE;
+    return SendRectSimple(cl, x, y, w, h);
 
-                /* Send remaining rectangles (at right and bottom). */
+outOfMemory:
+    rfbLog("tight: out of memory splitting %dx%d rectangle\n", w, h);
+    rfbCloseClient(cl);
+    return FALSE;
+}
 
-                if ( x_best + w_best != x + w &&
-                     !rfbSendRectEncodingTight(cl, x_best+w_best, y_best,
-                                               w-(x_best-x)-w_best, h_best) )
-                    return FALSE;
-                if ( y_best + h_best != y + h &&
-                     !rfbSendRectEncodingTight(cl, x, y_best+h_best,
-                                               w, h-(y_best-y)-h_best) )
-                    return FALSE;
+static void
+SetupTightState(cl)
+    rfbClientPtr cl;
+{
+    compressLevel = cl->tightCompressLevel;
+    qualityLevel = cl->tightQualityLevel;
 
-                /* Return after all recursive calls are done. */
+    if ( cl->format.depth == 24 && cl->format.redMax == 0xFF &&
+         cl->format.greenMax == 0xFF && cl->format.blueMax == 0xFF ) {
+        usePixelFormat24 = TRUE;
+    } else {
+        usePixelFormat24 = FALSE;
+    }
+}
 
-                return TRUE;
-            }
+static void
+CheckBufferSizes(cl)
+    rfbClientPtr cl;
+{
+    int maxBeforeSize, maxAfterSize;
+
+    maxBeforeSize = tightConf[compressLevel].maxRectSize *
+        (cl->format.bitsPerPixel / 8);
+    maxAfterSize = maxBeforeSize + (maxBeforeSize + 99) / 100 + 12;
+
+    if (tightBeforeBufSize < maxBeforeSize) {
+        tightBeforeBufSize = maxBeforeSize;
+        if (tightBeforeBuf == NULL)
+            tightBeforeBuf = (char *)xalloc(tightBeforeBufSize);
+        else
+            tightBeforeBuf = (char *)xrealloc(tightBeforeBuf,
+                                              tightBeforeBufSize);
+    }
+
+    if (tightAfterBufSize < maxAfterSize) {
+        tightAfterBufSize = maxAfterSize;
+        if (tightAfterBuf == NULL)
+            tightAfterBuf = (char *)xalloc(tightAfterBufSize);
+        else
+            tightAfterBuf = (char *)xrealloc(tightAfterBuf,
+                                             tightAfterBufSize);
+    }
+}
 
+/*
+ * Big rectangles are encoded on the work pool.  The rectangle is split just
+ * as it would be otherwise, but every subrectangle becomes a task encoded on
+ * one of the scratch records from parallel.c.  The zlib streams carry state
+ * from one subrectangle to the next, so a task leaves the data it would have
+ * compressed in the task; then each of the four streams compresses its share
+ * in order on a worker of its own.  JPEG subrectangles don't use the streams
+ * and are finished by their task.  The output is the same as a serial
+ * encode's.
+ */
+
+static Bool
+SendRectParallel(cl, x, y, w, h)
+    rfbClientPtr cl;
+    int x, y, w, h;
+{
+    int i;
+    Bool success;
+
+    cl->encodeTaskCount = 0;
+    cl->tightParallel = TRUE;
+    success = rfbSendRectEncodingTight(cl, x, y, w, h);
+    cl->tightParallel = FALSE;
+    if (!success)
+        return FALSE;
+
+    rfbWorkPoolRun(EncodeTask, cl, cl->encodeTaskCount);
+    rfbWorkPoolRun(CompressStream, cl, 4);
+    rfbMergeEncodeStats(cl);
+
+    for (i = 0; i < cl->encodeTaskCount; i++) {
+        rfbEncodeTask *task = &cl->encodeTasks[i];
+
+        if (!task->ok) {
+            rfbLog("tight: encoding %dx%d at %d,%d failed\n",
+                   task->w, task->h, task->x, task->y);
+            rfbCloseClient(cl);
+            return FALSE;
         }
+        if (!rfbQueueUpdateBytes(cl, task->buf, task->len))
+            return FALSE;
+        if (task->streamId < 0)
+            continue;
 
+        /* Room for the compact length. */
+        if (cl->ublen + 3 > UPDATE_BUF_SIZE) {
+            if (!rfbSendUpdateBuf(cl))
+                return FALSE;
+        }
+        cl->rfbZlibBytesIn += task->deferLen;
+        cl->rfbZlibBytesOut += task->zlen;
+        if (!SendCompressedData(cl, task->zbuf, task->zlen))
+            return FALSE;
     }
 
-    /* No suitable solid-color rectangles found. */
+    /* The tasks are used again for the next rectangle. */
+    return rfbSendUpdateBuf(cl);
+}
 
-    return SendRectSimple(cl, x, y, w, h);
+static void
+EncodeTask(void *arg, int index, int worker)
+{
+    rfbClientPtr owner = (rfbClientPtr)arg;
+    rfbClientPtr cl = owner->encodeScratch[worker];
+    rfbEncodeTask *task = &owner->encodeTasks[index];
+    Bool success;
+
+    SetupTightState(cl);
+    CheckBufferSizes(cl);
+
+    cl->encodeTask = task;
+    if (task->flags & TASK_SOLID_AREA)
+        success = SendSolidSubrect(cl, task->x, task->y, task->w, task->h);
+    else
+        success = SendSubrect(cl, task->x, task->y, task->w, task->h);
+    task->ok = (success && rfbSendUpdateBuf(cl));
+    cl->encodeTask = NULL;
+}
+
+static void
+CompressStream(void *arg, int streamId, int worker)
+{
+    rfbClientPtr cl = (rfbClientPtr)arg;
+    int i, size;
+
+    for (i = 0; i < cl->encodeTaskCount; i++) {
+        rfbEncodeTask *task = &cl->encodeTasks[i];
+
+        if (task->streamId != streamId)
+            continue;
+
+        size = task->deferLen + (task->deferLen + 99) / 100 + 12;
+        if (task->zsize < size) {
+            char *buf = (char *)xrealloc(task->zbuf, size);
+
+            if (buf == NULL) {
+                task->ok = FALSE;
+                return;
+            }
+            task->zbuf = buf;
+            task->zsize = size;
+        }
+
+        task->zlen = DeflateData(cl, streamId, task->deferBuf, task->deferLen,
+                                 task->zbuf, task->zsize,
+                                 task->zlibLevel, task->zlibStrategy);
+        if (task->zlen < 0) {
+            task->ok = FALSE;
+            return;
+        }
+    }
+}
+
+/*
+ * Release the buffers a client record's encoding used.  The zlib streams
+ * are ended by the caller.
+ */
+
+void
+rfbFreeTightData(cl)
+    rfbClientPtr cl;
+{
+    if (tightBeforeBuf)
+        xfree(tightBeforeBuf);
+    if (tightAfterBuf)
+        xfree(tightAfterBuf);
+    if (prevRowBuf)
+        xfree((char *)prevRowBuf);
+    if (cl->tightRuns)
+        xfree((char *)cl->tightRuns);
+    if (cl->tightPending)
+        xfree((char *)cl->tightPending);
+
+    tightBeforeBufSize = 0;
+    tightBeforeBuf = NULL;
+    tightAfterBufSize = 0;
+    tightAfterBuf = NULL;
+    prevRowBuf = NULL;
+    cl->tightRunsSize = 0;
+    cl->tightRuns = NULL;
+    cl->tightPendingSize = 0;
+    cl->tightPending = NULL;
 }
 
 static void
@@ -421,58 +706,121 @@ CheckSolidTile(cl, x, y, w, h, colorPtr, needSameColor)
     CARD32 *colorPtr;
     Bool needSameColor;
 {
-    switch(rfbServerFormat.bitsPerPixel) {
+    CARD32 colorValue;
+    int dy;
+
+    colorValue = GetFramebufferPixel(cl, x, y);
+    if (needSameColor && colorValue != *colorPtr)
+        return FALSE;
+
+    for (dy = y; dy < y + h; dy++) {
+        if (GetRuns(cl, dy)[x - cl->tightRunsX] < w)
+            return FALSE;
+        if (dy != y && GetFramebufferPixel(cl, x, dy) != colorValue)
+            return FALSE;
+    }
+
+    *colorPtr = colorValue;
+    return TRUE;
+}
+
+/*
+ * The run index covers the rectangle rfbSendRectEncodingTight was given.
+ * A row whose first run is 0 hasn't been indexed yet.
+ */
+
+static Bool
+SetupRunIndex(cl, x, y, w, h)
+    rfbClientPtr cl;
+    int x, y, w, h;
+{
+    int dy;
+
+    if (cl->tightRunsSize < w * h) {
+        CARD16 *runs = (CARD16 *)xrealloc(cl->tightRuns, w * h * sizeof(CARD16));
+
+        if (runs == NULL)
+            return FALSE;
+        cl->tightRuns = runs;
+        cl->tightRunsSize = w * h;
+    }
+
+    cl->tightRunsX = x;
+    cl->tightRunsY = y;
+    cl->tightRunsWidth = w;
+    for (dy = 0; dy < h; dy++)
+        cl->tightRuns[dy * w] = 0;
+    return TRUE;
+}
+
+static CARD16 *
+GetRuns(cl, y)
+    rfbClientPtr cl;
+    int y;
+{
+    CARD16 *runs = &cl->tightRuns[(y - cl->tightRunsY) * cl->tightRunsWidth];
+    char *fbptr;
+
+    if (runs[0] == 0) {
+        fbptr = (cl->scalingFrameBuffer + (cl->scalingPaddedWidthInBytes * y)
+                 + (cl->tightRunsX * (rfbScreen.bitsPerPixel / 8)));
+
+        switch (rfbServerFormat.bitsPerPixel) {
+        case 32:
+            FindRuns32((CARD32 *)fbptr, runs, cl->tightRunsWidth);
+            break;
+        case 16:
+            FindRuns16((CARD16 *)fbptr, runs, cl->tightRunsWidth);
+            break;
+        default:
+            FindRuns8((CARD8 *)fbptr, runs, cl->tightRunsWidth);
+        }
+    }
+    return runs;
+}
+
+static CARD32
+GetFramebufferPixel(cl, x, y)
+    rfbClientPtr cl;
+    int x, y;
+{
+    char *fbptr = (cl->scalingFrameBuffer + (cl->scalingPaddedWidthInBytes * y)
+                   + (x * (rfbScreen.bitsPerPixel / 8)));
+
+    switch (rfbServerFormat.bitsPerPixel) {
     case 32:
-        return CheckSolidTile32(cl, x, y, w, h, colorPtr, needSameColor);
+        return *(CARD32 *)fbptr;
     case 16:
-        return CheckSolidTile16(cl, x, y, w, h, colorPtr, needSameColor);
+        return *(CARD16 *)fbptr;
     default:
-        return CheckSolidTile8(cl, x, y, w, h, colorPtr, needSameColor);
+        return *(CARD8 *)fbptr;
     }
 }
 
-#define DEFINE_CHECK_SOLID_FUNCTION(bpp)                                      \
+#define DEFINE_FIND_RUNS_FUNCTION(bpp)                                        \
                                                                               \
-static Bool                                                                   \
-CheckSolidTile##bpp(cl, x, y, w, h, colorPtr, needSameColor)                      \
-    rfbClientPtr cl; \
-    int x, y;                                                                 \
-    CARD32 *colorPtr;                                                         \
-    Bool needSameColor;                                                       \
-{                                                                             \
+static void                                                                   \
+FindRuns##bpp(fbptr, runs, w)                                                 \
     CARD##bpp *fbptr;                                                         \
-    CARD##bpp colorValue;                                                     \
-    int dx, dy;                                                               \
-                                                                              \
-    fbptr = (CARD##bpp *)                                                     \
-        &cl->scalingFrameBuffer[y * cl->scalingPaddedWidthInBytes + x * (bpp/8)]; \
-                                                                              \
-    colorValue = *fbptr;                                                      \
-    if (needSameColor && (CARD32)colorValue != *colorPtr)                     \
-        return FALSE;                                                         \
-                                                                              \
-    for (dy = 0; dy < h; dy++) {                                              \
-        for (dx = 0; dx < w; dx++) {                                          \
-            if (colorValue != fbptr[dx])                                      \
-                return FALSE;                                                 \
-        }                                                                     \
-        fbptr = (CARD##bpp *)((CARD8 *)fbptr + cl->scalingPaddedWidthInBytes); \
-    }                                                                         \
+    CARD16 *runs;                                                             \
+    int w;                                                                    \
+{                                                                             \
+    int dx;                                                                   \
                                                                               \
-    *colorPtr = (CARD32)colorValue;                                           \
-    return TRUE;                                                              \
+    runs[w - 1] = 1;                                                          \
+    for (dx = w - 2; dx >= 0; dx--)                                           \
+        runs[dx] = (fbptr[dx] == fbptr[dx + 1]) ? runs[dx + 1] + 1 : 1;       \
 }
 
-DEFINE_CHECK_SOLID_FUNCTION(8)
-DEFINE_CHECK_SOLID_FUNCTION(16)
-DEFINE_CHECK_SOLID_FUNCTION(32)
+DEFINE_FIND_RUNS_FUNCTION(8)
+DEFINE_FIND_RUNS_FUNCTION(16)
+DEFINE_FIND_RUNS_FUNCTION(32)
 
 static Bool
 SendRectSimple(cl, x, y, w, h)
     rfbClientPtr cl;
     int x, y, w, h;
 {
-    int maxBeforeSize, maxAfterSize;
     int maxRectSize, maxRectWidth;
     int subrectMaxWidth, subrectMaxHeight;
     int dx, dy;
@@ -481,26 +829,8 @@ SendRectSimple(cl, x, y, w, h)
     maxRectSize = tightConf[compressLevel].maxRectSize;
     maxRectWidth = tightConf[compressLevel].maxRectWidth;
 
-    maxBeforeSize = maxRectSize * (cl->format.bitsPerPixel / 8);
-    maxAfterSize = maxBeforeSize + (maxBeforeSize + 99) / 100 + 12;
-
-    if (tightBeforeBufSize < maxBeforeSize) {
-        tightBeforeBufSize = maxBeforeSize;
-        if (tightBeforeBuf == NULL)
-            tightBeforeBuf = (char *)xalloc(tightBeforeBufSize);
-        else
-            tightBeforeBuf = (char *)xrealloc(tightBeforeBuf,
-                                              tightBeforeBufSize);
-    }
-
-    if (tightAfterBufSize < maxAfterSize) {
-        tightAfterBufSize = maxAfterSize;
-        if (tightAfterBuf == NULL)
-            tightAfterBuf = (char *)xalloc(tightAfterBufSize);
-        else
-            tightAfterBuf = (char *)xrealloc(tightAfterBuf,
-                                             tightAfterBufSize);
-    }
+    if (!cl->tightParallel)
+        CheckBufferSizes(cl);
 
     if (w > maxRectWidth || w * h > maxRectSize) {
         subrectMaxWidth = (w > maxRectWidth) ? maxRectWidth : w;
@@ -530,6 +860,9 @@ SendSubrect(cl, x, y, w, h)
     char *fbptr;
     Bool success = FALSE;
 
+    if (cl->tightParallel)
+        return (rfbAddEncodeTask(cl, x, y, w, h) != NULL);
+
     /* Send pending data if there is more than 128 bytes. */
     if (cl->ublen > 128) {
         if (!rfbSendUpdateBuf(cl))
@@ -551,16 +884,7 @@ SendSubrect(cl, x, y, w, h)
          w * h >= tightConf[compressLevel].monoMinRectSize ) {
         paletteMaxColors = 2;
     }
-    switch (cl->format.bitsPerPixel) {
-    case 8:
-        FillPalette8(w * h);
-        break;
-    case 16:
-        FillPalette16(w * h);
-        break;
-    default:
-        FillPalette32(w * h);
-    }
+    FillPalette(w, h);
 
     switch (paletteNumColors) {
     case 0:
@@ -598,6 +922,35 @@ SendSubrect(cl, x, y, w, h)
     return success;
 }
 
+static Bool
+SendSolidSubrect(cl, x, y, w, h)
+    rfbClientPtr cl;
+    int x, y, w, h;
+{
+    rfbEncodeTask *task;
+    char *fbptr;
+
+    if (cl->tightParallel) {
+        task = rfbAddEncodeTask(cl, x, y, w, h);
+        if (task == NULL)
+            return FALSE;
+        task->flags = TASK_SOLID_AREA;
+        return TRUE;
+    }
+
+    if (!SendTightHeader(cl, x, y, w, h))
+        return FALSE;
+
+    fbptr = (cl->scalingFrameBuffer + (cl->scalingPaddedWidthInBytes * y)
+             + (x * (rfbScreen.bitsPerPixel / 8)));
+
+    (*cl->translateFn)(cl->translateLookupTable, &rfbServerFormat,
+                       &cl->format, fbptr, tightBeforeBuf,
+                       cl->scalingPaddedWidthInBytes, 1, 1);
+
+    return SendSolidRect(cl);
+}
+
 static Bool
 SendTightHeader(cl, x, y, w, h)
     rfbClientPtr cl;
@@ -729,6 +1082,9 @@ SendIndexedRect(cl, w, h)
     int streamId = 2;
     int i, entryLen;
 
+    /* The commonest colors get the lowest indices */
+    rfbSortTileColours(&cl->tileAnalysis);
+
     if ( (cl->ublen + TIGHT_MIN_TO_COMPRESS + 6 +
           paletteNumColors * cl->format.bitsPerPixel / 8) > UPDATE_BUF_SIZE ) {
         if (!rfbSendUpdateBuf(cl))
@@ -748,7 +1104,7 @@ SendIndexedRect(cl, w, h)
 
         for (i = 0; i < paletteNumColors; i++) {
             ((CARD32 *)tightAfterBuf)[i] =
-                palette.entry[i].listNode->rgb;
+                cl->tileAnalysis.colours[i];
         }
         if (usePixelFormat24) {
             Pack24(tightAfterBuf, &cl->format, paletteNumColors);
@@ -766,7 +1122,7 @@ SendIndexedRect(cl, w, h)
 
         for (i = 0; i < paletteNumColors; i++) {
             ((CARD16 *)tightAfterBuf)[i] =
-                (CARD16)palette.entry[i].listNode->rgb;
+                (CARD16)cl->tileAnalysis.colours[i];
         }
 
         memcpy(&cl->updateBuf[cl->ublen], tightAfterBuf, paletteNumColors * 2);
@@ -854,8 +1210,7 @@ CompressData(cl, streamId, dataLen, zlibLevel, zlibStrategy)
     rfbClientPtr cl;
     int streamId, dataLen, zlibLevel, zlibStrategy;
 {
-    z_streamp pz;
-    int err;
+    int compressedLen;
 
     if (dataLen < TIGHT_MIN_TO_COMPRESS) {
         memcpy(&cl->updateBuf[cl->ublen], tightBeforeBuf, dataLen);
@@ -864,6 +1219,66 @@ CompressData(cl, streamId, dataLen, zlibLevel, zlibStrategy)
         return TRUE;
     }
 
+    /* Scratch records leave the compression to the client's own streams. */
+    if (cl->encodeTask)
+        return DeferCompression(cl, streamId, dataLen,
+                                zlibLevel, zlibStrategy);
+
+    compressedLen = DeflateData(cl, streamId, tightBeforeBuf, dataLen,
+                                tightAfterBuf, tightAfterBufSize,
+                                zlibLevel, zlibStrategy);
+    if (compressedLen < 0)
+        return FALSE;
+
+    cl->rfbZlibBytesIn += dataLen;
+    cl->rfbZlibBytesOut += compressedLen;
+    return SendCompressedData(cl, tightAfterBuf, compressedLen);
+}
+
+/*
+ * The task takes tightBeforeBuf as it is, and gives the scratch record its
+ * previous buffer to fill next time.
+ */
+
+static Bool
+DeferCompression(cl, streamId, dataLen, zlibLevel, zlibStrategy)
+    rfbClientPtr cl;
+    int streamId, dataLen, zlibLevel, zlibStrategy;
+{
+    rfbEncodeTask *task = cl->encodeTask;
+    char *buf = task->deferBuf;
+    int size = task->deferSize;
+
+    task->deferBuf = tightBeforeBuf;
+    task->deferSize = tightBeforeBufSize;
+    task->deferLen = dataLen;
+    task->streamId = streamId;
+    task->zlibLevel = zlibLevel;
+    task->zlibStrategy = zlibStrategy;
+
+    tightBeforeBuf = buf;
+    tightBeforeBufSize = size;
+    return TRUE;
+}
+
+/*
+ * Compress srcLen bytes with zlib stream streamId, returning the length of
+ * the compressed data or -1 on failure.
+ */
+
+static int
+DeflateData(cl, streamId, src, srcLen, dst, dstSize, zlibLevel, zlibStrategy)
+    rfbClientPtr cl;
+    int streamId;
+    char *src;
+    int srcLen;
+    char *dst;
+    int dstSize;
+    int zlibLevel, zlibStrategy;
+{
+    z_streamp pz;
+    int err;
+
     pz = &cl->zsStruct[streamId];
 
     /* Initialize compression stream if needed. */
@@ -875,41 +1290,43 @@ CompressData(cl, streamId, dataLen, zlibLevel, zlibStrategy)
         err = deflateInit2 (pz, zlibLevel, Z_DEFLATED, MAX_WBITS,
                             MAX_MEM_LEVEL, zlibStrategy);
         if (err != Z_OK)
-            return FALSE;
+            return -1;
 
         cl->zsActive[streamId] = TRUE;
         cl->zsLevel[streamId] = zlibLevel;
     }
 
     /* Prepare buffer pointers. */
-    pz->next_in = (Bytef *)tightBeforeBuf;
-    pz->avail_in = dataLen;
-    pz->next_out = (Bytef *)tightAfterBuf;
-    pz->avail_out = tightAfterBufSize;
+    pz->next_out = (Bytef *)dst;
+    pz->avail_out = dstSize;
 
-    /* Change compression parameters if needed. */
+    /* Change compression parameters if needed, before there's input for
+       deflateParams to refuse to change them over. */
     if (zlibLevel != cl->zsLevel[streamId]) {
+        pz->avail_in = 0;
         if (deflateParams (pz, zlibLevel, zlibStrategy) != Z_OK) {
-            return FALSE;
+            return -1;
         }
         cl->zsLevel[streamId] = zlibLevel;
     }
 
+    pz->next_in = (Bytef *)src;
+    pz->avail_in = srcLen;
+
     /* Actual compression. */
     if ( deflate (pz, Z_SYNC_FLUSH) != Z_OK ||
          pz->avail_in != 0 || pz->avail_out == 0 ) {
-        return FALSE;
+        return -1;
     }
 
-    return SendCompressedData(cl, tightAfterBufSize - pz->avail_out);
+    return dstSize - pz->avail_out;
 }
 
-static Bool SendCompressedData(cl, compressedLen)
+static Bool SendCompressedData(cl, data, compressedLen)
     rfbClientPtr cl;
+    char *data;
     int compressedLen;
 {
-    int i, portionLen;
-
     cl->updateBuf[cl->ublen++] = compressedLen & 0x7F;
     cl->rfbBytesSent[rfbEncodingTight]++;
     if (compressedLen > 0x7F) {
@@ -923,229 +1340,42 @@ static Bool SendCompressedData(cl, compressedLen)
         }
     }
 
-    portionLen = UPDATE_BUF_SIZE;
-    for (i = 0; i < compressedLen; i += portionLen) {
-        if (i + portionLen > compressedLen) {
-            portionLen = compressedLen - i;
-        }
-        if (cl->ublen + portionLen > UPDATE_BUF_SIZE) {
-            if (!rfbSendUpdateBuf(cl))
-                return FALSE;
-        }
-        memcpy(&cl->updateBuf[cl->ublen], &tightAfterBuf[i], portionLen);
-        cl->ublen += portionLen;
-    }
     cl->rfbBytesSent[rfbEncodingTight] += compressedLen;
-    return TRUE;
+    return rfbSendUpdateBytes(cl, data, compressedLen);
 }
 
 /*
  * Code to determine how many different colors used in rectangle.
  */
 
-#undef FillPalette8
+#undef FillPalette
 static void
-FillPalette8(cl, count)
+FillPalette(cl, w, h)
     rfbClientPtr cl;
-    int count;
+    int w, h;
 {
-    CARD8 *data = (CARD8 *)tightBeforeBuf;
-    CARD8 c0, c1;
-    int i, n0, n1;
-
-    paletteNumColors = 0;
+    rfbTileAnalysis *ta = &cl->tileAnalysis;
+    int maxColors = paletteMaxColors;
 
-    c0 = data[0];
-    for (i = 1; i < count && data[i] == c0; i++);
-    if (i == count) {
-        paletteNumColors = 1;
-        return;                 /* Solid rectangle */
-    }
+    /* 8 bit clients are only sent a palette for two colors */
+    if (cl->format.bitsPerPixel == 8 && maxColors > 2)
+        maxColors = 2;
 
-    if (paletteMaxColors < 2)
-        return;
+    rfbAnalyseTile(ta, tightBeforeBuf, cl->format.bitsPerPixel, w, h, w,
+                   maxColors, 0);
+    paletteNumColors = ta->numColours;
 
-    n0 = i;
-    c1 = data[i];
-    n1 = 0;
-    for (i++; i < count; i++) {
-        if (data[i] == c0) {
-            n0++;
-        } else if (data[i] == c1) {
-            n1++;
-        } else
-            break;
-    }
-    if (i == count) {
-        if (n0 > n1) {
-            monoBackground = (CARD32)c0;
-            monoForeground = (CARD32)c1;
+    if (paletteNumColors == 2) {
+        if (ta->counts[0] >= ta->counts[1]) {
+            monoBackground = ta->colours[0];
+            monoForeground = ta->colours[1];
         } else {
-            monoBackground = (CARD32)c1;
-            monoForeground = (CARD32)c0;
-        }
-        paletteNumColors = 2;   /* Two colors */
-    }
-}
-#define FillPalette8(x)              FillPalette8(cl, x)
-
-#undef FillPalette16
-#undef FillPalette32
-#define DEFINE_FILL_PALETTE_FUNCTION(bpp)                               \
-                                                                        \
-static void                                                             \
-FillPalette##bpp(cl, count)                                                 \
-    rfbClientPtr cl;                                                    \
-    int count;                                                          \
-{                                                                       \
-    CARD##bpp *data = (CARD##bpp *)tightBeforeBuf;                      \
-    CARD##bpp c0, c1, ci = 0;                                           \
-    int i, n0, n1, ni;                                                  \
-                                                                        \
-    c0 = data[0];                                                       \
-    for (i = 1; i < count && data[i] == c0; i++);                       \
-    if (i >= count) {                                                   \
-        paletteNumColors = 1;   /* Solid rectangle */                   \
-        return;                                                         \
-    }                                                                   \
-                                                                        \
-    if (paletteMaxColors < 2) {                                         \
-        paletteNumColors = 0;   /* Full-color encoding preferred */     \
-        return;                                                         \
-    }                                                                   \
-                                                                        \
-    n0 = i;                                                             \
-    c1 = data[i];                                                       \
-    n1 = 0;                                                             \
-    for (i++; i < count; i++) {                                         \
-        ci = data[i];                                                   \
-        if (ci == c0) {                                                 \
-            n0++;                                                       \
-        } else if (ci == c1) {                                          \
-            n1++;                                                       \
-        } else                                                          \
-            break;                                                      \
-    }                                                                   \
-    if (i >= count) {                                                   \
-        if (n0 > n1) {                                                  \
-            monoBackground = (CARD32)c0;                                \
-            monoForeground = (CARD32)c1;                                \
-        } else {                                                        \
-            monoBackground = (CARD32)c1;                                \
-            monoForeground = (CARD32)c0;                                \
-        }                                                               \
-        paletteNumColors = 2;   /* Two colors */                        \
-        return;                                                         \
-    }                                                                   \
-                                                                        \
-    PaletteReset();                                                     \
-    PaletteInsert (c0, (CARD32)n0, bpp);                                \
-    PaletteInsert (c1, (CARD32)n1, bpp);                                \
-                                                                        \
-    ni = 1;                                                             \
-    for (i++; i < count; i++) {                                         \
-        if (data[i] == ci) {                                            \
-            ni++;                                                       \
-        } else {                                                        \
-            if (!PaletteInsert (ci, (CARD32)ni, bpp))                   \
-                return;                                                 \
-            ci = data[i];                                               \
-            ni = 1;                                                     \
-        }                                                               \
-    }                                                                   \
-    PaletteInsert (ci, (CARD32)ni, bpp);                                \
-}
-
-DEFINE_FILL_PALETTE_FUNCTION(16)
-DEFINE_FILL_PALETTE_FUNCTION(32)
-#define FillPalette16(x)             FillPalette16(cl, x)
-#define FillPalette32(x)             FillPalette32(cl, x)
-
-
-/*
- * Functions to operate with palette structures.
- */
-
-#define HASH_FUNC16(rgb) ((int)((((rgb) >> 8) + (rgb)) & 0xFF))
-#define HASH_FUNC32(rgb) ((int)((((rgb) >> 16) + ((rgb) >> 8)) & 0xFF))
-
-#undef PaletteReset
-static void
-PaletteReset(rfbClientPtr cl)
-{
-    paletteNumColors = 0;
-    memset(palette.hash, 0, 256 * sizeof(COLOR_LIST *));
-}
-#define PaletteReset()               PaletteReset(cl)
-
-#undef PaletteInsert
-static int
-PaletteInsert(cl, rgb, numPixels, bpp)
-    rfbClientPtr cl;
-    CARD32 rgb;
-    int numPixels;
-    int bpp;
-{
-    COLOR_LIST *pnode;
-    COLOR_LIST *prev_pnode = NULL;
-    int hash_key, idx, new_idx, count;
-
-    hash_key = (bpp == 16) ? HASH_FUNC16(rgb) : HASH_FUNC32(rgb);
-
-    pnode = palette.hash[hash_key];
-
-    while (pnode != NULL) {
-        if (pnode->rgb == rgb) {
-            /* Such palette entry already exists. */
-            new_idx = idx = pnode->idx;
-            count = palette.entry[idx].numPixels + numPixels;
-            if (new_idx && palette.entry[new_idx-1].numPixels < count) {
-                do {
-                    palette.entry[new_idx] = palette.entry[new_idx-1];
-                    palette.entry[new_idx].listNode->idx = new_idx;
-                    new_idx--;
-                }
-                while (new_idx && palette.entry[new_idx-1].numPixels < count);
-                palette.entry[new_idx].listNode = pnode;
-                pnode->idx = new_idx;
-            }
-            palette.entry[new_idx].numPixels = count;
-            return paletteNumColors;
+            monoBackground = ta->colours[1];
+            monoForeground = ta->colours[0];
         }
-        prev_pnode = pnode;
-        pnode = pnode->next;
-    }
-
-    /* Check if palette is full. */
-    if (paletteNumColors == 256 || paletteNumColors == paletteMaxColors) {
-        paletteNumColors = 0;
-        return 0;
-    }
-
-    /* Move palette entries with lesser pixel counts. */
-    for ( idx = paletteNumColors;
-          idx > 0 && palette.entry[idx-1].numPixels < numPixels;
-          idx-- ) {
-        palette.entry[idx] = palette.entry[idx-1];
-        palette.entry[idx].listNode->idx = idx;
     }
-
-    /* Add new palette entry into the freed slot. */
-    pnode = &palette.list[paletteNumColors];
-    if (prev_pnode != NULL) {
-        prev_pnode->next = pnode;
-    } else {
-        palette.hash[hash_key] = pnode;
-    }
-    pnode->next = NULL;
-    pnode->idx = idx;
-    pnode->rgb = rgb;
-    palette.entry[idx].listNode = pnode;
-    palette.entry[idx].numPixels = numPixels;
-
-    return (++paletteNumColors);
 }
-#define PaletteInsert(x, y, z)       PaletteInsert(cl, x, y, z)
+#define FillPalette(x, y)            FillPalette(cl, x, y)
 
 
 /*
@@ -1161,25 +1391,28 @@ static void Pack24(buf, fmt, count)
 {
     CARD32 *buf32;
     CARD32 pix;
-    int r_shift, g_shift, b_shift;
+    int shiftBits[3];
 
     buf32 = (CARD32 *)buf;
 
     if (!rfbServerFormat.bigEndian == !fmt->bigEndian) {
-        r_shift = fmt->redShift;
-        g_shift = fmt->greenShift;
-        b_shift = fmt->blueShift;
+        shiftBits[0] = fmt->redShift;
+        shiftBits[1] = fmt->greenShift;
+        shiftBits[2] = fmt->blueShift;
     } else {
-        r_shift = 24 - fmt->redShift;
-        g_shift = 24 - fmt->greenShift;
-        b_shift = 24 - fmt->blueShift;
+        shiftBits[0] = 24 - fmt->redShift;
+        shiftBits[1] = 24 - fmt->greenShift;
+        shiftBits[2] = 24 - fmt->blueShift;
     }
 
+    if (rfbTightPack24(buf, shiftBits, count))
+        return;
+
     while (count--) {
         pix = *buf32++;
-        *buf++ = (char)(pix >> r_shift);
-        *buf++ = (char)(pix >> g_shift);
-        *buf++ = (char)(pix >> b_shift);
+        *buf++ = (char)(pix >> shiftBits[0]);
+        *buf++ = (char)(pix >> shiftBits[1]);
+        *buf++ = (char)(pix >> shiftBits[2]);
     }
 }
 
@@ -1198,29 +1431,19 @@ EncodeIndexedRect##bpp(cl, buf, count)                                      \
     CARD8 *buf;                                                         \
     int count;                                                          \
 {                                                                       \
-    COLOR_LIST *pnode;                                                  \
     CARD##bpp *src;                                                     \
     CARD##bpp rgb;                                                      \
-    int rep = 0;                                                        \
+    CARD8 idx;                                                          \
                                                                         \
     src = (CARD##bpp *) buf;                                            \
                                                                         \
     while (count--) {                                                   \
         rgb = *src++;                                                   \
+        idx = (CARD8)rfbTileColourIndex(&cl->tileAnalysis, rgb);        \
+        *buf++ = idx;                                                   \
         while (count && *src == rgb) {                                  \
-            rep++, src++, count--;                                      \
-        }                                                               \
-        pnode = palette.hash[HASH_FUNC##bpp(rgb)];                      \
-        while (pnode != NULL) {                                         \
-            if ((CARD##bpp)pnode->rgb == rgb) {                         \
-                *buf++ = (CARD8)pnode->idx;                             \
-                while (rep) {                                           \
-                    *buf++ = (CARD8)pnode->idx;                         \
-                    rep--;                                              \
-                }                                                       \
-                break;                                                  \
-            }                                                           \
-            pnode = pnode->next;                                        \
+            *buf++ = idx;                                               \
+            src++, count--;                                             \
         }                                                               \
     }                                                                   \
 }
@@ -1317,9 +1540,6 @@ FilterGradient24(cl, buf, fmt, w, h)
     int prediction;
     int x, y, c;
 
-    buf32 = (CARD32 *)buf;
-    memset (prevRowBuf, 0, w * 3 * sizeof(int));
-
     if (!rfbServerFormat.bigEndian == !fmt->bigEndian) {
         shiftBits[0] = fmt->redShift;
         shiftBits[1] = fmt->greenShift;
@@ -1330,6 +1550,12 @@ FilterGradient24(cl, buf, fmt, w, h)
         shiftBits[2] = 24 - fmt->blueShift;
     }
 
+    if (rfbTightFilterGradient24(buf, shiftBits, w, h, prevRowBuf))
+        return;
+
+    buf32 = (CARD32 *)buf;
+    memset (prevRowBuf, 0, w * 3 * sizeof(int));
+
     for (y = 0; y < h; y++) {
         for (c = 0; c < 3; c++) {
             pixUpper[c] = 0;
@@ -1382,10 +1608,14 @@ FilterGradient##bpp(cl, buf, fmt, w, h)                                      \
     int prediction;                                                      \
     int x, y, c;                                                         \
                                                                          \
-    memset (prevRowBuf, 0, w * 3 * sizeof(int));                         \
-                                                                         \
     endianMismatch = (!rfbServerFormat.bigEndian != !fmt->bigEndian);    \
                                                                          \
+    if (rfbTightFilterGradient##bpp(buf, fmt, endianMismatch, w, h,      \
+                                    prevRowBuf))                         \
+        return;                                                          \
+                                                                         \
+    memset (prevRowBuf, 0, w * 3 * sizeof(int));                         \
+                                                                         \
     maxColor[0] = fmt->redMax;                                           \
     maxColor[1] = fmt->greenMax;                                         \
     maxColor[2] = fmt->blueMax;                                          \
@@ -1511,27 +1741,30 @@ DetectSmoothImage24 (cl, fmt, w, h)
 
     memset(diffStat, 0, 256*sizeof(int));
 
-    y = 0, x = 0;
-    while (y < h && x < w) {
-        for (d = 0; d < h - y && d < w - x - DETECT_SUBROW_WIDTH; d++) {
-            for (c = 0; c < 3; c++) {
-                left[c] = (int)tightBeforeBuf[((y+d)*w+x+d)*4+off+c] & 0xFF;
-            }
-            for (dx = 1; dx <= DETECT_SUBROW_WIDTH; dx++) {
+    if (!rfbTightDetectStats24(tightBeforeBuf, off, w, h,
+                               diffStat, &pixelCount)) {
+        y = 0, x = 0;
+        while (y < h && x < w) {
+            for (d = 0; d < h - y && d < w - x - DETECT_SUBROW_WIDTH; d++) {
                 for (c = 0; c < 3; c++) {
-                    pix = (int)tightBeforeBuf[((y+d)*w+x+d+dx)*4+off+c] & 0xFF;
-                    diffStat[abs(pix - left[c])]++;
-                    left[c] = pix;
+                    left[c] = (int)tightBeforeBuf[((y+d)*w+x+d)*4+off+c] & 0xFF;
+                }
+                for (dx = 1; dx <= DETECT_SUBROW_WIDTH; dx++) {
+                    for (c = 0; c < 3; c++) {
+                        pix = (int)tightBeforeBuf[((y+d)*w+x+d+dx)*4+off+c] & 0xFF;
+                        diffStat[abs(pix - left[c])]++;
+                        left[c] = pix;
+                    }
+                    pixelCount++;
                 }
-                pixelCount++;
             }
-        }
-        if (w > h) {
-            x += h;
-            y = 0;
-        } else {
-            x = 0;
-            y += w;
+            if (w > h) {
+                x += h;
+                y = 0;
+            } else {
+                x = 0;
+                y += w;
+            }
         }
     }
 
@@ -1583,39 +1816,43 @@ DetectSmoothImage##bpp (cl, fmt, w, h)
                                                                              \
     memset(diffStat, 0, 256*sizeof(int));                                    \
                                                                              \
-    y = 0, x = 0;                                                            \
-    while (y < h && x < w) {                                                 \
-        for (d = 0; d < h - y && d < w - x - DETECT_SUBROW_WIDTH; d++) {     \
-            pix = ((CARD##bpp *)tightBeforeBuf)[(y+d)*w+x+d];                \
-            if (endianMismatch) {                                            \
-                pix = Swap##bpp(pix);                                        \
-            }                                                                \
-            for (c = 0; c < 3; c++) {                                        \
-                left[c] = (int)(pix >> shiftBits[c] & maxColor[c]);          \
-            }                                                                \
-            for (dx = 1; dx <= DETECT_SUBROW_WIDTH; dx++) {                  \
-                pix = ((CARD##bpp *)tightBeforeBuf)[(y+d)*w+x+d+dx];         \
+    if (!rfbTightDetectStats##bpp((CARD##bpp *)tightBeforeBuf, fmt,          \
+                                  endianMismatch, w, h,                      \
+                                  diffStat, &pixelCount)) {                  \
+        y = 0, x = 0;                                                        \
+        while (y < h && x < w) {                                             \
+            for (d = 0; d < h - y && d < w - x - DETECT_SUBROW_WIDTH; d++) { \
+                pix = ((CARD##bpp *)tightBeforeBuf)[(y+d)*w+x+d];            \
                 if (endianMismatch) {                                        \
                     pix = Swap##bpp(pix);                                    \
                 }                                                            \
-                sum = 0;                                                     \
                 for (c = 0; c < 3; c++) {                                    \
-                    sample = (int)(pix >> shiftBits[c] & maxColor[c]);       \
-                    sum += abs(sample - left[c]);                            \
-                    left[c] = sample;                                        \
+                    left[c] = (int)(pix >> shiftBits[c] & maxColor[c]);      \
+                }                                                            \
+                for (dx = 1; dx <= DETECT_SUBROW_WIDTH; dx++) {              \
+                    pix = ((CARD##bpp *)tightBeforeBuf)[(y+d)*w+x+d+dx];     \
+                    if (endianMismatch) {                                    \
+                        pix = Swap##bpp(pix);                                \
+                    }                                                        \
+                    sum = 0;                                                 \
+                    for (c = 0; c < 3; c++) {                                \
+                        sample = (int)(pix >> shiftBits[c] & maxColor[c]);   \
+                        sum += abs(sample - left[c]);                        \
+                        left[c] = sample;                                    \
+                    }                                                        \
+                    if (sum > 255)                                           \
+                        sum = 255;                                           \
+                    diffStat[sum]++;                                         \
+                    pixelCount++;                                            \
                 }                                                            \
-                if (sum > 255)                                               \
-                    sum = 255;                                               \
-                diffStat[sum]++;                                             \
-                pixelCount++;                                                \
             }                                                                \
-        }                                                                    \
-        if (w > h) {                                                         \
-            x += h;                                                          \
-            y = 0;                                                           \
-        } else {                                                             \
-            x = 0;                                                           \
-            y += w;                                                          \
+            if (w > h) {                                                     \
+                x += h;                                                      \
+                y = 0;                                                       \
+            } else {                                                         \
+                x = 0;                                                       \
+                y += w;                                                      \
+            }                                                                \
         }                                                                    \
     }                                                                        \
                                                                              \
@@ -1658,8 +1895,6 @@ SendJpegRect(cl, x, y, w, h, quality)
     JSAMPROW rowPointer[1];
     int dy;
 
-    cl->cinfo = &cinfo;  /* tight encoding -- GetClient() uses this to map cinfos to client records */
-
     if (rfbServerFormat.bitsPerPixel == 8)
         return SendFullColorRect(cl, w, h);
 
@@ -1671,6 +1906,7 @@ SendJpegRect(cl, x, y, w, h, quality)
 
     cinfo.err = jpeg_std_error(&jerr);
     jpeg_create_compress(&cinfo);
+    cinfo.client_data = cl;  /* for the destination manager */
 
     cinfo.image_width = w;
     cinfo.image_height = h;
@@ -1708,7 +1944,7 @@ SendJpegRect(cl, x, y, w, h, quality)
     cl->updateBuf[cl->ublen++] = (char)(rfbTightJpeg << 4);
     cl->rfbBytesSent[rfbEncodingTight]++;
 
-    return SendCompressedData(cl, jpegDstDataLen);
+    return SendCompressedData(cl, tightAfterBuf, jpegDstDataLen);
 }
 
 static void
@@ -1794,14 +2030,7 @@ DEFINE_JPEG_GET_ROW_FUNCTION(32)
  */
 
 /* tight encoding -- Map cinfo to client record */
-#define GetClient(cl, cinfo)                     \
-    for ( cl = rfbClientHead;; cl = cl->next ) { \
-        if (cl == NULL)                          \
-            pthread_exit(NULL);                  \
-                                                 \
-        if (cl->cinfo == cinfo)                  \
-            break;                               \
-    }
+#define GetClient(cl, cinfo)  cl = (rfbClientPtr)(cinfo)->client_data
 
 static void
 JpegInitDestination(j_compress_ptr cinfo)
@@ -26,23 +26,4 @@
 #define __TIGHT_H__
 #include <jpeglib.h>
 
-
-/* Stuff dealing with palettes. */
-
-typedef struct COLOR_LIST_s {
-    struct COLOR_LIST_s *next;
-    int idx;
-    CARD32 rgb;
-} COLOR_LIST;
-
-typedef struct PALETTE_ENTRY_s {
-    COLOR_LIST *listNode;
-    int numPixels;
-} PALETTE_ENTRY;
-
-typedef struct PALETTE_s {
-    PALETTE_ENTRY entry[256];
-    COLOR_LIST *hash[256];
-    COLOR_LIST list[256];
-} PALETTE;
 #endif
@@ -0,0 +1,590 @@
+/*
+ * tight_simd.c - Tight's per-pixel filters with SIMD.
+ *
+ * Every Tight rectangle which isn't solid or a palette is first sampled to
+ * guess whether it's smooth (DetectSmoothImage), and then either packed to
+ * 24 bit (Pack24) or run through the gradient filter before zlib gets it.
+ * The functions here do the same on a vector of pixels at a time:
+ *
+ *	- the gradient filter's prediction only depends on the pixels left
+ *	  of, above and above left of each pixel as they were before
+ *	  filtering, so a whole vector of them can be predicted at once.
+ *	  The row being filtered is copied aside first, as the scalar filter
+ *	  keeps the one above, because the output overwrites it;
+ *	- smoothness detection takes the differences of each of its sampled
+ *	  subrows in one go, leaving only the histogram to count one by one;
+ *	- packing to 24 bit is a byte shuffle.
+ *
+ * Each function returns FALSE, having done nothing, if it can't take the
+ * rectangle, and tight.c goes on to its scalar code.  The output is byte
+ * for byte the same either way; encbench -verifytight checks it.
+ *
+ * SSE2 does the filtering and sampling for any true colour format whose
+ * channels fit.  Packing to 24 bit, and so the 24 bit gradient filter,
+ * wants SSSE3's byte shuffle and is only used when the CPU has it.  On
+ * other CPUs everything is left to tight.c.
+ */
+
+/*
+ *  OSXvnc Copyright (C) 2002-2004 Redstone Software osxvnc@redstonesoftware.com
+ *  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rfb.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define TIGHT_SSE2
+#endif
+
+#if defined(__x86_64__) && (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#include <tmmintrin.h>
+#define TIGHT_SSSE3
+#define SSSE3_TARGET __attribute__((target("ssse3")))
+#endif
+
+Bool rfbSimdTight = TRUE;
+
+/* Must match tight.c */
+#define DETECT_SUBROW_WIDTH 7
+
+
+#ifdef TIGHT_SSE2
+
+/*
+ * The largest channel the 16 and 32 bit lanes take: three of them added
+ * up, or two less a third, mustn't overflow a signed lane.
+ */
+
+#define MAX_LANE_COLOR16 0x2AAA
+#define MAX_LANE_COLOR32 0x2AAAAAAA
+
+static inline __m128i Swap16x8(__m128i v) {
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+static inline __m128i Swap32x4(__m128i v) {
+    v = Swap16x8(v);
+    return _mm_or_si128(_mm_slli_epi32(v, 16), _mm_srli_epi32(v, 16));
+}
+
+#define SwapLanes16 Swap16x8
+#define SwapLanes32 Swap32x4
+
+/* A channel of each lane, and a lane's prediction clamped to [0, max] */
+
+#define DEFINE_LANE_FUNCTIONS(bpp)                                            \
+                                                                              \
+static inline __m128i Channel##bpp(__m128i v, __m128i shift, __m128i max) {   \
+    return _mm_and_si128(_mm_srl_epi##bpp(v, shift), max);                    \
+}                                                                             \
+                                                                              \
+static inline __m128i Clamp##bpp(__m128i v, __m128i max) {                    \
+    __m128i over;                                                             \
+                                                                              \
+    v = _mm_and_si128(v, _mm_cmpgt_epi##bpp(v, _mm_setzero_si128()));         \
+    over = _mm_cmpgt_epi##bpp(v, max);                                        \
+    return _mm_or_si128(_mm_and_si128(over, max), _mm_andnot_si128(over, v)); \
+}
+
+DEFINE_LANE_FUNCTIONS(16)
+DEFINE_LANE_FUNCTIONS(32)
+
+static Bool LanesFit(rfbPixelFormat *fmt, int max) {
+    return (fmt->redMax <= max && fmt->greenMax <= max && fmt->blueMax <= max &&
+            fmt->redShift < fmt->bitsPerPixel && fmt->greenShift < fmt->bitsPerPixel &&
+            fmt->blueShift < fmt->bitsPerPixel);
+}
+
+
+/*
+ * The gradient filter for 16 and 32 bit pixels.  rows has room for two
+ * rows of w + 1 pixels, each with a zero in front for the pixel left of
+ * the first.
+ */
+
+#define DEFINE_SSE2_GRADIENT_FUNCTION(bpp)                                    \
+                                                                              \
+static void                                                                   \
+FilterGradientSSE2_##bpp(CARD##bpp *buf, rfbPixelFormat *fmt,                 \
+                         Bool endianMismatch, int w, int h, CARD##bpp *rows)  \
+{                                                                             \
+    CARD##bpp *prev = rows, *cur = rows + w + 1, *tmp;                        \
+    __m128i shift[3], max[3];                                                 \
+    int maxColor[3], shiftBits[3];                                            \
+    int x, y, c;                                                              \
+                                                                              \
+    maxColor[0] = fmt->redMax;                                                \
+    maxColor[1] = fmt->greenMax;                                              \
+    maxColor[2] = fmt->blueMax;                                               \
+    shiftBits[0] = fmt->redShift;                                             \
+    shiftBits[1] = fmt->greenShift;                                           \
+    shiftBits[2] = fmt->blueShift;                                            \
+    for (c = 0; c < 3; c++) {                                                 \
+        shift[c] = _mm_cvtsi32_si128(shiftBits[c]);                           \
+        max[c] = _mm_set1_epi##bpp(maxColor[c]);                              \
+    }                                                                         \
+                                                                              \
+    memset(prev, 0, (w + 1) * sizeof(CARD##bpp));                             \
+    cur[0] = 0;                                                               \
+                                                                              \
+    for (y = 0; y < h; y++) {                                                 \
+        CARD##bpp *row = buf + y * w;                                         \
+                                                                              \
+        if (endianMismatch) {                                                 \
+            for (x = 0; x < w; x++)                                           \
+                cur[x + 1] = Swap##bpp(row[x]);                               \
+        } else {                                                              \
+            memcpy(cur + 1, row, w * sizeof(CARD##bpp));                      \
+        }                                                                     \
+                                                                              \
+        for (x = 0; x + 128 / bpp <= w; x += 128 / bpp) {                     \
+            __m128i here = _mm_loadu_si128((const __m128i *)(cur + x + 1));   \
+            __m128i left = _mm_loadu_si128((const __m128i *)(cur + x));       \
+            __m128i upper = _mm_loadu_si128((const __m128i *)(prev + x + 1)); \
+            __m128i upperLeft = _mm_loadu_si128((const __m128i *)(prev + x)); \
+            __m128i diff = _mm_setzero_si128();                               \
+                                                                              \
+            for (c = 0; c < 3; c++) {                                         \
+                __m128i pixHere = Channel##bpp(here, shift[c], max[c]);       \
+                __m128i prediction =                                          \
+                    _mm_sub_epi##bpp(_mm_add_epi##bpp(                        \
+                                         Channel##bpp(left, shift[c], max[c]),\
+                                         Channel##bpp(upper, shift[c], max[c])),\
+                                     Channel##bpp(upperLeft, shift[c], max[c]));\
+                                                                              \
+                prediction = Clamp##bpp(prediction, max[c]);                  \
+                diff = _mm_or_si128(diff, _mm_sll_epi##bpp(                   \
+                    _mm_and_si128(_mm_sub_epi##bpp(pixHere, prediction),      \
+                                  max[c]),                                    \
+                    shift[c]));                                               \
+            }                                                                 \
+            if (endianMismatch)                                               \
+                diff = SwapLanes##bpp(diff);                                  \
+            _mm_storeu_si128((__m128i *)(row + x), diff);                     \
+        }                                                                     \
+                                                                              \
+        for (; x < w; x++) {                                                  \
+            CARD##bpp diff = 0;                                               \
+                                                                              \
+            for (c = 0; c < 3; c++) {                                         \
+                int here = (int)(cur[x + 1] >> shiftBits[c] & maxColor[c]);   \
+                int prediction =                                              \
+                    (int)(cur[x] >> shiftBits[c] & maxColor[c]) +             \
+                    (int)(prev[x + 1] >> shiftBits[c] & maxColor[c]) -        \
+                    (int)(prev[x] >> shiftBits[c] & maxColor[c]);             \
+                                                                              \
+                if (prediction < 0) {                                         \
+                    prediction = 0;                                           \
+                } else if (prediction > maxColor[c]) {                        \
+                    prediction = maxColor[c];                                 \
+                }                                                             \
+                diff |= ((here - prediction) & maxColor[c]) << shiftBits[c];  \
+            }                                                                 \
+            if (endianMismatch) {                                             \
+                diff = Swap##bpp(diff);                                       \
+            }                                                                 \
+            row[x] = diff;                                                    \
+        }                                                                     \
+                                                                              \
+        tmp = prev;                                                           \
+        prev = cur;                                                           \
+        cur = tmp;                                                            \
+    }                                                                         \
+}
+
+DEFINE_SSE2_GRADIENT_FUNCTION(16)
+DEFINE_SSE2_GRADIENT_FUNCTION(32)
+
+
+/*
+ * Smoothness sampling for 16 and 32 bit pixels.  Each subrow is the
+ * DETECT_SUBROW_WIDTH + 1 pixels from p, and each of the others is
+ * compared with the one before it, which is one lane over.
+ */
+
+static inline __m128i SubrowSums16(__m128i pix, __m128i *shift, __m128i *max) {
+    __m128i left = _mm_slli_si128(pix, 2);
+    __m128i sum = _mm_setzero_si128();
+    int c;
+
+    for (c = 0; c < 3; c++) {
+        __m128i a = Channel16(pix, shift[c], max[c]);
+        __m128i b = Channel16(left, shift[c], max[c]);
+
+        sum = _mm_add_epi16(sum, _mm_or_si128(_mm_subs_epu16(a, b),
+                                              _mm_subs_epu16(b, a)));
+    }
+    return sum;
+}
+
+static inline __m128i SubrowSums32(__m128i pix, __m128i before, __m128i *shift,
+                                   __m128i *max) {
+    __m128i left = _mm_or_si128(_mm_slli_si128(pix, 4), _mm_srli_si128(before, 12));
+    __m128i sum = _mm_setzero_si128();
+    int c;
+
+    for (c = 0; c < 3; c++) {
+        __m128i d = _mm_sub_epi32(Channel32(pix, shift[c], max[c]),
+                                  Channel32(left, shift[c], max[c]));
+        __m128i sign = _mm_srai_epi32(d, 31);
+
+        sum = _mm_add_epi32(sum, _mm_sub_epi32(_mm_xor_si128(d, sign), sign));
+    }
+    return sum;
+}
+
+#define DEFINE_SSE2_DETECT_FUNCTION(bpp, LOAD_SUMS)                           \
+                                                                              \
+static void                                                                   \
+DetectStatsSSE2_##bpp(CARD##bpp *buf, rfbPixelFormat *fmt,                    \
+                      Bool endianMismatch, int w, int h, int *diffStat,       \
+                      int *pixelCount)                                        \
+{                                                                             \
+    __m128i shift[3], max[3];                                                 \
+    CARD##bpp sums[8] __attribute__((aligned(16)));                           \
+    int x, y, d, dx;                                                          \
+                                                                              \
+    shift[0] = _mm_cvtsi32_si128(fmt->redShift);                              \
+    shift[1] = _mm_cvtsi32_si128(fmt->greenShift);                            \
+    shift[2] = _mm_cvtsi32_si128(fmt->blueShift);                             \
+    max[0] = _mm_set1_epi##bpp(fmt->redMax);                                  \
+    max[1] = _mm_set1_epi##bpp(fmt->greenMax);                                \
+    max[2] = _mm_set1_epi##bpp(fmt->blueMax);                                 \
+                                                                              \
+    y = 0, x = 0;                                                             \
+    while (y < h && x < w) {                                                  \
+        for (d = 0; d < h - y && d < w - x - DETECT_SUBROW_WIDTH; d++) {      \
+            CARD##bpp *p = buf + (y+d)*w+x+d;                                 \
+                                                                              \
+            LOAD_SUMS                                                         \
+            for (dx = 1; dx <= DETECT_SUBROW_WIDTH; dx++)                     \
+                diffStat[sums[dx] > 255 ? 255 : sums[dx]]++;                  \
+            *pixelCount += DETECT_SUBROW_WIDTH;                               \
+        }                                                                     \
+        if (w > h) {                                                          \
+            x += h;                                                           \
+            y = 0;                                                            \
+        } else {                                                              \
+            x = 0;                                                            \
+            y += w;                                                           \
+        }                                                                     \
+    }                                                                         \
+}
+
+DEFINE_SSE2_DETECT_FUNCTION(16, {
+    __m128i pix = _mm_loadu_si128((const __m128i *)p);
+
+    if (endianMismatch)
+        pix = Swap16x8(pix);
+    _mm_store_si128((__m128i *)sums, SubrowSums16(pix, shift, max));
+})
+
+DEFINE_SSE2_DETECT_FUNCTION(32, {
+    __m128i pix0 = _mm_loadu_si128((const __m128i *)p);
+    __m128i pix1 = _mm_loadu_si128((const __m128i *)(p + 4));
+
+    if (endianMismatch) {
+        pix0 = Swap32x4(pix0);
+        pix1 = Swap32x4(pix1);
+    }
+    _mm_store_si128((__m128i *)sums, SubrowSums32(pix0, _mm_setzero_si128(), shift, max));
+    _mm_store_si128((__m128i *)(sums + 4), SubrowSums32(pix1, pix0, shift, max));
+})
+
+
+/*
+ * Smoothness sampling for 24 bit color in 32 bit pixels, which counts each
+ * channel's difference on its own.
+ */
+
+static void
+DetectStatsSSE2_24(char *buf, int off, int w, int h, int *diffStat, int *pixelCount)
+{
+    unsigned char diffs[32] __attribute__((aligned(16)));
+    int x, y, d, dx, c;
+
+    y = 0, x = 0;
+    while (y < h && x < w) {
+        for (d = 0; d < h - y && d < w - x - DETECT_SUBROW_WIDTH; d++) {
+            char *p = buf + ((y+d)*w+x+d)*4;
+            __m128i pix0 = _mm_loadu_si128((const __m128i *)p);
+            __m128i pix1 = _mm_loadu_si128((const __m128i *)(p + 16));
+            __m128i left0 = _mm_slli_si128(pix0, 4);
+            __m128i left1 = _mm_or_si128(_mm_slli_si128(pix1, 4), _mm_srli_si128(pix0, 12));
+
+            _mm_store_si128((__m128i *)diffs,
+                            _mm_or_si128(_mm_subs_epu8(pix0, left0), _mm_subs_epu8(left0, pix0)));
+            _mm_store_si128((__m128i *)(diffs + 16),
+                            _mm_or_si128(_mm_subs_epu8(pix1, left1), _mm_subs_epu8(left1, pix1)));
+
+            for (dx = 1; dx <= DETECT_SUBROW_WIDTH; dx++) {
+                for (c = 0; c < 3; c++)
+                    diffStat[diffs[dx * 4 + off + c]]++;
+            }
+            *pixelCount += DETECT_SUBROW_WIDTH;
+        }
+        if (w > h) {
+            x += h;
+            y = 0;
+        } else {
+            x = 0;
+            y += w;
+        }
+    }
+}
+
+#endif
+
+
+#ifdef TIGHT_SSSE3
+
+static Bool HaveSSSE3(void) {
+    static int haveSSSE3 = -1;
+
+    if (haveSSSE3 < 0) {
+        __builtin_cpu_init();
+        haveSSSE3 = __builtin_cpu_supports("ssse3") ? 1 : 0;
+    }
+    return haveSSSE3;
+}
+
+/* Picks the red, green and blue bytes of 4 pixels into the first 12 */
+
+static SSSE3_TARGET __m128i Pack24Mask(int *shiftBits) {
+    char mask[16];
+    int i, c;
+
+    for (i = 0; i < 4; i++) {
+        for (c = 0; c < 3; c++)
+            mask[i * 3 + c] = i * 4 + shiftBits[c] / 8;
+    }
+    for (i = 12; i < 16; i++)
+        mask[i] = (char)0x80;
+    return _mm_loadu_si128((const __m128i *)mask);
+}
+
+/*
+ * Each 4 pixels are read before they're written over, 12 bytes on from the
+ * last 4; the 4 bytes after those are written too, but they are pixels
+ * that have already been read, or the pixel's next 4 bytes after the end.
+ */
+
+static SSSE3_TARGET void
+Pack24SSSE3(char *buf, int *shiftBits, int count)
+{
+    __m128i mask = Pack24Mask(shiftBits);
+    CARD32 *buf32 = (CARD32 *)buf;
+    CARD32 pix;
+    int i;
+
+    for (i = 0; i + 4 <= count; i += 4) {
+        __m128i pix4 = _mm_loadu_si128((const __m128i *)(buf32 + i));
+
+        _mm_storeu_si128((__m128i *)(buf + i * 3), _mm_shuffle_epi8(pix4, mask));
+    }
+    buf += i * 3;
+    for (; i < count; i++) {
+        pix = buf32[i];
+        *buf++ = (char)(pix >> shiftBits[0]);
+        *buf++ = (char)(pix >> shiftBits[1]);
+        *buf++ = (char)(pix >> shiftBits[2]);
+    }
+}
+
+/*
+ * The 24 bit gradient filter works on all 4 bytes of each pixel, the
+ * padding too, and packs the result.  Each row goes out no further into
+ * buf than the rows after it start, as Pack24's does.  rows has room for
+ * two rows of w + 1 pixels.
+ */
+
+static SSSE3_TARGET void
+FilterGradientSSSE3_24(char *buf, int *shiftBits, int w, int h, CARD32 *rows)
+{
+    __m128i mask = Pack24Mask(shiftBits);
+    __m128i zero = _mm_setzero_si128();
+    CARD32 *prev = rows, *cur = rows + w + 1, *tmp;
+    int x, y, c;
+
+    memset(prev, 0, (w + 1) * sizeof(CARD32));
+    cur[0] = 0;
+
+    for (y = 0; y < h; y++) {
+        char *out = buf + y * w * 3;
+
+        memcpy(cur + 1, (CARD32 *)buf + y * w, w * sizeof(CARD32));
+
+        for (x = 0; x + 4 <= w; x += 4) {
+            __m128i here = _mm_loadu_si128((const __m128i *)(cur + x + 1));
+            __m128i left = _mm_loadu_si128((const __m128i *)(cur + x));
+            __m128i upper = _mm_loadu_si128((const __m128i *)(prev + x + 1));
+            __m128i upperLeft = _mm_loadu_si128((const __m128i *)(prev + x));
+            __m128i lo, hi;
+
+            lo = _mm_sub_epi16(_mm_add_epi16(_mm_unpacklo_epi8(left, zero),
+                                             _mm_unpacklo_epi8(upper, zero)),
+                               _mm_unpacklo_epi8(upperLeft, zero));
+            hi = _mm_sub_epi16(_mm_add_epi16(_mm_unpackhi_epi8(left, zero),
+                                             _mm_unpackhi_epi8(upper, zero)),
+                               _mm_unpackhi_epi8(upperLeft, zero));
+
+            /* Packing with unsigned saturation is the clamp to [0, 255] */
+            _mm_storeu_si128((__m128i *)(out + x * 3),
+                             _mm_shuffle_epi8(_mm_sub_epi8(here, _mm_packus_epi16(lo, hi)),
+                                              mask));
+        }
+
+        for (; x < w; x++) {
+            for (c = 0; c < 3; c++) {
+                int here = (int)(cur[x + 1] >> shiftBits[c] & 0xFF);
+                int prediction = (int)(cur[x] >> shiftBits[c] & 0xFF) +
+                                 (int)(prev[x + 1] >> shiftBits[c] & 0xFF) -
+                                 (int)(prev[x] >> shiftBits[c] & 0xFF);
+
+                if (prediction < 0) {
+                    prediction = 0;
+                } else if (prediction > 0xFF) {
+                    prediction = 0xFF;
+                }
+                out[x * 3 + c] = (char)(here - prediction);
+            }
+        }
+
+        tmp = prev;
+        prev = cur;
+        cur = tmp;
+    }
+}
+
+
+
+static Bool BytesAligned(int *shiftBits) {
+    int c;
+
+    for (c = 0; c < 3; c++) {
+        if (shiftBits[c] % 8 != 0 || shiftBits[c] < 0 || shiftBits[c] > 24)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+#endif
+
+
+/*
+ * rfbTightPack24 packs count 32 bit pixels in buf into 24 bit color, with
+ * red, green and blue from the bytes shiftBits[0], [1] and [2] bits up.
+ */
+
+Bool rfbTightPack24(char *buf, int *shiftBits, int count) {
+#ifdef TIGHT_SSSE3
+    if (rfbSimdTight && count >= 4 && BytesAligned(shiftBits) && HaveSSSE3()) {
+        Pack24SSSE3(buf, shiftBits, count);
+        return TRUE;
+    }
+#endif
+    return FALSE;
+}
+
+/*
+ * rfbTightFilterGradient24 runs the gradient filter over w x h 32 bit
+ * pixels in buf, packing them to 24 bit color as rfbTightPack24 does.
+ * rows is scratch space for 2 * (w + 1) pixels.
+ */
+
+Bool rfbTightFilterGradient24(char *buf, int *shiftBits, int w, int h, void *rows) {
+#ifdef TIGHT_SSSE3
+    if (rfbSimdTight && w >= 4 && BytesAligned(shiftBits) && HaveSSSE3()) {
+        FilterGradientSSSE3_24(buf, shiftBits, w, h, (CARD32 *)rows);
+        return TRUE;
+    }
+#endif
+    return FALSE;
+}
+
+/*
+ * rfbTightFilterGradient16 and 32 run the gradient filter over w x h
+ * pixels in the client's format.  rows is scratch space for 2 * (w + 1)
+ * pixels.
+ */
+
+Bool rfbTightFilterGradient16(CARD16 *buf, rfbPixelFormat *fmt, Bool endianMismatch,
+                              int w, int h, void *rows) {
+#ifdef TIGHT_SSE2
+    if (rfbSimdTight && LanesFit(fmt, MAX_LANE_COLOR16)) {
+        FilterGradientSSE2_16(buf, fmt, endianMismatch, w, h, (CARD16 *)rows);
+        return TRUE;
+    }
+#endif
+    return FALSE;
+}
+
+Bool rfbTightFilterGradient32(CARD32 *buf, rfbPixelFormat *fmt, Bool endianMismatch,
+                              int w, int h, void *rows) {
+#ifdef TIGHT_SSE2
+    if (rfbSimdTight && LanesFit(fmt, MAX_LANE_COLOR32)) {
+        FilterGradientSSE2_32(buf, fmt, endianMismatch, w, h, (CARD32 *)rows);
+        return TRUE;
+    }
+#endif
+    return FALSE;
+}
+
+/*
+ * rfbTightDetectStats24, 16 and 32 add DetectSmoothImage's samples of w x h
+ * pixels to diffStat and pixelCount.  For 24 bit color the channels start
+ * off bytes into each 32 bit pixel.
+ */
+
+Bool rfbTightDetectStats24(char *buf, int off, int w, int h, int *diffStat,
+                           int *pixelCount) {
+#ifdef TIGHT_SSE2
+    if (rfbSimdTight) {
+        DetectStatsSSE2_24(buf, off, w, h, diffStat, pixelCount);
+        return TRUE;
+    }
+#endif
+    return FALSE;
+}
+
+Bool rfbTightDetectStats16(CARD16 *buf, rfbPixelFormat *fmt, Bool endianMismatch,
+                           int w, int h, int *diffStat, int *pixelCount) {
+#ifdef TIGHT_SSE2
+    if (rfbSimdTight && LanesFit(fmt, MAX_LANE_COLOR16)) {
+        DetectStatsSSE2_16(buf, fmt, endianMismatch, w, h, diffStat, pixelCount);
+        return TRUE;
+    }
+#endif
+    return FALSE;
+}
+
+Bool rfbTightDetectStats32(CARD32 *buf, rfbPixelFormat *fmt, Bool endianMismatch,
+                           int w, int h, int *diffStat, int *pixelCount) {
+#ifdef TIGHT_SSE2
+    if (rfbSimdTight && LanesFit(fmt, MAX_LANE_COLOR32)) {
+        DetectStatsSSE2_32(buf, fmt, endianMismatch, w, h, diffStat, pixelCount);
+        return TRUE;
+    }
+#endif
+    return FALSE;
+}
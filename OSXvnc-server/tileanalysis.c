@@ -0,0 +1,350 @@
+/*
+ * tileanalysis.c - find the colours in a tile, for the encoders.
+ *
+ * Hextile wants to know if a tile is solid or has two colours, and which
+ * is the more common.  Tight wants the same, and failing that a palette of
+ * up to 256 colours with how many pixels each has.  ZRLE wants a palette of
+ * up to 127 and the number of runs, and of single pixels, the tile would
+ * make.  rfbAnalyseTile does all of them in one pass, stopping as soon as
+ * it knows the answer to what it's asked:
+ *
+ *	- the run of the first colour is found, which for a solid tile is
+ *	  the whole of it;
+ *	- unless runs are wanted, the rest is checked for being one of the
+ *	  first two colours, counting the first;
+ *	- past that it goes run by run, looking each run's colour up in a
+ *	  small hash table.
+ *
+ * The first two look at 16 bytes at a time with SSE2, as does finding
+ * where each run ends, so the long runs of a desktop go by quickly.
+ * Elsewhere the same loops are plain C.
+ */
+
+/*
+ *  OSXvnc Copyright (C) 2002-2004 Redstone Software osxvnc@redstonesoftware.com
+ *  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rfb.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define ANALYSIS_SSE2
+#endif
+
+Bool rfbSimdAnalysis = TRUE;
+
+
+static void StartHash(rfbTileAnalysis *ta) {
+    int i, h;
+
+    memset(ta->hash, 0, sizeof(ta->hash));
+    for (i = 0; i < ta->numColours; i++) {
+        for (h = rfbTileColourHash(ta->colours[i]); ta->hash[h]; h = (h + 1) & (rfbTileColourHashSize - 1))
+            ;
+        ta->hash[h] = i + 1;
+    }
+    ta->hashed = TRUE;
+}
+
+/* Adds count pixels of a colour, returning FALSE if it's new and there's
+   no room for it */
+
+static inline Bool AddColour(rfbTileAnalysis *ta, CARD32 pix, int count,
+                             int maxColours) {
+    int h, i;
+
+    for (h = rfbTileColourHash(pix); (i = ta->hash[h]); h = (h + 1) & (rfbTileColourHashSize - 1)) {
+        if (ta->colours[i - 1] == pix) {
+            ta->counts[i - 1] += count;
+            return TRUE;
+        }
+    }
+
+    if (ta->numColours == maxColours)
+        return FALSE;
+
+    ta->colours[ta->numColours] = pix;
+    ta->counts[ta->numColours] = count;
+    ta->hash[h] = ++ta->numColours;
+    return TRUE;
+}
+
+
+/*
+ * FindOther returns the index of the first of n pixels which isn't c, or n.
+ * FindOther2 returns the first which is neither c0 nor c1, adding the
+ * number of c0 before it to *n0.
+ */
+
+#ifdef ANALYSIS_SSE2
+#define SSE2_FIND_OTHER(bpp)                                                  \
+    if (rfbSimdAnalysis) {                                                    \
+        __m128i vc = _mm_set1_epi##bpp(c);                                    \
+                                                                              \
+        for (; i + 128 / bpp <= n; i += 128 / bpp) {                          \
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + i));            \
+            int m = _mm_movemask_epi8(_mm_cmpeq_epi##bpp(v, vc));             \
+                                                                              \
+            if (m != 0xFFFF)                                                  \
+                return i + __builtin_ctz(~m) / (bpp / 8);                     \
+        }                                                                     \
+    }
+
+#define SSE2_FIND_OTHER2(bpp)                                                 \
+    if (rfbSimdAnalysis) {                                                    \
+        __m128i v0 = _mm_set1_epi##bpp(c0), v1 = _mm_set1_epi##bpp(c1);       \
+                                                                              \
+        for (; i + 128 / bpp <= n; i += 128 / bpp) {                          \
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + i));            \
+            int m0 = _mm_movemask_epi8(_mm_cmpeq_epi##bpp(v, v0));            \
+            int m1 = _mm_movemask_epi8(_mm_cmpeq_epi##bpp(v, v1));            \
+                                                                              \
+            if ((m0 | m1) != 0xFFFF) {                                        \
+                int stop = __builtin_ctz(~(m0 | m1));                         \
+                                                                              \
+                *n0 += count + __builtin_popcount(m0 & ((1 << stop) - 1)) / (bpp / 8); \
+                return i + stop / (bpp / 8);                                  \
+            }                                                                 \
+            count += __builtin_popcount(m0) / (bpp / 8);                      \
+        }                                                                     \
+    }
+#else
+#define SSE2_FIND_OTHER(bpp)
+#define SSE2_FIND_OTHER2(bpp)
+#endif
+
+#define DEFINE_FIND_FUNCTIONS(bpp)                                            \
+                                                                              \
+static inline int                                                             \
+FindOther##bpp(const CARD##bpp *p, int n, CARD##bpp c)                        \
+{                                                                             \
+    int i = 0;                                                                \
+                                                                              \
+    if (n == 0 || p[0] != c)                                                  \
+        return 0;                                                             \
+    SSE2_FIND_OTHER(bpp)                                                      \
+    while (i < n && p[i] == c)                                                \
+        i++;                                                                  \
+    return i;                                                                 \
+}                                                                             \
+                                                                              \
+static inline int                                                             \
+FindOther2##bpp(const CARD##bpp *p, int n, CARD##bpp c0, CARD##bpp c1,        \
+                int *n0)                                                      \
+{                                                                             \
+    int i = 0, count = 0;                                                     \
+                                                                              \
+    if (n == 0 || (p[0] != c0 && p[0] != c1))                                 \
+        return 0;                                                             \
+    SSE2_FIND_OTHER2(bpp)                                                     \
+    for (; i < n; i++) {                                                      \
+        if (p[i] == c0)                                                       \
+            count++;                                                          \
+        else if (p[i] != c1)                                                  \
+            break;                                                            \
+    }                                                                         \
+    *n0 += count;                                                             \
+    return i;                                                                 \
+}
+
+DEFINE_FIND_FUNCTIONS(8)
+DEFINE_FIND_FUNCTIONS(16)
+DEFINE_FIND_FUNCTIONS(32)
+
+
+/*
+ * The analysis itself.  x and y are where it's got to, row the start of
+ * row y.
+ */
+
+#define DEFINE_ANALYSE_FUNCTION(bpp)                                          \
+                                                                              \
+static void                                                                   \
+Analyse##bpp(rfbTileAnalysis *ta, CARD##bpp *data, int w, int h, int stride,  \
+             int maxColours, int flags)                                       \
+{                                                                             \
+    CARD##bpp *row = data;                                                    \
+    CARD##bpp c0 = data[0], c1, pix;                                          \
+    int x = 0, y, n0, n1, len, from, before;                                  \
+    int runs = 0, singlePixels = 0;                                           \
+    Bool full = FALSE;                                                        \
+                                                                              \
+    ta->numColours = 0;                                                       \
+    ta->runs = ta->singlePixels = 0;                                          \
+    ta->hashed = FALSE;                                                       \
+    ta->colours[0] = c0;                                                      \
+                                                                              \
+    /* The run of the first colour */                                         \
+                                                                              \
+    for (y = 0; y < h; y++, row += stride) {                                  \
+        if ((x = FindOther##bpp(row, w, c0)) < w)                             \
+            break;                                                            \
+    }                                                                         \
+    if (y == h) {                                                             \
+        ta->numColours = 1;                                                   \
+        ta->counts[0] = w * h;                                                \
+        if (w * h == 1)                                                       \
+            ta->singlePixels = 1;                                             \
+        else                                                                  \
+            ta->runs = 1;                                                     \
+        return;                                                               \
+    }                                                                         \
+    n0 = y * w + x;                                                           \
+    ta->counts[0] = n0;                                                       \
+    if (maxColours < 2)                                                       \
+        return;                                                               \
+                                                                              \
+    if (flags & rfbAnalyseRuns) {                                             \
+        ta->numColours = 1;                                                   \
+        if (n0 == 1)                                                          \
+            ta->singlePixels++;                                               \
+        else                                                                  \
+            ta->runs++;                                                       \
+    } else {                                                                  \
+        /* Is the rest all the first two colours? */                          \
+                                                                              \
+        c1 = row[x++];                                                        \
+        n1 = 1;                                                               \
+        for (;;) {                                                            \
+            from = x;                                                         \
+            before = n0;                                                      \
+            x += FindOther2##bpp(row + x, w - x, c0, c1, &n0);                \
+            n1 += (x - from) - (n0 - before);                                 \
+            if (x < w || ++y == h)                                            \
+                break;                                                        \
+            row += stride;                                                    \
+            x = 0;                                                            \
+        }                                                                     \
+        ta->colours[1] = c1;                                                  \
+        ta->counts[0] = n0;                                                   \
+        ta->counts[1] = n1;                                                   \
+        if (y == h) {                                                         \
+            ta->numColours = 2;                                               \
+            return;                                                           \
+        }                                                                     \
+        if (maxColours == 2)                                                  \
+            return;                                                           \
+        ta->numColours = 2;                                                   \
+    }                                                                         \
+    StartHash(ta);                                                            \
+                                                                              \
+    /* Run by run from here */                                                \
+                                                                              \
+    while (y < h) {                                                           \
+        pix = row[x];                                                         \
+        from = x;                                                             \
+        len = 0;                                                              \
+        for (;;) {                                                            \
+            if (++x < w && row[x] == pix)                                     \
+                x += FindOther##bpp(row + x, w - x, pix);                     \
+            if (x < w || ++y == h)                                            \
+                break;                                                        \
+            len += x - from;                                                  \
+            row += stride;                                                    \
+            x = from = 0;                                                     \
+            if (row[0] != pix)                                                \
+                break;                                                        \
+        }                                                                     \
+        len += x - from;                                                      \
+                                                                              \
+        if (len == 1)                                                         \
+            singlePixels++;                                                   \
+        else                                                                  \
+            runs++;                                                           \
+        if (!full && !AddColour(ta, pix, len, maxColours)) {                  \
+            full = TRUE;                                                      \
+            if (!(flags & rfbAnalyseRuns))                                    \
+                break;                                                        \
+        }                                                                     \
+    }                                                                         \
+    if (flags & rfbAnalyseRuns) {                                             \
+        ta->runs += runs;                                                     \
+        ta->singlePixels += singlePixels;                                     \
+    }                                                                         \
+    if (full)                                                                 \
+        ta->numColours = 0;                                                   \
+}
+
+DEFINE_ANALYSE_FUNCTION(8)
+DEFINE_ANALYSE_FUNCTION(16)
+DEFINE_ANALYSE_FUNCTION(32)
+
+
+/*
+ * rfbAnalyseTile finds the colours of a w x h tile of pixels, stride
+ * pixels from one row to the next, keeping up to maxColours of them.
+ */
+
+void
+rfbAnalyseTile(rfbTileAnalysis *ta, void *data, int bitsPerPixel, int w,
+               int h, int stride, int maxColours, int flags)
+{
+    if (maxColours > rfbTileMaxColours)
+        maxColours = rfbTileMaxColours;
+
+    /* Rows with nothing between them are as good as one long row */
+    if (stride == w) {
+        w *= h;
+        stride = w;
+        h = 1;
+    }
+
+    switch (bitsPerPixel) {
+    case 8:
+        Analyse8(ta, (CARD8 *)data, w, h, stride, maxColours, flags);
+        break;
+    case 16:
+        Analyse16(ta, (CARD16 *)data, w, h, stride, maxColours, flags);
+        break;
+    default:
+        Analyse32(ta, (CARD32 *)data, w, h, stride, maxColours, flags);
+        break;
+    }
+}
+
+
+/*
+ * rfbSortTileColours puts the colours most common first, those seen first
+ * first among equals.
+ */
+
+void
+rfbSortTileColours(rfbTileAnalysis *ta)
+{
+    int i, j, count;
+    CARD32 pix;
+
+    for (i = 1; i < ta->numColours; i++) {
+        pix = ta->colours[i];
+        count = ta->counts[i];
+        for (j = i; j > 0 && ta->counts[j - 1] < count; j--) {
+            ta->colours[j] = ta->colours[j - 1];
+            ta->counts[j] = ta->counts[j - 1];
+        }
+        ta->colours[j] = pix;
+        ta->counts[j] = count;
+    }
+
+    if (ta->hashed)
+        StartHash(ta);
+}
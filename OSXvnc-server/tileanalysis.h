@@ -0,0 +1,80 @@
+/*
+ * tileanalysis.h - what colours a tile has, for the encoders.
+ */
+
+/*
+ *  OSXvnc Copyright (C) 2002-2004 Redstone Software osxvnc@redstonesoftware.com
+ *  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#ifndef __TILE_ANALYSIS_H__
+#define __TILE_ANALYSIS_H__
+
+#define rfbTileMaxColours 256
+#define rfbTileColourHashSize 512
+
+/* Count runs as ZRLE does, along each row and on into the next */
+#define rfbAnalyseRuns 1
+
+typedef struct rfbTileAnalysis {
+    /* The distinct colours, 1 for a solid tile and 2 for a mono one, or 0
+       if there are more than were asked for */
+    int numColours;
+
+    /* The colours in the order they're first seen, or most common first
+       after rfbSortTileColours, with the number of pixels of each.  When
+       there were too many colours the first two, and their counts as far
+       as the tile was looked at, are still there. */
+    CARD32 colours[rfbTileMaxColours];
+    int counts[rfbTileMaxColours];
+
+    /* With rfbAnalyseRuns, the runs of two or more pixels and of one */
+    int runs;
+    int singlePixels;
+
+    /* Index + 1 of each colour by rfbTileColourHash, unless the analysis
+       stopped before it needed them */
+    Bool hashed;
+    CARD16 hash[rfbTileColourHashSize];
+} rfbTileAnalysis;
+
+static inline int rfbTileColourHash(CARD32 pix) {
+    return (pix ^ (pix >> 7) ^ (pix >> 15) ^ (pix >> 23)) & (rfbTileColourHashSize - 1);
+}
+
+/* The index of a colour the analysis found, or -1 */
+
+static inline int rfbTileColourIndex(rfbTileAnalysis *ta, CARD32 pix) {
+    int i;
+
+    if (!ta->hashed) {
+        for (i = 0; i < ta->numColours; i++) {
+            if (ta->colours[i] == pix)
+                return i;
+        }
+        return -1;
+    }
+
+    for (i = rfbTileColourHash(pix); ta->hash[i]; i = (i + 1) & (rfbTileColourHashSize - 1)) {
+        if (ta->colours[ta->hash[i] - 1] == pix)
+            return ta->hash[i] - 1;
+    }
+    return -1;
+}
+
+#endif
@@ -0,0 +1,341 @@
+/*
+ * tilecache.c - encoded rectangles shared between clients.
+ *
+ * With many viewers on one screen every client would translate and encode
+ * the same pixels.  For the encodings whose output depends only on the
+ * pixels, the rectangle and the client's pixel format (Raw, RRE, CoRRE and
+ * Hextile) the first client to encode a rectangle keeps a copy of the bytes
+ * it sent, keyed by a hash of the source pixels, and the others replay them.
+ *
+ * None of these encodings use the compression or quality levels, so those
+ * are not part of the key, and nor is the client's scale: the hashed pixels
+ * are already scaled.  Zlib, ZlibHex, Tight and ZRLE carry compressor
+ * state from one rectangle to the next and are never cached.
+ */
+
+/*
+ *  OSXvnc Copyright (C) 2002-2004 Redstone Software osxvnc@redstonesoftware.com
+ *  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "rfb.h"
+
+int rfbTileCacheSize = 16;      /* in MB, 0 disables the cache */
+
+unsigned long rfbTileCacheHits = 0;
+unsigned long rfbTileCacheMisses = 0;
+unsigned long rfbTileCacheEvictions = 0;
+
+/* Rectangles smaller than this aren't worth hashing and keeping */
+#define TILE_CACHE_MIN_PIXELS 64
+
+#define TILE_CACHE_BUCKETS 4096
+
+typedef struct {
+    rfbTileHash hash;
+    int x, y, w, h;
+    int encoding;
+    rfbPixelFormat format;
+} tileKey;
+
+typedef struct tileEntry {
+    tileKey key;
+    struct tileEntry *hashNext;
+    struct tileEntry *lruPrev, *lruNext;
+    int refCount;               /* clients replaying it, plus one while cached */
+
+    /* What encoding the rectangle added to the client's statistics */
+    int rectanglesSent[MAX_ENCODINGS];
+    int bytesSent[MAX_ENCODINGS];
+
+    int len;
+    char data[1];
+} tileEntry;
+
+static pthread_mutex_t tileCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+static tileEntry *buckets[TILE_CACHE_BUCKETS];
+static tileEntry *lruHead = NULL, *lruTail = NULL;     /* most recent first */
+static size_t cacheBytes = 0;
+
+
+static size_t MaxCacheBytes(void) {
+    return (size_t)rfbTileCacheSize * 1024 * 1024;
+}
+
+static unsigned Bucket(tileKey *key) {
+    rfbTileHash h = key->hash ^ ((rfbTileHash)key->x << 16) ^ ((rfbTileHash)key->y << 32) ^ key->encoding;
+
+    return (unsigned)(h ^ (h >> 29) ^ (h >> 47)) & (TILE_CACHE_BUCKETS - 1);
+}
+
+static Bool FormatsEqual(rfbPixelFormat *a, rfbPixelFormat *b) {
+    return (a->bitsPerPixel == b->bitsPerPixel && a->depth == b->depth &&
+            a->bigEndian == b->bigEndian && a->trueColour == b->trueColour &&
+            a->redMax == b->redMax && a->greenMax == b->greenMax && a->blueMax == b->blueMax &&
+            a->redShift == b->redShift && a->greenShift == b->greenShift && a->blueShift == b->blueShift);
+}
+
+static Bool KeysEqual(tileKey *a, tileKey *b) {
+    return (a->hash == b->hash && a->x == b->x && a->y == b->y && a->w == b->w && a->h == b->h &&
+            a->encoding == b->encoding &&
+            FormatsEqual(&a->format, &b->format));
+}
+
+static void LruUnlink(tileEntry *entry) {
+    if (entry->lruPrev)
+        entry->lruPrev->lruNext = entry->lruNext;
+    else
+        lruHead = entry->lruNext;
+    if (entry->lruNext)
+        entry->lruNext->lruPrev = entry->lruPrev;
+    else
+        lruTail = entry->lruPrev;
+    entry->lruPrev = entry->lruNext = NULL;
+}
+
+static void LruPushFront(tileEntry *entry) {
+    entry->lruPrev = NULL;
+    entry->lruNext = lruHead;
+    if (lruHead)
+        lruHead->lruPrev = entry;
+    lruHead = entry;
+    if (!lruTail)
+        lruTail = entry;
+}
+
+static void ReleaseEntry(tileEntry *entry) {
+    if (--entry->refCount == 0)
+        xfree(entry);
+}
+
+/* Take an entry out of the table and the LRU list.  Called with the lock held. */
+
+static void RemoveEntry(tileEntry *entry) {
+    tileEntry **link = &buckets[Bucket(&entry->key)];
+
+    while (*link && *link != entry)
+        link = &(*link)->hashNext;
+    if (*link)
+        *link = entry->hashNext;
+
+    LruUnlink(entry);
+    cacheBytes -= sizeof(tileEntry) + entry->len;
+    ReleaseEntry(entry);
+}
+
+
+/*
+ * Returns the entry for a key with a reference held, or NULL.  The hit and
+ * miss counters are kept here, under the lock.
+ */
+
+static tileEntry *LookupEntry(tileKey *key) {
+    tileEntry *entry;
+
+    pthread_mutex_lock(&tileCacheMutex);
+    for (entry = buckets[Bucket(key)]; entry; entry = entry->hashNext) {
+        if (KeysEqual(&entry->key, key)) {
+            LruUnlink(entry);
+            LruPushFront(entry);
+            entry->refCount++;
+            break;
+        }
+    }
+    if (entry)
+        rfbTileCacheHits++;
+    else
+        rfbTileCacheMisses++;
+    pthread_mutex_unlock(&tileCacheMutex);
+
+    return entry;
+}
+
+static void InsertEntry(tileEntry *entry) {
+    tileEntry *old;
+    unsigned bucket = Bucket(&entry->key);
+
+    pthread_mutex_lock(&tileCacheMutex);
+
+    /* Another client may have got there first */
+    for (old = buckets[bucket]; old; old = old->hashNext) {
+        if (KeysEqual(&old->key, &entry->key)) {
+            pthread_mutex_unlock(&tileCacheMutex);
+            xfree(entry);
+            return;
+        }
+    }
+
+    cacheBytes += sizeof(tileEntry) + entry->len;
+    while (cacheBytes > MaxCacheBytes() && lruTail) {
+        RemoveEntry(lruTail);
+        rfbTileCacheEvictions++;
+    }
+
+    entry->refCount = 1;
+    entry->hashNext = buckets[bucket];
+    buckets[bucket] = entry;
+    LruPushFront(entry);
+
+    pthread_mutex_unlock(&tileCacheMutex);
+}
+
+
+/*
+ * rfbTileCacheFlush drops everything, for when the screen is reinitialised
+ * and the same bytes may now mean different pixels.
+ */
+
+void rfbTileCacheFlush(void) {
+    pthread_mutex_lock(&tileCacheMutex);
+    while (lruHead)
+        RemoveEntry(lruHead);
+    pthread_mutex_unlock(&tileCacheMutex);
+}
+
+
+static void CaptureBytes(rfbClientPtr cl, char *data, int len) {
+    if (cl->tileCaptureLen >= 0 && len > 0) {
+        if (cl->tileCaptureLen + len > cl->tileCaptureSize) {
+            int newSize = max(cl->tileCaptureSize * 2, cl->tileCaptureLen + len);
+            char *newBuf;
+
+            /* Nothing that big is going to be cached anyway */
+            if ((size_t)newSize > MaxCacheBytes() / 8) {
+                cl->tileCaptureLen = -1;
+                return;
+            }
+
+            newBuf = (char *)xrealloc(cl->tileCaptureBuf, newSize);
+            if (!newBuf) {
+                cl->tileCaptureLen = -1;
+                return;
+            }
+            cl->tileCaptureBuf = newBuf;
+            cl->tileCaptureSize = newSize;
+        }
+
+        memcpy(cl->tileCaptureBuf + cl->tileCaptureLen, data, len);
+        cl->tileCaptureLen += len;
+    }
+}
+
+
+/*
+ * rfbTileCacheCapture is called from rfbSendUpdateBuf while a rectangle is
+ * being captured, to keep the part of updateBuf that is about to go out.
+ * rfbTileCacheCaptureBytes does the same from rfbQueueUpdateBytes, followed
+ * by the data being queued.
+ */
+
+void rfbTileCacheCapture(rfbClientPtr cl) {
+    CaptureBytes(cl, cl->updateBuf + cl->tileCaptureFrom, cl->ublen - cl->tileCaptureFrom);
+
+    /* updateBuf is about to be emptied */
+    cl->tileCaptureFrom = 0;
+}
+
+void rfbTileCacheCaptureBytes(rfbClientPtr cl, char *data, int len) {
+    CaptureBytes(cl, cl->updateBuf + cl->tileCaptureFrom, cl->ublen - cl->tileCaptureFrom);
+    CaptureBytes(cl, data, len);
+    cl->tileCaptureFrom = cl->ublen;
+}
+
+static rfbTileHash HashRect(rfbClientPtr cl, int x, int y, int w, int h) {
+    int bpp = rfbScreen.bitsPerPixel / 8;
+
+    return rfbHashPixels(cl->scalingFrameBuffer + y * cl->scalingPaddedWidthInBytes + x * bpp,
+                         w * bpp, cl->scalingPaddedWidthInBytes, h);
+}
+
+
+/*
+ * rfbTileCacheSend sends a rectangle with one of the stateless encoders,
+ * replaying a cached copy if there is one and caching the output if not.
+ * The coordinates are those the encoder is called with, i.e. already scaled.
+ */
+
+Bool rfbTileCacheSend(rfbClientPtr cl, int x, int y, int w, int h,
+                      Bool (*encoder)(rfbClientPtr cl, int x, int y, int w, int h)) {
+    tileKey key;
+    tileEntry *entry;
+    unsigned long long rectanglesBefore[MAX_ENCODINGS], bytesBefore[MAX_ENCODINGS];
+    int i;
+
+    if (rfbTileCacheSize <= 0 || w * h < TILE_CACHE_MIN_PIXELS || !cl->format.trueColour)
+        return (*encoder)(cl, x, y, w, h);
+
+    memset(&key, 0, sizeof(key));
+    key.hash = HashRect(cl, x, y, w, h);
+    key.x = x;
+    key.y = y;
+    key.w = w;
+    key.h = h;
+    key.encoding = cl->preferredEncoding;
+    key.format = cl->format;
+
+    if ((entry = LookupEntry(&key)) != NULL) {
+        Bool ok = rfbSendUpdateBytes(cl, entry->data, entry->len);
+
+        for (i = 0; i < MAX_ENCODINGS; i++) {
+            cl->rfbRectanglesSent[i] += entry->rectanglesSent[i];
+            cl->rfbBytesSent[i] += entry->bytesSent[i];
+        }
+
+        pthread_mutex_lock(&tileCacheMutex);
+        ReleaseEntry(entry);
+        pthread_mutex_unlock(&tileCacheMutex);
+        return ok;
+    }
+
+    memcpy(rectanglesBefore, cl->rfbRectanglesSent, sizeof(rectanglesBefore));
+    memcpy(bytesBefore, cl->rfbBytesSent, sizeof(bytesBefore));
+    cl->tileCaptureLen = 0;
+    cl->tileCaptureFrom = cl->ublen;
+
+    if (!(*encoder)(cl, x, y, w, h)) {
+        cl->tileCaptureFrom = -1;
+        return FALSE;
+    }
+
+    rfbTileCacheCapture(cl);
+    cl->tileCaptureFrom = -1;
+
+    /* Only keep it if the pixels didn't change under the encoder */
+    if (cl->tileCaptureLen <= 0 || HashRect(cl, x, y, w, h) != key.hash)
+        return TRUE;
+
+    entry = (tileEntry *)xalloc(sizeof(tileEntry) + cl->tileCaptureLen);
+    if (!entry)
+        return TRUE;
+
+    entry->key = key;
+    for (i = 0; i < MAX_ENCODINGS; i++) {
+        entry->rectanglesSent[i] = cl->rfbRectanglesSent[i] - rectanglesBefore[i];
+        entry->bytesSent[i] = cl->rfbBytesSent[i] - bytesBefore[i];
+    }
+    entry->len = cl->tileCaptureLen;
+    memcpy(entry->data, cl->tileCaptureBuf, cl->tileCaptureLen);
+    InsertEntry(entry);
+
+    return TRUE;
+}
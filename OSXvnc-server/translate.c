@@ -25,6 +25,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include "rfb.h"
 
 static Bool rfbSetClientColourMapBGR233();
@@ -130,6 +131,109 @@ rfbTranslateFnType rfbTranslateWithRGBTablesFns[3][3] = {
 };
 
 
+/*
+ * The lookup tables depend only on the two formats, so clients in the same
+ * format share them.  Each table is kept with a count of the clients using
+ * it, and a few no one is using are kept as well: the cursor is sent by
+ * switching a client to the cursor's format and back, and a client that
+ * comes straight back after disconnecting finds its table still there.
+ * Once built a table is only read, so it needs no lock of its own.
+ */
+
+#define MAX_IDLE_TABLES 4
+
+typedef struct rfbTranslateTable {
+    rfbPixelFormat in, out;
+    Bool rgbTables;
+    int refCount;
+    char *table;
+    struct rfbTranslateTable *next;
+} rfbTranslateTable;
+
+static rfbTranslateTable *translateTables = NULL;  /* most recently used first */
+static pthread_mutex_t translateTablesMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static char *
+GetTranslateTable(rfbPixelFormat *in, rfbPixelFormat *out, Bool rgbTables)
+{
+    rfbTranslateTable *t, **link;
+
+    pthread_mutex_lock(&translateTablesMutex);
+    for (link = &translateTables; (t = *link); link = &t->next) {
+        if (t->rgbTables == rgbTables && PF_EQ(t->in, (*in)) && PF_EQ(t->out, (*out))) {
+            *link = t->next;
+            break;
+        }
+    }
+
+    if (!t && (t = (rfbTranslateTable *)xalloc(sizeof(rfbTranslateTable)))) {
+        t->in = *in;
+        t->out = *out;
+        t->rgbTables = rgbTables;
+        t->refCount = 0;
+        t->table = NULL;
+        if (rgbTables)
+            (*rfbInitTrueColourRGBTablesFns
+                [out->bitsPerPixel / 16]) (&t->table, in, out);
+        else
+            (*rfbInitTrueColourSingleTableFns
+                [out->bitsPerPixel / 16]) (&t->table, in, out);
+        if (!t->table) {
+            xfree(t);
+            t = NULL;
+        }
+    }
+
+    if (t) {
+        t->refCount++;
+        t->next = translateTables;
+        translateTables = t;
+    }
+    pthread_mutex_unlock(&translateTablesMutex);
+
+    return (t ? t->table : NULL);
+}
+
+static void
+ReleaseTranslateTable(char *table)
+{
+    rfbTranslateTable *t, **link;
+    int idle = 0;
+
+    if (!table)
+        return;
+
+    pthread_mutex_lock(&translateTablesMutex);
+    for (t = translateTables; t; t = t->next) {
+        if (t->table == table) {
+            t->refCount--;
+            break;
+        }
+    }
+
+    link = &translateTables;
+    while ((t = *link)) {
+        if (t->refCount == 0 && ++idle > MAX_IDLE_TABLES) {
+            *link = t->next;
+            xfree(t->table);
+            xfree(t);
+        }
+        else
+            link = &t->next;
+    }
+    pthread_mutex_unlock(&translateTablesMutex);
+}
+
+/*
+ * rfbFreeTranslateTable lets go of a client's lookup table.
+ */
+
+void rfbFreeTranslateTable(rfbClientPtr cl) {
+    ReleaseTranslateTable(cl->translateLookupTable);
+    cl->translateLookupTable = NULL;
+}
+
+
 /*
  * rfbTranslateNone is used when no translation is required.
  */
@@ -158,12 +262,29 @@ Bool rfbSetTranslateFunction(rfbClientPtr cl) {
     PrintPixelFormat(&cl->format);
     //cl->format = rfbServerFormat;
     cl->translateFn = rfbTranslateNone;
-    cl->translateLookupTable = NULL;
 	
     return rfbSetTranslateFunctionUsingFormat(cl, rfbServerFormat);
 }
 
+/*
+ * rfbSetTranslateFunctionUsingFormat sets the function translating from
+ * inFormat, taking the table it needs before letting go of the client's old
+ * one so that switching back and forth doesn't rebuild it.
+ */
+
+static Bool SetTranslateFunction(rfbClientPtr cl, rfbPixelFormat inFormat);
+
 Bool rfbSetTranslateFunctionUsingFormat(rfbClientPtr cl, rfbPixelFormat inFormat) {
+    char *oldTable = cl->translateLookupTable;
+    Bool ok;
+
+    cl->translateLookupTable = NULL;
+    ok = SetTranslateFunction(cl, inFormat);
+    ReleaseTranslateTable(oldTable);
+    return ok;
+}
+
+static Bool SetTranslateFunction(rfbClientPtr cl, rfbPixelFormat inFormat) {
     /*
      * Check that bits per pixel values are valid
      */
@@ -227,6 +348,11 @@ Bool rfbSetTranslateFunctionUsingFormat(rfbClientPtr cl, rfbPixelFormat inFormat
         return TRUE;
     }
 
+    /* 32 bit true colour has kernels which don't need a table */
+
+    if ((cl->translateFn = rfbSimdTranslateFunction(&inFormat, &cl->format)))
+        return TRUE;
+
     if ((inFormat.bitsPerPixel < 16) ||
         (!rfbEconomicTranslate && (inFormat.bitsPerPixel == 16))) {
 
@@ -238,10 +364,7 @@ Bool rfbSetTranslateFunctionUsingFormat(rfbClientPtr cl, rfbPixelFormat inFormat
                               [inFormat.bitsPerPixel / 16]
                                   [cl->format.bitsPerPixel / 16];
 
-        (*rfbInitTrueColourSingleTableFns
-            [cl->format.bitsPerPixel / 16]) (&cl->translateLookupTable,
-                                             &inFormat, &cl->format);
-
+        cl->translateLookupTable = GetTranslateTable(&inFormat, &cl->format, FALSE);
     }
     else {
         //rfbLog("three tables for R, G, B\n");
@@ -252,9 +375,14 @@ Bool rfbSetTranslateFunctionUsingFormat(rfbClientPtr cl, rfbPixelFormat inFormat
                               [inFormat.bitsPerPixel / 16]
                                   [cl->format.bitsPerPixel / 16];
 
-        (*rfbInitTrueColourRGBTablesFns
-            [cl->format.bitsPerPixel / 16]) (&cl->translateLookupTable,
-                                             &inFormat, &cl->format);
+        cl->translateLookupTable = GetTranslateTable(&inFormat, &cl->format, TRUE);
+    }
+
+    if (!cl->translateLookupTable) {
+        rfbLog("rfbSetTranslateFunction: out of memory for lookup table\n");
+        cl->translateFn = rfbTranslateNone;
+        rfbCloseClient(cl);
+        return FALSE;
     }
 
     return TRUE;
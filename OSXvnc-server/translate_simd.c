@@ -0,0 +1,455 @@
+/*
+ * translate_simd.c - translate 32 bit true colour pixels with SIMD.
+ *
+ * The screen is nearly always 32 bits per pixel with 8 bits for each of
+ * red, green and blue, and translate.c would translate it for a client
+ * with a different format using three lookup tables, one pixel at a time.
+ * For that input the tables hold nothing a few shifts, masks and a multiply
+ * can't work out, so the functions here do the same sums on 4 (SSE2) or
+ * 8 (AVX2) pixels at once:
+ *
+ *	out = ((((p >> inShift) & 255) * outMax + 127) / 255) << outShift
+ *
+ * for each channel, ORed together and byte swapped as the tables would
+ * have been.  That's the table's own rounding, so the output is exactly
+ * what the table functions give; the division by 255 is done as
+ * (v + 1 + (v >> 8)) >> 8, which is exact for every v that can occur.
+ * Channels the client also has 8 bits of skip the multiply, which leaves
+ * just a swizzle for 32 bit clients.
+ *
+ * rfbSimdTranslateFunction picks the widest kernel the CPU can run for a
+ * pair of formats, or returns NULL to leave them to the tables.  Each
+ * instruction set only needs its own loop over a row; elsewhere (NEON on
+ * ARM, say) the plain C loop is written so the compiler can vectorise it.
+ */
+
+/*
+ *  OSXvnc Copyright (C) 2002-2004 Redstone Software osxvnc@redstonesoftware.com
+ *  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "rfb.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define TRANSLATE_SSE2
+#endif
+
+#if defined(__x86_64__) && (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#include <immintrin.h>
+#define TRANSLATE_AVX2
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define TRANSLATE_PORTABLE
+#endif
+
+Bool rfbSimdTranslate = TRUE;
+
+typedef struct {
+    int inShift[3];
+    int outMax[3];
+    int outShift[3];
+    Bool scale;                 /* a channel has fewer than 8 bits */
+    Bool swap;                  /* byte order differs */
+} translateParams;
+
+
+static void GetTranslateParams(translateParams *params, rfbPixelFormat *in,
+                               rfbPixelFormat *out) {
+    params->inShift[0] = in->redShift;
+    params->inShift[1] = in->greenShift;
+    params->inShift[2] = in->blueShift;
+    params->outMax[0] = out->redMax;
+    params->outMax[1] = out->greenMax;
+    params->outMax[2] = out->blueMax;
+    params->outShift[0] = out->redShift;
+    params->outShift[1] = out->greenShift;
+    params->outShift[2] = out->blueShift;
+    params->scale = (out->redMax != 255 || out->greenMax != 255 ||
+                     out->blueMax != 255);
+    params->swap = (out->bitsPerPixel != 8 && out->bigEndian != in->bigEndian);
+}
+
+
+/*
+ * TranslatePixel does one pixel the long way, for the ends of rows and for
+ * CPUs without a kernel.  It's written so it vectorises where it can.
+ */
+
+static inline CARD32 TranslatePixel(const translateParams *params, CARD32 pix) {
+    CARD32 result = 0;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        CARD32 c = (pix >> params->inShift[i]) & 255;
+
+        if (params->scale)
+            c = (c * params->outMax[i] + 127) / 255;
+        result |= c << params->outShift[i];
+    }
+    return result;
+}
+
+static inline void TranslatePixels(const translateParams *params, int outBits,
+                                   CARD32 *ip, char *optr, int n) {
+    int i;
+
+    switch (outBits) {
+        case 8:
+            for (i = 0; i < n; i++)
+                ((CARD8 *)optr)[i] = TranslatePixel(params, ip[i]);
+            break;
+        case 16:
+            for (i = 0; i < n; i++) {
+                CARD16 pix = TranslatePixel(params, ip[i]);
+                ((CARD16 *)optr)[i] = (params->swap ? Swap16(pix) : pix);
+            }
+            break;
+        case 32:
+            for (i = 0; i < n; i++) {
+                CARD32 pix = TranslatePixel(params, ip[i]);
+                ((CARD32 *)optr)[i] = (params->swap ? Swap32(pix) : pix);
+            }
+            break;
+    }
+}
+
+
+#ifdef TRANSLATE_PORTABLE
+
+static inline void TranslatePortable(rfbPixelFormat *in, rfbPixelFormat *out,
+                                     char *iptr, char *optr,
+                                     int bytesBetweenInputLines,
+                                     int width, int height, int outBits) {
+    translateParams params;
+
+    GetTranslateParams(&params, in, out);
+    while (height > 0) {
+        TranslatePixels(&params, outBits, (CARD32 *)iptr, optr, width);
+        iptr += bytesBetweenInputLines;
+        optr += width * (outBits / 8);
+        height--;
+    }
+}
+
+static void rfbTranslatePortable32to8(char *table, rfbPixelFormat *in,
+                                      rfbPixelFormat *out, char *iptr, char *optr,
+                                      int bytesBetweenInputLines,
+                                      int width, int height) {
+    TranslatePortable(in, out, iptr, optr, bytesBetweenInputLines, width, height, 8);
+}
+
+static void rfbTranslatePortable32to16(char *table, rfbPixelFormat *in,
+                                       rfbPixelFormat *out, char *iptr, char *optr,
+                                       int bytesBetweenInputLines,
+                                       int width, int height) {
+    TranslatePortable(in, out, iptr, optr, bytesBetweenInputLines, width, height, 16);
+}
+
+static void rfbTranslatePortable32to32(char *table, rfbPixelFormat *in,
+                                       rfbPixelFormat *out, char *iptr, char *optr,
+                                       int bytesBetweenInputLines,
+                                       int width, int height) {
+    TranslatePortable(in, out, iptr, optr, bytesBetweenInputLines, width, height, 32);
+}
+
+#endif
+
+
+#ifdef TRANSLATE_SSE2
+
+/* Channel i of 4 pixels, in place in the output pixel */
+
+static inline __m128i ChannelSSE2(__m128i pix, __m128i inShift, __m128i outMax,
+                                  __m128i outShift, Bool scale) {
+    __m128i c = _mm_and_si128(_mm_srl_epi32(pix, inShift), _mm_set1_epi32(255));
+
+    if (scale) {
+        /* c * outMax fits in the low 16 bits of each lane */
+        c = _mm_add_epi32(_mm_mullo_epi16(c, outMax), _mm_set1_epi32(127));
+        c = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(c, _mm_set1_epi32(1)),
+                                         _mm_srli_epi32(c, 8)), 8);
+    }
+    return _mm_sll_epi32(c, outShift);
+}
+
+static inline void TranslateSSE2(rfbPixelFormat *in, rfbPixelFormat *out,
+                                 char *iptr, char *optr,
+                                 int bytesBetweenInputLines,
+                                 int width, int height, int outBits) {
+    translateParams params;
+    __m128i inShift[3], outMax[3], outShift[3];
+    int i, x;
+
+    GetTranslateParams(&params, in, out);
+    for (i = 0; i < 3; i++) {
+        inShift[i] = _mm_cvtsi32_si128(params.inShift[i]);
+        outMax[i] = _mm_set1_epi32(params.outMax[i]);
+        outShift[i] = _mm_cvtsi32_si128(params.outShift[i]);
+    }
+
+    while (height > 0) {
+        CARD32 *ip = (CARD32 *)iptr;
+
+        for (x = 0; x + 8 <= width; x += 8) {
+            __m128i a = _mm_loadu_si128((__m128i *)(ip + x));
+            __m128i b = _mm_loadu_si128((__m128i *)(ip + x + 4));
+            __m128i oa = _mm_setzero_si128(), ob = _mm_setzero_si128();
+
+            for (i = 0; i < 3; i++) {
+                oa = _mm_or_si128(oa, ChannelSSE2(a, inShift[i], outMax[i], outShift[i], params.scale));
+                ob = _mm_or_si128(ob, ChannelSSE2(b, inShift[i], outMax[i], outShift[i], params.scale));
+            }
+
+            switch (outBits) {
+                case 8:
+                    oa = _mm_packs_epi32(oa, ob);
+                    _mm_storel_epi64((__m128i *)(optr + x), _mm_packus_epi16(oa, oa));
+                    break;
+                case 16:
+                    /* Sign extend so that the signed pack keeps all 16 bits */
+                    oa = _mm_srai_epi32(_mm_slli_epi32(oa, 16), 16);
+                    ob = _mm_srai_epi32(_mm_slli_epi32(ob, 16), 16);
+                    oa = _mm_packs_epi32(oa, ob);
+                    if (params.swap)
+                        oa = _mm_or_si128(_mm_slli_epi16(oa, 8), _mm_srli_epi16(oa, 8));
+                    _mm_storeu_si128((__m128i *)(optr + x * 2), oa);
+                    break;
+                case 32:
+                    if (params.swap) {
+                        oa = _mm_shufflehi_epi16(_mm_shufflelo_epi16(oa, 0xb1), 0xb1);
+                        ob = _mm_shufflehi_epi16(_mm_shufflelo_epi16(ob, 0xb1), 0xb1);
+                        oa = _mm_or_si128(_mm_slli_epi16(oa, 8), _mm_srli_epi16(oa, 8));
+                        ob = _mm_or_si128(_mm_slli_epi16(ob, 8), _mm_srli_epi16(ob, 8));
+                    }
+                    _mm_storeu_si128((__m128i *)(optr + x * 4), oa);
+                    _mm_storeu_si128((__m128i *)(optr + x * 4 + 16), ob);
+                    break;
+            }
+        }
+        TranslatePixels(&params, outBits, ip + x, optr + x * (outBits / 8), width - x);
+
+        iptr += bytesBetweenInputLines;
+        optr += width * (outBits / 8);
+        height--;
+    }
+}
+
+static void rfbTranslateSSE2_32to8(char *table, rfbPixelFormat *in,
+                                   rfbPixelFormat *out, char *iptr, char *optr,
+                                   int bytesBetweenInputLines,
+                                   int width, int height) {
+    TranslateSSE2(in, out, iptr, optr, bytesBetweenInputLines, width, height, 8);
+}
+
+static void rfbTranslateSSE2_32to16(char *table, rfbPixelFormat *in,
+                                    rfbPixelFormat *out, char *iptr, char *optr,
+                                    int bytesBetweenInputLines,
+                                    int width, int height) {
+    TranslateSSE2(in, out, iptr, optr, bytesBetweenInputLines, width, height, 16);
+}
+
+static void rfbTranslateSSE2_32to32(char *table, rfbPixelFormat *in,
+                                    rfbPixelFormat *out, char *iptr, char *optr,
+                                    int bytesBetweenInputLines,
+                                    int width, int height) {
+    TranslateSSE2(in, out, iptr, optr, bytesBetweenInputLines, width, height, 32);
+}
+
+#endif
+
+
+#ifdef TRANSLATE_AVX2
+
+static inline AVX2_TARGET __m256i ChannelAVX2(__m256i pix, __m128i inShift,
+                                              __m256i outMax, __m128i outShift,
+                                              Bool scale) {
+    __m256i c = _mm256_and_si256(_mm256_srl_epi32(pix, inShift), _mm256_set1_epi32(255));
+
+    if (scale) {
+        c = _mm256_add_epi32(_mm256_mullo_epi16(c, outMax), _mm256_set1_epi32(127));
+        c = _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(c, _mm256_set1_epi32(1)),
+                                               _mm256_srli_epi32(c, 8)), 8);
+    }
+    return _mm256_sll_epi32(c, outShift);
+}
+
+static inline AVX2_TARGET void TranslateAVX2(rfbPixelFormat *in, rfbPixelFormat *out,
+                                             char *iptr, char *optr,
+                                             int bytesBetweenInputLines,
+                                             int width, int height, int outBits) {
+    translateParams params;
+    __m128i inShift[3], outShift[3];
+    __m256i outMax[3];
+    const __m256i swap32 = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                            3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    int i, x;
+
+    GetTranslateParams(&params, in, out);
+    for (i = 0; i < 3; i++) {
+        inShift[i] = _mm_cvtsi32_si128(params.inShift[i]);
+        outMax[i] = _mm256_set1_epi32(params.outMax[i]);
+        outShift[i] = _mm_cvtsi32_si128(params.outShift[i]);
+    }
+
+    while (height > 0) {
+        CARD32 *ip = (CARD32 *)iptr;
+
+        for (x = 0; x + 16 <= width; x += 16) {
+            __m256i a = _mm256_loadu_si256((__m256i *)(ip + x));
+            __m256i b = _mm256_loadu_si256((__m256i *)(ip + x + 8));
+            __m256i oa = _mm256_setzero_si256(), ob = _mm256_setzero_si256();
+
+            for (i = 0; i < 3; i++) {
+                oa = _mm256_or_si256(oa, ChannelAVX2(a, inShift[i], outMax[i], outShift[i], params.scale));
+                ob = _mm256_or_si256(ob, ChannelAVX2(b, inShift[i], outMax[i], outShift[i], params.scale));
+            }
+
+            /* The packs work within each 128 bit half, hence the permutes */
+            switch (outBits) {
+                case 8:
+                    oa = _mm256_permute4x64_epi64(_mm256_packs_epi32(oa, ob), 0xd8);
+                    oa = _mm256_permute4x64_epi64(_mm256_packus_epi16(oa, oa), 0x08);
+                    _mm_storeu_si128((__m128i *)(optr + x), _mm256_castsi256_si128(oa));
+                    break;
+                case 16:
+                    oa = _mm256_srai_epi32(_mm256_slli_epi32(oa, 16), 16);
+                    ob = _mm256_srai_epi32(_mm256_slli_epi32(ob, 16), 16);
+                    oa = _mm256_permute4x64_epi64(_mm256_packs_epi32(oa, ob), 0xd8);
+                    if (params.swap)
+                        oa = _mm256_or_si256(_mm256_slli_epi16(oa, 8), _mm256_srli_epi16(oa, 8));
+                    _mm256_storeu_si256((__m256i *)(optr + x * 2), oa);
+                    break;
+                case 32:
+                    if (params.swap) {
+                        oa = _mm256_shuffle_epi8(oa, swap32);
+                        ob = _mm256_shuffle_epi8(ob, swap32);
+                    }
+                    _mm256_storeu_si256((__m256i *)(optr + x * 4), oa);
+                    _mm256_storeu_si256((__m256i *)(optr + x * 4 + 32), ob);
+                    break;
+            }
+        }
+        TranslatePixels(&params, outBits, ip + x, optr + x * (outBits / 8), width - x);
+
+        iptr += bytesBetweenInputLines;
+        optr += width * (outBits / 8);
+        height--;
+    }
+}
+
+static AVX2_TARGET void rfbTranslateAVX2_32to8(char *table, rfbPixelFormat *in,
+                                               rfbPixelFormat *out, char *iptr, char *optr,
+                                               int bytesBetweenInputLines,
+                                               int width, int height) {
+    TranslateAVX2(in, out, iptr, optr, bytesBetweenInputLines, width, height, 8);
+}
+
+static AVX2_TARGET void rfbTranslateAVX2_32to16(char *table, rfbPixelFormat *in,
+                                                rfbPixelFormat *out, char *iptr, char *optr,
+                                                int bytesBetweenInputLines,
+                                                int width, int height) {
+    TranslateAVX2(in, out, iptr, optr, bytesBetweenInputLines, width, height, 16);
+}
+
+static AVX2_TARGET void rfbTranslateAVX2_32to32(char *table, rfbPixelFormat *in,
+                                                rfbPixelFormat *out, char *iptr, char *optr,
+                                                int bytesBetweenInputLines,
+                                                int width, int height) {
+    TranslateAVX2(in, out, iptr, optr, bytesBetweenInputLines, width, height, 32);
+}
+
+static Bool HaveAVX2(void) {
+    static int haveAVX2 = -1;
+
+    if (haveAVX2 < 0) {
+        __builtin_cpu_init();
+        haveAVX2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    return haveAVX2;
+}
+
+#endif
+
+
+static Bool ChannelFits(int max, int shift, int bits) {
+    if (max <= 0 || max > 255 || shift < 0 || shift > 24)
+        return FALSE;
+    return (bits == 32 || ((CARD32)max << shift) < (1U << bits));
+}
+
+
+/*
+ * rfbSimdTranslateFunction returns a function translating from one format
+ * to the other, or NULL if there isn't a kernel for them and the tables
+ * should be used.  The function doesn't need a table.
+ */
+
+rfbTranslateFnType rfbSimdTranslateFunction(rfbPixelFormat *in, rfbPixelFormat *out) {
+    int index;
+
+    if (!rfbSimdTranslate)
+        return NULL;
+
+    if (in->bitsPerPixel != 32 || !in->trueColour || !out->trueColour ||
+        in->redMax != 255 || in->greenMax != 255 || in->blueMax != 255 ||
+        in->redShift > 24 || in->greenShift > 24 || in->blueShift > 24)
+        return NULL;
+
+    switch (out->bitsPerPixel) {
+        case 8:  index = 0; break;
+        case 16: index = 1; break;
+        case 32: index = 2; break;
+        default: return NULL;
+    }
+    if (!ChannelFits(out->redMax, out->redShift, out->bitsPerPixel) ||
+        !ChannelFits(out->greenMax, out->greenShift, out->bitsPerPixel) ||
+        !ChannelFits(out->blueMax, out->blueShift, out->bitsPerPixel))
+        return NULL;
+
+#ifdef TRANSLATE_AVX2
+    if (HaveAVX2()) {
+        static const rfbTranslateFnType fns[3] = {
+            rfbTranslateAVX2_32to8, rfbTranslateAVX2_32to16, rfbTranslateAVX2_32to32
+        };
+        return fns[index];
+    }
+#endif
+#ifdef TRANSLATE_SSE2
+    {
+        static const rfbTranslateFnType fns[3] = {
+            rfbTranslateSSE2_32to8, rfbTranslateSSE2_32to16, rfbTranslateSSE2_32to32
+        };
+        return fns[index];
+    }
+#endif
+#ifdef TRANSLATE_PORTABLE
+    {
+        static const rfbTranslateFnType fns[3] = {
+            rfbTranslatePortable32to8, rfbTranslatePortable32to16, rfbTranslatePortable32to32
+        };
+        return fns[index];
+    }
+#endif
+    return NULL;
+}
@@ -0,0 +1,470 @@
+/*
+ * updatebuf.c - building up and sending framebuffer updates, and the Raw
+ * encoding.
+ *
+ * rfbSendFramebufferUpdate sends a client's update with its chosen
+ * encoding.  The encoders add their output to the client's updateBuf, or
+ * queue larger pieces to go out with it by writev, and call rfbSendUpdateBuf
+ * when it is full.  None of this needs the window server, so it is kept
+ * apart from rfbserver.c and can be linked into encbench.
+ */
+
+/*
+ *  OSXvnc Copyright (C) 2002-2004 Redstone Software osxvnc@redstonesoftware.com
+ *  Original Xvnc code Copyright (C) 1999 AT&T Laboratories Cambridge.
+ *  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rfb.h"
+
+/*
+ * A Raw line longer than updateBuf is translated on its own.
+ */
+
+static Bool TranslateRawLine(rfbClientPtr cl, char *fbptr, int w) {
+    int bytesPerLine = w * (cl->format.bitsPerPixel / 8);
+    char *line = (char *)xalloc(bytesPerLine);
+    Bool ok;
+
+    if (!line) {
+        rfbLog("rfbSendRectEncodingRaw: out of memory for %d bytes per line\n",
+               bytesPerLine);
+        rfbCloseClient(cl);
+        return FALSE;
+    }
+
+    (*cl->translateFn)(cl->translateLookupTable, &rfbServerFormat,
+                       &cl->format, fbptr, line,
+                       cl->scalingPaddedWidthInBytes, w, 1);
+    ok = rfbSendUpdateBytes(cl, line, bytesPerLine);
+    xfree(line);
+    return ok;
+}
+
+/*
+ * Send a given rectangle in raw encoding (rfbEncodingRaw).
+ */
+
+Bool rfbSendRectEncodingRaw(rfbClientPtr cl, int x, int y, int w, int h) {
+    rfbFramebufferUpdateRectHeader rect;
+    int nlines;
+    int bytesPerLine = w * (cl->format.bitsPerPixel / 8);
+    char *fbptr = (cl->scalingFrameBuffer + (cl->scalingPaddedWidthInBytes * y)
+                   + (x * (rfbScreen.bitsPerPixel / 8)));
+
+    if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE) {
+        if (!rfbSendUpdateBuf(cl))
+            return FALSE;
+    }
+
+    rect.r.x = Swap16IfLE(x);
+    rect.r.y = Swap16IfLE(y);
+    rect.r.w = Swap16IfLE(w);
+    rect.r.h = Swap16IfLE(h);
+    rect.encoding = Swap32IfLE(rfbEncodingRaw);
+
+    memcpy(&cl->updateBuf[cl->ublen], (char *)&rect,sz_rfbFramebufferUpdateRectHeader);
+    cl->ublen += sz_rfbFramebufferUpdateRectHeader;
+
+    cl->rfbRectanglesSent[rfbEncodingRaw]++;
+    cl->rfbBytesSent[rfbEncodingRaw] += sz_rfbFramebufferUpdateRectHeader + bytesPerLine * h;
+
+    /* Lines which need no translating go out straight from the framebuffer */
+
+    if (cl->translateFn == rfbTranslateNone) {
+        if (bytesPerLine == cl->scalingPaddedWidthInBytes)
+            return rfbQueueUpdateBytes(cl, fbptr, bytesPerLine * h);
+
+        for (; h > 0; h--) {
+            if (!rfbQueueUpdateBytes(cl, fbptr, bytesPerLine))
+                return FALSE;
+            fbptr += cl->scalingPaddedWidthInBytes;
+        }
+        return TRUE;
+    }
+
+    while (h > 0) {
+        nlines = min(h, (UPDATE_BUF_SIZE - cl->ublen) / bytesPerLine);
+
+        if (nlines == 0) {
+            if (cl->ublen > 0) {
+                if (!rfbSendUpdateBuf(cl))
+                    return FALSE;
+                continue;
+            }
+            if (!TranslateRawLine(cl, fbptr, w))
+                return FALSE;
+            fbptr += cl->scalingPaddedWidthInBytes;
+            h--;
+            continue;
+        }
+
+        (*cl->translateFn)(cl->translateLookupTable, &rfbServerFormat,
+                           &cl->format, fbptr, &cl->updateBuf[cl->ublen],
+                           cl->scalingPaddedWidthInBytes, w, nlines);
+
+        cl->ublen += nlines * bytesPerLine;
+        fbptr += (cl->scalingPaddedWidthInBytes * nlines);
+        h -= nlines;
+    }
+
+    return TRUE;
+}
+
+
+
+/*
+ * Send an empty rectangle with encoding field set to value of
+ * rfbEncodingLastRect to notify client that this is the last
+ * rectangle in framebuffer update ("LastRect" extension of RFB
+                                    * protocol).
+ */
+
+Bool rfbSendLastRectMarker(rfbClientPtr cl) {
+    rfbFramebufferUpdateRectHeader rect;
+
+    if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE) {
+        if (!rfbSendUpdateBuf(cl))
+            return FALSE;
+    }
+
+    rect.encoding = Swap32IfLE(rfbEncodingLastRect);
+    rect.r.x = 0;
+    rect.r.y = 0;
+    rect.r.w = 0;
+    rect.r.h = 0;
+
+    memcpy(&cl->updateBuf[cl->ublen], (char *)&rect,sz_rfbFramebufferUpdateRectHeader);
+    cl->ublen += sz_rfbFramebufferUpdateRectHeader;
+
+    cl->rfbLastRectMarkersSent++;
+    cl->rfbLastRectBytesSent += sz_rfbFramebufferUpdateRectHeader;
+
+    return TRUE;
+}
+
+
+/*
+ * Send the contents of updateBuf.  Returns 1 if successful, -1 if
+ * not (errno should be set).
+ */
+
+Bool rfbSendUpdateBuf(rfbClientPtr cl) {
+    int n;
+
+    /*
+     int i;
+     for (i = 0; i < cl->ublen; i++) {
+         fprintf(stderr,"%02x ",((unsigned char *)cl->updateBuf)[i]);
+     }
+     fprintf(stderr,"\n");
+     */
+
+    if (cl->tileCaptureFrom >= 0)
+        rfbTileCacheCapture(cl);
+
+    if (cl->encodeTask)
+        return rfbAppendEncodeTask(cl);
+
+    if (cl->ublen > cl->ubqueued) {
+        cl->updateVec[cl->uvcount].iov_base = cl->updateBuf + cl->ubqueued;
+        cl->updateVec[cl->uvcount].iov_len = cl->ublen - cl->ubqueued;
+        cl->uvcount++;
+    }
+
+    n = WriteExactV(cl, cl->updateVec, cl->uvcount);
+
+    cl->ublen = 0;
+    cl->uvcount = 0;
+    cl->ubqueued = 0;
+
+    if (n < 0) {
+        rfbLogPerror("rfbSendUpdateBuf: write");
+        rfbCloseClient(cl);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+/*
+ * rfbQueueUpdateBytes adds data to the update without copying it, so it must
+ * stay as it is until the next rfbSendUpdateBuf.  Small pieces are copied
+ * into updateBuf anyway.
+ */
+
+#define UPDATE_MIN_QUEUED 1024
+
+Bool rfbQueueUpdateBytes(rfbClientPtr cl, char *data, int len) {
+    if (len < UPDATE_MIN_QUEUED) {
+        if (cl->ublen + len > UPDATE_BUF_SIZE && !rfbSendUpdateBuf(cl))
+            return FALSE;
+        memcpy(cl->updateBuf + cl->ublen, data, len);
+        cl->ublen += len;
+        return TRUE;
+    }
+
+    if (cl->encodeTask) {
+        if (!rfbSendUpdateBuf(cl))
+            return FALSE;
+        if (cl->tileCaptureFrom >= 0)
+            rfbTileCacheCaptureBytes(cl, data, len);
+        return rfbAppendEncodeTaskBytes(cl, data, len);
+    }
+
+    if (cl->tileCaptureFrom >= 0)
+        rfbTileCacheCaptureBytes(cl, data, len);
+
+    if (cl->ublen > cl->ubqueued) {
+        cl->updateVec[cl->uvcount].iov_base = cl->updateBuf + cl->ubqueued;
+        cl->updateVec[cl->uvcount].iov_len = cl->ublen - cl->ubqueued;
+        cl->uvcount++;
+        cl->ubqueued = cl->ublen;
+    }
+    cl->updateVec[cl->uvcount].iov_base = data;
+    cl->updateVec[cl->uvcount].iov_len = len;
+    cl->uvcount++;
+
+    /* Leave room for the rest of updateBuf */
+    if (cl->uvcount >= UPDATE_MAX_VECS - 2)
+        return rfbSendUpdateBuf(cl);
+    return TRUE;
+}
+
+
+/*
+ * rfbSendUpdateBytes adds already encoded data to the update.  Unlike
+ * rfbQueueUpdateBytes the data can be reused as soon as it returns.
+ */
+
+Bool rfbSendUpdateBytes(rfbClientPtr cl, char *data, int len) {
+    if (cl->ublen + len <= UPDATE_BUF_SIZE) {
+        memcpy(cl->updateBuf + cl->ublen, data, len);
+        cl->ublen += len;
+        return TRUE;
+    }
+
+    return (rfbQueueUpdateBytes(cl, data, len) && rfbSendUpdateBuf(cl));
+}
+
+
+/*
+ * rfbSendFramebufferUpdate - send the currently pending framebuffer update to
+ * the RFB client.
+ */
+
+Bool rfbSendFramebufferUpdate(rfbClientPtr cl, RegionRec updateRegion) {
+    int i;
+    rfbPaceTime encodeStart;
+    int nUpdateRegionRects = 0;
+    int nParallelRects;
+    Bool sendRichCursorEncoding = FALSE;
+    Bool sendCursorPositionEncoding = FALSE;
+
+    rfbFramebufferUpdateMsg *fu = (rfbFramebufferUpdateMsg *)cl->updateBuf;
+
+    /* Now send the update */
+
+    cl->rfbFramebufferUpdateMessagesSent++;
+
+    nParallelRects = rfbParallelEncodePrepare(cl, &updateRegion);
+
+    if (nParallelRects) {
+        nUpdateRegionRects = nParallelRects;
+    } else if (cl->preferredEncoding == rfbEncodingCoRRE) {
+        for (i = 0; i < REGION_NUM_RECTS(&updateRegion); i++) {
+            int x = REGION_RECTS(&updateRegion)[i].x1;
+            int y = REGION_RECTS(&updateRegion)[i].y1;
+            int w = REGION_RECTS(&updateRegion)[i].x2 - x;
+            int h = REGION_RECTS(&updateRegion)[i].y2 - y;
+            nUpdateRegionRects += (((w-1) / cl->correMaxWidth + 1)
+                                   * ((h-1) / cl->correMaxHeight + 1));
+        }
+    } else if (cl->preferredEncoding == rfbEncodingZlib) {
+        for (i = 0; i < REGION_NUM_RECTS(&updateRegion); i++) {
+            int x = REGION_RECTS(&updateRegion)[i].x1;
+            int y = REGION_RECTS(&updateRegion)[i].y1;
+            int w = REGION_RECTS(&updateRegion)[i].x2 - x;
+            int h = REGION_RECTS(&updateRegion)[i].y2 - y;
+            nUpdateRegionRects += (((h-1) / (ZLIB_MAX_SIZE( w ) / w)) + 1);
+        }
+    } else if (cl->preferredEncoding == rfbEncodingTight) {
+        for (i = 0; i < REGION_NUM_RECTS(&updateRegion); i++) {
+            int x = REGION_RECTS(&updateRegion)[i].x1;
+            int y = REGION_RECTS(&updateRegion)[i].y1;
+            int w = REGION_RECTS(&updateRegion)[i].x2 - x;
+            int h = REGION_RECTS(&updateRegion)[i].y2 - y;
+            int n = rfbNumCodedRectsTight(cl, x, y, w, h);
+            if (n == 0) {
+                nUpdateRegionRects = 0xFFFF;
+                break;
+            }
+            nUpdateRegionRects += n;
+        }
+    } else {
+        nUpdateRegionRects = REGION_NUM_RECTS(&updateRegion);
+    }
+
+    // Sometimes send the mouse cursor update also
+
+    if (nUpdateRegionRects != 0xFFFF) {
+        if (rfbShouldSendNewCursor(cl)) {
+            sendRichCursorEncoding = TRUE;
+            nUpdateRegionRects++;
+        }
+        if (rfbShouldSendNewPosition(cl)) {
+            sendCursorPositionEncoding = TRUE;
+            nUpdateRegionRects++;
+        }
+		if (cl->needNewScreenSize) {
+			nUpdateRegionRects++;
+		}        
+    }
+
+    fu->type = rfbFramebufferUpdate;
+    fu->nRects = Swap16IfLE(nUpdateRegionRects);
+    cl->ublen = sz_rfbFramebufferUpdateMsg;
+	
+    // Sometimes send the mouse cursor update (this can fail with big cursors so we'll try it first
+    if (sendRichCursorEncoding) {
+        if (!rfbSendRichCursorUpdate(cl)) {
+            // rfbLog("Error Sending Cursor\n"); // We'll log at the lower level if it fails and only fail a few times
+            // return FALSE;  Since this is the first update we can "skip the cursor update" instead of failing the whole thing
+			--nUpdateRegionRects;
+			fu->nRects = Swap16IfLE(nUpdateRegionRects);
+        }
+    }
+    if (sendCursorPositionEncoding) {
+        if (!rfbSendCursorPos(cl)) {
+            rfbLog("Error Sending Cursor Position\n");
+            return FALSE;
+        }
+
+    }
+	if (cl->needNewScreenSize) {
+        if (rfbSendScreenUpdateEncoding(cl)) {
+            cl->needNewScreenSize = FALSE;
+        }
+        else {
+            rfbLog("Error Sending New Screen Size\n");
+            return FALSE;
+        }            
+    }
+	
+    encodeStart = rfbPacingNow();
+    if (nParallelRects) {
+        if (!rfbParallelEncodeSend(cl))
+            return FALSE;
+    } else {
+        for (i = 0; i < REGION_NUM_RECTS(&updateRegion); i++) {
+            int x = REGION_RECTS(&updateRegion)[i].x1;
+            int y = REGION_RECTS(&updateRegion)[i].y1;
+            int w = REGION_RECTS(&updateRegion)[i].x2 - x;
+            int h = REGION_RECTS(&updateRegion)[i].y2 - y;
+
+			// Refresh with latest pointer (should be "read-locked" throughout here with CG but I don't see that option)
+			if (cl->scalingFactor != 1)
+				CopyScalingRect( cl, &x, &y, &w, &h, TRUE);
+			else 
+				cl->scalingFrameBuffer = rfbGetFramebuffer();
+		
+            cl->rfbRawBytesEquivalent += (sz_rfbFramebufferUpdateRectHeader
+                                          + w * (cl->format.bitsPerPixel / 8) * h);
+
+            switch (cl->preferredEncoding) {
+                case rfbEncodingRaw:
+                    if (!rfbTileCacheSend(cl, x, y, w, h, rfbSendRectEncodingRaw)) {
+                        return FALSE;
+                    }
+                    break;
+                case rfbEncodingRRE:
+                    if (!rfbTileCacheSend(cl, x, y, w, h, rfbSendRectEncodingRRE)) {
+                        return FALSE;
+                    }
+                    break;
+                case rfbEncodingCoRRE:
+                    if (!rfbTileCacheSend(cl, x, y, w, h, rfbSendRectEncodingCoRRE)) {
+                        return FALSE;
+                    }
+                    break;
+                case rfbEncodingHextile:
+                    if (!rfbTileCacheSend(cl, x, y, w, h, rfbSendRectEncodingHextile)) {
+                        return FALSE;
+                    }
+                    break;
+                case rfbEncodingZlib:
+                    if (!rfbSendRectEncodingZlib(cl, x, y, w, h)) {
+                        return FALSE;
+                    }
+                    break;
+                case rfbEncodingTight:
+                    if (!rfbSendRectEncodingTight(cl, x, y, w, h)) {
+                        return FALSE;
+                    }
+                    break;
+                case rfbEncodingZlibHex:
+                    if (!rfbSendRectEncodingZlibHex(cl, x, y, w, h)) {
+                        return FALSE;
+                    }
+                    break;
+                case rfbEncodingZRLE:
+                    if (!rfbSendRectEncodingZRLE(cl, x, y, w, h)) {
+                        return FALSE;
+                    }
+                    break;
+            }
+        }
+    }
+    rfbStatsHistAdd(cl->rfbEncodeTimeHist[cl->preferredEncoding], rfbPacingNow() - encodeStart);
+
+    if (nUpdateRegionRects == 0xFFFF && !rfbSendLastRectMarker(cl))
+        return FALSE;
+
+    if (!rfbSendUpdateBuf(cl))
+        return FALSE;
+
+    return TRUE;
+}
+
+Bool rfbSendScreenUpdateEncoding(rfbClientPtr cl) {
+    rfbFramebufferUpdateRectHeader rect;
+				
+    if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE) {
+        if (!rfbSendUpdateBuf(cl))
+            return FALSE;
+    }
+
+    rect.r.x = 0;
+    rect.r.y = 0;
+    rect.r.w = Swap16IfLE(rfbScaledWidth(cl));
+    rect.r.h = Swap16IfLE(rfbScaledHeight(cl));
+    rect.encoding = Swap32IfLE(rfbEncodingDesktopResize);
+
+    memcpy(&cl->updateBuf[cl->ublen], (char *)&rect,sz_rfbFramebufferUpdateRectHeader);
+    cl->ublen += sz_rfbFramebufferUpdateRectHeader;
+
+    cl->rfbRectanglesSent[rfbStatsDesktopResize]++;
+    cl->rfbBytesSent[rfbStatsDesktopResize] += sz_rfbFramebufferUpdateRectHeader;
+
+    // Let's push this out right away
+    return rfbSendUpdateBuf(cl);
+}
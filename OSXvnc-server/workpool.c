@@ -0,0 +1,219 @@
+/*
+ * workpool.c - shared pool of worker threads for encoding.
+ *
+ * An output thread hands the pool a batch of independent tasks and works on
+ * the batch itself while the pool threads help out.  Any idle pool thread
+ * takes the next unclaimed task from the oldest batch, so one client's big
+ * update can use every core while several clients' batches share them.
+ *
+ * Every thread has a worker number: the calling output thread is always 0
+ * and pool threads are 1 to rfbWorkPoolThreads()-1.  Tasks use it to pick
+ * per-thread scratch state, so nothing they touch needs locking.
+ */
+
+/*
+ *  OSXvnc Copyright (C) 2002-2004 Redstone Software osxvnc@redstonesoftware.com
+ *  All Rights Reserved.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "rfb.h"
+
+int rfbEncodeThreads = 0;           /* 0 picks one per CPU, 1 encodes serially */
+
+typedef struct workBatch {
+    rfbWorkFn fn;
+    void *arg;
+    int count;
+    int next;                       /* next task to hand out */
+    int done;
+    struct workBatch *nextBatch;
+} workBatch;
+
+static pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolWorkCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t poolDoneCond = PTHREAD_COND_INITIALIZER;
+static workBatch *poolHead = NULL, *poolTail = NULL;
+
+static pthread_t poolThread[WORKPOOL_MAX_THREADS];
+static int poolThreads = 1;
+static Bool poolRunning = FALSE;
+
+
+/*
+ * Hand out the next task of a batch, with poolMutex held.  A batch leaves the
+ * queue once all its tasks are claimed, but its owner waits for them to
+ * finish before it goes away.
+ */
+
+static int ClaimTask(workBatch *batch) {
+    int task = batch->next++;
+
+    if (batch->next == batch->count) {
+        workBatch **prev = &poolHead, *last = NULL;
+
+        while (*prev != batch) {
+            last = *prev;
+            prev = &(*prev)->nextBatch;
+        }
+        *prev = batch->nextBatch;
+        if (poolTail == batch)
+            poolTail = last;
+    }
+    return task;
+}
+
+static void FinishTask(workBatch *batch) {
+    if (++batch->done == batch->count)
+        pthread_cond_broadcast(&poolDoneCond);
+}
+
+static void *workerRun(void *arg) {
+    int worker = (int)(long)arg;
+    workBatch *batch;
+    int task;
+
+    pthread_mutex_lock(&poolMutex);
+    while (poolRunning) {
+        if (!poolHead) {
+            pthread_cond_wait(&poolWorkCond, &poolMutex);
+            continue;
+        }
+
+        batch = poolHead;
+        task = ClaimTask(batch);
+        pthread_mutex_unlock(&poolMutex);
+
+        (*batch->fn)(batch->arg, task, worker);
+
+        pthread_mutex_lock(&poolMutex);
+        FinishTask(batch);
+    }
+    pthread_mutex_unlock(&poolMutex);
+
+    return NULL;
+}
+
+
+/*
+ * rfbWorkPoolStart starts rfbEncodeThreads-1 pool threads.  If none can be
+ * started everything simply runs on the calling thread.
+ */
+
+void rfbWorkPoolStart(void) {
+    int n = rfbEncodeThreads;
+
+    if (n <= 0)
+        n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    n = max(1, min(n, WORKPOOL_MAX_THREADS));
+
+    pthread_mutex_lock(&poolMutex);
+    if (!poolRunning) {
+        poolRunning = TRUE;
+        for (poolThreads = 1; poolThreads < n; poolThreads++) {
+            if (pthread_create(&poolThread[poolThreads], NULL, workerRun, (void *)(long)poolThreads) != 0) {
+                rfbLogPerror("workpool: pthread_create");
+                break;
+            }
+        }
+        if (poolThreads > 1)
+            rfbLog("Encoding with %d threads\n", poolThreads);
+    }
+    pthread_mutex_unlock(&poolMutex);
+}
+
+void rfbWorkPoolStop(void) {
+    int i;
+
+    pthread_mutex_lock(&poolMutex);
+    if (!poolRunning) {
+        pthread_mutex_unlock(&poolMutex);
+        return;
+    }
+    poolRunning = FALSE;
+    pthread_cond_broadcast(&poolWorkCond);
+    pthread_mutex_unlock(&poolMutex);
+
+    for (i = 1; i < poolThreads; i++)
+        pthread_join(poolThread[i], NULL);
+    poolThreads = 1;
+}
+
+
+/*
+ * rfbWorkPoolThreads is the number of worker numbers in use, including the
+ * caller's.
+ */
+
+int rfbWorkPoolThreads(void) {
+    return poolThreads;
+}
+
+
+/*
+ * rfbWorkPoolRun calls fn(arg, task, worker) for every task from 0 to
+ * count-1 and returns once they have all finished.  The calling thread only
+ * works on its own batch, as worker 0.
+ */
+
+void rfbWorkPoolRun(rfbWorkFn fn, void *arg, int count) {
+    workBatch batch;
+    int task;
+
+    if (count <= 0)
+        return;
+
+    if (poolThreads <= 1 || count == 1) {
+        for (task = 0; task < count; task++)
+            (*fn)(arg, task, 0);
+        return;
+    }
+
+    batch.fn = fn;
+    batch.arg = arg;
+    batch.count = count;
+    batch.next = 0;
+    batch.done = 0;
+    batch.nextBatch = NULL;
+
+    pthread_mutex_lock(&poolMutex);
+    if (poolTail)
+        poolTail->nextBatch = &batch;
+    else
+        poolHead = &batch;
+    poolTail = &batch;
+    pthread_cond_broadcast(&poolWorkCond);
+
+    while (batch.next < batch.count) {
+        task = ClaimTask(&batch);
+        pthread_mutex_unlock(&poolMutex);
+
+        (*fn)(arg, task, 0);
+
+        pthread_mutex_lock(&poolMutex);
+        FinishTask(&batch);
+    }
+
+    while (batch.done < batch.count)
+        pthread_cond_wait(&poolDoneCond, &poolMutex);
+    pthread_mutex_unlock(&poolMutex);
+}
@@ -112,8 +112,6 @@ rfbSendOneRectEncodingZlib(cl, x, y, w, h)
 		       &cl->format, fbptr, zlibBeforeBuf,
 		       cl->scalingPaddedWidthInBytes, w, h);
 
-    cl->compStream.next_in = ( Bytef * )zlibBeforeBuf;
-    cl->compStream.avail_in = w * h * (cl->format.bitsPerPixel / 8);
     cl->compStream.next_out = ( Bytef * )zlibAfterBuf;
     cl->compStream.avail_out = maxCompSize;
     cl->compStream.data_type = Z_BINARY;
@@ -136,11 +134,29 @@ rfbSendOneRectEncodingZlib(cl, x, y, w, h)
         /* deflateInit( &(cl->compStream), Z_BEST_COMPRESSION ); */
         /* deflateInit( &(cl->compStream), Z_BEST_SPEED ); */
         cl->compStreamInited = TRUE;
+        cl->compStreamLevel = cl->zlibCompressLevel;
 
     }
 
     previousOut = cl->compStream.total_out;
 
+    /* Pick up any change of level since (see linkest.c), before the new
+       input is given, as deflateParams won't change it with input waiting. */
+    if ( cl->zlibCompressLevel != cl->compStreamLevel ) {
+        cl->compStream.avail_in = 0;
+        deflateResult = deflateParams( &(cl->compStream),
+                                       cl->zlibCompressLevel,
+                                       Z_DEFAULT_STRATEGY );
+        if ( deflateResult != Z_OK ) {
+            rfbLog("zlib deflateParams error: %d\n", deflateResult);
+            return FALSE;
+        }
+        cl->compStreamLevel = cl->zlibCompressLevel;
+    }
+
+    cl->compStream.next_in = ( Bytef * )zlibBeforeBuf;
+    cl->compStream.avail_in = w * h * (cl->format.bitsPerPixel / 8);
+
     /* Perform the compression here. */
     deflateResult = deflate( &(cl->compStream), Z_SYNC_FLUSH );
 
@@ -151,6 +167,8 @@ rfbSendOneRectEncodingZlib(cl, x, y, w, h)
         rfbLog("zlib deflation error: %s\n", cl->compStream.msg);
         return FALSE;
     }
+    cl->rfbZlibBytesIn += w * h * (cl->format.bitsPerPixel / 8);
+    cl->rfbZlibBytesOut += zlibAfterBufLen;
 
     /* Note that it is not possible to switch zlib parameters based on
      * the results of the compression pass.  The reason is
@@ -86,14 +86,13 @@ zlibCompress( BYTE *from_buf,
               unsigned int length,
               unsigned int size,
               rfbClientPtr cl,
-              struct z_stream_s *compressor )
+              struct z_stream_s *compressor,
+              int *compressorLevel )
 {
     int previousTotalOut;
     int deflateResult;
 
-    /* Initialize input/output buffer assignment for compressor state. */
-    compressor->avail_in = length;
-    compressor->next_in = from_buf;
+    /* Initialize output buffer assignment for compressor state. */
     compressor->avail_out = size;
     compressor->next_out = to_buf;
     compressor->data_type = Z_BINARY;
@@ -121,12 +120,34 @@ zlibCompress( BYTE *from_buf,
                     compressor->msg );
             return -1;
         }
+        *compressorLevel = cl->zlibCompressLevel;
 
     }
 
     /* Record previous total output size. */
     previousTotalOut = compressor->total_out;
 
+    /* Pick up any change of level since (see linkest.c), before the new
+       input is given, as deflateParams won't change it with input waiting. */
+    if ( cl->zlibCompressLevel != *compressorLevel )
+    {
+        compressor->avail_in = 0;
+        deflateResult = deflateParams( compressor,
+                                       cl->zlibCompressLevel,
+                                       Z_DEFAULT_STRATEGY );
+        if ( deflateResult != Z_OK )
+        {
+            rfbLog( "deflateParams returned error:%d\n",
+                    deflateResult );
+            return -1;
+        }
+        *compressorLevel = cl->zlibCompressLevel;
+    }
+
+    /* Initialize input buffer assignment for compressor state. */
+    compressor->avail_in = length;
+    compressor->next_in = from_buf;
+
     /* Compress the raw data into the result buffer. */
     deflateResult = deflate( compressor, Z_SYNC_FLUSH );
 
@@ -138,6 +159,8 @@ zlibCompress( BYTE *from_buf,
         return -1;
     }
 
+    cl->rfbZlibBytesIn += length;
+    cl->rfbZlibBytesOut += compressor->total_out - previousTotalOut;
     return compressor->total_out - previousTotalOut;
 }
 
@@ -252,17 +275,16 @@ sendZlibHex##bpp(cl, rx, ry, rw, rh)					      \
 		   validFg = FALSE;					      \
 		   cl->ublen = startUblen;					      \
 		   cl->updateBuf[cl->ublen++] = rfbHextileZlibRaw;		      \
-		   (*cl->translateFn)(cl->translateLookupTable,		      \
-					&rfbServerFormat, &cl->format, fbptr, \
-					(char *)clientPixelData,	      \
-					cl->scalingPaddedWidthInBytes, w, h);  \
 									      \
 		   compressedSize = zlibCompress( (BYTE*) clientPixelData,    \
 						  (BYTE*) &cl->updateBuf[cl->ublen+2], \
 						  w * h * (bpp/8),	      \
 						  (16*16+2)*(bpp/8)+20,	      \
 						  cl,			      \
-						  &(cl->compStreamRaw));      \
+						  &(cl->compStreamRaw),	      \
+						  &cl->compStreamRawLevel);   \
+		   if (compressedSize < 0)				      \
+		       return FALSE;					      \
 									      \
 		    card16ptr = (CARD16*) (&cl->updateBuf[cl->ublen]);		      \
 		    *card16ptr = Swap16IfLE(compressedSize);		      \
@@ -274,10 +296,6 @@ sendZlibHex##bpp(cl, rx, ry, rw, rh)					      \
 		   validFg = FALSE;					      \
 		   cl->ublen = startUblen;					      \
 		   cl->updateBuf[cl->ublen++] = rfbHextileRaw;			      \
-		   (*cl->translateFn)(cl->translateLookupTable,		      \
-					&rfbServerFormat, &cl->format, fbptr, \
-					(char *)clientPixelData,	      \
-					cl->scalingPaddedWidthInBytes, w, h);  \
 									      \
 		    /* Extra copy protects against bus errors on RISC. */     \
 		    memcpy(&cl->updateBuf[cl->ublen], (char *)clientPixelData,	      \
@@ -299,7 +317,10 @@ sendZlibHex##bpp(cl, rx, ry, rw, rh)					      \
 						  encodedBytes,		      \
 						  (16*16+2)*(bpp/8)+20,	      \
 						  cl,			      \
-						  &(cl->compStreamHex));      \
+						  &(cl->compStreamHex),	      \
+						  &cl->compStreamHexLevel);   \
+		   if (compressedSize < 0)				      \
+		       return FALSE;					      \
 									      \
 		    card16ptr = (CARD16*) (&cl->updateBuf[cl->ublen]);		      \
 		    *card16ptr = Swap16IfLE(compressedSize);		      \
@@ -321,92 +342,44 @@ static Bool								      \
 subrectEncode##bpp(CARD##bpp *data, int w, int h, CARD##bpp bg,		      \
 		   CARD##bpp fg, Bool mono, rfbClientPtr cl)		      \
 {									      \
+    rfbSubrectSearch search;						      \
+    rfbSubrect sr[rfbSubrectBatch];					      \
     CARD##bpp singleCL;							      \
-    int x,y;								      \
-    int i,j;								      \
-    int hx=0,hy,vx=0,vy;						      \
-    int hyflag;								      \
-    CARD##bpp *seg;							      \
-    CARD##bpp *line;							      \
-    int hw,hh,vw,vh;							      \
-    int thex,they,thew,theh;						      \
     int numsubs = 0;							      \
     int newLen;								      \
     int nSubrectsUblen;							      \
+    int i, n;								      \
 									      \
     nSubrectsUblen = cl->ublen;						      \
-    cl->ublen++;								      \
-									      \
-    for (y=0; y<h; y++) {						      \
-	line = data+(y*w);						      \
-	for (x=0; x<w; x++) {						      \
-	    if (line[x] != bg) {					      \
-		singleCL = line[x];						      \
-		hy = y-1;						      \
-		hyflag = 1;						      \
-		for (j=y; j<h; j++) {					      \
-		    seg = data+(j*w);					      \
-		    if (seg[x] != singleCL) {break;}				      \
-		    i = x;						      \
-		    while ((seg[i] == singleCL) && (i < w)) i += 1;		      \
-		    i -= 1;						      \
-		    if (j == y) vx = hx = i;				      \
-		    if (i < vx) vx = i;					      \
-		    if ((hyflag > 0) && (i >= hx)) {			      \
-			hy += 1;					      \
-		    } else {						      \
-			hyflag = 0;					      \
-		    }							      \
-		}							      \
-		vy = j-1;						      \
-									      \
-		/* We now have two possible subrects: (x,y,hx,hy) and	      \
-		 * (x,y,vx,vy).  We'll choose the bigger of the two.	      \
-		 */							      \
-		hw = hx-x+1;						      \
-		hh = hy-y+1;						      \
-		vw = vx-x+1;						      \
-		vh = vy-y+1;						      \
-									      \
-		thex = x;						      \
-		they = y;						      \
-									      \
-		if ((hw*hh) > (vw*vh)) {				      \
-		    thew = hw;						      \
-		    theh = hh;						      \
-		} else {						      \
-		    thew = vw;						      \
-		    theh = vh;						      \
-		}							      \
+    cl->ublen++;							      \
 									      \
-		if (mono) {						      \
-		    newLen = cl->ublen - nSubrectsUblen + 2;		      \
-		} else {						      \
-		    newLen = cl->ublen - nSubrectsUblen + bpp/8 + 2;	      \
-		}							      \
+    if (!rfbSubrectStart(&search, cl, data, bpp, w, h, w, bg))		      \
+	return FALSE;							      \
 									      \
-		if (newLen > (w * h * (bpp/8)))				      \
-		    return FALSE;					      \
+    while ((n = rfbNextSubrects(&search, sr, rfbSubrectBatch)) > 0) {	      \
+	for (i = 0; i < n; i++) {					      \
+	    if (mono) {							      \
+		newLen = cl->ublen - nSubrectsUblen + 2;		      \
+	    } else {							      \
+		newLen = cl->ublen - nSubrectsUblen + bpp/8 + 2;	      \
+	    }								      \
 									      \
-		numsubs += 1;						      \
+	    if (newLen > (w * h * (bpp/8)))				      \
+		return FALSE;						      \
 									      \
-		if (!mono) PUT_PIXEL##bpp(singleCL);				      \
+	    numsubs += 1;						      \
 									      \
-		cl->updateBuf[cl->ublen++] = rfbHextilePackXY(thex,they);	      \
-		cl->updateBuf[cl->ublen++] = rfbHextilePackWH(thew,theh);	      \
+	    singleCL = (CARD##bpp)sr[i].colour;				      \
+	    if (!mono) PUT_PIXEL##bpp(singleCL);			      \
 									      \
-		/*							      \
-		 * Now mark the subrect as done.			      \
-		 */							      \
-		for (j=they; j < (they+theh); j++) {			      \
-		    for (i=thex; i < (thex+thew); i++) {		      \
-			data[j*w+i] = bg;				      \
-		    }							      \
-		}							      \
-	    }								      \
+	    cl->updateBuf[cl->ublen++] = rfbHextilePackXY(sr[i].x,sr[i].y);   \
+	    cl->updateBuf[cl->ublen++] = rfbHextilePackWH(sr[i].w,sr[i].h);   \
 	}								      \
     }									      \
 									      \
+    if (search.overBudget)						      \
+	return FALSE;							      \
+									      \
     cl->updateBuf[nSubrectsUblen] = numsubs;				      \
 									      \
     return TRUE;							      \
@@ -30,33 +30,243 @@ extern "C" {
 }
 #include <rdr/MemOutStream.h>
 #include <rdr/ZlibOutStream.h>
+#include <rdr/Exception.h>
+#include <zlib.h>
 
 
-#define GET_IMAGE_INTO_BUF(tx,ty,tw,th,buf)                                \
-  char *fbptr = (cl->scalingFrameBuffer + (cl->scalingPaddedWidthInBytes * ty) \
-                 + (tx * (rfbScreen.bitsPerPixel / 8)));                   \
-                                                                           \
-  (*cl->translateFn)(cl->translateLookupTable, &rfbServerFormat,           \
-                     &cl->format, fbptr, (char*)buf,                       \
-                     cl->scalingPaddedWidthInBytes, tw, th);
+#include <zrleEncode.h>
 
-#define EXTRA_ARGS , rfbClientPtr cl
 
-#define BPP 8
-#include <zrleEncode.h>
-#undef BPP
-#define BPP 16
-#include <zrleEncode.h>
-#undef BPP
-#define BPP 32
-#include <zrleEncode.h>
-#define CPIXEL 24A
-#include <zrleEncode.h>
-#undef CPIXEL
-#define CPIXEL 24B
-#include <zrleEncode.h>
-#undef CPIXEL
-#undef BPP
+typedef void (*ZrleTilesFn)(int x, int y, int w, int h, rdr::OutStream* os,
+                            void* buf, rfbClientPtr cl);
+
+// zrleTilesFor picks the encoder for a client's pixel size and CPIXEL form.
+// A client in the server's own format has its pixels copied straight out
+// of the framebuffer rather than through translateFn.
+
+template <class PIXEL_T, class Writer>
+static ZrleTilesFn zrleTilesFor(rfbClientPtr cl)
+{
+  if (cl->translateFn == rfbTranslateNone &&
+      rfbScreen.bitsPerPixel == (int)sizeof(PIXEL_T) * 8)
+    return zrleEncodeTiles<PIXEL_T, Writer, ZrleCopiedRows<PIXEL_T> >;
+
+  return zrleEncodeTiles<PIXEL_T, Writer, ZrleTranslatedRows>;
+}
+
+static ZrleTilesFn zrleTilesFunction(rfbClientPtr cl)
+{
+  switch (cl->format.bitsPerPixel) {
+
+  case 8:
+    return zrleTilesFor<rdr::U8, ZrleWriter8>(cl);
+
+  case 16:
+    return zrleTilesFor<rdr::U16, ZrleWriter16>(cl);
+  }
+
+  bool fitsInLS3Bytes
+    = ((cl->format.redMax   << cl->format.redShift)   < (1<<24) &&
+       (cl->format.greenMax << cl->format.greenShift) < (1<<24) &&
+       (cl->format.blueMax  << cl->format.blueShift)  < (1<<24));
+
+  bool fitsInMS3Bytes = (cl->format.redShift   > 7  &&
+                         cl->format.greenShift > 7  &&
+                         cl->format.blueShift  > 7);
+
+  if ((fitsInLS3Bytes && !cl->format.bigEndian) ||
+      (fitsInMS3Bytes && cl->format.bigEndian))
+    return zrleTilesFor<rdr::U32, ZrleWriter24A>(cl);
+
+  if ((fitsInLS3Bytes && cl->format.bigEndian) ||
+      (fitsInMS3Bytes && !cl->format.bigEndian))
+    return zrleTilesFor<rdr::U32, ZrleWriter24B>(cl);
+
+  return zrleTilesFor<rdr::U32, ZrleWriter32>(cl);
+}
+
+
+/*
+ * Large rectangles are encoded on the work pool, one row of tiles per task.
+ * The tiles of every row are encoded at once, then every row is deflated at
+ * once, each primed with the uncompressed data before it as a dictionary and
+ * ending on a sync flush.  The first row carries on the client's own stream,
+ * and since the client inflates everything with one stream, the rows can
+ * simply be sent one after the other.  Afterwards the client's stream is
+ * primed with the end of the rectangle so it carries on from there.
+ */
+
+#define ZRLE_PARALLEL_MIN_AREA (256 * 256)
+#define ZRLE_WINDOW 32768
+
+struct ZrleGroup {
+  int y, h;
+  rdr::MemOutStream plain;      // tile data before compression
+  rdr::MemOutStream packed;     // compressed, ending on a sync flush
+  bool ok;
+};
+
+struct ZrleParallel {
+  rfbClientPtr cl;
+  ZrleTilesFn encodeTiles;
+  rdr::ZlibOutStream* zos;
+  int x, w;
+
+  ZrleGroup* groups;
+  int nGroups;
+  int groupsSize;
+
+  z_stream zs[WORKPOOL_MAX_THREADS];
+  bool zsInited[WORKPOOL_MAX_THREADS];
+};
+
+// zrleHistory() finds up to ZRLE_WINDOW bytes of uncompressed data from
+// before the given group, copying it into dict if it spans several groups.
+
+static const rdr::U8* zrleHistory(ZrleParallel* p, int group, rdr::U8* dict,
+                                  int* length)
+{
+  ZrleGroup* last = &p->groups[group-1];
+  int len = 0;
+
+  if (last->plain.length() >= ZRLE_WINDOW) {
+    *length = ZRLE_WINDOW;
+    return (const rdr::U8*)last->plain.data() + last->plain.length() - ZRLE_WINDOW;
+  }
+
+  while (group > 0 && len < ZRLE_WINDOW) {
+    ZrleGroup* g = &p->groups[--group];
+    int n = min(g->plain.length(), ZRLE_WINDOW - len);
+
+    memcpy(dict + ZRLE_WINDOW - len - n,
+           (const rdr::U8*)g->plain.data() + g->plain.length() - n, n);
+    len += n;
+  }
+
+  *length = len;
+  return dict + ZRLE_WINDOW - len;
+}
+
+static void zrleEncodeGroup(void* arg, int index, int worker)
+{
+  ZrleParallel* p = (ZrleParallel*)arg;
+  ZrleGroup* g = &p->groups[index];
+  rdr::U32 buf[rfbZRLETileWidth * rfbZRLETileHeight + 1];
+
+  try {
+    g->plain.clear();
+    g->packed.clear();
+    (*p->encodeTiles)(p->x, g->y, p->w, g->h, &g->plain, buf, p->cl);
+    g->ok = true;
+  } catch (...) {
+    g->ok = false;
+  }
+}
+
+static void zrleDeflateGroup(void* arg, int index, int worker)
+{
+  ZrleParallel* p = (ZrleParallel*)arg;
+  ZrleGroup* g = &p->groups[index];
+  z_stream* zs = &p->zs[worker];
+  rdr::U8 dict[ZRLE_WINDOW];
+  const rdr::U8* history;
+  int historyLen;
+
+  if (!g->ok)
+    return;
+
+  try {
+    if (index == 0) {
+      p->zos->setUnderlying(&g->packed);
+      p->zos->writeBytes(g->plain.data(), g->plain.length());
+      p->zos->flush();
+      return;
+    }
+
+    if (!p->zsInited[worker]) {
+      zs->zalloc = Z_NULL;
+      zs->zfree = Z_NULL;
+      zs->opaque = Z_NULL;
+      if (deflateInit2(zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+                       Z_DEFAULT_STRATEGY) != Z_OK)
+        throw rdr::Exception("zrleDeflateGroup: deflateInit failed");
+      p->zsInited[worker] = true;
+    }
+
+    history = zrleHistory(p, index, dict, &historyLen);
+    if (deflateReset(zs) != Z_OK ||
+        deflateSetDictionary(zs, (const Bytef*)history, historyLen) != Z_OK)
+      throw rdr::Exception("zrleDeflateGroup: deflateSetDictionary failed");
+
+    zs->next_in = (Bytef*)g->plain.data();
+    zs->avail_in = g->plain.length();
+
+    do {
+      g->packed.check(1);
+      zs->next_out = g->packed.getptr();
+      zs->avail_out = g->packed.getend() - g->packed.getptr();
+
+      if (deflate(zs, Z_SYNC_FLUSH) != Z_OK)
+        throw rdr::Exception("zrleDeflateGroup: deflate failed");
+
+      g->packed.setptr(zs->next_out);
+    } while (zs->avail_out == 0);
+  } catch (...) {
+    g->ok = false;
+  }
+}
+
+static bool zrleEncodeParallel(rfbClientPtr cl, int x, int y, int w, int h,
+                               ZrleTilesFn encodeTiles, rdr::ZlibOutStream* zos,
+                               rdr::MemOutStream* mos)
+{
+  ZrleParallel* p = (ZrleParallel*)cl->zrleParallelData;
+  rdr::U8 dict[ZRLE_WINDOW];
+  const rdr::U8* history;
+  int i, historyLen;
+
+  if (!p) {
+    p = new ZrleParallel;
+    p->groups = NULL;
+    p->groupsSize = 0;
+    for (i = 0; i < WORKPOOL_MAX_THREADS; i++)
+      p->zsInited[i] = false;
+    cl->zrleParallelData = p;
+  }
+
+  p->cl = cl;
+  p->encodeTiles = encodeTiles;
+  p->zos = zos;
+  p->x = x;
+  p->w = w;
+  p->nGroups = (h + rfbZRLETileHeight - 1) / rfbZRLETileHeight;
+
+  if (p->nGroups > p->groupsSize) {
+    delete [] p->groups;
+    p->groups = new ZrleGroup[p->nGroups];
+    p->groupsSize = p->nGroups;
+  }
+
+  for (i = 0; i < p->nGroups; i++) {
+    p->groups[i].y = y + i * rfbZRLETileHeight;
+    p->groups[i].h = min(rfbZRLETileHeight, y + h - p->groups[i].y);
+  }
+
+  rfbWorkPoolRun(zrleEncodeGroup, p, p->nGroups);
+  rfbWorkPoolRun(zrleDeflateGroup, p, p->nGroups);
+
+  for (i = 0; i < p->nGroups; i++) {
+    if (!p->groups[i].ok)
+      return false;
+    mos->writeBytes(p->groups[i].packed.data(), p->groups[i].packed.length());
+  }
+
+  zos->setUnderlying(mos);
+  history = zrleHistory(p, p->nGroups, dict, &historyLen);
+  zos->setDictionary(history, historyLen);
+
+  return true;
+}
 
 
 /*
@@ -66,7 +276,7 @@ extern "C" {
 /*
  * zrleBeforeBuf contains pixel data in the client's format.  It must be at
  * least one pixel bigger than the largest tile of pixel data, since the
- * ZRLE encoding algorithm writes to the position one past the end of the pixel
+ * ZRLE encoding algorithm reads the position one past the end of the pixel
  * data.
  */
 
@@ -87,41 +297,26 @@ rdr::ZlibOutStream* zos = (rdr::ZlibOutStream*)cl->zrleData;
 rdr::MemOutStream* mos = (rdr::MemOutStream*)cl->mosData;
     mos->clear();
 
-  switch (cl->format.bitsPerPixel) {
-
-  case 8:
-    zrleEncode8( x, y, w, h, mos, zos, zrleBeforeBuf, cl);
-    break;
-
-  case 16:
-    zrleEncode16(x, y, w, h, mos, zos, zrleBeforeBuf, cl);
-    break;
-
-  case 32:
-    bool fitsInLS3Bytes
-      = ((cl->format.redMax   << cl->format.redShift)   < (1<<24) &&
-         (cl->format.greenMax << cl->format.greenShift) < (1<<24) &&
-         (cl->format.blueMax  << cl->format.blueShift)  < (1<<24));
+  ZrleTilesFn encodeTiles = zrleTilesFunction(cl);
 
-    bool fitsInMS3Bytes = (cl->format.redShift   > 7  &&
-                           cl->format.greenShift > 7  &&
-                           cl->format.blueShift  > 7);
+  if (rfbWorkPoolThreads() > 1 && h > rfbZRLETileHeight &&
+      w * h >= ZRLE_PARALLEL_MIN_AREA) {
+    bool ok;
 
-    if ((fitsInLS3Bytes && !cl->format.bigEndian) ||
-        (fitsInMS3Bytes && cl->format.bigEndian))
-    {
-      zrleEncode24A(x, y, w, h, mos, zos, zrleBeforeBuf, cl);
-    }
-    else if ((fitsInLS3Bytes && cl->format.bigEndian) ||
-             (fitsInMS3Bytes && !cl->format.bigEndian))
-    {
-      zrleEncode24B(x, y, w, h, mos, zos, zrleBeforeBuf, cl);
+    try {
+      ok = zrleEncodeParallel(cl, x, y, w, h, encodeTiles, zos, mos);
+    } catch (rdr::Exception&) {
+      ok = false;
     }
-    else
-    {
-      zrleEncode32(x, y, w, h, mos, zos, zrleBeforeBuf, cl);
+    if (!ok) {
+      rfbLog("rfbSendRectEncodingZRLE: parallel encoding failed\n");
+      rfbCloseClient(cl);
+      return FALSE;
     }
-    break;
+  } else {
+    zos->setUnderlying(mos);
+    (*encodeTiles)(x, y, w, h, zos, zrleBeforeBuf, cl);
+    zos->flush();
   }
 
   cl->rfbRectanglesSent[rfbEncodingZRLE]++;
@@ -153,28 +348,7 @@ rdr::MemOutStream* mos = (rdr::MemOutStream*)cl->mosData;
   memcpy(&updateBuf[ublen], (char *)&hdr, sz_rfbZRLEHeader);
   ublen += sz_rfbZRLEHeader;
 
-  // copy into updateBuf and send from there.  Maybe should send directly?
-
-  for (int i = 0; i < mos->length();) {
-
-    int bytesToCopy = UPDATE_BUF_SIZE - ublen;
-
-    if (i + bytesToCopy > mos->length()) {
-      bytesToCopy = mos->length() - i;
-    }
-
-    memcpy(&updateBuf[ublen], (CARD8*)mos->data() + i, bytesToCopy);
-
-    ublen += bytesToCopy;
-    i += bytesToCopy;
-
-    if (ublen == UPDATE_BUF_SIZE) {
-      if (!rfbSendUpdateBuf(cl))
-        return FALSE;
-    }
-  }
-
-  return TRUE;
+  return rfbSendUpdateBytes(cl, (char *)mos->data(), mos->length());
 }
 
 
@@ -188,5 +362,16 @@ void FreeZrleData(rfbClientPtr cl)
         delete (rdr::MemOutStream*)cl->mosData;
         cl->mosData = NULL;
     }
+    if (cl->zrleParallelData) {
+        ZrleParallel* p = (ZrleParallel*)cl->zrleParallelData;
+
+        for (int i = 0; i < WORKPOOL_MAX_THREADS; i++) {
+            if (p->zsInited[i])
+                deflateEnd(&p->zs[i]);
+        }
+        delete [] p->groups;
+        delete p;
+        cl->zrleParallelData = NULL;
+    }
 }
 
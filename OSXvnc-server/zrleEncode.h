@@ -17,160 +17,106 @@
 // USA.
 
 //
-// zrleEncode.h - zrle encoding function.
+// zrleEncode.h - zrle encoding functions.
 //
-// Before including this file, you must define a number of CPP macros.
+// zrleEncodeTiles<PIXEL_T, Writer, Source> writes the tiles of a rectangle
+// uncompressed to any OutStream, so that callers can do the compression
+// themselves.  PIXEL_T is the client's pixel type, Writer writes a pixel
+// in the CPIXEL form the client is sent (the 24 bit ones leave a byte out),
+// and Source gets a tile from the framebuffer into the buffer in
+// the client's format.
 //
-// BPP should be 8, 16 or 32 depending on the bits per pixel.
-// GET_IMAGE_INTO_BUF should be some code which gets a rectangle of pixel data
-// into the given buffer.  EXTRA_ARGS can be defined to pass any other
-// arguments needed by GET_IMAGE_INTO_BUF.
+// Each tile is fetched whole and its palette and runs found by
+// rfbAnalyseTile (see tileanalysis.c) before it is written.
 //
-// Note that the buf argument to ZRLE_ENCODE needs to be at least one pixel
-// bigger than the largest tile of pixel data, since the ZRLE encoding
-// algorithm writes to the position one past the end of the pixel data.
+// Note that the buf argument to zrleEncodeTiles needs to be at least one
+// pixel bigger than the largest tile of pixel data, since the ZRLE encoding
+// algorithm reads the position one past the end of the pixel data.
 //
 
+#ifndef __ZRLE_ENCODE_H__
+#define __ZRLE_ENCODE_H__
+
 #include <rdr/OutStream.h>
 #include <assert.h>
 
 using namespace rdr;
 
-/* __RFB_CONCAT2 concatenates its two arguments.  __RFB_CONCAT2E does the same
-   but also expands its arguments if they are macros */
-
-#ifndef __RFB_CONCAT2E
-#define __RFB_CONCAT2(a,b) a##b
-#define __RFB_CONCAT2E(a,b) __RFB_CONCAT2(a,b)
-#endif
-
-#ifdef CPIXEL
-#define PIXEL_T __RFB_CONCAT2E(rdr::U,BPP)
-#define WRITE_PIXEL __RFB_CONCAT2E(writeOpaque,CPIXEL)
-#define ZRLE_ENCODE __RFB_CONCAT2E(zrleEncode,CPIXEL)
-#define ZRLE_ENCODE_TILE __RFB_CONCAT2E(zrleEncodeTile,CPIXEL)
-#define BPPOUT 24
-#else
-#define PIXEL_T __RFB_CONCAT2E(rdr::U,BPP)
-#define WRITE_PIXEL __RFB_CONCAT2E(writeOpaque,BPP)
-#define ZRLE_ENCODE __RFB_CONCAT2E(zrleEncode,BPP)
-#define ZRLE_ENCODE_TILE __RFB_CONCAT2E(zrleEncodeTile,BPP)
-#define BPPOUT BPP
-#endif
-
-#ifndef ZRLE_ONCE
-#define ZRLE_ONCE
 static const int bitsPerPackedPixel[] = {
   0, 1, 2, 2, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4
 };
 
-// The PaletteHelper class helps us build up the palette from pixel data by
-// storing a reverse index using a simple hash-table
-
-class PaletteHelper {
-public:
-  enum { MAX_SIZE = 127 };
-
-  PaletteHelper()
-  {
-    memset(index, 255, sizeof(index));
-    size = 0;
-  }
+// Writers
 
-  inline int hash(rdr::U32 pix)
-  {
-    return (pix ^ (pix >> 17)) & 4095;
-  }
+struct ZrleWriter8 {
+  enum { bytes = 1 };
+  static inline void write(rdr::OutStream* os, U8 pix) { os->writeOpaque8(pix); }
+};
 
-  inline void insert(rdr::U32 pix)
-  {
-    if (size < MAX_SIZE) {
-      int i = hash(pix);
-      while (index[i] != 255 && key[i] != pix)
-        i++;
-      if (index[i] != 255) return;
-
-      index[i] = size;
-      key[i] = pix;
-      palette[size] = pix;
-    }
-    size++;
-  }
+struct ZrleWriter16 {
+  enum { bytes = 2 };
+  static inline void write(rdr::OutStream* os, U16 pix) { os->writeOpaque16(pix); }
+};
 
-  inline int lookup(rdr::U32 pix)
-  {
-    assert(size <= MAX_SIZE);
-    int i = hash(pix);
-    while (index[i] != 255 && key[i] != pix)
-      i++;
-    if (index[i] != 255) return index[i];
-    return -1;
-  }
+struct ZrleWriter32 {
+  enum { bytes = 4 };
+  static inline void write(rdr::OutStream* os, U32 pix) { os->writeOpaque32(pix); }
+};
 
-  rdr::U32 palette[MAX_SIZE];
-  rdr::U8 index[4096+MAX_SIZE];
-  rdr::U32 key[4096+MAX_SIZE];
-  int size;
+struct ZrleWriter24A {
+  enum { bytes = 3 };
+  static inline void write(rdr::OutStream* os, U32 pix) { os->writeOpaque24A(pix); }
 };
-#endif
 
-void ZRLE_ENCODE_TILE (PIXEL_T* data, int w, int h, rdr::OutStream* os);
+struct ZrleWriter24B {
+  enum { bytes = 3 };
+  static inline void write(rdr::OutStream* os, U32 pix) { os->writeOpaque24B(pix); }
+};
 
-void ZRLE_ENCODE (int x, int y, int w, int h, rdr::OutStream* os,
-                  rdr::ZlibOutStream* zos, void* buf
-                  EXTRA_ARGS
-                  )
-{
-  zos->setUnderlying(os);
 
-  for (int ty = y; ty < y+h; ty += rfbZRLETileHeight) {
-    int th = rfbZRLETileHeight;
-    if (th > y+h-ty) th = y+h-ty;
-    for (int tx = x; tx < x+w; tx += rfbZRLETileWidth) {
-      int tw = rfbZRLETileWidth;
-      if (tw > x+w-tx) tw = x+w-tx;
+// Sources
 
-      GET_IMAGE_INTO_BUF(tx,ty,tw,th,buf);
+struct ZrleTranslatedRows {
+  static inline void fetch(rfbClientPtr cl, char* fbptr, void* rows, int w,
+                           int h)
+  {
+    (*cl->translateFn)(cl->translateLookupTable, &rfbServerFormat,
+                       &cl->format, fbptr, (char*)rows,
+                       cl->scalingPaddedWidthInBytes, w, h);
+  }
+};
 
-      ZRLE_ENCODE_TILE((PIXEL_T*)buf, tw, th, zos);
+template <class PIXEL_T>
+struct ZrleCopiedRows {
+  static inline void fetch(rfbClientPtr cl, char* fbptr, void* rows, int w,
+                           int h)
+  {
+    for (int i = 0; i < h; i++) {
+      memcpy((PIXEL_T*)rows + i * w, fbptr, w * sizeof(PIXEL_T));
+      fbptr += cl->scalingPaddedWidthInBytes;
     }
   }
-  zos->flush();
-}
-
-
-void ZRLE_ENCODE_TILE (PIXEL_T* data, int w, int h, rdr::OutStream* os)
-{
-  // First find the palette and the number of runs
+};
 
-  PaletteHelper ph;
 
-  int runs = 0;
-  int singlePixels = 0;
+// The largest palette a tile can have
 
-  PIXEL_T* ptr = data;
-  PIXEL_T* end = ptr + h * w;
-  *end = ~*(end-1); // one past the end is different so the while loop ends
+#define ZRLE_MAX_PALETTE 127
 
-  while (ptr < end) {
-    PIXEL_T pix = *ptr;
-    if (*++ptr != pix) {
-      singlePixels++;
-    } else {
-      while (*++ptr == pix) ;
-      runs++;
-    }
-    ph.insert(pix);
-  }
 
-  //fprintf(stderr,"runs %d, single pixels %d, paletteSize %d\n",
-  //        runs, singlePixels, ph.size);
+template <class PIXEL_T, class Writer>
+static void zrleEncodeTile(PIXEL_T* data, int w, int h, rdr::OutStream* os,
+                           rfbTileAnalysis& ta)
+{
+  int runs = ta.runs;
+  int singlePixels = ta.singlePixels;
+  int paletteSize = ta.numColours ? ta.numColours : ZRLE_MAX_PALETTE + 1;
 
   // Solid tile is a special case
 
-  if (ph.size == 1) {
+  if (paletteSize == 1) {
     os->writeU8(1);
-    os->WRITE_PIXEL(ph.palette[0]);
+    Writer::write(os, ta.colours[0]);
     return;
   }
 
@@ -182,17 +128,17 @@ void ZRLE_ENCODE_TILE (PIXEL_T* data, int w, int h, rdr::OutStream* os)
   bool useRle = false;
   bool usePalette = false;
 
-  int estimatedBytes = w * h * (BPPOUT/8); // start assuming raw
+  int estimatedBytes = w * h * Writer::bytes; // start assuming raw
 
-  int plainRleBytes = ((BPPOUT/8)+1) * (runs + singlePixels);
+  int plainRleBytes = (Writer::bytes+1) * (runs + singlePixels);
 
   if (plainRleBytes < estimatedBytes) {
     useRle = true;
     estimatedBytes = plainRleBytes;
   }
 
-  if (ph.size < 128) {
-    int paletteRleBytes = (BPPOUT/8) * ph.size + 2 * runs + singlePixels;
+  if (paletteSize < 128) {
+    int paletteRleBytes = Writer::bytes * paletteSize + 2 * runs + singlePixels;
 
     if (paletteRleBytes < estimatedBytes) {
       useRle = true;
@@ -200,9 +146,9 @@ void ZRLE_ENCODE_TILE (PIXEL_T* data, int w, int h, rdr::OutStream* os)
       estimatedBytes = paletteRleBytes;
     }
 
-    if (ph.size < 17) {
-      int packedBytes = ((BPPOUT/8) * ph.size +
-                         w * h * bitsPerPackedPixel[ph.size-1] / 8);
+    if (paletteSize < 17) {
+      int packedBytes = (Writer::bytes * paletteSize +
+                         w * h * bitsPerPackedPixel[paletteSize-1] / 8);
 
       if (packedBytes < estimatedBytes) {
         useRle = false;
@@ -212,12 +158,12 @@ void ZRLE_ENCODE_TILE (PIXEL_T* data, int w, int h, rdr::OutStream* os)
     }
   }
 
-  if (!usePalette) ph.size = 0;
+  if (!usePalette) paletteSize = 0;
 
-  os->writeU8((useRle ? 128 : 0) | ph.size);
+  os->writeU8((useRle ? 128 : 0) | paletteSize);
 
-  for (int i = 0; i < ph.size; i++) {
-    os->WRITE_PIXEL(ph.palette[i]);
+  for (int i = 0; i < paletteSize; i++) {
+    Writer::write(os, ta.colours[i]);
   }
 
   if (useRle) {
@@ -233,17 +179,17 @@ void ZRLE_ENCODE_TILE (PIXEL_T* data, int w, int h, rdr::OutStream* os)
         ptr++;
       int len = ptr - runStart;
       if (len <= 2 && usePalette) {
-        int index = ph.lookup(pix);
+        int index = rfbTileColourIndex(&ta, pix);
         if (len == 2)
           os->writeU8(index);
         os->writeU8(index);
         continue;
       }
       if (usePalette) {
-        int index = ph.lookup(pix);
+        int index = rfbTileColourIndex(&ta, pix);
         os->writeU8(index | 128);
       } else {
-        os->WRITE_PIXEL(pix);
+        Writer::write(os, pix);
       }
       len -= 1;
       while (len >= 255) {
@@ -261,9 +207,9 @@ void ZRLE_ENCODE_TILE (PIXEL_T* data, int w, int h, rdr::OutStream* os)
 
       // packed pixels
 
-      assert (ph.size < 17);
+      assert (paletteSize < 17);
 
-      int bppp = bitsPerPackedPixel[ph.size-1];
+      int bppp = bitsPerPackedPixel[paletteSize-1];
 
       PIXEL_T* ptr = data;
 
@@ -275,7 +221,7 @@ void ZRLE_ENCODE_TILE (PIXEL_T* data, int w, int h, rdr::OutStream* os)
 
         while (ptr < eol) {
           PIXEL_T pix = *ptr++;
-          U8 index = ph.lookup(pix);
+          U8 index = rfbTileColourIndex(&ta, pix);
           byte = (byte << bppp) | index;
           nbits += bppp;
           if (nbits >= 8) {
@@ -292,19 +238,43 @@ void ZRLE_ENCODE_TILE (PIXEL_T* data, int w, int h, rdr::OutStream* os)
 
       // raw
 
-#ifdef CPIXEL
-      for (PIXEL_T* ptr = data; ptr < data+w*h; ptr++) {
-        os->WRITE_PIXEL(*ptr);
+      if (Writer::bytes == sizeof(PIXEL_T)) {
+        os->writeBytes(data, w*h*sizeof(PIXEL_T));
+      } else {
+        for (PIXEL_T* ptr = data; ptr < data+w*h; ptr++) {
+          Writer::write(os, *ptr);
+        }
       }
-#else
-      os->writeBytes(data, w*h*(BPP/8));
-#endif
     }
   }
 }
 
-#undef PIXEL_T
-#undef WRITE_PIXEL
-#undef ZRLE_ENCODE
-#undef ZRLE_ENCODE_TILE
-#undef BPPOUT
+
+template <class PIXEL_T, class Writer, class Source>
+static void zrleEncodeTiles(int x, int y, int w, int h, rdr::OutStream* os,
+                            void* buf, rfbClientPtr cl)
+{
+  PIXEL_T* data = (PIXEL_T*)buf;
+
+  for (int ty = y; ty < y+h; ty += rfbZRLETileHeight) {
+    int th = rfbZRLETileHeight;
+    if (th > y+h-ty) th = y+h-ty;
+    for (int tx = x; tx < x+w; tx += rfbZRLETileWidth) {
+      int tw = rfbZRLETileWidth;
+      if (tw > x+w-tx) tw = x+w-tx;
+
+      char* fbptr = (cl->scalingFrameBuffer + (cl->scalingPaddedWidthInBytes * ty)
+                     + (tx * (rfbScreen.bitsPerPixel / 8)));
+
+      rfbTileAnalysis ta;
+
+      Source::fetch(cl, fbptr, data, tw, th);
+      rfbAnalyseTile(&ta, data, sizeof(PIXEL_T) * 8, tw, th, tw,
+                     ZRLE_MAX_PALETTE, rfbAnalyseRuns);
+
+      zrleEncodeTile<PIXEL_T, Writer>(data, tw, th, os, ta);
+    }
+  }
+}
+
+#endif